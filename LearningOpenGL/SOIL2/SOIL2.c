@@ -105,6 +105,22 @@
 #endif
 
 #include "SOIL2.h"
+#include <stddef.h>
+
+/*	stb_image allocates from a per-thread arena while SOIL_load_images(),
+	SOIL_load_images_into() and SOIL_load_image_into() decode, so bulk loads
+	reuse the same already-touched scratch memory instead of a malloc/free
+	(and page faults) per zlib buffer and JPEG plane	*/
+static void * soil_arena_malloc( size_t sz );
+static void * soil_arena_realloc( void *p, size_t oldsz, size_t newsz );
+static void soil_arena_free( void *p );
+static int soil_write_image( const char *filename, int image_type,
+		int width, int height, int channels,
+		const unsigned char *const data, int quality );
+#define STBI_MALLOC(sz)						soil_arena_malloc( sz )
+#define STBI_REALLOC_SIZED(p,oldsz,newsz)	soil_arena_realloc( p, oldsz, newsz )
+#define STBI_FREE(p)						soil_arena_free( p )
+
 #define STB_IMAGE_IMPLEMENTATION
 #include "stb_image.h"
 #define STB_IMAGE_WRITE_IMPLEMENTATION
@@ -121,6 +137,515 @@
 /*	error reporting	*/
 const char *result_string_pointer = "SOIL initialized";
 
+#if defined( _MSC_VER )
+	#define SOIL_THREAD_LOCAL __declspec( thread )
+#elif defined( __GNUC__ ) || defined( __clang__ )
+	#define SOIL_THREAD_LOCAL __thread
+#else
+	#define SOIL_THREAD_LOCAL _Thread_local
+#endif
+
+/*	allocations are only served from the arena between soil_arena_begin()
+	and soil_arena_end(), and the into-buffer decodes free everything they
+	allocate before returning, so arena memory never leaves the thread. The
+	pairs nest: a thread waiting in a parallel_for may pick up another decode
+	while its own still holds arena blocks	*/
+typedef struct
+{
+	unsigned char *base;
+	size_t size;
+	size_t used;
+	size_t overflow;	/*	bytes that didn't fit and went to malloc	*/
+	size_t peak;		/*	most the current load needed at once	*/
+	unsigned char *last;
+	int live;
+	int active;			/*	soil_arena_begin() calls not ended yet	*/
+} soil_arena;
+
+static SOIL_THREAD_LOCAL soil_arena soil_thread_arena;
+
+#define SOIL_ARENA_ALIGN( sz )	( ( (sz) + 15 ) & ~(size_t)15 )
+#define SOIL_ARENA_GRANULE		( 1 << 20 )
+
+static int soil_arena_owns( soil_arena *arena, void *p )
+{
+	return arena->base && (unsigned char*)p >= arena->base && (unsigned char*)p < arena->base + arena->size;
+}
+
+static void * soil_arena_malloc( size_t sz )
+{
+	soil_arena *arena = &soil_thread_arena;
+	size_t aligned = SOIL_ARENA_ALIGN( sz );
+
+	if ( arena->active )
+	{
+		if ( arena->used + aligned <= arena->size )
+		{
+			arena->last = arena->base + arena->used;
+			arena->used += aligned;
+			arena->live++;
+
+			if ( arena->used + arena->overflow > arena->peak )
+				arena->peak = arena->used + arena->overflow;
+
+			return arena->last;
+		}
+
+		arena->overflow += aligned;
+
+		if ( arena->used + arena->overflow > arena->peak )
+			arena->peak = arena->used + arena->overflow;
+	}
+
+	return malloc( sz );
+}
+
+static void soil_arena_free( void *p )
+{
+	soil_arena *arena = &soil_thread_arena;
+
+	if ( !p )
+		return;
+
+	if ( soil_arena_owns( arena, p ) )
+	{
+		/*	the newest block gives its space back right away, the rest once
+			nothing in the arena is live any more	*/
+		if ( p == arena->last )
+		{
+			arena->used = arena->last - arena->base;
+			arena->last = NULL;
+		}
+
+		if ( --arena->live == 0 )
+			arena->used = 0;
+
+		return;
+	}
+
+	free( p );
+}
+
+static void * soil_arena_realloc( void *p, size_t oldsz, size_t newsz )
+{
+	soil_arena *arena = &soil_thread_arena;
+	void *q;
+
+	if ( !p )
+		return soil_arena_malloc( newsz );
+
+	if ( !soil_arena_owns( arena, p ) )
+		return realloc( p, newsz );
+
+	/*	growing the newest block is free	*/
+	if ( p == arena->last && (unsigned char*)p + SOIL_ARENA_ALIGN( newsz ) <= arena->base + arena->size )
+	{
+		arena->used = ( arena->last - arena->base ) + SOIL_ARENA_ALIGN( newsz );
+
+		if ( arena->used + arena->overflow > arena->peak )
+			arena->peak = arena->used + arena->overflow;
+
+		return p;
+	}
+
+	q = soil_arena_malloc( newsz );
+
+	if ( q )
+	{
+		memcpy( q, p, oldsz < newsz ? oldsz : newsz );
+		soil_arena_free( p );
+	}
+
+	return q;
+}
+
+static void soil_arena_begin( void )
+{
+	soil_arena *arena = &soil_thread_arena;
+
+	if ( arena->active++ )
+		return;
+
+	arena->used		= 0;
+	arena->overflow	= 0;
+	arena->peak		= 0;
+	arena->live		= 0;
+	arena->last		= NULL;
+}
+
+static void soil_arena_end( void )
+{
+	soil_arena *arena = &soil_thread_arena;
+
+	if ( --arena->active )
+		return;
+
+	/*	grow to what this load needed, so the next one like it fits	*/
+	if ( arena->peak > arena->size && arena->live == 0 )
+	{
+		size_t size = ( arena->peak + SOIL_ARENA_GRANULE - 1 ) & ~(size_t)( SOIL_ARENA_GRANULE - 1 );
+
+		free( arena->base );
+		arena->base = (unsigned char*)malloc( size );
+		arena->size = arena->base ? size : 0;
+	}
+
+	arena->used = 0;
+	arena->last = NULL;
+}
+
+void
+	SOIL_free_thread_arena
+	(
+		void
+	)
+{
+	soil_arena *arena = &soil_thread_arena;
+
+	free( arena->base );
+	arena->base = NULL;
+	arena->size = 0;
+}
+
+/*	a fixed pool of worker threads behind stbi_set_parallel_for(),
+	stbi_write_set_parallel_for() and jo_jpeg_set_parallel_for(), so one big
+	baseline JPEG can decode its restart intervals, one PNG filter and deflate
+	its rows, and one saved JPEG encode its restart intervals, on every core	*/
+#if !defined( SOIL_PLATFORM_WIN32 ) && !defined( SOIL_NO_THREADS )
+#include <pthread.h>
+#include <unistd.h>
+
+typedef struct
+{
+	pthread_mutex_t lock;
+	pthread_cond_t wake;		/*	workers wait here for a job	*/
+	pthread_cond_t done;		/*	the submitter waits here for the job to finish	*/
+	pthread_mutex_t submit;		/*	one job at a time	*/
+	pthread_t *threads;
+	int thread_count;
+	void (*task)( void *arg, int index );
+	void *arg;
+	int count;
+	int next;
+	int pending;
+	int quit;
+} soil_pool;
+
+static soil_pool *soil_decode_pool = NULL;
+#endif
+
+/*	what soil_parallel_for() runs batches on: the decode pool, a scheduler
+	given to SOIL_set_parallel_for(), or nothing	*/
+static void (*soil_parallel_for_func)( void *user, int count, void (*task)( void *arg, int index ), void *arg ) = NULL;
+static void *soil_parallel_for_user = NULL;
+
+#if !defined( SOIL_PLATFORM_WIN32 ) && !defined( SOIL_NO_THREADS )
+
+/*	runs tasks of the current job until none are left, with pool->lock held	*/
+static void soil_pool_work( soil_pool *pool )
+{
+	while ( pool->next < pool->count )
+	{
+		void (*task)( void *arg, int index ) = pool->task;
+		void *arg = pool->arg;
+		int index = pool->next++;
+
+		pthread_mutex_unlock( &pool->lock );
+		task( arg, index );
+		pthread_mutex_lock( &pool->lock );
+
+		if ( --pool->pending == 0 )
+			pthread_cond_signal( &pool->done );
+	}
+}
+
+static void * soil_pool_thread( void *user )
+{
+	soil_pool *pool = (soil_pool*)user;
+
+	pthread_mutex_lock( &pool->lock );
+
+	while ( !pool->quit )
+	{
+		if ( pool->next < pool->count )
+			soil_pool_work( pool );
+		else
+			pthread_cond_wait( &pool->wake, &pool->lock );
+	}
+
+	pthread_mutex_unlock( &pool->lock );
+
+	/*	the tasks decoded with this thread's arena	*/
+	SOIL_free_thread_arena();
+
+	return NULL;
+}
+
+static void soil_pool_parallel_for( void *user, int count, void (*task)( void *arg, int index ), void *arg )
+{
+	soil_pool *pool = (soil_pool*)user;
+	int i;
+
+	/*	another thread's image has the pool, decode this one on our own	*/
+	if ( pthread_mutex_trylock( &pool->submit ) != 0 )
+	{
+		for ( i = 0; i < count; i++ )
+			task( arg, i );
+
+		return;
+	}
+
+	pthread_mutex_lock( &pool->lock );
+	pool->task		= task;
+	pool->arg		= arg;
+	pool->count		= count;
+	pool->next		= 0;
+	pool->pending	= count;
+	pthread_cond_broadcast( &pool->wake );
+
+	soil_pool_work( pool );
+
+	while ( pool->pending > 0 )
+		pthread_cond_wait( &pool->done, &pool->lock );
+
+	pool->count = 0;
+	pthread_mutex_unlock( &pool->lock );
+	pthread_mutex_unlock( &pool->submit );
+}
+
+static void soil_pool_destroy( soil_pool *pool )
+{
+	int i;
+
+	pthread_mutex_lock( &pool->lock );
+	pool->quit = 1;
+	pthread_cond_broadcast( &pool->wake );
+	pthread_mutex_unlock( &pool->lock );
+
+	for ( i = 0; i < pool->thread_count; i++ )
+		pthread_join( pool->threads[i], NULL );
+
+	pthread_mutex_destroy( &pool->lock );
+	pthread_mutex_destroy( &pool->submit );
+	pthread_cond_destroy( &pool->wake );
+	pthread_cond_destroy( &pool->done );
+	free( pool->threads );
+	free( pool );
+}
+
+static soil_pool * soil_pool_create( int thread_count )
+{
+	soil_pool *pool = (soil_pool*)calloc( 1, sizeof( soil_pool ) );
+
+	if ( !pool )
+		return NULL;
+
+	pool->threads = (pthread_t*)malloc( thread_count * sizeof( pthread_t ) );
+
+	if ( !pool->threads )
+	{
+		free( pool );
+		return NULL;
+	}
+
+	pthread_mutex_init( &pool->lock, NULL );
+	pthread_mutex_init( &pool->submit, NULL );
+	pthread_cond_init( &pool->wake, NULL );
+	pthread_cond_init( &pool->done, NULL );
+
+	for ( pool->thread_count = 0; pool->thread_count < thread_count; pool->thread_count++ )
+	{
+		if ( pthread_create( &pool->threads[pool->thread_count], NULL, soil_pool_thread, pool ) != 0 )
+			break;
+	}
+
+	return pool;
+}
+#endif
+
+void
+	SOIL_set_decode_threads
+	(
+		int threads
+	)
+{
+#if !defined( SOIL_PLATFORM_WIN32 ) && !defined( SOIL_NO_THREADS )
+	if ( threads <= 0 )
+	{
+		long cores = sysconf( _SC_NPROCESSORS_ONLN );
+		threads = cores > 0 ? (int)cores : 1;
+	}
+
+	/*	the calling thread takes part in every job, so it counts as one	*/
+	if ( threads > 1 )
+	{
+		soil_pool *pool = soil_pool_create( threads - 1 );
+
+		if ( pool )
+		{
+			SOIL_set_parallel_for( soil_pool_parallel_for, pool );
+			soil_decode_pool = pool;
+			return;
+		}
+	}
+
+	SOIL_set_parallel_for( NULL, NULL );
+#else
+	(void)threads;
+#endif
+}
+
+void
+	SOIL_set_parallel_for
+	(
+		void (*parallel_for)( void *user, int count, void (*task)( void *arg, int index ), void *arg ),
+		void *user
+	)
+{
+	stbi_set_parallel_for( parallel_for, user );
+	stbi_write_set_parallel_for( parallel_for, user );
+	jo_jpeg_set_parallel_for( parallel_for, user );
+
+#if !defined( SOIL_PLATFORM_WIN32 ) && !defined( SOIL_NO_THREADS )
+	/*	the hooks no longer point at the old pool, so it can go	*/
+	if ( soil_decode_pool )
+	{
+		soil_pool_destroy( soil_decode_pool );
+		soil_decode_pool = NULL;
+	}
+#endif
+
+	soil_parallel_for_func = parallel_for;
+	soil_parallel_for_user = user;
+}
+
+/*	runs task on the decode pool or the caller's scheduler if there is one, otherwise right here	*/
+static void soil_parallel_for( int count, void (*task)( void *arg, int index ), void *arg )
+{
+	int i;
+
+	if ( soil_parallel_for_func )
+	{
+		soil_parallel_for_func( soil_parallel_for_user, count, task, arg );
+		return;
+	}
+
+	for ( i = 0; i < count; i++ )
+		task( arg, i );
+}
+
+/*	image files are mapped read-only and decoded straight out of the page
+	cache, instead of going through stdio and stb_image's small read buffer	*/
+#if !defined( SOIL_NO_MMAP ) && !defined( SOIL_PLATFORM_WIN32 )
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#define SOIL_MMAP
+#endif
+
+typedef struct
+{
+	unsigned char *data;
+	int size;
+#if defined( SOIL_PLATFORM_WIN32 ) && !defined( SOIL_NO_MMAP )
+	HANDLE mapping;
+#endif
+} soil_mapped_file;
+
+/*	returns 0 if the file can't be mapped (missing, empty, too large for
+	stb_image, or no mmap on this platform), callers then fall back to stdio	*/
+static int soil_map_file( const char *filename, soil_mapped_file *file )
+{
+#if defined( SOIL_MMAP )
+	struct stat st;
+	void *data;
+	int fd = open( filename, O_RDONLY );
+
+	file->data = NULL;
+	file->size = 0;
+
+	if ( fd < 0 )
+		return 0;
+
+	if ( fstat( fd, &st ) != 0 || !S_ISREG( st.st_mode ) || st.st_size <= 0 || st.st_size > 0x7fffffff )
+	{
+		close( fd );
+		return 0;
+	}
+
+	data = mmap( NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0 );
+	close( fd );
+
+	if ( data == MAP_FAILED )
+		return 0;
+
+	/*	decoders read front to back, so ask for aggressive read-ahead now	*/
+	posix_madvise( data, (size_t)st.st_size, POSIX_MADV_SEQUENTIAL );
+	posix_madvise( data, (size_t)st.st_size, POSIX_MADV_WILLNEED );
+
+	file->data = (unsigned char*)data;
+	file->size = (int)st.st_size;
+	return 1;
+#elif defined( SOIL_PLATFORM_WIN32 ) && !defined( SOIL_NO_MMAP )
+	LARGE_INTEGER size;
+	HANDLE handle = CreateFileA( filename, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL );
+
+	file->data = NULL;
+	file->size = 0;
+	file->mapping = NULL;
+
+	if ( handle == INVALID_HANDLE_VALUE )
+		return 0;
+
+	if ( !GetFileSizeEx( handle, &size ) || size.QuadPart <= 0 || size.QuadPart > 0x7fffffff )
+	{
+		CloseHandle( handle );
+		return 0;
+	}
+
+	file->mapping = CreateFileMappingA( handle, NULL, PAGE_READONLY, 0, 0, NULL );
+	CloseHandle( handle );
+
+	if ( !file->mapping )
+		return 0;
+
+	file->data = (unsigned char*)MapViewOfFile( file->mapping, FILE_MAP_READ, 0, 0, 0 );
+
+	if ( !file->data )
+	{
+		CloseHandle( file->mapping );
+		file->mapping = NULL;
+		return 0;
+	}
+
+	file->size = (int)size.QuadPart;
+	return 1;
+#else
+	(void)filename;
+	file->data = NULL;
+	file->size = 0;
+	return 0;
+#endif
+}
+
+static void soil_unmap_file( soil_mapped_file *file )
+{
+	if ( !file->data )
+		return;
+
+#if defined( SOIL_MMAP )
+	munmap( file->data, (size_t)file->size );
+#elif defined( SOIL_PLATFORM_WIN32 ) && !defined( SOIL_NO_MMAP )
+	UnmapViewOfFile( file->data );
+	CloseHandle( file->mapping );
+	file->mapping = NULL;
+#endif
+
+	file->data = NULL;
+	file->size = 0;
+}
+
 /*	for loading cube maps	*/
 enum{
 	SOIL_CAPABILITY_UNKNOWN = -1,
@@ -1839,50 +2364,1071 @@ int
 	return save_result;
 }
 
-unsigned char*
-	SOIL_load_image
-	(
-		const char *filename,
-		int *width, int *height, int *channels,
-		int force_channels
-	)
+/*	asynchronous screenshots: glReadPixels goes into a pixel buffer object
+	and returns at once, the buffer is mapped once its fence says the GPU has
+	written it, and the flip, encode and file write run on a writer thread	*/
+#define SOIL_PIXEL_PACK_BUFFER				0x88EB
+#define SOIL_PIXEL_PACK_BUFFER_BINDING		0x88ED
+#define SOIL_STREAM_READ					0x88E1
+#define SOIL_READ_ONLY						0x88B8
+#define SOIL_SYNC_GPU_COMMANDS_COMPLETE		0x9117
+#define SOIL_ALREADY_SIGNALED				0x911A
+#define SOIL_CONDITION_SATISFIED			0x911C
+#define SOIL_SYNC_FLUSH_COMMANDS_BIT		0x00000001
+#define SOIL_SYNC_WAIT_FOREVER				0xFFFFFFFFFFFFFFFFull
+
+typedef struct SOIL_GLsync_s *SOIL_GLsync;
+typedef void (APIENTRY * P_SOIL_GLGENBUFFERSPROC) (GLsizei n, GLuint *buffers);
+typedef void (APIENTRY * P_SOIL_GLDELETEBUFFERSPROC) (GLsizei n, const GLuint *buffers);
+typedef void (APIENTRY * P_SOIL_GLBINDBUFFERPROC) (GLenum target, GLuint buffer);
+typedef void (APIENTRY * P_SOIL_GLBUFFERDATAPROC) (GLenum target, ptrdiff_t size, const GLvoid *data, GLenum usage);
+typedef GLvoid * (APIENTRY * P_SOIL_GLMAPBUFFERPROC) (GLenum target, GLenum access);
+typedef GLboolean (APIENTRY * P_SOIL_GLUNMAPBUFFERPROC) (GLenum target);
+typedef SOIL_GLsync (APIENTRY * P_SOIL_GLFENCESYNCPROC) (GLenum condition, GLbitfield flags);
+typedef GLenum (APIENTRY * P_SOIL_GLCLIENTWAITSYNCPROC) (SOIL_GLsync sync, GLbitfield flags, unsigned long long timeout);
+typedef void (APIENTRY * P_SOIL_GLDELETESYNCPROC) (SOIL_GLsync sync);
+static P_SOIL_GLGENBUFFERSPROC soilGlGenBuffers = NULL;
+static P_SOIL_GLDELETEBUFFERSPROC soilGlDeleteBuffers = NULL;
+static P_SOIL_GLBINDBUFFERPROC soilGlBindBuffer = NULL;
+static P_SOIL_GLBUFFERDATAPROC soilGlBufferData = NULL;
+static P_SOIL_GLMAPBUFFERPROC soilGlMapBuffer = NULL;
+static P_SOIL_GLUNMAPBUFFERPROC soilGlUnmapBuffer = NULL;
+static P_SOIL_GLFENCESYNCPROC soilGlFenceSync = NULL;
+static P_SOIL_GLCLIENTWAITSYNCPROC soilGlClientWaitSync = NULL;
+static P_SOIL_GLDELETESYNCPROC soilGlDeleteSync = NULL;
+
+static int has_PBO_capability = SOIL_CAPABILITY_UNKNOWN;
+
+static int query_PBO_capability( void )
 {
-	unsigned char *result = stbi_load( filename,
-			width, height, channels, force_channels );
-	if( result == NULL )
-	{
-		result_string_pointer = stbi_failure_reason();
-	} else
+	if ( has_PBO_capability == SOIL_CAPABILITY_UNKNOWN )
 	{
-		result_string_pointer = "Image loaded";
+		has_PBO_capability = SOIL_CAPABILITY_NONE;
+
+#if !defined( SOIL_GLES1 ) && !defined( SOIL_GLES2 )
+		{
+			/*	pixel buffer objects are core since 2.1	*/
+			const char *version = (const char *)glGetString( GL_VERSION );
+			const char *dot = version ? strchr( version, '.' ) : NULL;
+			int major = version ? atoi( version ) : 0;
+			int minor = dot ? atoi( dot + 1 ) : 0;
+
+			if ( major > 2 || ( major == 2 && minor >= 1 ) || SOIL_GL_ExtensionSupported( "GL_ARB_pixel_buffer_object" ) )
+			{
+				soilGlGenBuffers = (P_SOIL_GLGENBUFFERSPROC)SOIL_GL_GetProcAddress( "glGenBuffers" );
+				soilGlDeleteBuffers = (P_SOIL_GLDELETEBUFFERSPROC)SOIL_GL_GetProcAddress( "glDeleteBuffers" );
+				soilGlBindBuffer = (P_SOIL_GLBINDBUFFERPROC)SOIL_GL_GetProcAddress( "glBindBuffer" );
+				soilGlBufferData = (P_SOIL_GLBUFFERDATAPROC)SOIL_GL_GetProcAddress( "glBufferData" );
+				soilGlMapBuffer = (P_SOIL_GLMAPBUFFERPROC)SOIL_GL_GetProcAddress( "glMapBuffer" );
+				soilGlUnmapBuffer = (P_SOIL_GLUNMAPBUFFERPROC)SOIL_GL_GetProcAddress( "glUnmapBuffer" );
+
+				if ( soilGlGenBuffers && soilGlDeleteBuffers && soilGlBindBuffer && soilGlBufferData && soilGlMapBuffer && soilGlUnmapBuffer )
+				{
+					has_PBO_capability = SOIL_CAPABILITY_PRESENT;
+				}
+
+				/*	fences are optional, without them a read back is mapped once it
+					is a few frames old	*/
+				if ( major > 3 || ( major == 3 && minor >= 2 ) || SOIL_GL_ExtensionSupported( "GL_ARB_sync" ) )
+				{
+					soilGlFenceSync = (P_SOIL_GLFENCESYNCPROC)SOIL_GL_GetProcAddress( "glFenceSync" );
+					soilGlClientWaitSync = (P_SOIL_GLCLIENTWAITSYNCPROC)SOIL_GL_GetProcAddress( "glClientWaitSync" );
+					soilGlDeleteSync = (P_SOIL_GLDELETESYNCPROC)SOIL_GL_GetProcAddress( "glDeleteSync" );
+				}
+
+				if ( !soilGlFenceSync || !soilGlClientWaitSync || !soilGlDeleteSync )
+				{
+					soilGlFenceSync = NULL;
+					soilGlClientWaitSync = NULL;
+					soilGlDeleteSync = NULL;
+				}
+			}
+		}
+#endif
 	}
-	return result;
+
+	return has_PBO_capability;
 }
 
-unsigned char*
-	SOIL_load_image_from_memory
-	(
-		const unsigned char *const buffer,
-		int buffer_length,
-		int *width, int *height, int *channels,
-		int force_channels
-	)
+/*	read backs in flight at once; a capture every frame maps the one from
+	two frames ago	*/
+#define SOIL_CAPTURE_SLOTS		3
+/*	encoded frames allowed to wait for the writer before capturing blocks	*/
+#define SOIL_CAPTURE_MAX_QUEUED	8
+
+typedef struct soil_capture_job
 {
-	unsigned char *result = stbi_load_from_memory(
-				buffer, buffer_length,
-				width, height, channels,
-				force_channels );
-	if( result == NULL )
-	{
-		result_string_pointer = stbi_failure_reason();
+	struct soil_capture_job *next;
+	char *filename;
+	int image_type;
+	int width, height;
+	unsigned char *pixels;	/*	BGRA, bottom row first, as glReadPixels returns it	*/
+} soil_capture_job;
+
+typedef struct
+{
+	GLuint pbo;
+	int size;
+	SOIL_GLsync fence;
+	int age;				/*	SOIL_process_screenshots calls since the read back	*/
+	soil_capture_job *job;	/*	NULL while the slot is free	*/
+} soil_capture_slot;
+
+static soil_capture_slot soil_capture_slots[SOIL_CAPTURE_SLOTS];
+static int soil_capture_head = 0;	/*	the slot the next read back goes to	*/
+static int soil_capture_tail = 0;	/*	the oldest read back in flight	*/
+static int soil_capture_in_flight = 0;
+static int soil_capture_failures = 0;
+
+static void soil_capture_free_job( soil_capture_job *job )
+{
+	free( job->filename );
+	free( job->pixels );
+	free( job );
+}
+
+/*	flips and swizzles to RGB, saves and frees the job, returns the save result	*/
+static int soil_capture_write_job( soil_capture_job *job )
+{
+	int width = job->width, height = job->height;
+	unsigned char *rgb = (unsigned char*)malloc( width * height * 3 );
+	int i, j, save_result = 0;
+
+	if ( NULL != rgb )
+	{
+		for ( j = 0; j < height; ++j )
+		{
+			const unsigned char *src = job->pixels + ( height - 1 - j ) * width * 4;
+			unsigned char *dst = rgb + j * width * 3;
+
+			for ( i = 0; i < width; ++i, src += 4, dst += 3 )
+			{
+				dst[0] = src[2];
+				dst[1] = src[1];
+				dst[2] = src[0];
+			}
+		}
+
+		save_result = soil_write_image( job->filename, job->image_type, width, height, 3, rgb, 80 );
+		free( rgb );
+	}
+
+	soil_capture_free_job( job );
+	return save_result;
+}
+
+#if !defined( SOIL_PLATFORM_WIN32 ) && !defined( SOIL_NO_THREADS )
+typedef struct
+{
+	pthread_mutex_t lock;
+	pthread_cond_t wake;	/*	the writer waits here for jobs	*/
+	pthread_cond_t space;	/*	capturing waits here for room in the queue	*/
+	pthread_t thread;
+	soil_capture_job *first, *last;
+	int queued;				/*	jobs not written yet, the one being written included	*/
+	int failures;
+	int quit;
+	int running;
+} soil_capture_writer;
+
+static soil_capture_writer soil_writer;
+
+static void * soil_capture_writer_thread( void *user )
+{
+	soil_capture_writer *writer = (soil_capture_writer*)user;
+	soil_capture_job *job;
+	int save_result;
+
+	pthread_mutex_lock( &writer->lock );
+
+	for ( ;; )
+	{
+		if ( NULL == writer->first )
+		{
+			if ( writer->quit )
+				break;
+
+			pthread_cond_wait( &writer->wake, &writer->lock );
+			continue;
+		}
+
+		job = writer->first;
+		writer->first = job->next;
+
+		if ( NULL == writer->first )
+			writer->last = NULL;
+
+		pthread_mutex_unlock( &writer->lock );
+		save_result = soil_capture_write_job( job );
+		pthread_mutex_lock( &writer->lock );
+
+		if ( !save_result )
+			writer->failures++;
+
+		writer->queued--;
+		pthread_cond_broadcast( &writer->space );
+	}
+
+	pthread_mutex_unlock( &writer->lock );
+
+	return NULL;
+}
+
+static int soil_capture_writer_start( void )
+{
+	if ( soil_writer.running )
+		return 1;
+
+	memset( &soil_writer, 0, sizeof( soil_writer ) );
+	pthread_mutex_init( &soil_writer.lock, NULL );
+	pthread_cond_init( &soil_writer.wake, NULL );
+	pthread_cond_init( &soil_writer.space, NULL );
+
+	if ( pthread_create( &soil_writer.thread, NULL, soil_capture_writer_thread, &soil_writer ) != 0 )
+	{
+		pthread_mutex_destroy( &soil_writer.lock );
+		pthread_cond_destroy( &soil_writer.wake );
+		pthread_cond_destroy( &soil_writer.space );
+		return 0;
+	}
+
+	soil_writer.running = 1;
+	return 1;
+}
+
+/*	waits for the queue to drain, then stops the writer, returns its failures	*/
+static int soil_capture_writer_stop( void )
+{
+	int failures;
+
+	if ( !soil_writer.running )
+		return 0;
+
+	pthread_mutex_lock( &soil_writer.lock );
+	soil_writer.quit = 1;
+	pthread_cond_signal( &soil_writer.wake );
+	pthread_mutex_unlock( &soil_writer.lock );
+	pthread_join( soil_writer.thread, NULL );
+
+	failures = soil_writer.failures;
+	pthread_mutex_destroy( &soil_writer.lock );
+	pthread_cond_destroy( &soil_writer.wake );
+	pthread_cond_destroy( &soil_writer.space );
+	soil_writer.running = 0;
+
+	return failures;
+}
+
+static int soil_capture_pending_writes( void )
+{
+	int queued = 0;
+
+	if ( soil_writer.running )
+	{
+		pthread_mutex_lock( &soil_writer.lock );
+		queued = soil_writer.queued;
+		pthread_mutex_unlock( &soil_writer.lock );
+	}
+
+	return queued;
+}
+#endif
+
+/*	hands a read back to the writer thread, or writes it right here if
+	there is none	*/
+static void soil_capture_submit( soil_capture_job *job )
+{
+#if !defined( SOIL_PLATFORM_WIN32 ) && !defined( SOIL_NO_THREADS )
+	if ( soil_capture_writer_start() )
+	{
+		job->next = NULL;
+
+		pthread_mutex_lock( &soil_writer.lock );
+
+		while ( soil_writer.queued >= SOIL_CAPTURE_MAX_QUEUED )
+			pthread_cond_wait( &soil_writer.space, &soil_writer.lock );
+
+		if ( soil_writer.last )
+			soil_writer.last->next = job;
+		else
+			soil_writer.first = job;
+
+		soil_writer.last = job;
+		soil_writer.queued++;
+		pthread_cond_signal( &soil_writer.wake );
+		pthread_mutex_unlock( &soil_writer.lock );
+		return;
+	}
+#endif
+
+	if ( !soil_capture_write_job( job ) )
+		soil_capture_failures++;
+}
+
+/*	maps the oldest read back and passes its pixels on, waiting for the GPU
+	if wait is set; returns 0 if it isn't ready yet	*/
+static int soil_capture_retire_oldest( int wait )
+{
+	soil_capture_slot *slot = &soil_capture_slots[soil_capture_tail];
+	soil_capture_job *job = slot->job;
+	GLint previous_binding = 0;
+	void *mapped;
+
+	if ( slot->fence )
+	{
+		GLenum status = soilGlClientWaitSync( slot->fence, wait ? SOIL_SYNC_FLUSH_COMMANDS_BIT : 0, wait ? SOIL_SYNC_WAIT_FOREVER : 0 );
+
+		if ( !wait && status != SOIL_ALREADY_SIGNALED && status != SOIL_CONDITION_SATISFIED )
+			return 0;
+
+		soilGlDeleteSync( slot->fence );
+		slot->fence = NULL;
+	} else if ( !wait && slot->age < SOIL_CAPTURE_SLOTS - 1 )
+	{
+		return 0;
+	}
+
+	job->pixels = (unsigned char*)malloc( job->width * job->height * 4 );
+
+	glGetIntegerv( SOIL_PIXEL_PACK_BUFFER_BINDING, &previous_binding );
+	soilGlBindBuffer( SOIL_PIXEL_PACK_BUFFER, slot->pbo );
+	mapped = soilGlMapBuffer( SOIL_PIXEL_PACK_BUFFER, SOIL_READ_ONLY );
+
+	if ( NULL != mapped && NULL != job->pixels )
+	{
+		memcpy( job->pixels, mapped, job->width * job->height * 4 );
+	}
+
+	if ( NULL != mapped )
+	{
+		soilGlUnmapBuffer( SOIL_PIXEL_PACK_BUFFER );
+	}
+
+	soilGlBindBuffer( SOIL_PIXEL_PACK_BUFFER, (GLuint)previous_binding );
+
+	slot->job = NULL;
+	soil_capture_tail = ( soil_capture_tail + 1 ) % SOIL_CAPTURE_SLOTS;
+	soil_capture_in_flight--;
+
+	if ( NULL == mapped || NULL == job->pixels )
+	{
+		soil_capture_failures++;
+		soil_capture_free_job( job );
+		return 1;
+	}
+
+	soil_capture_submit( job );
+	return 1;
+}
+
+int
+	SOIL_queue_screenshot
+	(
+		const char *filename,
+		int image_type,
+		int x, int y,
+		int width, int height
+	)
+{
+	soil_capture_job *job;
+	GLint previous_alignment = 4;
+
+	/*	error checks	*/
+	if( (width < 1) || (height < 1) )
+	{
+		result_string_pointer = "Invalid screenshot dimensions";
+		return 0;
+	}
+	if( (x < 0) || (y < 0) )
+	{
+		result_string_pointer = "Invalid screenshot location";
+		return 0;
+	}
+	if( filename == NULL )
+	{
+		result_string_pointer = "Invalid screenshot filename";
+		return 0;
+	}
+
+	job = (soil_capture_job*)calloc( 1, sizeof( soil_capture_job ) );
+
+	if ( NULL != job )
+	{
+		job->filename = (char*)malloc( strlen( filename ) + 1 );
+	}
+
+	if ( NULL == job || NULL == job->filename )
+	{
+		free( job );
+		result_string_pointer = "Out of memory";
+		return 0;
+	}
+
+	strcpy( job->filename, filename );
+	job->image_type = image_type;
+	job->width = width;
+	job->height = height;
+
+	/*	BGRA rows are always 4 byte aligned, and it's the layout drivers can
+		read back without converting	*/
+	glGetIntegerv( GL_PACK_ALIGNMENT, &previous_alignment );
+	glPixelStorei( GL_PACK_ALIGNMENT, 4 );
+
+	if ( query_PBO_capability() == SOIL_CAPABILITY_PRESENT )
+	{
+		soil_capture_slot *slot = &soil_capture_slots[soil_capture_head];
+		GLint previous_binding = 0;
+
+		/*	every slot is busy, the oldest has to be finished first	*/
+		while ( NULL != slot->job )
+		{
+			soil_capture_retire_oldest( 1 );
+		}
+
+		glGetIntegerv( SOIL_PIXEL_PACK_BUFFER_BINDING, &previous_binding );
+
+		if ( 0 == slot->pbo )
+		{
+			soilGlGenBuffers( 1, &slot->pbo );
+		}
+
+		soilGlBindBuffer( SOIL_PIXEL_PACK_BUFFER, slot->pbo );
+
+		if ( slot->size != width * height * 4 )
+		{
+			slot->size = width * height * 4;
+			soilGlBufferData( SOIL_PIXEL_PACK_BUFFER, slot->size, NULL, SOIL_STREAM_READ );
+		}
+
+		glReadPixels( x, y, width, height, GL_BGRA, GL_UNSIGNED_BYTE, 0 );
+		soilGlBindBuffer( SOIL_PIXEL_PACK_BUFFER, (GLuint)previous_binding );
+
+		slot->fence = soilGlFenceSync ? soilGlFenceSync( SOIL_SYNC_GPU_COMMANDS_COMPLETE, 0 ) : NULL;
+		slot->age = 0;
+		slot->job = job;
+		soil_capture_head = ( soil_capture_head + 1 ) % SOIL_CAPTURE_SLOTS;
+		soil_capture_in_flight++;
+	} else
+	{
+		job->pixels = (unsigned char*)malloc( width * height * 4 );
+
+		if ( NULL == job->pixels )
+		{
+			glPixelStorei( GL_PACK_ALIGNMENT, previous_alignment );
+			soil_capture_free_job( job );
+			result_string_pointer = "Out of memory";
+			return 0;
+		}
+
+		glReadPixels( x, y, width, height, GL_BGRA, GL_UNSIGNED_BYTE, job->pixels );
+		soil_capture_submit( job );
+	}
+
+	glPixelStorei( GL_PACK_ALIGNMENT, previous_alignment );
+
+	result_string_pointer = "Screenshot queued";
+	return 1;
+}
+
+int
+	SOIL_process_screenshots
+	(
+		void
+	)
+{
+	int i, pending;
+
+	for ( i = 0; i < SOIL_CAPTURE_SLOTS; ++i )
+	{
+		if ( soil_capture_slots[i].job )
+			soil_capture_slots[i].age++;
+	}
+
+	while ( soil_capture_in_flight > 0 && soil_capture_retire_oldest( 0 ) )
+	{
+	}
+
+	pending = soil_capture_in_flight;
+
+#if !defined( SOIL_PLATFORM_WIN32 ) && !defined( SOIL_NO_THREADS )
+	pending += soil_capture_pending_writes();
+#endif
+
+	return pending;
+}
+
+int
+	SOIL_finish_screenshots
+	(
+		void
+	)
+{
+	int i, failures;
+
+	while ( soil_capture_in_flight > 0 )
+	{
+		soil_capture_retire_oldest( 1 );
+	}
+
+	for ( i = 0; i < SOIL_CAPTURE_SLOTS; ++i )
+	{
+		if ( soil_capture_slots[i].pbo )
+		{
+			soilGlDeleteBuffers( 1, &soil_capture_slots[i].pbo );
+		}
+
+		soil_capture_slots[i].pbo = 0;
+		soil_capture_slots[i].size = 0;
+	}
+
+	soil_capture_head = soil_capture_tail = 0;
+	failures = soil_capture_failures;
+	soil_capture_failures = 0;
+
+#if !defined( SOIL_PLATFORM_WIN32 ) && !defined( SOIL_NO_THREADS )
+	failures += soil_capture_writer_stop();
+#endif
+
+	if ( failures )
+	{
+		result_string_pointer = "Failed to save a screenshot";
+		return 0;
+	}
+
+	result_string_pointer = "Screenshots saved";
+	return 1;
+}
+
+unsigned char*
+	SOIL_load_image
+	(
+		const char *filename,
+		int *width, int *height, int *channels,
+		int force_channels
+	)
+{
+	soil_mapped_file file;
+	unsigned char *result;
+
+	if ( soil_map_file( filename, &file ) )
+	{
+		result = stbi_load_from_memory( file.data, file.size,
+				width, height, channels, force_channels );
+		soil_unmap_file( &file );
+	} else
+	{
+		result = stbi_load( filename,
+				width, height, channels, force_channels );
+	}
+
+	if( result == NULL )
+	{
+		result_string_pointer = stbi_failure_reason();
+	} else
+	{
+		result_string_pointer = "Image loaded";
+	}
+	return result;
+}
+
+unsigned char*
+	SOIL_load_image_from_memory
+	(
+		const unsigned char *const buffer,
+		int buffer_length,
+		int *width, int *height, int *channels,
+		int force_channels
+	)
+{
+	unsigned char *result = stbi_load_from_memory(
+				buffer, buffer_length,
+				width, height, channels,
+				force_channels );
+	if( result == NULL )
+	{
+		result_string_pointer = stbi_failure_reason();
+	} else
+	{
+		result_string_pointer = "Image loaded from memory";
+	}
+	return result;
+}
+
+typedef struct
+{
+	const char *const *filenames;
+	soil_mapped_file *files;
+	unsigned char **images;
+	unsigned char *const *buffers;	/*	the caller's destinations, NULL when the batch allocates the images	*/
+	const int *buffer_sizes;
+	int *widths, *heights, *channels;
+	int force_channels;
+	const char **failures;
+} soil_image_batch;
+
+/*	decodes one image of a batch. The decoder's scratch comes from the
+	thread's arena, so a worker reuses the same memory from one image to the
+	next. Without caller buffers the image is allocated at the size its header
+	gives, with plain malloc as it outlives the arena; a file stbi_info can't
+	read, or one that doesn't decode to that size, is loaded the ordinary way	*/
+static void soil_image_batch_load( void *arg, int index )
+{
+	soil_image_batch *batch = (soil_image_batch*)arg;
+	soil_mapped_file *file = &batch->files[index];
+	const char *filename = batch->filenames[index];
+	int width = 0, height = 0, channels = 0;
+	unsigned char *image = NULL, *dest = NULL;
+	int dest_size = 0, found;
+
+	if ( batch->buffers )
+	{
+		dest = batch->buffers[index];
+		dest_size = batch->buffer_sizes[index];
+	} else
+	{
+		found = file->data ? stbi_info_from_memory( file->data, file->size, &width, &height, &channels )
+						   : stbi_info( filename, &width, &height, &channels );
+
+		if ( batch->force_channels )
+			channels = batch->force_channels;
+
+		if ( found && stbi__mad3sizes_valid( width, height, channels, 0 ) )
+		{
+			dest_size = width * height * channels;
+			dest = (unsigned char*)malloc( dest_size );
+		}
+	}
+
+	if ( dest || batch->buffers )
+	{
+		soil_arena_begin();
+
+		if ( file->data )
+		{
+			image = stbi_load_from_memory_into( file->data, file->size,
+					&width, &height, &channels, batch->force_channels, dest, dest_size );
+		} else
+		{
+			image = stbi_load_into( filename,
+					&width, &height, &channels, batch->force_channels, dest, dest_size );
+		}
+
+		soil_arena_end();
+
+		if ( !image && !batch->buffers )
+			free( dest );
+	}
+
+	if ( !image && !batch->buffers )
+	{
+		if ( file->data )
+		{
+			image = stbi_load_from_memory( file->data, file->size,
+					&width, &height, &channels, batch->force_channels );
+		} else
+		{
+			image = stbi_load( filename,
+					&width, &height, &channels, batch->force_channels );
+		}
+
+		/*	a thread that picked this up while waiting inside its own decode
+			has its arena active, and the caller frees the image with free()	*/
+		if ( image && soil_arena_owns( &soil_thread_arena, image ) )
+		{
+			size_t size = (size_t)width * height * ( batch->force_channels ? batch->force_channels : channels );
+			unsigned char *copy = (unsigned char*)malloc( size );
+
+			if ( copy )
+				memcpy( copy, image, size );
+
+			soil_arena_free( image );
+			image = copy;
+		}
+	}
+
+	if ( file->data )
+		soil_unmap_file( file );
+
+	if ( !batch->buffers )
+		batch->images[index] = image;
+
+	batch->widths[index] = image ? width : 0;
+	batch->heights[index] = image ? height : 0;
+
+	if ( batch->channels )
+		batch->channels[index] = image ? channels : 0;
+
+	batch->failures[index] = image ? NULL : stbi_failure_reason();
+}
+
+/*	maps every file and decodes them on the pool, see SOIL_load_images and
+	SOIL_load_images_into	*/
+static int soil_load_image_batch( int count, soil_image_batch *batch )
+{
+	int i, loaded = 0;
+
+	if ( count <= 0 )
+	{
+		result_string_pointer = "No images to load";
+		return 0;
+	}
+
+	batch->files = (soil_mapped_file*)malloc( count * sizeof( soil_mapped_file ) );
+	batch->failures = (const char**)malloc( count * sizeof( const char* ) );
+
+	if ( NULL == batch->files || NULL == batch->failures )
+	{
+		free( batch->files );
+		free( (void*)batch->failures );
+		result_string_pointer = "Out of memory";
+		return 0;
+	}
+
+	/*	map everything first, so read-ahead of the later files overlaps
+		with decoding the earlier ones	*/
+	for ( i = 0; i < count; i++ )
+	{
+		soil_map_file( batch->filenames[i], &batch->files[i] );
+	}
+
+	soil_parallel_for( count, soil_image_batch_load, batch );
+
+	result_string_pointer = "Images loaded";
+
+	for ( i = count - 1; i >= 0; i-- )
+	{
+		if ( batch->widths[i] > 0 )
+			loaded++;
+		else
+			result_string_pointer = batch->failures[i];
+	}
+
+	free( batch->files );
+	free( (void*)batch->failures );
+
+	return loaded;
+}
+
+int
+	SOIL_load_images
+	(
+		int count,
+		const char *const *filenames,
+		unsigned char **images,
+		int *widths, int *heights, int *channels,
+		int force_channels
+	)
+{
+	soil_image_batch batch;
+
+	batch.filenames = filenames;
+	batch.images = images;
+	batch.buffers = NULL;
+	batch.buffer_sizes = NULL;
+	batch.widths = widths;
+	batch.heights = heights;
+	batch.channels = channels;
+	batch.force_channels = force_channels;
+
+	return soil_load_image_batch( count, &batch );
+}
+
+int
+	SOIL_load_images_into
+	(
+		int count,
+		const char *const *filenames,
+		unsigned char *const *buffers, const int *buffer_sizes,
+		int *widths, int *heights, int *channels,
+		int force_channels
+	)
+{
+	soil_image_batch batch;
+
+	batch.filenames = filenames;
+	batch.images = NULL;
+	batch.buffers = buffers;
+	batch.buffer_sizes = buffer_sizes;
+	batch.widths = widths;
+	batch.heights = heights;
+	batch.channels = channels;
+	batch.force_channels = force_channels;
+
+	return soil_load_image_batch( count, &batch );
+}
+
+typedef struct
+{
+	const char *const *filenames;
+	int *widths, *heights, *channels, *compressed;
+} soil_probe_batch;
+
+/*	reads the header of a mapped file, or of filename if data is NULL	*/
+static int soil_probe_header( const unsigned char *data, int size, const char *filename, int *width, int *height, int *channels, int *compressed )
+{
+	*compressed = 0;
+
+#ifndef STBI_NO_DDS
+	if ( data ? stbi__dds_info_from_memory( data, size, width, height, channels, compressed )
+			  : stbi__dds_info_from_path( filename, width, height, channels, compressed ) )
+		return 1;
+#endif
+
+#ifndef STBI_NO_PVR
+	if ( data ? stbi__pvr_info_from_memory( data, size, width, height, channels, compressed )
+			  : stbi__pvr_info_from_path( filename, width, height, channels, compressed ) )
+		return 1;
+#endif
+
+#ifndef STBI_NO_PKM
+	if ( data ? stbi__pkm_info_from_memory( data, size, width, height, channels )
+			  : stbi__pkm_info_from_path( filename, width, height, channels ) )
+	{
+		*compressed = 1;
+		return 1;
+	}
+#endif
+
+	return data ? stbi_info_from_memory( data, size, width, height, channels )
+				: stbi_info( filename, width, height, channels );
+}
+
+/*	the mapping only faults in the pages the header parsers touch	*/
+static void soil_probe_batch_image( void *arg, int index )
+{
+	soil_probe_batch *batch = (soil_probe_batch*)arg;
+	soil_mapped_file file;
+	int width = 0, height = 0, channels = 0, compressed = 0;
+	int found;
+
+	if ( soil_map_file( batch->filenames[index], &file ) )
+	{
+		found = soil_probe_header( file.data, file.size, NULL, &width, &height, &channels, &compressed );
+		soil_unmap_file( &file );
+	} else
+	{
+		found = soil_probe_header( NULL, 0, batch->filenames[index], &width, &height, &channels, &compressed );
+	}
+
+	if ( !found )
+		width = height = channels = compressed = 0;
+
+	batch->widths[index] = width;
+	batch->heights[index] = height;
+
+	if ( batch->channels )
+		batch->channels[index] = channels;
+
+	if ( batch->compressed )
+		batch->compressed[index] = compressed;
+}
+
+int
+	SOIL_probe_images
+	(
+		int count,
+		const char *const *filenames,
+		int *widths, int *heights, int *channels,
+		int *compressed
+	)
+{
+	soil_probe_batch batch;
+	int i, found = 0;
+
+	batch.filenames = filenames;
+	batch.widths = widths;
+	batch.heights = heights;
+	batch.channels = channels;
+	batch.compressed = compressed;
+
+	soil_parallel_for( count, soil_probe_batch_image, &batch );
+
+	for ( i = 0; i < count; i++ )
+	{
+		if ( widths[i] > 0 )
+			found++;
+	}
+
+	result_string_pointer = found == count ? "Image headers read" : "Unknown image header";
+	return found;
+}
+
+/*	brings a stbi_load_*_scaled() result to the size of mip level scale_shift
+	of the full image: a JPEG arrives scaled but rounded up, so its partial
+	last column and row are dropped, anything else arrives at full size and
+	is box filtered down	*/
+static unsigned char *
+	soil_finish_scaled_image
+	(
+		unsigned char *img,
+		int full_width, int full_height,
+		int *width, int *height, int channels,
+		int scale_shift
+	)
+{
+	int mip_width = full_width >> scale_shift;
+	int mip_height = full_height >> scale_shift;
+	int j;
+
+	if ( mip_width < 1 ) mip_width = 1;
+	if ( mip_height < 1 ) mip_height = 1;
+
+	if ( NULL == img || ( *width == mip_width && *height == mip_height ) )
+	{
+		return img;
+	}
+
+	if ( *width == full_width && *height == full_height )
+	{
+		unsigned char *mip = (unsigned char*)malloc( mip_width * mip_height * channels );
+
+		if ( NULL != mip )
+		{
+			mipmap_image( img, full_width, full_height, channels, mip, 1 << scale_shift, 1 << scale_shift );
+		} else
+		{
+			result_string_pointer = "Out of memory";
+		}
+
+		SOIL_free_image_data( img );
+		img = mip;
+	} else
+	{
+		for ( j = 1; j < mip_height; ++j )
+		{
+			memmove( img + j * mip_width * channels, img + j * *width * channels, mip_width * channels );
+		}
+	}
+
+	*width = mip_width;
+	*height = mip_height;
+	return img;
+}
+
+unsigned char*
+	SOIL_load_image_scaled
+	(
+		const char *filename,
+		int scale_shift,
+		int *width, int *height, int *channels,
+		int force_channels
+	)
+{
+	int full_width, full_height, comp;
+	unsigned char *result = NULL;
+
+	if ( !stbi_info( filename, &full_width, &full_height, &comp ) )
+	{
+		result_string_pointer = stbi_failure_reason();
+		return NULL;
+	}
+
+	result = stbi_load_scaled( filename,
+			width, height, channels, force_channels, scale_shift );
+	if( result == NULL )
+	{
+		result_string_pointer = stbi_failure_reason();
+	} else
+	{
+		result_string_pointer = "Image loaded";
+		result = soil_finish_scaled_image( result, full_width, full_height,
+				width, height, force_channels ? force_channels : *channels, scale_shift );
+	}
+	return result;
+}
+
+unsigned char*
+	SOIL_load_image_from_memory_scaled
+	(
+		const unsigned char *const buffer,
+		int buffer_length,
+		int scale_shift,
+		int *width, int *height, int *channels,
+		int force_channels
+	)
+{
+	int full_width, full_height, comp;
+	unsigned char *result = NULL;
+
+	if ( !stbi_info_from_memory( buffer, buffer_length, &full_width, &full_height, &comp ) )
+	{
+		result_string_pointer = stbi_failure_reason();
+		return NULL;
+	}
+
+	result = stbi_load_from_memory_scaled(
+				buffer, buffer_length,
+				width, height, channels,
+				force_channels, scale_shift );
+	if( result == NULL )
+	{
+		result_string_pointer = stbi_failure_reason();
 	} else
 	{
 		result_string_pointer = "Image loaded from memory";
+		result = soil_finish_scaled_image( result, full_width, full_height,
+				width, height, force_channels ? force_channels : *channels, scale_shift );
 	}
 	return result;
 }
 
 
+int
+	SOIL_load_image_into
+	(
+		const char *filename,
+		unsigned char *buffer, int buffer_size,
+		int *width, int *height, int *channels,
+		int force_channels
+	)
+{
+	unsigned char *result;
+
+	soil_arena_begin();
+	result = stbi_load_into( filename,
+			width, height, channels, force_channels,
+			buffer, buffer_size );
+	soil_arena_end();
+
+	if( result == NULL )
+	{
+		result_string_pointer = stbi_failure_reason();
+		return 0;
+	}
+
+	result_string_pointer = "Image loaded";
+	return 1;
+}
+
+int
+	SOIL_load_image_from_memory_into
+	(
+		const unsigned char *const buffer,
+		int buffer_length,
+		unsigned char *dest, int dest_size,
+		int *width, int *height, int *channels,
+		int force_channels
+	)
+{
+	unsigned char *result;
+
+	soil_arena_begin();
+	result = stbi_load_from_memory_into(
+				buffer, buffer_length,
+				width, height, channels, force_channels,
+				dest, dest_size );
+	soil_arena_end();
+
+	if( result == NULL )
+	{
+		result_string_pointer = stbi_failure_reason();
+		return 0;
+	}
+
+	result_string_pointer = "Image loaded from memory";
+	return 1;
+}
+
 int
 	SOIL_save_image
 	(
@@ -1895,8 +3441,10 @@ int
 	return SOIL_save_image_quality( filename, image_type, width, height, channels, data, 80 );
 }
 
-int
-	SOIL_save_image_quality
+/*	writes the image without touching result_string_pointer, so the
+	screenshot writer thread can call it while the GL thread keeps going	*/
+static int
+	soil_write_image
 	(
 		const char *filename,
 		int image_type,
@@ -1944,6 +3492,22 @@ int
 		save_result = 0;
 	}
 
+	return save_result;
+}
+
+int
+	SOIL_save_image_quality
+	(
+		const char *filename,
+		int image_type,
+		int width, int height, int channels,
+		const unsigned char *const data,
+		int quality
+	)
+{
+	int save_result = soil_write_image( filename, image_type,
+			width, height, channels, data, quality );
+
 	if( save_result == 0 )
 	{
 		result_string_pointer = "Saving the image failed";
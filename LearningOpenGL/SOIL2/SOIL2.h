@@ -368,6 +368,49 @@ int
 		int width, int height
 	);
 
+/**
+	Captures the OpenGL window (RGB) to disk without waiting for it.
+	The pixels are read back into a pixel buffer object and the call
+	returns at once; when the GPU is done the image is flipped, encoded
+	and written on a background writer thread. Call
+	SOIL_process_screenshots once per frame to move finished read backs
+	along, and SOIL_finish_screenshots before the context goes away.
+	Without pixel buffer objects the read back is synchronous, but the
+	encoding still happens on the writer thread.
+	\return 0 if it failed, otherwise returns 1
+**/
+int
+	SOIL_queue_screenshot
+	(
+		const char *filename,
+		int image_type,
+		int x, int y,
+		int width, int height
+	);
+
+/**
+	Hands every screenshot whose read back has finished over to the
+	writer thread, without blocking. Needs the GL context current.
+	\return the number of queued screenshots not yet written to disk
+**/
+int
+	SOIL_process_screenshots
+	(
+		void
+	);
+
+/**
+	Waits until every queued screenshot is on disk, then releases the
+	read back buffers and stops the writer thread. Needs the GL context
+	current.
+	\return 0 if any screenshot failed to save, otherwise returns 1
+**/
+int
+	SOIL_finish_screenshots
+	(
+		void
+	);
+
 /**
 	Loads an image from disk into an array of unsigned chars.
 	Note that *channels return the original channel count of the
@@ -403,6 +446,187 @@ unsigned char*
 		int force_channels
 	);
 
+/**
+	Loads several images from disk in one call. Every file is memory
+	mapped up front, and the decodes run on the SOIL_set_decode_threads()
+	pool when there is one. Each image is allocated once at the size its
+	header gives, and stb_image's scratch memory comes from the decoding
+	thread's arena, see SOIL_free_thread_arena. images, widths and heights
+	(and channels, if not NULL) must each hold count entries; an image that
+	fails to load is left NULL with a size of 0. Free each image with
+	SOIL_free_image_data.
+	\return the number of images that loaded
+**/
+int
+	SOIL_load_images
+	(
+		int count,
+		const char *const *filenames,
+		unsigned char **images,
+		int *widths, int *heights, int *channels,
+		int force_channels
+	);
+
+/**
+	Loads several images from disk straight into caller-provided buffers,
+	such as slices of one mapped pixel buffer object, without allocating
+	the images at all. SOIL_probe_images tells the sizes up front. The
+	files are mapped and decoded as in SOIL_load_images, and each buffer
+	is filled as in SOIL_load_image_into. An image that fails to load, or
+	doesn't fit its buffer, gets a size of 0.
+	\param buffers the destination for the pixels of each image
+	\param buffer_sizes the size of each destination in bytes
+	\return the number of images that loaded
+**/
+int
+	SOIL_load_images_into
+	(
+		int count,
+		const char *const *filenames,
+		unsigned char *const *buffers, const int *buffer_sizes,
+		int *widths, int *heights, int *channels,
+		int force_channels
+	);
+
+/**
+	Reads only the headers of several image files, so texture storage
+	and staging buffers can be sized before the images are decoded.
+	Understands every format SOIL_load_image does. widths and heights
+	(and channels and compressed, if not NULL) must each hold count
+	entries; a file that can't be read gets a size of 0.
+	\param compressed set to 1 for files holding block-compressed data (DXTn, PVRTC or ETC1)
+	\return the number of headers that were read
+**/
+int
+	SOIL_probe_images
+	(
+		int count,
+		const char *const *filenames,
+		int *widths, int *heights, int *channels,
+		int *compressed
+	);
+
+/**
+	Loads an image from disk at the size of one of its lower mip levels,
+	max(1, width >> scale_shift) by max(1, height >> scale_shift).
+	JPEGs are decoded at that scale directly from their low-frequency
+	DCT coefficients, which is much cheaper than a full decode; other
+	formats are decoded at full size and box filtered down.
+	\param scale_shift 0 for the full image, 1, 2 or 3 for 1/2, 1/4 or 1/8
+	\return 0 if failed, otherwise returns 1
+**/
+unsigned char*
+	SOIL_load_image_scaled
+	(
+		const char *filename,
+		int scale_shift,
+		int *width, int *height, int *channels,
+		int force_channels
+	);
+
+/**
+	Loads an image from memory at the size of one of its lower mip
+	levels, see SOIL_load_image_scaled.
+	\param scale_shift 0 for the full image, 1, 2 or 3 for 1/2, 1/4 or 1/8
+	\return 0 if failed, otherwise returns 1
+**/
+unsigned char*
+	SOIL_load_image_from_memory_scaled
+	(
+		const unsigned char *const buffer,
+		int buffer_length,
+		int scale_shift,
+		int *width, int *height, int *channels,
+		int force_channels
+	);
+
+/**
+	Loads an image from disk straight into a caller-provided buffer,
+	such as a mapped pixel buffer object, instead of allocating one.
+	The buffer must hold width*height*force_channels bytes (or the
+	image's own channel count with SOIL_LOAD_AUTO); stbi_info can
+	tell the size up front.  JPEG and 8-bit PNG images are decoded
+	directly into the buffer, other formats are decoded and copied.
+	stb_image's scratch memory comes from a per-thread arena that is
+	kept between calls, see SOIL_free_thread_arena.
+	\param buffer the destination for the pixels
+	\param buffer_size the size of the destination in bytes
+	\return 0 if failed (also if the image doesn't fit), otherwise returns 1
+**/
+int
+	SOIL_load_image_into
+	(
+		const char *filename,
+		unsigned char *buffer, int buffer_size,
+		int *width, int *height, int *channels,
+		int force_channels
+	);
+
+/**
+	Loads an image from memory straight into a caller-provided buffer,
+	see SOIL_load_image_into.
+	\param dest the destination for the pixels
+	\param dest_size the size of the destination in bytes
+	\return 0 if failed (also if the image doesn't fit), otherwise returns 1
+**/
+int
+	SOIL_load_image_from_memory_into
+	(
+		const unsigned char *const buffer,
+		int buffer_length,
+		unsigned char *dest, int dest_size,
+		int *width, int *height, int *channels,
+		int force_channels
+	);
+
+/**
+	Releases the calling thread's decode arena used by SOIL_load_images,
+	SOIL_load_images_into, SOIL_load_image_into and
+	SOIL_load_image_from_memory_into. Call it from a loader thread once it
+	is done with bulk loading. The SOIL_set_decode_threads() pool's threads
+	release their own as they exit.
+**/
+void
+	SOIL_free_thread_arena
+	(
+		void
+	);
+
+/**
+	Sets how many threads a single image decode may use.  Large baseline
+	JPEGs that have restart markers are split at those markers and the
+	pieces decoded on a pool of worker threads; everything else still
+	decodes on the calling thread.  The same pool filters and deflates
+	the rows of PNGs, and encodes the restart intervals of JPEGs, being
+	saved.  Loads running on several threads at once share the pool, a
+	load that finds it busy decodes on its own.
+	Call it while no image is being loaded.  Not available on Windows,
+	where this does nothing.
+	\param threads 0 for one thread per CPU core, 1 to decode on the calling thread only (the default)
+**/
+void
+	SOIL_set_decode_threads
+	(
+		int threads
+	);
+
+/**
+	Runs the work SOIL_set_decode_threads() would split over its own pool
+	on the caller's scheduler instead, e.g. an engine's job system.
+	parallel_for must call task( arg, index ) for every index in
+	[0, count) and return once all of them are done; several threads may
+	call it at once.  Stops the SOIL_set_decode_threads() pool, if any.
+	Call it while no image is being loaded.
+	\param parallel_for the scheduler's parallel for, NULL to decode on the calling thread only
+	\param user passed back to parallel_for
+**/
+void
+	SOIL_set_parallel_for
+	(
+		void (*parallel_for)( void *user, int count, void (*task)( void *arg, int index ), void *arg ),
+		void *user
+	);
+
 /**
 	Saves an image from an array of unsigned chars (RGBA) to disk
 	\param quality parameter only used for SOIL_SAVE_TYPE_JPG files, values accepted between 0 and 100.
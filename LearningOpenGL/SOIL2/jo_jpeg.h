@@ -4,8 +4,13 @@
  * 	Based on a javascript jpeg writer
  * 	JPEG baseline (no JPEG progressive)
  * 	Supports 1, 3 or 4 component input. (luminance, RGB or RGBX)
+ * 	Images larger than JO_SEGMENT_MCUS 8x8 blocks get restart markers, so the output
+ * 	depends only on the image, not on how many threads encoded it.
  *
  * Latest revisions:
+ *	1.60 (2026-10-19) SSE2 DCT, quantization and color transform, with AVX2 versions picked at run time
+ *		(JO_NO_AVX2 disables them). Rows are split into restart intervals that encode in parallel
+ *		through jo_jpeg_set_parallel_for(). Scan data is buffered in memory.
  *	1.53 (2016-07-08) Added support to compile as plain C code.
  *	1.52 (2012-22-11) Added support for specifying Luminance, RGB, or RGBA via comp(onents) argument (1, 3 and 4 respectively). 
  *	1.51 (2012-19-11) Fixed some warnings
@@ -30,6 +35,12 @@
 // Returns false on failure
 extern int jo_write_jpg(const char *filename, const void *data, int width, int height, int comp, int quality);
 
+// Restart intervals are encoded through this callback, which should call
+// task(arg, i) for every i in [0, count) and return once all have finished.
+// Pass NULL to encode on the calling thread again.
+typedef void jo_jpeg_parallel_for(void *user, int count, void (*task)(void *arg, int index), void *arg);
+extern void jo_jpeg_set_parallel_for(jo_jpeg_parallel_for *func, void *user);
+
 #endif // JO_INCLUDE_JPEG_H
 
 #ifndef JO_JPEG_HEADER_FILE_ONLY
@@ -42,22 +53,89 @@ extern int jo_write_jpg(const char *filename, const void *data, int width, int h
 #include <stdlib.h>
 #include <math.h>
 
+#if !defined(JO_NO_SIMD) && (defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2))
+#define JO_SSE2
+#include <emmintrin.h>
+#endif
+
+// AVX2 is compiled with a per-function target and only used when the CPU reports it, like stb_image
+#if defined(JO_SSE2) && !defined(JO_NO_AVX2)
+#if defined(_MSC_VER) && _MSC_VER >= 1700
+#define JO_AVX2
+#define JO_AVX2_TARGET
+#include <intrin.h>
+#elif defined(__clang__) || (defined(__GNUC__) && (__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9)))
+#define JO_AVX2
+#define JO_AVX2_TARGET __attribute__((target("avx2")))
+#endif
+#endif
+
+#ifdef JO_AVX2
+#include <immintrin.h>
+#endif
+
+// Blocks are encoded in restart intervals of about this many MCUs each
+#define JO_SEGMENT_MCUS 4096
+
 static const unsigned char s_jo_ZigZag[] = { 0,1,5,6,14,15,27,28,2,4,7,13,16,26,29,42,3,8,12,17,25,30,41,43,9,11,18,24,31,40,44,53,10,19,23,32,39,45,52,54,20,22,33,38,46,51,55,60,21,34,37,47,50,56,59,61,35,36,48,49,57,58,62,63 };
 
-static void jo_writeBits(FILE *fp, int *bitBuf, int *bitCnt, const unsigned short *bs) {
-	*bitCnt += bs[1];
-	*bitBuf |= bs[0] << (24 - *bitCnt);
-	while(*bitCnt >= 8) {
-		unsigned char c = (*bitBuf >> 16) & 255;
-		putc(c, fp);
+static jo_jpeg_parallel_for *s_jo_parallel_for = NULL;
+static void *s_jo_parallel_for_user = NULL;
+
+void jo_jpeg_set_parallel_for(jo_jpeg_parallel_for *func, void *user) {
+	s_jo_parallel_for = func;
+	s_jo_parallel_for_user = user;
+}
+
+static void jo_runTasks(int count, void (*task)(void *arg, int index), void *arg) {
+	int i;
+	if(s_jo_parallel_for && count > 1) {
+		s_jo_parallel_for(s_jo_parallel_for_user, count, task, arg);
+	} else {
+		for(i = 0; i < count; ++i) {
+			task(arg, i);
+		}
+	}
+}
+
+// Entropy coded bytes of one restart interval
+typedef struct {
+	unsigned char *buf;
+	int size, capacity;
+	unsigned int bitBuf;
+	int bitCnt;
+	int failed;
+} jo_bitWriter;
+
+static void jo_putc(jo_bitWriter *w, unsigned char c) {
+	if(w->size == w->capacity) {
+		int capacity = w->capacity ? w->capacity * 2 : 4096;
+		unsigned char *buf = (unsigned char *)realloc(w->buf, capacity);
+		if(!buf) {
+			w->failed = 1;
+			return;
+		}
+		w->buf = buf;
+		w->capacity = capacity;
+	}
+	w->buf[w->size++] = c;
+}
+
+static void jo_writeBits(jo_bitWriter *w, const unsigned short *bs) {
+	w->bitCnt += bs[1];
+	w->bitBuf |= bs[0] << (24 - w->bitCnt);
+	while(w->bitCnt >= 8) {
+		unsigned char c = (w->bitBuf >> 16) & 255;
+		jo_putc(w, c);
 		if(c == 255) {
-			putc(0, fp);
+			jo_putc(w, 0);
 		}
-		*bitBuf <<= 8;
-		*bitCnt -= 8;
+		w->bitBuf <<= 8;
+		w->bitCnt -= 8;
 	}
 }
 
+#ifndef JO_SSE2
 static void jo_DCT(float *d0, float *d1, float *d2, float *d3, float *d4, float *d5, float *d6, float *d7) {
 	float tmp0 = *d0 + *d7;
 	float tmp7 = *d0 - *d7;
@@ -100,22 +178,265 @@ static void jo_DCT(float *d0, float *d1, float *d2, float *d3, float *d4, float
 	*d1 = z11 + z4;
 	*d7 = z11 - z4;
 } 
+#endif
 
-static void jo_calcBits(int val, unsigned short bits[2]) {
-	int tmp1 = val < 0 ? -val : val;
-	val = val < 0 ? val-1 : val;
-	bits[1] = 1;
-	while(tmp1 >>= 1) {
-		++bits[1];
+#ifdef JO_SSE2
+// jo_DCT on four blocks' worth of lanes at once, same operations in the same order
+static void jo_DCT4(__m128 d[8]) {
+	const __m128 c4 = _mm_set1_ps(0.707106781f), c6 = _mm_set1_ps(0.382683433f);
+	const __m128 c2mc6 = _mm_set1_ps(0.541196100f), c2pc6 = _mm_set1_ps(1.306562965f);
+	__m128 tmp0 = _mm_add_ps(d[0], d[7]);
+	__m128 tmp7 = _mm_sub_ps(d[0], d[7]);
+	__m128 tmp1 = _mm_add_ps(d[1], d[6]);
+	__m128 tmp6 = _mm_sub_ps(d[1], d[6]);
+	__m128 tmp2 = _mm_add_ps(d[2], d[5]);
+	__m128 tmp5 = _mm_sub_ps(d[2], d[5]);
+	__m128 tmp3 = _mm_add_ps(d[3], d[4]);
+	__m128 tmp4 = _mm_sub_ps(d[3], d[4]);
+
+	// Even part
+	__m128 tmp10 = _mm_add_ps(tmp0, tmp3);
+	__m128 tmp13 = _mm_sub_ps(tmp0, tmp3);
+	__m128 tmp11 = _mm_add_ps(tmp1, tmp2);
+	__m128 tmp12 = _mm_sub_ps(tmp1, tmp2);
+
+	d[0] = _mm_add_ps(tmp10, tmp11);
+	d[4] = _mm_sub_ps(tmp10, tmp11);
+
+	__m128 z1 = _mm_mul_ps(_mm_add_ps(tmp12, tmp13), c4);
+	d[2] = _mm_add_ps(tmp13, z1);
+	d[6] = _mm_sub_ps(tmp13, z1);
+
+	// Odd part
+	tmp10 = _mm_add_ps(tmp4, tmp5);
+	tmp11 = _mm_add_ps(tmp5, tmp6);
+	tmp12 = _mm_add_ps(tmp6, tmp7);
+
+	__m128 z5 = _mm_mul_ps(_mm_sub_ps(tmp10, tmp12), c6);
+	__m128 z2 = _mm_add_ps(_mm_mul_ps(tmp10, c2mc6), z5);
+	__m128 z4 = _mm_add_ps(_mm_mul_ps(tmp12, c2pc6), z5);
+	__m128 z3 = _mm_mul_ps(tmp11, c4);
+
+	__m128 z11 = _mm_add_ps(tmp7, z3);
+	__m128 z13 = _mm_sub_ps(tmp7, z3);
+
+	d[5] = _mm_add_ps(z13, z2);
+	d[3] = _mm_sub_ps(z13, z2);
+	d[1] = _mm_add_ps(z11, z4);
+	d[7] = _mm_sub_ps(z11, z4);
+}
+
+// The SSE2 path keeps blocks transposed (column major), so loading a block
+// row by row already gives the lanes the row DCT wants.
+#define JO_BLOCK_INDEX(row, col) ((col)*8 + (row))
+
+// Forward DCT and quantization, DU receives the coefficients in natural order
+static void jo_fdctQuantize(float *CDU, const float *fdtbl, int *DU) {
+	const __m128 half = _mm_set1_ps(0.5f), signMask = _mm_set1_ps(-0.0f);
+	__m128 lo[8], hi[8], left[8], right[8];
+	int i;
+
+	// DCT rows: lo[c] is column c of rows 0-3, hi[c] of rows 4-7
+	for(i = 0; i < 8; ++i) {
+		lo[i] = _mm_loadu_ps(CDU + i*8);
+		hi[i] = _mm_loadu_ps(CDU + i*8 + 4);
+	}
+	jo_DCT4(lo);
+	jo_DCT4(hi);
+
+	// Back to row major, left[r] and right[r] are the two halves of row r
+	_MM_TRANSPOSE4_PS(lo[0], lo[1], lo[2], lo[3]);
+	_MM_TRANSPOSE4_PS(lo[4], lo[5], lo[6], lo[7]);
+	_MM_TRANSPOSE4_PS(hi[0], hi[1], hi[2], hi[3]);
+	_MM_TRANSPOSE4_PS(hi[4], hi[5], hi[6], hi[7]);
+	for(i = 0; i < 4; ++i) {
+		left[i] = lo[i];
+		left[i+4] = hi[i];
+		right[i] = lo[i+4];
+		right[i+4] = hi[i+4];
+	}
+
+	// DCT columns
+	jo_DCT4(left);
+	jo_DCT4(right);
+
+	// Quantize/descale, rounding half away from zero like the scalar path
+	for(i = 0; i < 8; ++i) {
+		__m128 v[2];
+		int h;
+		v[0] = _mm_mul_ps(left[i], _mm_loadu_ps(fdtbl + i*8));
+		v[1] = _mm_mul_ps(right[i], _mm_loadu_ps(fdtbl + i*8 + 4));
+		for(h = 0; h < 2; ++h) {
+			__m128 sign = _mm_and_ps(v[h], signMask);
+			__m128i q = _mm_cvttps_epi32(_mm_add_ps(_mm_xor_ps(v[h], sign), half));
+			__m128i s = _mm_srai_epi32(_mm_castps_si128(sign), 31);
+			_mm_storeu_si128((__m128i *)(DU + i*8 + h*4), _mm_sub_epi32(_mm_xor_si128(q, s), s));
+		}
 	}
-	bits[0] = val & ((1<<bits[1])-1);
 }
 
-static int jo_processDU(FILE *fp, int *bitBuf, int *bitCnt, float *CDU, float *fdtbl, int DC, const unsigned short HTDC[256][2], const unsigned short HTAC[256][2]) {
-	const unsigned short EOB[2] = { HTAC[0x00][0], HTAC[0x00][1] };
-	const unsigned short M16zeroes[2] = { HTAC[0xF0][0], HTAC[0xF0][1] };
-	int dataOff, i, nrmarker;
-	
+// RGB to YCbCr for a whole block, 16 pixels per step
+static void jo_colorTransform(const unsigned char *R, const unsigned char *G, const unsigned char *B, float *YDU, float *UDU, float *VDU) {
+	const __m128i zero = _mm_setzero_si128();
+	int i, j;
+	for(i = 0; i < 64; i += 16) {
+		__m128i r8 = _mm_loadu_si128((const __m128i *)(R + i));
+		__m128i g8 = _mm_loadu_si128((const __m128i *)(G + i));
+		__m128i b8 = _mm_loadu_si128((const __m128i *)(B + i));
+		__m128i r16[2], g16[2], b16[2];
+		r16[0] = _mm_unpacklo_epi8(r8, zero); r16[1] = _mm_unpackhi_epi8(r8, zero);
+		g16[0] = _mm_unpacklo_epi8(g8, zero); g16[1] = _mm_unpackhi_epi8(g8, zero);
+		b16[0] = _mm_unpacklo_epi8(b8, zero); b16[1] = _mm_unpackhi_epi8(b8, zero);
+		for(j = 0; j < 4; ++j) {
+			__m128 r = _mm_cvtepi32_ps(j & 1 ? _mm_unpackhi_epi16(r16[j>>1], zero) : _mm_unpacklo_epi16(r16[j>>1], zero));
+			__m128 g = _mm_cvtepi32_ps(j & 1 ? _mm_unpackhi_epi16(g16[j>>1], zero) : _mm_unpacklo_epi16(g16[j>>1], zero));
+			__m128 b = _mm_cvtepi32_ps(j & 1 ? _mm_unpackhi_epi16(b16[j>>1], zero) : _mm_unpacklo_epi16(b16[j>>1], zero));
+			__m128 y = _mm_add_ps(_mm_mul_ps(_mm_set1_ps(+0.29900f), r), _mm_mul_ps(_mm_set1_ps(0.58700f), g));
+			__m128 u = _mm_sub_ps(_mm_mul_ps(_mm_set1_ps(-0.16874f), r), _mm_mul_ps(_mm_set1_ps(0.33126f), g));
+			__m128 v = _mm_sub_ps(_mm_mul_ps(_mm_set1_ps(+0.50000f), r), _mm_mul_ps(_mm_set1_ps(0.41869f), g));
+			y = _mm_sub_ps(_mm_add_ps(y, _mm_mul_ps(_mm_set1_ps(0.11400f), b)), _mm_set1_ps(128.0f));
+			u = _mm_add_ps(u, _mm_mul_ps(_mm_set1_ps(0.50000f), b));
+			v = _mm_sub_ps(v, _mm_mul_ps(_mm_set1_ps(0.08131f), b));
+			_mm_storeu_ps(YDU + i + j*4, y);
+			_mm_storeu_ps(UDU + i + j*4, u);
+			_mm_storeu_ps(VDU + i + j*4, v);
+		}
+	}
+}
+
+#ifdef JO_AVX2
+static int jo_avx2Available(void) {
+#ifdef _MSC_VER
+	int info[4];
+	__cpuid(info, 0);
+	if(info[0] < 7) {
+		return 0;
+	}
+	// OSXSAVE and AVX, then the OS must save the YMM registers
+	__cpuid(info, 1);
+	if((info[2] & 0x18000000) != 0x18000000 || (_xgetbv(0) & 6) != 6) {
+		return 0;
+	}
+	__cpuidex(info, 7, 0);
+	return (info[1] & (1 << 5)) != 0;
+#else
+	return __builtin_cpu_supports("avx2");
+#endif
+}
+
+// jo_DCT4 on eight lanes, no FMA so the results stay bit-identical
+static JO_AVX2_TARGET void jo_DCT8(__m256 d[8]) {
+	const __m256 c4 = _mm256_set1_ps(0.707106781f), c6 = _mm256_set1_ps(0.382683433f);
+	const __m256 c2mc6 = _mm256_set1_ps(0.541196100f), c2pc6 = _mm256_set1_ps(1.306562965f);
+	__m256 tmp0 = _mm256_add_ps(d[0], d[7]);
+	__m256 tmp7 = _mm256_sub_ps(d[0], d[7]);
+	__m256 tmp1 = _mm256_add_ps(d[1], d[6]);
+	__m256 tmp6 = _mm256_sub_ps(d[1], d[6]);
+	__m256 tmp2 = _mm256_add_ps(d[2], d[5]);
+	__m256 tmp5 = _mm256_sub_ps(d[2], d[5]);
+	__m256 tmp3 = _mm256_add_ps(d[3], d[4]);
+	__m256 tmp4 = _mm256_sub_ps(d[3], d[4]);
+
+	// Even part
+	__m256 tmp10 = _mm256_add_ps(tmp0, tmp3);
+	__m256 tmp13 = _mm256_sub_ps(tmp0, tmp3);
+	__m256 tmp11 = _mm256_add_ps(tmp1, tmp2);
+	__m256 tmp12 = _mm256_sub_ps(tmp1, tmp2);
+
+	d[0] = _mm256_add_ps(tmp10, tmp11);
+	d[4] = _mm256_sub_ps(tmp10, tmp11);
+
+	__m256 z1 = _mm256_mul_ps(_mm256_add_ps(tmp12, tmp13), c4);
+	d[2] = _mm256_add_ps(tmp13, z1);
+	d[6] = _mm256_sub_ps(tmp13, z1);
+
+	// Odd part
+	tmp10 = _mm256_add_ps(tmp4, tmp5);
+	tmp11 = _mm256_add_ps(tmp5, tmp6);
+	tmp12 = _mm256_add_ps(tmp6, tmp7);
+
+	__m256 z5 = _mm256_mul_ps(_mm256_sub_ps(tmp10, tmp12), c6);
+	__m256 z2 = _mm256_add_ps(_mm256_mul_ps(tmp10, c2mc6), z5);
+	__m256 z4 = _mm256_add_ps(_mm256_mul_ps(tmp12, c2pc6), z5);
+	__m256 z3 = _mm256_mul_ps(tmp11, c4);
+
+	__m256 z11 = _mm256_add_ps(tmp7, z3);
+	__m256 z13 = _mm256_sub_ps(tmp7, z3);
+
+	d[5] = _mm256_add_ps(z13, z2);
+	d[3] = _mm256_sub_ps(z13, z2);
+	d[1] = _mm256_add_ps(z11, z4);
+	d[7] = _mm256_sub_ps(z11, z4);
+}
+
+// jo_fdctQuantize with a whole block column, then row, per register
+static JO_AVX2_TARGET void jo_fdctQuantize_avx2(float *CDU, const float *fdtbl, int *DU) {
+	const __m256 half = _mm256_set1_ps(0.5f), signMask = _mm256_set1_ps(-0.0f);
+	__m256 d[8], t[8], u[8];
+	int i;
+
+	// DCT rows: d[c] is column c
+	for(i = 0; i < 8; ++i) {
+		d[i] = _mm256_loadu_ps(CDU + i*8);
+	}
+	jo_DCT8(d);
+
+	// Back to row major: d[r] is row r
+	for(i = 0; i < 8; i += 2) {
+		t[i] = _mm256_unpacklo_ps(d[i], d[i+1]);
+		t[i+1] = _mm256_unpackhi_ps(d[i], d[i+1]);
+	}
+	for(i = 0; i < 8; i += 4) {
+		u[i] = _mm256_shuffle_ps(t[i], t[i+2], _MM_SHUFFLE(1,0,1,0));
+		u[i+1] = _mm256_shuffle_ps(t[i], t[i+2], _MM_SHUFFLE(3,2,3,2));
+		u[i+2] = _mm256_shuffle_ps(t[i+1], t[i+3], _MM_SHUFFLE(1,0,1,0));
+		u[i+3] = _mm256_shuffle_ps(t[i+1], t[i+3], _MM_SHUFFLE(3,2,3,2));
+	}
+	for(i = 0; i < 4; ++i) {
+		d[i] = _mm256_permute2f128_ps(u[i], u[i+4], 0x20);
+		d[i+4] = _mm256_permute2f128_ps(u[i], u[i+4], 0x31);
+	}
+
+	// DCT columns
+	jo_DCT8(d);
+
+	// Quantize/descale, rounding half away from zero like the scalar path
+	for(i = 0; i < 8; ++i) {
+		__m256 v = _mm256_mul_ps(d[i], _mm256_loadu_ps(fdtbl + i*8));
+		__m256 sign = _mm256_and_ps(v, signMask);
+		__m256i q = _mm256_cvttps_epi32(_mm256_add_ps(_mm256_xor_ps(v, sign), half));
+		__m256i s = _mm256_srai_epi32(_mm256_castps_si256(sign), 31);
+		_mm256_storeu_si256((__m256i *)(DU + i*8), _mm256_sub_epi32(_mm256_xor_si256(q, s), s));
+	}
+}
+
+// jo_colorTransform, 8 pixels per step
+static JO_AVX2_TARGET void jo_colorTransform_avx2(const unsigned char *R, const unsigned char *G, const unsigned char *B, float *YDU, float *UDU, float *VDU) {
+	int i;
+	for(i = 0; i < 64; i += 8) {
+		__m256 r = _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *)(R + i))));
+		__m256 g = _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *)(G + i))));
+		__m256 b = _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *)(B + i))));
+		__m256 y = _mm256_add_ps(_mm256_mul_ps(_mm256_set1_ps(+0.29900f), r), _mm256_mul_ps(_mm256_set1_ps(0.58700f), g));
+		__m256 u = _mm256_sub_ps(_mm256_mul_ps(_mm256_set1_ps(-0.16874f), r), _mm256_mul_ps(_mm256_set1_ps(0.33126f), g));
+		__m256 v = _mm256_sub_ps(_mm256_mul_ps(_mm256_set1_ps(+0.50000f), r), _mm256_mul_ps(_mm256_set1_ps(0.41869f), g));
+		y = _mm256_sub_ps(_mm256_add_ps(y, _mm256_mul_ps(_mm256_set1_ps(0.11400f), b)), _mm256_set1_ps(128.0f));
+		u = _mm256_add_ps(u, _mm256_mul_ps(_mm256_set1_ps(0.50000f), b));
+		v = _mm256_sub_ps(v, _mm256_mul_ps(_mm256_set1_ps(0.08131f), b));
+		_mm256_storeu_ps(YDU + i, y);
+		_mm256_storeu_ps(UDU + i, u);
+		_mm256_storeu_ps(VDU + i, v);
+	}
+}
+#endif
+
+#else
+
+#define JO_BLOCK_INDEX(row, col) ((row)*8 + (col))
+
+static void jo_fdctQuantize(float *CDU, const float *fdtbl, int *DU) {
+	int dataOff, i;
+
 	// DCT rows
 	for(dataOff=0; dataOff<64; dataOff+=8) {
 		jo_DCT(&CDU[dataOff], &CDU[dataOff+1], &CDU[dataOff+2], &CDU[dataOff+3], &CDU[dataOff+4], &CDU[dataOff+5], &CDU[dataOff+6], &CDU[dataOff+7]);
@@ -124,22 +445,81 @@ static int jo_processDU(FILE *fp, int *bitBuf, int *bitCnt, float *CDU, float *f
 	for(dataOff=0; dataOff<8; ++dataOff) {
 		jo_DCT(&CDU[dataOff], &CDU[dataOff+8], &CDU[dataOff+16], &CDU[dataOff+24], &CDU[dataOff+32], &CDU[dataOff+40], &CDU[dataOff+48], &CDU[dataOff+56]);
 	}
-	// Quantize/descale/zigzag the coefficients
-	int DU[64];
+	// Quantize/descale the coefficients
 	for(i=0; i<64; ++i) {
 		float v = CDU[i]*fdtbl[i];
-		DU[s_jo_ZigZag[i]] = (int)(v < 0 ? ceilf(v - 0.5f) : floorf(v + 0.5f));
+		DU[i] = (int)(v < 0 ? ceilf(v - 0.5f) : floorf(v + 0.5f));
+	}
+}
+
+static void jo_colorTransform(const unsigned char *R, const unsigned char *G, const unsigned char *B, float *YDU, float *UDU, float *VDU) {
+	int pos;
+	for(pos = 0; pos < 64; ++pos) {
+		float r = R[pos], g = G[pos], b = B[pos];
+		YDU[pos]=+0.29900f*r+0.58700f*g+0.11400f*b-128;
+		UDU[pos]=-0.16874f*r-0.33126f*g+0.50000f*b;
+		VDU[pos]=+0.50000f*r-0.41869f*g-0.08131f*b;
+	}
+}
+
+#endif
+
+typedef void jo_fdctQuantizeFunc(float *CDU, const float *fdtbl, int *DU);
+typedef void jo_colorTransformFunc(const unsigned char *R, const unsigned char *G, const unsigned char *B, float *YDU, float *UDU, float *VDU);
+
+// Gathers the 8x8 block at x,y, repeating the last row/column past the image edge
+static void jo_loadBlock(jo_colorTransformFunc *colorTransform, const unsigned char *imageData, int width, int height, int comp, int x, int y, float *YDU, float *UDU, float *VDU) {
+	unsigned char R[64], G[64], B[64];
+	int ofsG = comp > 1 ? 1 : 0, ofsB = comp > 1 ? 2 : 0;
+	int row, col;
+	for(row = 0; row < 8; ++row) {
+		const unsigned char *line = imageData + (size_t)(y+row < height ? y+row : height-1)*width*comp;
+		for(col = 0; col < 8; ++col) {
+			const unsigned char *p = line + (x+col < width ? x+col : width-1)*comp;
+			int pos = JO_BLOCK_INDEX(row, col);
+			R[pos] = p[0];
+			G[pos] = p[ofsG];
+			B[pos] = p[ofsB];
+		}
+	}
+	colorTransform(R, G, B, YDU, UDU, VDU);
+}
+
+static void jo_calcBits(int val, unsigned short bits[2]) {
+	int tmp1 = val < 0 ? -val : val;
+	val = val < 0 ? val-1 : val;
+#if defined(__GNUC__) || defined(__clang__)
+	bits[1] = tmp1 ? 32 - __builtin_clz(tmp1) : 1;
+#else
+	bits[1] = 1;
+	while(tmp1 >>= 1) {
+		++bits[1];
+	}
+#endif
+	bits[0] = val & ((1<<bits[1])-1);
+}
+
+static int jo_processDU(jo_bitWriter *w, jo_fdctQuantizeFunc *fdctQuantize, float *CDU, const float *fdtbl, int DC, const unsigned short HTDC[256][2], const unsigned short HTAC[256][2]) {
+	const unsigned short EOB[2] = { HTAC[0x00][0], HTAC[0x00][1] };
+	const unsigned short M16zeroes[2] = { HTAC[0xF0][0], HTAC[0xF0][1] };
+	int i, nrmarker;
+
+	// DCT, quantize/descale, then zigzag the coefficients
+	int coef[64], DU[64];
+	fdctQuantize(CDU, fdtbl, coef);
+	for(i=0; i<64; ++i) {
+		DU[s_jo_ZigZag[i]] = coef[i];
 	}
 
 	// Encode DC
-	int diff = DU[0] - DC; 
+	int diff = DU[0] - DC;
 	if (diff == 0) {
-		jo_writeBits(fp, bitBuf, bitCnt, HTDC[0]);
+		jo_writeBits(w, HTDC[0]);
 	} else {
 		unsigned short bits[2];
 		jo_calcBits(diff, bits);
-		jo_writeBits(fp, bitBuf, bitCnt, HTDC[bits[1]]);
-		jo_writeBits(fp, bitBuf, bitCnt, bits);
+		jo_writeBits(w, HTDC[bits[1]]);
+		jo_writeBits(w, bits);
 	}
 	// Encode ACs
 	int end0pos = 63;
@@ -147,7 +527,7 @@ static int jo_processDU(FILE *fp, int *bitBuf, int *bitCnt, float *CDU, float *f
 	}
 	// end0pos = first element in reverse order !=0
 	if(end0pos == 0) {
-		jo_writeBits(fp, bitBuf, bitCnt, EOB);
+		jo_writeBits(w, EOB);
 		return DU[0];
 	}
 	for(i = 1; i <= end0pos; ++i) {
@@ -158,20 +538,54 @@ static int jo_processDU(FILE *fp, int *bitBuf, int *bitCnt, float *CDU, float *f
 		if ( nrzeroes >= 16 ) {
 			int lng = nrzeroes>>4;
 			for (nrmarker=1; nrmarker <= lng; ++nrmarker)
-				jo_writeBits(fp, bitBuf, bitCnt, M16zeroes);
+				jo_writeBits(w, M16zeroes);
 			nrzeroes &= 15;
 		}
 		unsigned short bits[2];
 		jo_calcBits(DU[i], bits);
-		jo_writeBits(fp, bitBuf, bitCnt, HTAC[(nrzeroes<<4)+bits[1]]);
-		jo_writeBits(fp, bitBuf, bitCnt, bits);
+		jo_writeBits(w, HTAC[(nrzeroes<<4)+bits[1]]);
+		jo_writeBits(w, bits);
 	}
 	if(end0pos != 63) {
-		jo_writeBits(fp, bitBuf, bitCnt, EOB);
+		jo_writeBits(w, EOB);
 	}
 	return DU[0];
 }
 
+typedef struct {
+	const unsigned char *imageData;
+	int width, height, comp;
+	int segmentHeight; // pixel rows per restart interval
+	const float *fdtbl_Y, *fdtbl_UV;
+	const unsigned short (*YDC_HT)[2], (*YAC_HT)[2], (*UVDC_HT)[2], (*UVAC_HT)[2];
+	jo_bitWriter *segments;
+	jo_fdctQuantizeFunc *fdctQuantize;
+	jo_colorTransformFunc *colorTransform;
+} jo_encodeJob;
+
+// Encodes one restart interval; DC predictions start over at 0 in each
+static void jo_encodeSegment(void *arg, int index) {
+	static const unsigned short fillBits[] = {0x7F, 7};
+	jo_encodeJob *job = (jo_encodeJob *)arg;
+	jo_bitWriter *w = &job->segments[index];
+	int DCY=0, DCU=0, DCV=0;
+	int x, y, yEnd = (index+1)*job->segmentHeight;
+	if(yEnd > job->height) {
+		yEnd = job->height;
+	}
+	for(y = index*job->segmentHeight; y < yEnd; y += 8) {
+		for(x = 0; x < job->width; x += 8) {
+			float YDU[64], UDU[64], VDU[64];
+			jo_loadBlock(job->colorTransform, job->imageData, job->width, job->height, job->comp, x, y, YDU, UDU, VDU);
+			DCY = jo_processDU(w, job->fdctQuantize, YDU, job->fdtbl_Y, DCY, job->YDC_HT, job->YAC_HT);
+			DCU = jo_processDU(w, job->fdctQuantize, UDU, job->fdtbl_UV, DCU, job->UVDC_HT, job->UVAC_HT);
+			DCV = jo_processDU(w, job->fdctQuantize, VDU, job->fdtbl_UV, DCV, job->UVDC_HT, job->UVAC_HT);
+		}
+	}
+	// Pad to a byte boundary with 1 bits, the RST or EOI marker comes next
+	jo_writeBits(w, fillBits);
+}
+
 int jo_write_jpg(const char *filename, const void *data, int width, int height, int comp, int quality) {
 	// Constants that don't pollute global namespace
 	static const unsigned char std_dc_luminance_nrcodes[] = {0,0,1,5,1,1,1,1,1,1,0,0,0,0,0,0,0};
@@ -240,14 +654,9 @@ int jo_write_jpg(const char *filename, const void *data, int width, int height,
 	static const int YQT[] = {16,11,10,16,24,40,51,61,12,12,14,19,26,58,60,55,14,13,16,24,40,57,69,56,14,17,22,29,51,87,80,62,18,22,37,56,68,109,103,77,24,35,55,64,81,104,113,92,49,64,78,87,103,121,120,101,72,92,95,98,112,100,103,99};
 	static const int UVQT[] = {17,18,24,47,99,99,99,99,18,21,26,66,99,99,99,99,24,26,56,99,99,99,99,99,47,66,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99};
 	static const float aasf[] = { 1.0f * 2.828427125f, 1.387039845f * 2.828427125f, 1.306562965f * 2.828427125f, 1.175875602f * 2.828427125f, 1.0f * 2.828427125f, 0.785694958f * 2.828427125f, 0.541196100f * 2.828427125f, 0.275899379f * 2.828427125f };
-	int i, row, col, x, y, k, pos;
-	
-	if(!data || !filename || !width || !height || comp > 4 || comp < 1 || comp == 2) {
-		return 0;
-	}
+	int i, row, col, k;
 
-	FILE *fp = fopen(filename, "wb");
-	if(!fp) {
+	if(!data || !filename || !width || !height || comp > 4 || comp < 1 || comp == 2) {
 		return 0;
 	}
 
@@ -271,70 +680,101 @@ int jo_write_jpg(const char *filename, const void *data, int width, int height,
 		}
 	}
 
-	// Write Headers
-	static const unsigned char head0[] = { 0xFF,0xD8,0xFF,0xE0,0,0x10,'J','F','I','F',0,1,1,0,0,1,0,1,0,0,0xFF,0xDB,0,0x84,0 };
-	fwrite(head0, sizeof(head0), 1, fp);
-	fwrite(YTable, sizeof(YTable), 1, fp);
-	putc(1, fp);
-	fwrite(UVTable, sizeof(UVTable), 1, fp);
-	const unsigned char head1[] = { 0xFF,0xC0,0,0x11,8,(unsigned char)(height>>8),(unsigned char)(height&0xFF),(unsigned char)(width>>8),(unsigned char)(width&0xFF),3,1,0x11,0,2,0x11,1,3,0x11,1,0xFF,0xC4,0x01,0xA2,0 };
-	fwrite(head1, sizeof(head1), 1, fp);
-	fwrite(std_dc_luminance_nrcodes+1, sizeof(std_dc_luminance_nrcodes)-1, 1, fp);
-	fwrite(std_dc_luminance_values, sizeof(std_dc_luminance_values), 1, fp);
-	putc(0x10, fp); // HTYACinfo
-	fwrite(std_ac_luminance_nrcodes+1, sizeof(std_ac_luminance_nrcodes)-1, 1, fp);
-	fwrite(std_ac_luminance_values, sizeof(std_ac_luminance_values), 1, fp);
-	putc(1, fp); // HTUDCinfo
-	fwrite(std_dc_chrominance_nrcodes+1, sizeof(std_dc_chrominance_nrcodes)-1, 1, fp);
-	fwrite(std_dc_chrominance_values, sizeof(std_dc_chrominance_values), 1, fp);
-	putc(0x11, fp); // HTUACinfo
-	fwrite(std_ac_chrominance_nrcodes+1, sizeof(std_ac_chrominance_nrcodes)-1, 1, fp);
-	fwrite(std_ac_chrominance_values, sizeof(std_ac_chrominance_values), 1, fp);
-	static const unsigned char head2[] = { 0xFF,0xDA,0,0xC,3,1,0,2,0x11,3,0x11,0,0x3F,0 };
-	fwrite(head2, sizeof(head2), 1, fp);
+	// Split the MCU rows into restart intervals that encode independently.
+	// Small images stay a single interval and need no DRI/RST markers.
+	int mcusPerRow = (width + 7) / 8;
+	int segmentRows = JO_SEGMENT_MCUS / mcusPerRow;
+	segmentRows = segmentRows < 1 ? 1 : segmentRows;
+	int segmentCount = ((height + 7) / 8 + segmentRows - 1) / segmentRows;
+	int restartInterval = segmentRows * mcusPerRow;
+
+	jo_bitWriter *segments = (jo_bitWriter *)calloc(segmentCount, sizeof(jo_bitWriter));
+	if(!segments) {
+		return 0;
+	}
 
 	// Encode 8x8 macroblocks
-	const unsigned char *imageData = (const unsigned char *)data;
-	int DCY=0, DCU=0, DCV=0;
-	int bitBuf=0, bitCnt=0;
-	int ofsG = comp > 1 ? 1 : 0, ofsB = comp > 1 ? 2 : 0;
-	for(y = 0; y < height; y += 8) {
-		for(x = 0; x < width; x += 8) {
-			float YDU[64], UDU[64], VDU[64];
-			for(row = y, pos = 0; row < y+8; ++row) {
-				for(col = x; col < x+8; ++col, ++pos) {
-					int p = row*width*comp + col*comp;
-					if(row >= height) {
-						p -= width*comp*(row+1 - height);
-					}
-					if(col >= width) {
-						p -= comp*(col+1 - width);
-					}
-
-					float r = imageData[p+0], g = imageData[p+ofsG], b = imageData[p+ofsB];
-					YDU[pos]=+0.29900f*r+0.58700f*g+0.11400f*b-128;
-					UDU[pos]=-0.16874f*r-0.33126f*g+0.50000f*b;
-					VDU[pos]=+0.50000f*r-0.41869f*g-0.08131f*b;
-				}
-			}
+	jo_encodeJob job;
+	job.imageData = (const unsigned char *)data;
+	job.width = width;
+	job.height = height;
+	job.comp = comp;
+	job.segmentHeight = segmentRows * 8;
+	job.fdtbl_Y = fdtbl_Y;
+	job.fdtbl_UV = fdtbl_UV;
+	job.YDC_HT = YDC_HT;
+	job.YAC_HT = YAC_HT;
+	job.UVDC_HT = UVDC_HT;
+	job.UVAC_HT = UVAC_HT;
+	job.segments = segments;
+	job.fdctQuantize = jo_fdctQuantize;
+	job.colorTransform = jo_colorTransform;
+#ifdef JO_AVX2
+	// Picked here rather than in the tasks, which may run on several threads
+	if(jo_avx2Available()) {
+		job.fdctQuantize = jo_fdctQuantize_avx2;
+		job.colorTransform = jo_colorTransform_avx2;
+	}
+#endif
+	jo_runTasks(segmentCount, jo_encodeSegment, &job);
 
-			DCY = jo_processDU(fp, &bitBuf, &bitCnt, YDU, fdtbl_Y, DCY, YDC_HT, YAC_HT);
-			DCU = jo_processDU(fp, &bitBuf, &bitCnt, UDU, fdtbl_UV, DCU, UVDC_HT, UVAC_HT);
-			DCV = jo_processDU(fp, &bitBuf, &bitCnt, VDU, fdtbl_UV, DCV, UVDC_HT, UVAC_HT);
-		}
+	int ok = 1;
+	for(i = 0; i < segmentCount; ++i) {
+		ok = ok && !segments[i].failed;
 	}
-	
-	// Do the bit alignment of the EOI marker
-	static const unsigned short fillBits[] = {0x7F, 7};
-	jo_writeBits(fp, &bitBuf, &bitCnt, fillBits);
 
-	// EOI
-	putc(0xFF, fp);
-	putc(0xD9, fp);
+	FILE *fp = ok ? fopen(filename, "wb") : NULL;
+	if(fp) {
+		// Write Headers
+		static const unsigned char head0[] = { 0xFF,0xD8,0xFF,0xE0,0,0x10,'J','F','I','F',0,1,1,0,0,1,0,1,0,0,0xFF,0xDB,0,0x84,0 };
+		fwrite(head0, sizeof(head0), 1, fp);
+		fwrite(YTable, sizeof(YTable), 1, fp);
+		putc(1, fp);
+		fwrite(UVTable, sizeof(UVTable), 1, fp);
+		const unsigned char head1[] = { 0xFF,0xC0,0,0x11,8,(unsigned char)(height>>8),(unsigned char)(height&0xFF),(unsigned char)(width>>8),(unsigned char)(width&0xFF),3,1,0x11,0,2,0x11,1,3,0x11,1,0xFF,0xC4,0x01,0xA2,0 };
+		fwrite(head1, sizeof(head1), 1, fp);
+		fwrite(std_dc_luminance_nrcodes+1, sizeof(std_dc_luminance_nrcodes)-1, 1, fp);
+		fwrite(std_dc_luminance_values, sizeof(std_dc_luminance_values), 1, fp);
+		putc(0x10, fp); // HTYACinfo
+		fwrite(std_ac_luminance_nrcodes+1, sizeof(std_ac_luminance_nrcodes)-1, 1, fp);
+		fwrite(std_ac_luminance_values, sizeof(std_ac_luminance_values), 1, fp);
+		putc(1, fp); // HTUDCinfo
+		fwrite(std_dc_chrominance_nrcodes+1, sizeof(std_dc_chrominance_nrcodes)-1, 1, fp);
+		fwrite(std_dc_chrominance_values, sizeof(std_dc_chrominance_values), 1, fp);
+		putc(0x11, fp); // HTUACinfo
+		fwrite(std_ac_chrominance_nrcodes+1, sizeof(std_ac_chrominance_nrcodes)-1, 1, fp);
+		fwrite(std_ac_chrominance_values, sizeof(std_ac_chrominance_values), 1, fp);
+		if(segmentCount > 1) {
+			const unsigned char dri[] = { 0xFF,0xDD,0,4,(unsigned char)(restartInterval>>8),(unsigned char)(restartInterval&0xFF) };
+			fwrite(dri, sizeof(dri), 1, fp);
+		}
+		static const unsigned char head2[] = { 0xFF,0xDA,0,0xC,3,1,0,2,0x11,3,0x11,0,0x3F,0 };
+		fwrite(head2, sizeof(head2), 1, fp);
+
+		for(i = 0; i < segmentCount; ++i) {
+			fwrite(segments[i].buf, segments[i].size, 1, fp);
+			if(i + 1 < segmentCount) {
+				// RSTn
+				putc(0xFF, fp);
+				putc(0xD0 + (i & 7), fp);
+			}
+		}
 
-	fclose(fp);
-	return 1;
+		// EOI
+		putc(0xFF, fp);
+		putc(0xD9, fp);
+
+		ok = !ferror(fp);
+		fclose(fp);
+	} else {
+		ok = 0;
+	}
+
+	for(i = 0; i < segmentCount; ++i) {
+		free(segments[i].buf);
+	}
+	free(segments);
+	return ok;
 }
 
 #endif
-
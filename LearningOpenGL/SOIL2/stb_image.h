@@ -152,7 +152,8 @@ RECENT REVISION HISTORY:
 // If image loading fails for any reason, the return value will be NULL,
 // and *x, *y, *comp will be unchanged. The function stbi_failure_reason()
 // can be queried for an extremely brief, end-user unfriendly explanation
-// of why the load failed. Define STBI_NO_FAILURE_STRINGS to avoid
+// of why the load failed; each thread has its own, unless you define
+// STBI_NO_THREAD_LOCALS. Define STBI_NO_FAILURE_STRINGS to avoid
 // compiling these strings at all, and STBI_FAILURE_USERMSG to get slightly
 // more user-friendly ones.
 //
@@ -198,14 +199,18 @@ RECENT REVISION HISTORY:
 // SIMD support
 //
 // The JPEG decoder will try to automatically use SIMD kernels on x86 when
-// supported by the compiler. For ARM Neon support, you must explicitly
-// request it.
+// supported by the compiler, as does PNG defiltering of 8-bit RGB and RGBA
+// images (x86 only). For ARM Neon support, you must explicitly request it.
 //
 // (The old do-it-yourself SIMD API is no longer supported in the current
 // code.)
 //
 // On x86, SSE2 will automatically be used when available based on a run-time
-// test; if not, the generic C versions are used as a fall-back. On ARM targets,
+// test; if not, the generic C versions are used as a fall-back. When the
+// compiler can build AVX2 code (GCC 4.9+, Clang, VC++ 2012+), wider AVX2
+// versions of the JPEG IDCT and color conversion are compiled alongside and
+// selected at run-time on CPUs that support them; define STBI_NO_AVX2 to
+// leave them out. On ARM targets,
 // the typical path is to have separate builds for NEON and non-NEON devices
 // (at least this is true for iOS and Android). Therefore, the NEON support is
 // toggled by a build flag: define STBI_NEON to get NEON loops.
@@ -361,6 +366,28 @@ STBIDEF stbi_uc *stbi_load_from_file   (FILE *f, int *x, int *y, int *channels_i
 // for stbi_load_from_file, file pointer is left pointing immediately after image
 #endif
 
+// decode into a caller-provided buffer of dest_size bytes (e.g. a mapped pixel
+// buffer object) instead of a newly allocated one. returns dest, or NULL if
+// decoding failed or the image needs more than dest_size bytes. JPEG and 8-bit
+// non-paletted PNG images are written straight into dest (JPEG wants one byte
+// of slack past the pixels for that); other formats are decoded as usual and
+// copied.
+STBIDEF stbi_uc *stbi_load_from_memory_into(stbi_uc const *buffer, int len, int *x, int *y, int *channels_in_file, int desired_channels, stbi_uc *dest, int dest_size);
+#ifndef STBI_NO_STDIO
+STBIDEF stbi_uc *stbi_load_into            (char const *filename,           int *x, int *y, int *channels_in_file, int desired_channels, stbi_uc *dest, int dest_size);
+STBIDEF stbi_uc *stbi_load_from_file_into  (FILE *f,                        int *x, int *y, int *channels_in_file, int desired_channels, stbi_uc *dest, int dest_size);
+#endif
+
+// decode a JPEG at 1/2, 1/4 or 1/8 of its size (scale_shift 1..3), using only
+// the low-frequency DCT coefficients of each block, e.g. for a lower mip or a
+// thumbnail. *x and *y get the reduced size, rounded up. other formats
+// ignore scale_shift and come back at full size.
+STBIDEF stbi_uc *stbi_load_from_memory_scaled(stbi_uc const *buffer, int len, int *x, int *y, int *channels_in_file, int desired_channels, int scale_shift);
+#ifndef STBI_NO_STDIO
+STBIDEF stbi_uc *stbi_load_scaled            (char const *filename,           int *x, int *y, int *channels_in_file, int desired_channels, int scale_shift);
+STBIDEF stbi_uc *stbi_load_from_file_scaled  (FILE *f,                        int *x, int *y, int *channels_in_file, int desired_channels, int scale_shift);
+#endif
+
 ////////////////////////////////////
 //
 // 16-bits-per-channel interface
@@ -436,6 +463,14 @@ STBIDEF void stbi_convert_iphone_png_to_rgb(int flag_true_if_should_convert);
 // flip the image vertically, so the first pixel in the output array is the bottom left
 STBIDEF void stbi_set_flip_vertically_on_load(int flag_true_if_should_flip);
 
+// let the decoder split work across threads: parallel_for must call
+// task(arg, i) once for every i in [0, count), on any threads, and return once
+// all of them are done. currently used for baseline JPEGs with restart
+// markers, whose restart intervals decode independently. set it before
+// loading anything; pass NULL (the default) to decode on the calling thread.
+typedef void stbi_parallel_for(void *user, int count, void (*task)(void *arg, int index), void *arg);
+STBIDEF void stbi_set_parallel_for(stbi_parallel_for *parallel_for, void *user);
+
 // ZLIB client - used by PNG, available for other purposes
 
 STBIDEF char *stbi_zlib_decode_malloc_guesssize(const char *buffer, int len, int initial_size, int *outlen);
@@ -541,6 +576,25 @@ STBIDEF int   stbi_zlib_decode_noheader_buffer(char *obuffer, int olen, const ch
    #define stbi_inline __forceinline
 #endif
 
+// the failure reason is kept per thread, so loads on several threads and the
+// tasks of a parallel decode don't race on it. define STBI_NO_THREAD_LOCALS
+// on compilers without thread-local storage
+#ifndef STBI_NO_THREAD_LOCALS
+   #if defined(__cplusplus) && __cplusplus >= 201103L
+      #define STBI_THREAD_LOCAL       thread_local
+   #elif defined(_MSC_VER)
+      #define STBI_THREAD_LOCAL       __declspec(thread)
+   #elif defined(__GNUC__) || defined(__clang__)
+      #define STBI_THREAD_LOCAL       __thread
+   #elif defined(__STDC_VERSION__) && __STDC_VERSION__ >= 201112L && !defined(__STDC_NO_THREADS__)
+      #define STBI_THREAD_LOCAL       _Thread_local
+   #endif
+#endif
+
+#ifndef STBI_THREAD_LOCAL
+   #define STBI_THREAD_LOCAL
+#endif
+
 
 #ifdef _MSC_VER
 typedef unsigned short stbi__uint16;
@@ -599,6 +653,25 @@ typedef unsigned char validate_uint32[sizeof(stbi__uint32)==4 ? 1 : -1];
 #define STBI__X86_TARGET
 #endif
 
+#if defined(STBI__X86_TARGET) || defined(STBI__X64_TARGET) || defined(_M_ARM64) || (defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__)
+#define STBI__LITTLE_ENDIAN
+#endif
+
+// the JPEG and zlib entropy decoders keep their bits in a 64-bit register
+// where one is available, so a single refill pulls in up to seven bytes and
+// covers several Huffman symbols instead of at most three bytes per refill
+#if defined(STBI__X64_TARGET) || defined(__aarch64__) || defined(_M_ARM64)
+#ifdef _MSC_VER
+typedef unsigned __int64 stbi__bitbuf;
+#else
+typedef uint64_t stbi__bitbuf;
+#endif
+#define STBI__BITBUF_BITS  64
+#else
+typedef stbi__uint32 stbi__bitbuf;
+#define STBI__BITBUF_BITS  32
+#endif
+
 #if defined(__GNUC__) && (defined(STBI__X86_TARGET) || defined(STBI__X64_TARGET)) && !defined(__SSE2__) && !defined(STBI_NO_SIMD)
 // NOTE: not clear do we actually need this for the 64-bit path?
 // gcc doesn't support sse2 intrinsics unless you compile with -msse2,
@@ -662,6 +735,42 @@ static int stbi__sse2_available()
 #endif
 #endif
 
+// x86 AVX2: only the kernels carry the avx2 target, so the rest of the
+// library still runs on SSE2-only machines
+#if defined(STBI_SSE2) && !defined(STBI_NO_AVX2)
+#if defined(_MSC_VER) && _MSC_VER >= 1700
+#define STBI_AVX2
+#define STBI_AVX2_TARGET
+#elif defined(__clang__) || (defined(__GNUC__) && (__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9)))
+#define STBI_AVX2
+#define STBI_AVX2_TARGET __attribute__((target("avx2")))
+#endif
+#endif
+
+#ifdef STBI_AVX2
+#include <immintrin.h>
+
+#ifdef _MSC_VER
+static int stbi__avx2_available()
+{
+   int info[4];
+   __cpuid(info,0);
+   if (info[0] < 7) return 0;
+   __cpuid(info,1);
+   // OSXSAVE + AVX, and the OS must save the ymm state
+   if ((info[2] & 0x18000000) != 0x18000000) return 0;
+   if ((_xgetbv(0) & 6) != 6) return 0;
+   __cpuidex(info,7,0);
+   return ((info[1] >> 5) & 1) != 0;
+}
+#else
+static int stbi__avx2_available()
+{
+   return __builtin_cpu_supports("avx2");
+}
+#endif
+#endif
+
 // ARM NEON
 #if defined(STBI_NO_SIMD) && defined(STBI_NEON)
 #undef STBI_NEON
@@ -697,6 +806,13 @@ typedef struct
 
    stbi_uc *img_buffer, *img_buffer_end;
    stbi_uc *img_buffer_original, *img_buffer_original_end;
+
+   // caller's buffer for the final image, set by the stbi_load_*_into calls
+   stbi_uc *out_dest;
+   int out_dest_size;
+
+   // log2 of the JPEG downscale factor, set by the stbi_load_*_scaled calls
+   int jpeg_scale;
 } stbi__context;
 
 
@@ -709,6 +825,8 @@ static void stbi__start_mem(stbi__context *s, stbi_uc const *buffer, int len)
    s->read_from_callbacks = 0;
    s->img_buffer = s->img_buffer_original = (stbi_uc *) buffer;
    s->img_buffer_end = s->img_buffer_original_end = (stbi_uc *) buffer+len;
+   s->out_dest = NULL;
+   s->jpeg_scale = 0;
 }
 
 // initialize a callback-based context
@@ -721,6 +839,8 @@ static void stbi__start_callbacks(stbi__context *s, stbi_io_callbacks *c, void *
    s->img_buffer_original = s->buffer_start;
    stbi__refill_buffer(s);
    s->img_buffer_original_end = s->img_buffer_end;
+   s->out_dest = NULL;
+   s->jpeg_scale = 0;
 }
 
 #ifndef STBI_NO_STDIO
@@ -850,8 +970,8 @@ static void    *stbi__pkm_load(stbi__context *s, int *x, int *y, int *comp, int
 static int      stbi__pkm_info(stbi__context *s, int *x, int *y, int *comp);
 #endif
 
-// this is not threadsafe
-static const char *stbi__g_failure_reason;
+// one per thread, see STBI_THREAD_LOCAL
+static STBI_THREAD_LOCAL const char *stbi__g_failure_reason;
 
 STBIDEF const char *stbi_failure_reason(void)
 {
@@ -934,6 +1054,21 @@ static void *stbi__malloc_mad3(int a, int b, int c, int add)
    return stbi__malloc(a*b*c + add);
 }
 
+// allocation for a decoder's final 8-bit image, which goes straight into the
+// caller's buffer during stbi_load_*_into when it fits. the decoder must not
+// free or replace the result afterwards; see stbi__free_output
+static void *stbi__malloc_output_mad3(stbi__context *s, int a, int b, int c, int add)
+{
+   if (!stbi__mad3sizes_valid(a, b, c, add)) return NULL;
+   if (s->out_dest && a*b*c + add <= s->out_dest_size) return s->out_dest;
+   return stbi__malloc(a*b*c + add);
+}
+
+static void stbi__free_output(stbi__context *s, void *p)
+{
+   if (p != s->out_dest) STBI_FREE(p);
+}
+
 static void *stbi__malloc_mad4(int a, int b, int c, int d, int add)
 {
    if (!stbi__mad4sizes_valid(a, b, c, d, add)) return NULL;
@@ -975,6 +1110,15 @@ STBIDEF void stbi_set_flip_vertically_on_load(int flag_true_if_should_flip)
     stbi__vertically_flip_on_load = flag_true_if_should_flip;
 }
 
+static stbi_parallel_for *stbi__parallel_for = NULL;
+static void *stbi__parallel_for_user = NULL;
+
+STBIDEF void stbi_set_parallel_for(stbi_parallel_for *parallel_for, void *user)
+{
+   stbi__parallel_for = parallel_for;
+   stbi__parallel_for_user = user;
+}
+
 static void *stbi__load_main(stbi__context *s, int *x, int *y, int *comp, int req_comp, stbi__result_info *ri, int bpc)
 {
    memset(ri, 0, sizeof(*ri)); // make sure it's initialized if we add new fields
@@ -1237,6 +1381,96 @@ STBIDEF stbi_uc *stbi_load_from_callbacks(stbi_io_callbacks const *clbk, void *u
    return stbi__load_and_postprocess_8bit(&s,x,y,comp,req_comp);
 }
 
+static stbi_uc *stbi__load_into(stbi__context *s, int *x, int *y, int *comp, int req_comp, stbi_uc *dest, int dest_size)
+{
+   stbi_uc *result;
+   int n, size;
+   if (dest == NULL || dest_size <= 0) return stbi__errpuc("bad dest", "Invalid destination buffer");
+   s->out_dest = dest;
+   s->out_dest_size = dest_size;
+   result = stbi__load_and_postprocess_8bit(s, x, y, comp, req_comp);
+   if (result == NULL || result == dest) return result;
+
+   // the decoder didn't write into dest itself
+   n = req_comp ? req_comp : *comp;
+   if (!stbi__mad3sizes_valid(*x, *y, n, 0) || *x * *y * n > dest_size) {
+      STBI_FREE(result);
+      return stbi__errpuc("dest too small", "Destination buffer too small");
+   }
+   size = *x * *y * n;
+   memcpy(dest, result, size);
+   STBI_FREE(result);
+   return dest;
+}
+
+STBIDEF stbi_uc *stbi_load_from_memory_into(stbi_uc const *buffer, int len, int *x, int *y, int *comp, int req_comp, stbi_uc *dest, int dest_size)
+{
+   stbi__context s;
+   stbi__start_mem(&s,buffer,len);
+   return stbi__load_into(&s,x,y,comp,req_comp,dest,dest_size);
+}
+
+#ifndef STBI_NO_STDIO
+STBIDEF stbi_uc *stbi_load_from_file_into(FILE *f, int *x, int *y, int *comp, int req_comp, stbi_uc *dest, int dest_size)
+{
+   unsigned char *result;
+   stbi__context s;
+   stbi__start_file(&s,f);
+   result = stbi__load_into(&s,x,y,comp,req_comp,dest,dest_size);
+   if (result) {
+      // need to 'unget' all the characters in the IO buffer
+      fseek(f, - (int) (s.img_buffer_end - s.img_buffer), SEEK_CUR);
+   }
+   return result;
+}
+
+STBIDEF stbi_uc *stbi_load_into(char const *filename, int *x, int *y, int *comp, int req_comp, stbi_uc *dest, int dest_size)
+{
+   FILE *f = stbi__fopen(filename, "rb");
+   unsigned char *result;
+   if (!f) return stbi__errpuc("can't fopen", "Unable to open file");
+   result = stbi_load_from_file_into(f,x,y,comp,req_comp,dest,dest_size);
+   fclose(f);
+   return result;
+}
+#endif //!STBI_NO_STDIO
+
+STBIDEF stbi_uc *stbi_load_from_memory_scaled(stbi_uc const *buffer, int len, int *x, int *y, int *comp, int req_comp, int scale_shift)
+{
+   stbi__context s;
+   if (scale_shift < 0 || scale_shift > 3) return stbi__errpuc("bad scale", "Scale must be 1/1, 1/2, 1/4 or 1/8");
+   stbi__start_mem(&s,buffer,len);
+   s.jpeg_scale = scale_shift;
+   return stbi__load_and_postprocess_8bit(&s,x,y,comp,req_comp);
+}
+
+#ifndef STBI_NO_STDIO
+STBIDEF stbi_uc *stbi_load_from_file_scaled(FILE *f, int *x, int *y, int *comp, int req_comp, int scale_shift)
+{
+   unsigned char *result;
+   stbi__context s;
+   if (scale_shift < 0 || scale_shift > 3) return stbi__errpuc("bad scale", "Scale must be 1/1, 1/2, 1/4 or 1/8");
+   stbi__start_file(&s,f);
+   s.jpeg_scale = scale_shift;
+   result = stbi__load_and_postprocess_8bit(&s,x,y,comp,req_comp);
+   if (result) {
+      // need to 'unget' all the characters in the IO buffer
+      fseek(f, - (int) (s.img_buffer_end - s.img_buffer), SEEK_CUR);
+   }
+   return result;
+}
+
+STBIDEF stbi_uc *stbi_load_scaled(char const *filename, int *x, int *y, int *comp, int req_comp, int scale_shift)
+{
+   FILE *f = stbi__fopen(filename, "rb");
+   unsigned char *result;
+   if (!f) return stbi__errpuc("can't fopen", "Unable to open file");
+   result = stbi_load_from_file_scaled(f,x,y,comp,req_comp,scale_shift);
+   fclose(f);
+   return result;
+}
+#endif //!STBI_NO_STDIO
+
 #ifndef STBI_NO_LINEAR
 static float *stbi__loadf_main(stbi__context *s, int *x, int *y, int *comp, int req_comp)
 {
@@ -1670,6 +1904,9 @@ static stbi_uc *stbi__hdr_to_ldr(float   *data, int x, int y, int comp)
 // huffman decoding acceleration
 #define FAST_BITS   9  // larger handles more cases; smaller stomps less cache
 
+// rotate left within the entropy bit buffer
+#define stbi__jrot(x,y)  (((x) << (y)) | ((x) >> ((STBI__BITBUF_BITS - (y)) & (STBI__BITBUF_BITS - 1))))
+
 typedef struct
 {
    stbi_uc  fast[1 << FAST_BITS];
@@ -1711,7 +1948,7 @@ typedef struct
       int      coeff_w, coeff_h; // number of 8x8 coefficient blocks
    } img_comp[4];
 
-   stbi__uint32   code_buffer; // jpeg entropy-coded buffer
+   stbi__bitbuf   code_buffer; // jpeg entropy-coded buffer, left-aligned
    int            code_bits;   // number of valid bits
    unsigned char  marker;      // marker seen while filling entropy buffer
    int            nomore;      // flag if we saw a marker so must stop
@@ -1728,6 +1965,7 @@ typedef struct
 
    int scan_n, order[4];
    int restart_interval, todo;
+   int scale;  // log2 of the downscale factor; blocks decode to (8>>scale)^2 pixels
 
 // kernels
    void (*idct_block_kernel)(stbi_uc *out, int out_stride, short data[64]);
@@ -1806,19 +2044,31 @@ static void stbi__build_fast_ac(stbi__int16 *fast_ac, stbi__huffman *h)
 static void stbi__grow_buffer_unsafe(stbi__jpeg *j)
 {
    do {
-      int b = j->nomore ? 0 : stbi__get8(j->s);
+      int b;
+      stbi__context *s = j->s;
+      // fast path: take bytes straight out of the context buffer for as
+      // long as there is no 0xff (stuffed byte or marker) in the way
+      if (!j->nomore) {
+         while (j->code_bits <= STBI__BITBUF_BITS - 8 && s->img_buffer < s->img_buffer_end && *s->img_buffer != 0xff) {
+            j->code_buffer |= (stbi__bitbuf) *s->img_buffer++ << (STBI__BITBUF_BITS - 8 - j->code_bits);
+            j->code_bits += 8;
+         }
+         if (j->code_bits > STBI__BITBUF_BITS - 8)
+            return;
+      }
+      b = j->nomore ? 0 : stbi__get8(s);
       if (b == 0xff) {
-         int c = stbi__get8(j->s);
-         while (c == 0xff) c = stbi__get8(j->s); // consume fill bytes
+         int c = stbi__get8(s);
+         while (c == 0xff) c = stbi__get8(s); // consume fill bytes
          if (c != 0) {
             j->marker = (unsigned char) c;
             j->nomore = 1;
             return;
          }
       }
-      j->code_buffer |= b << (24 - j->code_bits);
+      j->code_buffer |= (stbi__bitbuf) b << (STBI__BITBUF_BITS - 8 - j->code_bits);
       j->code_bits += 8;
-   } while (j->code_bits <= 24);
+   } while (j->code_bits <= STBI__BITBUF_BITS - 8);
 }
 
 // (1 << n) - 1
@@ -1834,7 +2084,7 @@ stbi_inline static int stbi__jpeg_huff_decode(stbi__jpeg *j, stbi__huffman *h)
 
    // look at the top FAST_BITS and determine what symbol ID it is,
    // if the code is <= FAST_BITS
-   c = (j->code_buffer >> (32 - FAST_BITS)) & ((1 << FAST_BITS)-1);
+   c = (int) (j->code_buffer >> (STBI__BITBUF_BITS - FAST_BITS)) & ((1 << FAST_BITS)-1);
    k = h->fast[c];
    if (k < 255) {
       int s = h->size[k];
@@ -1851,7 +2101,7 @@ stbi_inline static int stbi__jpeg_huff_decode(stbi__jpeg *j, stbi__huffman *h)
    // end; in other words, regardless of the number of bits, it
    // wants to be compared against something shifted to have 16;
    // that way we don't need to shift inside the loop.
-   temp = j->code_buffer >> 16;
+   temp = (unsigned int) (j->code_buffer >> (STBI__BITBUF_BITS - 16));
    for (k=FAST_BITS+1 ; ; ++k)
       if (temp < h->maxcode[k])
          break;
@@ -1865,8 +2115,8 @@ stbi_inline static int stbi__jpeg_huff_decode(stbi__jpeg *j, stbi__huffman *h)
       return -1;
 
    // convert the huffman code to the symbol id
-   c = ((j->code_buffer >> (32 - k)) & stbi__bmask[k]) + h->delta[k];
-   STBI_ASSERT((((j->code_buffer) >> (32 - h->size[c])) & stbi__bmask[h->size[c]]) == h->code[c]);
+   c = ((unsigned int) (j->code_buffer >> (STBI__BITBUF_BITS - k)) & stbi__bmask[k]) + h->delta[k];
+   STBI_ASSERT((((unsigned int) (j->code_buffer >> (STBI__BITBUF_BITS - h->size[c]))) & stbi__bmask[h->size[c]]) == h->code[c]);
 
    // convert the id to a symbol
    j->code_bits -= k;
@@ -1881,39 +2131,37 @@ static int const stbi__jbias[16] = {0,-1,-3,-7,-15,-31,-63,-127,-255,-511,-1023,
 // always extends everything it receives.
 stbi_inline static int stbi__extend_receive(stbi__jpeg *j, int n)
 {
-   unsigned int k;
+   stbi__bitbuf k;
    int sgn;
    if (j->code_bits < n) stbi__grow_buffer_unsafe(j);
 
-   sgn = (stbi__int32)j->code_buffer >> 31; // sign bit is always in MSB
-   k = stbi_lrot(j->code_buffer, n);
+   sgn = (stbi__int32) (j->code_buffer >> (STBI__BITBUF_BITS - 32)) >> 31; // sign bit is always in MSB
+   k = stbi__jrot(j->code_buffer, n);
    STBI_ASSERT(n >= 0 && n < (int) (sizeof(stbi__bmask)/sizeof(*stbi__bmask)));
-   j->code_buffer = k & ~stbi__bmask[n];
-   k &= stbi__bmask[n];
+   j->code_buffer = k & ~(stbi__bitbuf) stbi__bmask[n];
    j->code_bits -= n;
-   return k + (stbi__jbias[n] & ~sgn);
+   return (int) (k & stbi__bmask[n]) + (stbi__jbias[n] & ~sgn);
 }
 
 // get some unsigned bits
 stbi_inline static int stbi__jpeg_get_bits(stbi__jpeg *j, int n)
 {
-   unsigned int k;
+   stbi__bitbuf k;
    if (j->code_bits < n) stbi__grow_buffer_unsafe(j);
-   k = stbi_lrot(j->code_buffer, n);
-   j->code_buffer = k & ~stbi__bmask[n];
-   k &= stbi__bmask[n];
+   k = stbi__jrot(j->code_buffer, n);
+   j->code_buffer = k & ~(stbi__bitbuf) stbi__bmask[n];
    j->code_bits -= n;
-   return k;
+   return (int) (k & stbi__bmask[n]);
 }
 
 stbi_inline static int stbi__jpeg_get_bit(stbi__jpeg *j)
 {
-   unsigned int k;
+   stbi__bitbuf k;
    if (j->code_bits < 1) stbi__grow_buffer_unsafe(j);
    k = j->code_buffer;
    j->code_buffer <<= 1;
    --j->code_bits;
-   return k & 0x80000000;
+   return (int) (k >> (STBI__BITBUF_BITS - 1));
 }
 
 // given a value that's at position X in the zigzag stream,
@@ -1957,7 +2205,7 @@ static int stbi__jpeg_decode_block(stbi__jpeg *j, short data[64], stbi__huffman
       unsigned int zig;
       int c,r,s;
       if (j->code_bits < 16) stbi__grow_buffer_unsafe(j);
-      c = (j->code_buffer >> (32 - FAST_BITS)) & ((1 << FAST_BITS)-1);
+      c = (int) (j->code_buffer >> (STBI__BITBUF_BITS - FAST_BITS)) & ((1 << FAST_BITS)-1);
       r = fac[c];
       if (r) { // fast-AC path
          k += (r >> 4) & 15; // run
@@ -2031,7 +2279,7 @@ static int stbi__jpeg_decode_block_prog_ac(stbi__jpeg *j, short data[64], stbi__
          unsigned int zig;
          int c,r,s;
          if (j->code_bits < 16) stbi__grow_buffer_unsafe(j);
-         c = (j->code_buffer >> (32 - FAST_BITS)) & ((1 << FAST_BITS)-1);
+         c = (int) (j->code_buffer >> (STBI__BITBUF_BITS - FAST_BITS)) & ((1 << FAST_BITS)-1);
          r = fac[c];
          if (r) { // fast-AC path
             k += (r >> 4) & 15; // run
@@ -2243,6 +2491,55 @@ static void stbi__idct_block(stbi_uc *out, int out_stride, short data[64])
    }
 }
 
+// reduced IDCTs for scaled decoding: a block comes out as 4x4, 2x2 or 1x1
+// pixels, computed from its 4x4, 2x2 or 1x1 lowest frequencies with the
+// same fixed-point scaling as above
+static void stbi__idct_block_4x4(stbi_uc *out, int out_stride, short data[64])
+{
+   int i,val[16],*v=val;
+   stbi_uc *o;
+   for (i=0; i < 4; ++i) {
+      int t10 = stbi__fsh(data[i] + data[16+i]) + 512;
+      int t12 = stbi__fsh(data[i] - data[16+i]) + 512;
+      int z1  = (data[8+i] + data[24+i]) * stbi__f2f(0.5411961f);
+      int t0  = z1 + data[8+i]  * stbi__f2f( 0.765366865f);
+      int t2  = z1 + data[24+i] * stbi__f2f(-1.847759065f);
+      v[   i] = (t10+t0) >> 10;
+      v[12+i] = (t10-t0) >> 10;
+      v[ 4+i] = (t12+t2) >> 10;
+      v[ 8+i] = (t12-t2) >> 10;
+   }
+   for (i=0, o=out; i < 4; ++i,v+=4,o+=out_stride) {
+      int t10 = stbi__fsh(v[0] + v[2]) + 65536 + (128<<17);
+      int t12 = stbi__fsh(v[0] - v[2]) + 65536 + (128<<17);
+      int z1  = (v[1] + v[3]) * stbi__f2f(0.5411961f);
+      int t0  = z1 + v[1] * stbi__f2f( 0.765366865f);
+      int t2  = z1 + v[3] * stbi__f2f(-1.847759065f);
+      o[0] = stbi__clamp((t10+t0) >> 17);
+      o[3] = stbi__clamp((t10-t0) >> 17);
+      o[1] = stbi__clamp((t12+t2) >> 17);
+      o[2] = stbi__clamp((t12-t2) >> 17);
+   }
+}
+
+static void stbi__idct_block_2x2(stbi_uc *out, int out_stride, short data[64])
+{
+   int a = data[0] + data[8], b = data[0] - data[8];
+   int c = data[1] + data[9], d = data[1] - data[9];
+   a += 4 + (128<<3);
+   b += 4 + (128<<3);
+   out[0]            = stbi__clamp((a+c) >> 3);
+   out[1]            = stbi__clamp((a-c) >> 3);
+   out[out_stride]   = stbi__clamp((b+d) >> 3);
+   out[out_stride+1] = stbi__clamp((b-d) >> 3);
+}
+
+static void stbi__idct_block_1x1(stbi_uc *out, int out_stride, short data[64])
+{
+   STBI_NOTUSED(out_stride);
+   out[0] = stbi__clamp((data[0] + 4 + (128<<3)) >> 3);
+}
+
 #ifdef STBI_SSE2
 // sse2 integer IDCT. not the fastest possible implementation but it
 // produces bit-identical results to the generic C version so it's
@@ -2424,115 +2721,291 @@ static void stbi__idct_simd(stbi_uc *out, int out_stride, short data[64])
 
 #endif // STBI_SSE2
 
-#ifdef STBI_NEON
-
-// NEON integer IDCT. should produce bit-identical
-// results to the generic C version.
-static void stbi__idct_simd(stbi_uc *out, int out_stride, short data[64])
+#ifdef STBI_AVX2
+// avx2 integer IDCT. same arithmetic as stbi__idct_simd, so the results are
+// still bit-identical to the generic C version, but the 32-bit intermediates
+// of all eight columns live in one register (columns 0-3 in the low lane,
+// 4-7 in the high lane) instead of a lo/hi pair of registers.
+static STBI_AVX2_TARGET void stbi__idct_avx2(stbi_uc *out, int out_stride, short data[64])
 {
-   int16x8_t row0, row1, row2, row3, row4, row5, row6, row7;
-
-   int16x4_t rot0_0 = vdup_n_s16(stbi__f2f(0.5411961f));
-   int16x4_t rot0_1 = vdup_n_s16(stbi__f2f(-1.847759065f));
-   int16x4_t rot0_2 = vdup_n_s16(stbi__f2f( 0.765366865f));
-   int16x4_t rot1_0 = vdup_n_s16(stbi__f2f( 1.175875602f));
-   int16x4_t rot1_1 = vdup_n_s16(stbi__f2f(-0.899976223f));
-   int16x4_t rot1_2 = vdup_n_s16(stbi__f2f(-2.562915447f));
-   int16x4_t rot2_0 = vdup_n_s16(stbi__f2f(-1.961570560f));
-   int16x4_t rot2_1 = vdup_n_s16(stbi__f2f(-0.390180644f));
-   int16x4_t rot3_0 = vdup_n_s16(stbi__f2f( 0.298631336f));
-   int16x4_t rot3_1 = vdup_n_s16(stbi__f2f( 2.053119869f));
-   int16x4_t rot3_2 = vdup_n_s16(stbi__f2f( 3.072711026f));
-   int16x4_t rot3_3 = vdup_n_s16(stbi__f2f( 1.501321110f));
-
-#define dct_long_mul(out, inq, coeff) \
-   int32x4_t out##_l = vmull_s16(vget_low_s16(inq), coeff); \
-   int32x4_t out##_h = vmull_s16(vget_high_s16(inq), coeff)
-
-#define dct_long_mac(out, acc, inq, coeff) \
-   int32x4_t out##_l = vmlal_s16(acc##_l, vget_low_s16(inq), coeff); \
-   int32x4_t out##_h = vmlal_s16(acc##_h, vget_high_s16(inq), coeff)
+   __m128i row0, row1, row2, row3, row4, row5, row6, row7;
+   __m128i tmp;
 
-#define dct_widen(out, inq) \
-   int32x4_t out##_l = vshll_n_s16(vget_low_s16(inq), 12); \
-   int32x4_t out##_h = vshll_n_s16(vget_high_s16(inq), 12)
+   // dot product constant: even elems=x, odd elems=y
+   #define dct_const(x,y)  _mm256_setr_epi16((x),(y),(x),(y),(x),(y),(x),(y),(x),(y),(x),(y),(x),(y),(x),(y))
 
-// wide add
-#define dct_wadd(out, a, b) \
-   int32x4_t out##_l = vaddq_s32(a##_l, b##_l); \
-   int32x4_t out##_h = vaddq_s32(a##_h, b##_h)
+   // out(0) = c0[even]*x + c0[odd]*y   (c0, x, y 16-bit, out 32-bit)
+   // out(1) = c1[even]*x + c1[odd]*y
+   #define dct_rot(out0,out1, x,y,c0,c1) \
+      __m256i c0##xy = _mm256_inserti128_si256(_mm256_castsi128_si256(_mm_unpacklo_epi16((x),(y))), _mm_unpackhi_epi16((x),(y)), 1); \
+      __m256i out0 = _mm256_madd_epi16(c0##xy, c0); \
+      __m256i out1 = _mm256_madd_epi16(c0##xy, c1)
 
-// wide sub
-#define dct_wsub(out, a, b) \
-   int32x4_t out##_l = vsubq_s32(a##_l, b##_l); \
-   int32x4_t out##_h = vsubq_s32(a##_h, b##_h)
+   // out = in << 12  (in 16-bit, out 32-bit)
+   #define dct_widen(out, in) \
+      __m256i out = _mm256_slli_epi32(_mm256_cvtepi16_epi32(in), 12)
 
-// butterfly a/b, then shift using "shiftop" by "s" and pack
-#define dct_bfly32o(out0,out1, a,b,shiftop,s) \
-   { \
-      dct_wadd(sum, a, b); \
-      dct_wsub(dif, a, b); \
-      out0 = vcombine_s16(shiftop(sum_l, s), shiftop(sum_h, s)); \
-      out1 = vcombine_s16(shiftop(dif_l, s), shiftop(dif_h, s)); \
-   }
+   // wide add
+   #define dct_wadd(out, a, b) \
+      __m256i out = _mm256_add_epi32(a, b)
 
-#define dct_pass(shiftop, shift) \
-   { \
-      /* even part */ \
-      int16x8_t sum26 = vaddq_s16(row2, row6); \
-      dct_long_mul(p1e, sum26, rot0_0); \
-      dct_long_mac(t2e, p1e, row6, rot0_1); \
-      dct_long_mac(t3e, p1e, row2, rot0_2); \
-      int16x8_t sum04 = vaddq_s16(row0, row4); \
-      int16x8_t dif04 = vsubq_s16(row0, row4); \
-      dct_widen(t0e, sum04); \
-      dct_widen(t1e, dif04); \
-      dct_wadd(x0, t0e, t3e); \
-      dct_wsub(x3, t0e, t3e); \
-      dct_wadd(x1, t1e, t2e); \
-      dct_wsub(x2, t1e, t2e); \
-      /* odd part */ \
-      int16x8_t sum15 = vaddq_s16(row1, row5); \
-      int16x8_t sum17 = vaddq_s16(row1, row7); \
-      int16x8_t sum35 = vaddq_s16(row3, row5); \
-      int16x8_t sum37 = vaddq_s16(row3, row7); \
-      int16x8_t sumodd = vaddq_s16(sum17, sum35); \
-      dct_long_mul(p5o, sumodd, rot1_0); \
-      dct_long_mac(p1o, p5o, sum17, rot1_1); \
-      dct_long_mac(p2o, p5o, sum35, rot1_2); \
-      dct_long_mul(p3o, sum37, rot2_0); \
-      dct_long_mul(p4o, sum15, rot2_1); \
-      dct_wadd(sump13o, p1o, p3o); \
-      dct_wadd(sump24o, p2o, p4o); \
-      dct_wadd(sump23o, p2o, p3o); \
-      dct_wadd(sump14o, p1o, p4o); \
-      dct_long_mac(x4, sump13o, row7, rot3_0); \
-      dct_long_mac(x5, sump24o, row5, rot3_1); \
-      dct_long_mac(x6, sump23o, row3, rot3_2); \
-      dct_long_mac(x7, sump14o, row1, rot3_3); \
-      dct_bfly32o(row0,row7, x0,x7,shiftop,shift); \
-      dct_bfly32o(row1,row6, x1,x6,shiftop,shift); \
-      dct_bfly32o(row2,row5, x2,x5,shiftop,shift); \
-      dct_bfly32o(row3,row4, x3,x4,shiftop,shift); \
-   }
+   // wide sub
+   #define dct_wsub(out, a, b) \
+      __m256i out = _mm256_sub_epi32(a, b)
 
-   // load
-   row0 = vld1q_s16(data + 0*8);
-   row1 = vld1q_s16(data + 1*8);
-   row2 = vld1q_s16(data + 2*8);
-   row3 = vld1q_s16(data + 3*8);
-   row4 = vld1q_s16(data + 4*8);
-   row5 = vld1q_s16(data + 5*8);
-   row6 = vld1q_s16(data + 6*8);
-   row7 = vld1q_s16(data + 7*8);
+   // butterfly a/b, add bias, then shift by "s" and pack; the pack works
+   // per lane, so put the 64-bit quarters back in column order afterwards
+   #define dct_bfly32o(out0, out1, a,b,bias,s) \
+      { \
+         __m256i abiased = _mm256_add_epi32(a, bias); \
+         dct_wadd(sum, abiased, b); \
+         dct_wsub(dif, abiased, b); \
+         __m256i packed = _mm256_permute4x64_epi64(_mm256_packs_epi32(_mm256_srai_epi32(sum, s), _mm256_srai_epi32(dif, s)), 0xd8); \
+         out0 = _mm256_castsi256_si128(packed); \
+         out1 = _mm256_extracti128_si256(packed, 1); \
+      }
 
-   // add DC bias
-   row0 = vaddq_s16(row0, vsetq_lane_s16(1024, vdupq_n_s16(0), 0));
+   // 8-bit interleave step (for transposes)
+   #define dct_interleave8(a, b) \
+      tmp = a; \
+      a = _mm_unpacklo_epi8(a, b); \
+      b = _mm_unpackhi_epi8(tmp, b)
 
-   // column pass
-   dct_pass(vrshrn_n_s32, 10);
+   // 16-bit interleave step (for transposes)
+   #define dct_interleave16(a, b) \
+      tmp = a; \
+      a = _mm_unpacklo_epi16(a, b); \
+      b = _mm_unpackhi_epi16(tmp, b)
 
-   // 16bit 8x8 transpose
+   #define dct_pass(bias,shift) \
+      { \
+         /* even part */ \
+         dct_rot(t2e,t3e, row2,row6, rot0_0,rot0_1); \
+         __m128i sum04 = _mm_add_epi16(row0, row4); \
+         __m128i dif04 = _mm_sub_epi16(row0, row4); \
+         dct_widen(t0e, sum04); \
+         dct_widen(t1e, dif04); \
+         dct_wadd(x0, t0e, t3e); \
+         dct_wsub(x3, t0e, t3e); \
+         dct_wadd(x1, t1e, t2e); \
+         dct_wsub(x2, t1e, t2e); \
+         /* odd part */ \
+         dct_rot(y0o,y2o, row7,row3, rot2_0,rot2_1); \
+         dct_rot(y1o,y3o, row5,row1, rot3_0,rot3_1); \
+         __m128i sum17 = _mm_add_epi16(row1, row7); \
+         __m128i sum35 = _mm_add_epi16(row3, row5); \
+         dct_rot(y4o,y5o, sum17,sum35, rot1_0,rot1_1); \
+         dct_wadd(x4, y0o, y4o); \
+         dct_wadd(x5, y1o, y5o); \
+         dct_wadd(x6, y2o, y5o); \
+         dct_wadd(x7, y3o, y4o); \
+         dct_bfly32o(row0,row7, x0,x7,bias,shift); \
+         dct_bfly32o(row1,row6, x1,x6,bias,shift); \
+         dct_bfly32o(row2,row5, x2,x5,bias,shift); \
+         dct_bfly32o(row3,row4, x3,x4,bias,shift); \
+      }
+
+   __m256i rot0_0 = dct_const(stbi__f2f(0.5411961f), stbi__f2f(0.5411961f) + stbi__f2f(-1.847759065f));
+   __m256i rot0_1 = dct_const(stbi__f2f(0.5411961f) + stbi__f2f( 0.765366865f), stbi__f2f(0.5411961f));
+   __m256i rot1_0 = dct_const(stbi__f2f(1.175875602f) + stbi__f2f(-0.899976223f), stbi__f2f(1.175875602f));
+   __m256i rot1_1 = dct_const(stbi__f2f(1.175875602f), stbi__f2f(1.175875602f) + stbi__f2f(-2.562915447f));
+   __m256i rot2_0 = dct_const(stbi__f2f(-1.961570560f) + stbi__f2f( 0.298631336f), stbi__f2f(-1.961570560f));
+   __m256i rot2_1 = dct_const(stbi__f2f(-1.961570560f), stbi__f2f(-1.961570560f) + stbi__f2f( 3.072711026f));
+   __m256i rot3_0 = dct_const(stbi__f2f(-0.390180644f) + stbi__f2f( 2.053119869f), stbi__f2f(-0.390180644f));
+   __m256i rot3_1 = dct_const(stbi__f2f(-0.390180644f), stbi__f2f(-0.390180644f) + stbi__f2f( 1.501321110f));
+
+   // rounding biases in column/row passes, see stbi__idct_block for explanation.
+   __m256i bias_0 = _mm256_set1_epi32(512);
+   __m256i bias_1 = _mm256_set1_epi32(65536 + (128<<17));
+
+   // load
+   row0 = _mm_load_si128((const __m128i *) (data + 0*8));
+   row1 = _mm_load_si128((const __m128i *) (data + 1*8));
+   row2 = _mm_load_si128((const __m128i *) (data + 2*8));
+   row3 = _mm_load_si128((const __m128i *) (data + 3*8));
+   row4 = _mm_load_si128((const __m128i *) (data + 4*8));
+   row5 = _mm_load_si128((const __m128i *) (data + 5*8));
+   row6 = _mm_load_si128((const __m128i *) (data + 6*8));
+   row7 = _mm_load_si128((const __m128i *) (data + 7*8));
+
+   // column pass
+   dct_pass(bias_0, 10);
+
+   {
+      // 16bit 8x8 transpose pass 1
+      dct_interleave16(row0, row4);
+      dct_interleave16(row1, row5);
+      dct_interleave16(row2, row6);
+      dct_interleave16(row3, row7);
+
+      // transpose pass 2
+      dct_interleave16(row0, row2);
+      dct_interleave16(row1, row3);
+      dct_interleave16(row4, row6);
+      dct_interleave16(row5, row7);
+
+      // transpose pass 3
+      dct_interleave16(row0, row1);
+      dct_interleave16(row2, row3);
+      dct_interleave16(row4, row5);
+      dct_interleave16(row6, row7);
+   }
+
+   // row pass
+   dct_pass(bias_1, 17);
+
+   {
+      // pack
+      __m128i p0 = _mm_packus_epi16(row0, row1); // a0a1a2a3...a7b0b1b2b3...b7
+      __m128i p1 = _mm_packus_epi16(row2, row3);
+      __m128i p2 = _mm_packus_epi16(row4, row5);
+      __m128i p3 = _mm_packus_epi16(row6, row7);
+
+      // 8bit 8x8 transpose pass 1
+      dct_interleave8(p0, p2); // a0e0a1e1...
+      dct_interleave8(p1, p3); // c0g0c1g1...
+
+      // transpose pass 2
+      dct_interleave8(p0, p1); // a0c0e0g0...
+      dct_interleave8(p2, p3); // b0d0f0h0...
+
+      // transpose pass 3
+      dct_interleave8(p0, p2); // a0b0c0d0...
+      dct_interleave8(p1, p3); // a4b4c4d4...
+
+      // store
+      _mm_storel_epi64((__m128i *) out, p0); out += out_stride;
+      _mm_storel_epi64((__m128i *) out, _mm_shuffle_epi32(p0, 0x4e)); out += out_stride;
+      _mm_storel_epi64((__m128i *) out, p2); out += out_stride;
+      _mm_storel_epi64((__m128i *) out, _mm_shuffle_epi32(p2, 0x4e)); out += out_stride;
+      _mm_storel_epi64((__m128i *) out, p1); out += out_stride;
+      _mm_storel_epi64((__m128i *) out, _mm_shuffle_epi32(p1, 0x4e)); out += out_stride;
+      _mm_storel_epi64((__m128i *) out, p3); out += out_stride;
+      _mm_storel_epi64((__m128i *) out, _mm_shuffle_epi32(p3, 0x4e));
+   }
+
+#undef dct_const
+#undef dct_rot
+#undef dct_widen
+#undef dct_wadd
+#undef dct_wsub
+#undef dct_bfly32o
+#undef dct_interleave8
+#undef dct_interleave16
+#undef dct_pass
+}
+
+#endif // STBI_AVX2
+
+#ifdef STBI_NEON
+
+// NEON integer IDCT. should produce bit-identical
+// results to the generic C version.
+static void stbi__idct_simd(stbi_uc *out, int out_stride, short data[64])
+{
+   int16x8_t row0, row1, row2, row3, row4, row5, row6, row7;
+
+   int16x4_t rot0_0 = vdup_n_s16(stbi__f2f(0.5411961f));
+   int16x4_t rot0_1 = vdup_n_s16(stbi__f2f(-1.847759065f));
+   int16x4_t rot0_2 = vdup_n_s16(stbi__f2f( 0.765366865f));
+   int16x4_t rot1_0 = vdup_n_s16(stbi__f2f( 1.175875602f));
+   int16x4_t rot1_1 = vdup_n_s16(stbi__f2f(-0.899976223f));
+   int16x4_t rot1_2 = vdup_n_s16(stbi__f2f(-2.562915447f));
+   int16x4_t rot2_0 = vdup_n_s16(stbi__f2f(-1.961570560f));
+   int16x4_t rot2_1 = vdup_n_s16(stbi__f2f(-0.390180644f));
+   int16x4_t rot3_0 = vdup_n_s16(stbi__f2f( 0.298631336f));
+   int16x4_t rot3_1 = vdup_n_s16(stbi__f2f( 2.053119869f));
+   int16x4_t rot3_2 = vdup_n_s16(stbi__f2f( 3.072711026f));
+   int16x4_t rot3_3 = vdup_n_s16(stbi__f2f( 1.501321110f));
+
+#define dct_long_mul(out, inq, coeff) \
+   int32x4_t out##_l = vmull_s16(vget_low_s16(inq), coeff); \
+   int32x4_t out##_h = vmull_s16(vget_high_s16(inq), coeff)
+
+#define dct_long_mac(out, acc, inq, coeff) \
+   int32x4_t out##_l = vmlal_s16(acc##_l, vget_low_s16(inq), coeff); \
+   int32x4_t out##_h = vmlal_s16(acc##_h, vget_high_s16(inq), coeff)
+
+#define dct_widen(out, inq) \
+   int32x4_t out##_l = vshll_n_s16(vget_low_s16(inq), 12); \
+   int32x4_t out##_h = vshll_n_s16(vget_high_s16(inq), 12)
+
+// wide add
+#define dct_wadd(out, a, b) \
+   int32x4_t out##_l = vaddq_s32(a##_l, b##_l); \
+   int32x4_t out##_h = vaddq_s32(a##_h, b##_h)
+
+// wide sub
+#define dct_wsub(out, a, b) \
+   int32x4_t out##_l = vsubq_s32(a##_l, b##_l); \
+   int32x4_t out##_h = vsubq_s32(a##_h, b##_h)
+
+// butterfly a/b, then shift using "shiftop" by "s" and pack
+#define dct_bfly32o(out0,out1, a,b,shiftop,s) \
+   { \
+      dct_wadd(sum, a, b); \
+      dct_wsub(dif, a, b); \
+      out0 = vcombine_s16(shiftop(sum_l, s), shiftop(sum_h, s)); \
+      out1 = vcombine_s16(shiftop(dif_l, s), shiftop(dif_h, s)); \
+   }
+
+#define dct_pass(shiftop, shift) \
+   { \
+      /* even part */ \
+      int16x8_t sum26 = vaddq_s16(row2, row6); \
+      dct_long_mul(p1e, sum26, rot0_0); \
+      dct_long_mac(t2e, p1e, row6, rot0_1); \
+      dct_long_mac(t3e, p1e, row2, rot0_2); \
+      int16x8_t sum04 = vaddq_s16(row0, row4); \
+      int16x8_t dif04 = vsubq_s16(row0, row4); \
+      dct_widen(t0e, sum04); \
+      dct_widen(t1e, dif04); \
+      dct_wadd(x0, t0e, t3e); \
+      dct_wsub(x3, t0e, t3e); \
+      dct_wadd(x1, t1e, t2e); \
+      dct_wsub(x2, t1e, t2e); \
+      /* odd part */ \
+      int16x8_t sum15 = vaddq_s16(row1, row5); \
+      int16x8_t sum17 = vaddq_s16(row1, row7); \
+      int16x8_t sum35 = vaddq_s16(row3, row5); \
+      int16x8_t sum37 = vaddq_s16(row3, row7); \
+      int16x8_t sumodd = vaddq_s16(sum17, sum35); \
+      dct_long_mul(p5o, sumodd, rot1_0); \
+      dct_long_mac(p1o, p5o, sum17, rot1_1); \
+      dct_long_mac(p2o, p5o, sum35, rot1_2); \
+      dct_long_mul(p3o, sum37, rot2_0); \
+      dct_long_mul(p4o, sum15, rot2_1); \
+      dct_wadd(sump13o, p1o, p3o); \
+      dct_wadd(sump24o, p2o, p4o); \
+      dct_wadd(sump23o, p2o, p3o); \
+      dct_wadd(sump14o, p1o, p4o); \
+      dct_long_mac(x4, sump13o, row7, rot3_0); \
+      dct_long_mac(x5, sump24o, row5, rot3_1); \
+      dct_long_mac(x6, sump23o, row3, rot3_2); \
+      dct_long_mac(x7, sump14o, row1, rot3_3); \
+      dct_bfly32o(row0,row7, x0,x7,shiftop,shift); \
+      dct_bfly32o(row1,row6, x1,x6,shiftop,shift); \
+      dct_bfly32o(row2,row5, x2,x5,shiftop,shift); \
+      dct_bfly32o(row3,row4, x3,x4,shiftop,shift); \
+   }
+
+   // load
+   row0 = vld1q_s16(data + 0*8);
+   row1 = vld1q_s16(data + 1*8);
+   row2 = vld1q_s16(data + 2*8);
+   row3 = vld1q_s16(data + 3*8);
+   row4 = vld1q_s16(data + 4*8);
+   row5 = vld1q_s16(data + 5*8);
+   row6 = vld1q_s16(data + 6*8);
+   row7 = vld1q_s16(data + 7*8);
+
+   // add DC bias
+   row0 = vaddq_s16(row0, vsetq_lane_s16(1024, vdupq_n_s16(0), 0));
+
+   // column pass
+   dct_pass(vrshrn_n_s32, 10);
+
+   // 16bit 8x8 transpose
    {
 // these three map to a single VTRN.16, VTRN.32, and VSWP, respectively.
 // whether compilers actually get this is another story, sadly.
@@ -2666,67 +3139,241 @@ static void stbi__jpeg_reset(stbi__jpeg *j)
    // since we don't even allow 1<<30 pixels
 }
 
-static int stbi__parse_entropy_coded_data(stbi__jpeg *z)
-{
-   stbi__jpeg_reset(z);
-   if (!z->progressive) {
-      if (z->scan_n == 1) {
-         int i,j;
-         STBI_SIMD_ALIGN(short, data[64]);
-         int n = z->order[0];
-         // non-interleaved data, we just need to process one block at a time,
-         // in trivial scanline order
-         // number of blocks to do just depends on how many actual "pixels" this
-         // component has, independent of interleaved MCU blocking and such
-         int w = (z->img_comp[n].x+7) >> 3;
-         int h = (z->img_comp[n].y+7) >> 3;
-         for (j=0; j < h; ++j) {
-            for (i=0; i < w; ++i) {
-               int ha = z->img_comp[n].ha;
-               if (!stbi__jpeg_decode_block(z, data, z->huff_dc+z->img_comp[n].hd, z->huff_ac+ha, z->fast_ac[ha], n, z->dequant[z->img_comp[n].tq])) return 0;
-               z->idct_block_kernel(z->img_comp[n].data+z->img_comp[n].w2*j*8+i*8, z->img_comp[n].w2, data);
-               // every data block is an MCU, so countdown the restart interval
-               if (--z->todo <= 0) {
-                  if (z->code_bits < 24) stbi__grow_buffer_unsafe(z);
-                  // if it's NOT a restart, then just bail, so we get corrupt data
-                  // rather than no data
-                  if (!STBI__RESTART(z->marker)) return 1;
-                  stbi__jpeg_reset(z);
-               }
-            }
+// number of MCUs in the current baseline scan; a non-interleaved scan codes
+// one block of its component per MCU
+static int stbi__jpeg_scan_mcus(stbi__jpeg *z)
+{
+   if (z->scan_n == 1) {
+      int n = z->order[0];
+      return ((z->img_comp[n].x+7) >> 3) * ((z->img_comp[n].y+7) >> 3);
+   }
+   return z->img_mcu_x * z->img_mcu_y;
+}
+
+// decode MCUs [first, last) of the current baseline scan, in raster order
+static int stbi__jpeg_decode_mcus(stbi__jpeg *z, int first, int last)
+{
+   STBI_SIMD_ALIGN(short, data[64]);
+   int i,j,k,x,y,m;
+   if (z->scan_n == 1) {
+      int n = z->order[0];
+      // non-interleaved data, we just need to process one block at a time,
+      // in trivial scanline order
+      // number of blocks to do just depends on how many actual "pixels" this
+      // component has, independent of interleaved MCU blocking and such
+      int w = (z->img_comp[n].x+7) >> 3;
+      i = first % w;
+      j = first / w;
+      for (m=first; m < last; ++m) {
+         int ha = z->img_comp[n].ha;
+         if (!stbi__jpeg_decode_block(z, data, z->huff_dc+z->img_comp[n].hd, z->huff_ac+ha, z->fast_ac[ha], n, z->dequant[z->img_comp[n].tq])) return 0;
+         z->idct_block_kernel(z->img_comp[n].data+((z->img_comp[n].w2*j+i)*8 >> z->scale), z->img_comp[n].w2, data);
+         // every data block is an MCU, so countdown the restart interval
+         if (--z->todo <= 0) {
+            if (z->code_bits < 24) stbi__grow_buffer_unsafe(z);
+            // if it's NOT a restart, then just bail, so we get corrupt data
+            // rather than no data
+            if (!STBI__RESTART(z->marker)) return 1;
+            stbi__jpeg_reset(z);
          }
-         return 1;
-      } else { // interleaved
-         int i,j,k,x,y;
-         STBI_SIMD_ALIGN(short, data[64]);
-         for (j=0; j < z->img_mcu_y; ++j) {
-            for (i=0; i < z->img_mcu_x; ++i) {
-               // scan an interleaved mcu... process scan_n components in order
-               for (k=0; k < z->scan_n; ++k) {
-                  int n = z->order[k];
-                  // scan out an mcu's worth of this component; that's just determined
-                  // by the basic H and V specified for the component
-                  for (y=0; y < z->img_comp[n].v; ++y) {
-                     for (x=0; x < z->img_comp[n].h; ++x) {
-                        int x2 = (i*z->img_comp[n].h + x)*8;
-                        int y2 = (j*z->img_comp[n].v + y)*8;
-                        int ha = z->img_comp[n].ha;
-                        if (!stbi__jpeg_decode_block(z, data, z->huff_dc+z->img_comp[n].hd, z->huff_ac+ha, z->fast_ac[ha], n, z->dequant[z->img_comp[n].tq])) return 0;
-                        z->idct_block_kernel(z->img_comp[n].data+z->img_comp[n].w2*y2+x2, z->img_comp[n].w2, data);
-                     }
-                  }
-               }
-               // after all interleaved components, that's an interleaved MCU,
-               // so now count down the restart interval
-               if (--z->todo <= 0) {
-                  if (z->code_bits < 24) stbi__grow_buffer_unsafe(z);
-                  if (!STBI__RESTART(z->marker)) return 1;
-                  stbi__jpeg_reset(z);
+         if (++i == w) { i = 0; ++j; }
+      }
+   } else { // interleaved
+      i = first % z->img_mcu_x;
+      j = first / z->img_mcu_x;
+      for (m=first; m < last; ++m) {
+         // scan an interleaved mcu... process scan_n components in order
+         for (k=0; k < z->scan_n; ++k) {
+            int n = z->order[k];
+            // scan out an mcu's worth of this component; that's just determined
+            // by the basic H and V specified for the component
+            for (y=0; y < z->img_comp[n].v; ++y) {
+               for (x=0; x < z->img_comp[n].h; ++x) {
+                  int x2 = (i*z->img_comp[n].h + x)*8;
+                  int y2 = (j*z->img_comp[n].v + y)*8;
+                  int ha = z->img_comp[n].ha;
+                  if (!stbi__jpeg_decode_block(z, data, z->huff_dc+z->img_comp[n].hd, z->huff_ac+ha, z->fast_ac[ha], n, z->dequant[z->img_comp[n].tq])) return 0;
+                  z->idct_block_kernel(z->img_comp[n].data+((z->img_comp[n].w2*y2+x2) >> z->scale), z->img_comp[n].w2, data);
                }
             }
          }
-         return 1;
+         // after all interleaved components, that's an interleaved MCU,
+         // so now count down the restart interval
+         if (--z->todo <= 0) {
+            if (z->code_bits < 24) stbi__grow_buffer_unsafe(z);
+            if (!STBI__RESTART(z->marker)) return 1;
+            stbi__jpeg_reset(z);
+         }
+         if (++i == z->img_mcu_x) { i = 0; ++j; }
+      }
+   }
+   return 1;
+}
+
+// restart intervals reset the entropy decoder and the dc predictors, so with
+// a parallel_for installed, big baseline scans are cut at their RST markers
+// and the intervals are decoded as independent tasks. each task works on a
+// private copy of the decoder state and writes its own MCUs of the planes.
+#define STBI__JPEG_PARALLEL_MIN_MCUS  1024
+#define STBI__JPEG_MAX_TASKS          64
+
+typedef struct
+{
+   stbi__jpeg *z;
+   stbi_uc *data;    // entropy-coded bytes of the scan
+   int *seg;         // restart interval i is data[seg[i]..seg[i+1])
+   int count;        // restart intervals found
+   int total;        // MCUs in the scan
+   int tasks;
+   stbi_uc status[STBI__JPEG_MAX_TASKS]; // 1 ok, 0 bad huffman code, 2 bad marker
+} stbi__jpeg_par;
+
+typedef struct
+{
+   stbi__context *s;
+   stbi_uc *buf;     // copy of what was read, for stream sources
+   int len, cap;
+   int copy, failed;
+} stbi__jpeg_scan;
+
+static int stbi__jpeg_scan_get8(stbi__jpeg_scan *b)
+{
+   stbi_uc c;
+   if (stbi__at_eof(b->s)) return -1;
+   c = stbi__get8(b->s);
+   if (b->copy && !b->failed) {
+      if (b->len == b->cap) {
+         int cap = b->cap ? b->cap*2 : 65536;
+         stbi_uc *t = (stbi_uc *) STBI_REALLOC_SIZED(b->buf, b->cap, cap);
+         if (!t) { b->failed = 1; return c; }
+         b->buf = t;
+         b->cap = cap;
+      }
+      b->buf[b->len] = c;
+   }
+   ++b->len;
+   return c;
+}
+
+// consume the rest of the scan, up to and including the marker that ends it,
+// noting where each restart interval starts. memory sources are scanned in
+// place, streams are copied out into *owned
+static int stbi__jpeg_find_restarts(stbi__jpeg *z, stbi__jpeg_par *p, int intervals, stbi_uc **owned)
+{
+   stbi__jpeg_scan b;
+   int c;
+
+   *owned = NULL;
+   p->seg = (int *) stbi__malloc_mad2(intervals+1, sizeof(int), 0);
+   if (!p->seg) return stbi__err("outofmem", "Out of memory");
+   b.s = z->s;
+   b.buf = NULL;
+   b.len = b.cap = 0;
+   b.copy = z->s->read_from_callbacks;
+   b.failed = 0;
+   p->data = z->s->img_buffer;
+   p->seg[0] = 0;
+   p->count = 1;
+   z->marker = STBI__MARKER_none;
+   while ((c = stbi__jpeg_scan_get8(&b)) >= 0) {
+      if (c != 0xff) continue;
+      // 0xff 0x00 is a stuffed data byte and 0xff 0xd0..0xd7 a restart, any
+      // other marker ends the scan; extra 0xff before a marker are fill bytes
+      do c = stbi__jpeg_scan_get8(&b); while (c == 0xff);
+      if (c <= 0) continue;
+      if (STBI__RESTART(c)) {
+         // a stray one past the last interval is the last interval's problem
+         if (p->count < intervals)
+            p->seg[p->count++] = b.len;
+      } else {
+         z->marker = (unsigned char) c;
+         break;
+      }
+   }
+   p->seg[p->count] = b.len;
+   *owned = b.buf;
+   if (b.failed) return stbi__err("outofmem", "Out of memory");
+   if (b.copy) p->data = b.buf;
+   return 1;
+}
+
+static void stbi__jpeg_decode_task(void *arg, int index)
+{
+   stbi__jpeg_par *p = (stbi__jpeg_par *) arg;
+   stbi__jpeg j = *p->z;
+   stbi__context s;
+   int r, first = p->count * index / p->tasks, last = p->count * (index+1) / p->tasks;
+
+   p->status[index] = 1;
+   for (r=first; r < last; ++r) {
+      int m = r * j.restart_interval;
+      stbi__start_mem(&s, p->data + p->seg[r], p->seg[r+1] - p->seg[r]);
+      j.s = &s;
+      stbi__jpeg_reset(&j);
+      if (!stbi__jpeg_decode_mcus(&j, m, m + j.restart_interval < p->total ? m + j.restart_interval : p->total)) {
+         p->status[index] = 0;
+         return;
+      }
+      // the serial decoder gives up on the scan when an interval doesn't end
+      // right at its restart marker, and then trips over that marker; the
+      // same goes for the last interval and the marker closing the scan
+      if (r < p->count-1) {
+         if (j.todo <= 0) {
+            p->status[index] = 2;
+            return;
+         }
+      } else if (p->z->marker != STBI__MARKER_none) {
+         if (j.marker == STBI__MARKER_none) {
+            int c = 0;
+            while (c != 0xff && !stbi__at_eof(&s)) c = stbi__get8(&s);
+            if (c == 0xff) stbi__get8(&s);
+         }
+         if (!stbi__at_eof(&s)) {
+            p->status[index] = 2;
+            return;
+         }
       }
+   }
+}
+
+static int stbi__jpeg_decode_parallel(stbi__jpeg *z, int total)
+{
+   stbi__jpeg_par p;
+   stbi_uc *owned;
+   int i;
+
+   if (!stbi__jpeg_find_restarts(z, &p, (total + z->restart_interval - 1) / z->restart_interval, &owned)) {
+      STBI_FREE(p.seg);
+      STBI_FREE(owned);
+      return 0;
+   }
+   p.z = z;
+   p.total = total;
+   p.tasks = p.count < STBI__JPEG_MAX_TASKS ? p.count : STBI__JPEG_MAX_TASKS;
+   if (p.tasks > 1)
+      stbi__parallel_for(stbi__parallel_for_user, p.tasks, stbi__jpeg_decode_task, &p);
+   else
+      stbi__jpeg_decode_task(&p, 0);
+   STBI_FREE(p.seg);
+   STBI_FREE(owned);
+   // report the first interval that went wrong, as the serial decoder would.
+   // a task's own stbi__err only set the failure reason of the thread it ran
+   // on, so the reason is set again here, on the thread that asked for the load
+   for (i=0; i < p.tasks; ++i) {
+      if (p.status[i] == 0) return stbi__err("bad huffman code","Corrupt JPEG");
+      if (p.status[i] == 2) return stbi__err("unknown marker","Corrupt JPEG");
+   }
+   return 1;
+}
+
+static int stbi__parse_entropy_coded_data(stbi__jpeg *z)
+{
+   stbi__jpeg_reset(z);
+   if (!z->progressive) {
+      int total = stbi__jpeg_scan_mcus(z);
+      if (stbi__parallel_for && z->restart_interval && total > z->restart_interval && total >= STBI__JPEG_PARALLEL_MIN_MCUS)
+         return stbi__jpeg_decode_parallel(z, total);
+      return stbi__jpeg_decode_mcus(z, 0, total);
    } else {
       if (z->scan_n == 1) {
          int i,j;
@@ -2809,7 +3456,7 @@ static void stbi__jpeg_finish(stbi__jpeg *z)
             for (i=0; i < w; ++i) {
                short *data = z->img_comp[n].coeff + 64 * (i + j * z->img_comp[n].coeff_w);
                stbi__jpeg_dequantize(data, z->dequant[z->img_comp[n].tq]);
-               z->idct_block_kernel(z->img_comp[n].data+z->img_comp[n].w2*j*8+i*8, z->img_comp[n].w2, data);
+               z->idct_block_kernel(z->img_comp[n].data+((z->img_comp[n].w2*j+i)*8 >> z->scale), z->img_comp[n].w2, data);
             }
          }
       }
@@ -3039,8 +3686,9 @@ static int stbi__process_frame_header(stbi__jpeg *z, int scan)
       //
       // img_mcu_x, img_mcu_y: <=17 bits; comp[i].h and .v are <=4 (checked earlier)
       // so these muls can't overflow with 32-bit ints (which we require)
-      z->img_comp[i].w2 = z->img_mcu_x * z->img_comp[i].h * 8;
-      z->img_comp[i].h2 = z->img_mcu_y * z->img_comp[i].v * 8;
+      // (a scaled decode gets planes of (8>>scale)^2 pixels per block)
+      z->img_comp[i].w2 = z->img_mcu_x * z->img_comp[i].h * 8 >> z->scale;
+      z->img_comp[i].h2 = z->img_mcu_y * z->img_comp[i].v * 8 >> z->scale;
       z->img_comp[i].coeff = 0;
       z->img_comp[i].raw_coeff = 0;
       z->img_comp[i].linebuf = NULL;
@@ -3050,10 +3698,9 @@ static int stbi__process_frame_header(stbi__jpeg *z, int scan)
       // align blocks for idct using mmx/sse
       z->img_comp[i].data = (stbi_uc*) (((size_t) z->img_comp[i].raw_data + 15) & ~15);
       if (z->progressive) {
-         // w2, h2 are multiples of 8 (see above)
-         z->img_comp[i].coeff_w = z->img_comp[i].w2 / 8;
-         z->img_comp[i].coeff_h = z->img_comp[i].h2 / 8;
-         z->img_comp[i].raw_coeff = stbi__malloc_mad3(z->img_comp[i].w2, z->img_comp[i].h2, sizeof(short), 15);
+         z->img_comp[i].coeff_w = z->img_mcu_x * z->img_comp[i].h;
+         z->img_comp[i].coeff_h = z->img_mcu_y * z->img_comp[i].v;
+         z->img_comp[i].raw_coeff = stbi__malloc_mad3(z->img_comp[i].coeff_w * 8, z->img_comp[i].coeff_h * 8, sizeof(short), 15);
          if (z->img_comp[i].raw_coeff == NULL)
             return stbi__free_jpeg_components(z, i+1, stbi__err("outofmem", "Out of memory"));
          z->img_comp[i].coeff = (short*) (((size_t) z->img_comp[i].raw_coeff + 15) & ~15);
@@ -3508,9 +4155,95 @@ static void stbi__YCbCr_to_RGB_simd(stbi_uc *out, stbi_uc const *y, stbi_uc cons
 }
 #endif
 
+#ifdef STBI_AVX2
+// 16 pixels per iteration, and unlike the SSE2 version it also handles
+// step == 3, which is what RGB texture loads ask for.
+static STBI_AVX2_TARGET void stbi__YCbCr_to_RGB_avx2(stbi_uc *out, stbi_uc const *y, stbi_uc const *pcb, stbi_uc const *pcr, int count, int step)
+{
+   int i = 0;
+
+   if (step == 4 || step == 3) {
+      __m128i signflip  = _mm_set1_epi8(-0x80);
+      __m256i cr_const0 = _mm256_set1_epi16(   (short) ( 1.40200f*4096.0f+0.5f));
+      __m256i cr_const1 = _mm256_set1_epi16( - (short) ( 0.71414f*4096.0f+0.5f));
+      __m256i cb_const0 = _mm256_set1_epi16( - (short) ( 0.34414f*4096.0f+0.5f));
+      __m256i cb_const1 = _mm256_set1_epi16(   (short) ( 1.77200f*4096.0f+0.5f));
+      __m256i y_bias = _mm256_set1_epi16(128);
+      __m256i xw = _mm256_set1_epi16(255); // alpha channel
+      // drops every fourth byte of RGBX quads
+      __m256i rgb_pack = _mm256_setr_epi8(0,1,2,4,5,6,8,9,10,12,13,14,-1,-1,-1,-1,
+                                          0,1,2,4,5,6,8,9,10,12,13,14,-1,-1,-1,-1);
+      // the step == 3 stores are 16 bytes wide and run 4 bytes past the last
+      // pixel, so stop while there are still two pixels left for the tail
+      int tail = (step == 3) ? 2 : 0;
+
+      for (; i+15+tail < count; i += 16) {
+         // load
+         __m128i y_bytes = _mm_loadu_si128((__m128i *) (y+i));
+         __m128i cr_bytes = _mm_loadu_si128((__m128i *) (pcr+i));
+         __m128i cb_bytes = _mm_loadu_si128((__m128i *) (pcb+i));
+         __m128i cr_biased = _mm_xor_si128(cr_bytes, signflip); // -128
+         __m128i cb_biased = _mm_xor_si128(cb_bytes, signflip); // -128
+
+         // widen to short (and left-shift cr, cb by 8)
+         __m256i yw  = _mm256_or_si256(_mm256_slli_epi16(_mm256_cvtepu8_epi16(y_bytes), 8), y_bias);
+         __m256i crw = _mm256_slli_epi16(_mm256_cvtepu8_epi16(cr_biased), 8);
+         __m256i cbw = _mm256_slli_epi16(_mm256_cvtepu8_epi16(cb_biased), 8);
+
+         // color transform
+         __m256i yws = _mm256_srli_epi16(yw, 4);
+         __m256i cr0 = _mm256_mulhi_epi16(cr_const0, crw);
+         __m256i cb0 = _mm256_mulhi_epi16(cb_const0, cbw);
+         __m256i cb1 = _mm256_mulhi_epi16(cbw, cb_const1);
+         __m256i cr1 = _mm256_mulhi_epi16(crw, cr_const1);
+         __m256i rws = _mm256_add_epi16(cr0, yws);
+         __m256i gwt = _mm256_add_epi16(cb0, yws);
+         __m256i bws = _mm256_add_epi16(yws, cb1);
+         __m256i gws = _mm256_add_epi16(gwt, cr1);
+
+         // descale
+         __m256i rw = _mm256_srai_epi16(rws, 4);
+         __m256i bw = _mm256_srai_epi16(bws, 4);
+         __m256i gw = _mm256_srai_epi16(gws, 4);
+
+         // back to byte, set up for transpose
+         __m256i brb = _mm256_packus_epi16(rw, bw);
+         __m256i gxb = _mm256_packus_epi16(gw, xw);
+
+         // transpose to interleave channels; each lane holds 8 pixels
+         __m256i t0 = _mm256_unpacklo_epi8(brb, gxb);
+         __m256i t1 = _mm256_unpackhi_epi8(brb, gxb);
+         __m256i o0 = _mm256_unpacklo_epi16(t0, t1); // pixels 0-3, 8-11
+         __m256i o1 = _mm256_unpackhi_epi16(t0, t1); // pixels 4-7, 12-15
+         __m256i p0 = _mm256_permute2x128_si256(o0, o1, 0x20); // pixels 0-7
+         __m256i p1 = _mm256_permute2x128_si256(o0, o1, 0x31); // pixels 8-15
+
+         // store
+         if (step == 4) {
+            _mm256_storeu_si256((__m256i *) (out + 0), p0);
+            _mm256_storeu_si256((__m256i *) (out + 32), p1);
+            out += 64;
+         } else {
+            p0 = _mm256_shuffle_epi8(p0, rgb_pack);
+            p1 = _mm256_shuffle_epi8(p1, rgb_pack);
+            _mm_storeu_si128((__m128i *) (out + 0), _mm256_castsi256_si128(p0));
+            _mm_storeu_si128((__m128i *) (out + 12), _mm256_extracti128_si256(p0, 1));
+            _mm_storeu_si128((__m128i *) (out + 24), _mm256_castsi256_si128(p1));
+            _mm_storeu_si128((__m128i *) (out + 36), _mm256_extracti128_si256(p1, 1));
+            out += 48;
+         }
+      }
+   }
+
+   if (i < count)
+      stbi__YCbCr_to_RGB_simd(out, y+i, pcb+i, pcr+i, count-i, step);
+}
+#endif
+
 // set up the kernels
 static void stbi__setup_jpeg(stbi__jpeg *j)
 {
+   j->scale = 0;
    j->idct_block_kernel = stbi__idct_block;
    j->YCbCr_to_RGB_kernel = stbi__YCbCr_to_RGB_row;
    j->resample_row_hv_2_kernel = stbi__resample_row_hv_2;
@@ -3523,6 +4256,13 @@ static void stbi__setup_jpeg(stbi__jpeg *j)
    }
 #endif
 
+#ifdef STBI_AVX2
+   if (stbi__avx2_available()) {
+      j->idct_block_kernel = stbi__idct_avx2;
+      j->YCbCr_to_RGB_kernel = stbi__YCbCr_to_RGB_avx2;
+   }
+#endif
+
 #ifdef STBI_NEON
    j->idct_block_kernel = stbi__idct_simd;
    j->YCbCr_to_RGB_kernel = stbi__YCbCr_to_RGB_simd;
@@ -3564,6 +4304,17 @@ static stbi_uc *load_jpeg_image(stbi__jpeg *z, int *out_x, int *out_y, int *comp
    // load a jpeg image from whichever source, but leave in YCbCr format
    if (!stbi__decode_jpeg_image(z)) { stbi__cleanup_jpeg(z); return NULL; }
 
+   // the planes hold the scaled image, so carry on at that size
+   if (z->scale) {
+      int k, round = (1 << z->scale) - 1;
+      z->s->img_x = (z->s->img_x + round) >> z->scale;
+      z->s->img_y = (z->s->img_y + round) >> z->scale;
+      for (k=0; k < z->s->img_n; ++k) {
+         z->img_comp[k].x = (z->img_comp[k].x + round) >> z->scale;
+         z->img_comp[k].y = (z->img_comp[k].y + round) >> z->scale;
+      }
+   }
+
    // determine actual number of components to generate
    n = req_comp ? req_comp : z->s->img_n >= 3 ? 3 : 1;
 
@@ -3606,7 +4357,7 @@ static stbi_uc *load_jpeg_image(stbi__jpeg *z, int *out_x, int *out_y, int *comp
       }
 
       // can't error after this so, this is safe
-      output = (stbi_uc *) stbi__malloc_mad3(n, z->s->img_x, z->s->img_y, 1);
+      output = (stbi_uc *) stbi__malloc_output_mad3(z->s, n, z->s->img_x, z->s->img_y, 1);
       if (!output) { stbi__cleanup_jpeg(z); return stbi__errpuc("outofmem", "Out of memory"); }
 
       // now go ahead and resample
@@ -3719,6 +4470,11 @@ static void * STBI_FORCE_STACK_ALIGN stbi__jpeg_load(stbi__context *s, int *x, i
    STBI_NOTUSED(ri);
    j->s = s;
    stbi__setup_jpeg(j);
+   if (s->jpeg_scale) {
+      static void (* const scaled_idct[3])(stbi_uc *out, int out_stride, short data[64]) = { stbi__idct_block_4x4, stbi__idct_block_2x2, stbi__idct_block_1x1 };
+      j->scale = s->jpeg_scale;
+      j->idct_block_kernel = scaled_idct[j->scale-1];
+   }
    result = load_jpeg_image(j, x,y,comp,req_comp);
    STBI_FREE(j);
    return result;
@@ -3765,6 +4521,8 @@ static int stbi__jpeg_info(stbi__context *s, int *x, int *y, int *comp)
 //      - all output is written to a single output buffer (can malloc/realloc)
 //    performance
 //      - fast huffman
+//      - literal/length table that resolves two literals in one lookup
+//      - word-at-a-time bit refills and match copies
 
 #ifndef STBI_NO_ZLIB
 
@@ -3772,6 +4530,15 @@ static int stbi__jpeg_info(stbi__context *s, int *x, int *y, int *comp)
 #define STBI__ZFAST_BITS  9 // accelerate all cases in default tables
 #define STBI__ZFAST_MASK  ((1 << STBI__ZFAST_BITS) - 1)
 
+// literal pairs are looked up with a few more bits than single symbols
+#define STBI__ZPAIR_BITS  11
+#define STBI__ZPAIR_MASK  ((1 << STBI__ZPAIR_BITS) - 1)
+#define STBI__ZPAIR_FLAG  (1 << 24)
+
+// how much output a streaming consumer is handed at a time; small enough
+// that it is still in cache when the consumer reads it
+#define STBI__ZSINK_WINDOW 16384
+
 // zlib-style huffman encoding
 // (jpegs packs from left, zlib from right, so can't share code)
 typedef struct
@@ -3801,6 +4568,25 @@ stbi_inline static int stbi__bit_reverse(int v, int bits)
    return stbi__bitreverse16(v) >> (16-bits);
 }
 
+// build a table that decodes two consecutive literals at once: entries are
+// lit0 | lit1 << 8 | total bits << 16 | STBI__ZPAIR_FLAG, or 0 when the next
+// code is not a literal or the pair does not fit in STBI__ZPAIR_BITS
+static void stbi__zbuild_pairs(stbi__uint32 *pairs, const stbi__zhuffman *z)
+{
+   int i;
+   for (i=0; i < (1 << STBI__ZPAIR_BITS); ++i) {
+      int b0 = z->fast[i & STBI__ZFAST_MASK], b1, s0, s1;
+      pairs[i] = 0;
+      if (!b0 || (b0 & 511) >= 256) continue;
+      s0 = b0 >> 9;
+      b1 = z->fast[(i >> s0) & STBI__ZFAST_MASK];
+      if (!b1 || (b1 & 511) >= 256) continue;
+      s1 = b1 >> 9;
+      if (s0 + s1 > STBI__ZPAIR_BITS) continue;
+      pairs[i] = (stbi__uint32) ((b0 & 255) | ((b1 & 255) << 8) | ((s0 + s1) << 16)) | STBI__ZPAIR_FLAG;
+   }
+}
+
 static int stbi__zbuild_huffman(stbi__zhuffman *z, const stbi_uc *sizelist, int num)
 {
    int i,k=0;
@@ -3858,7 +4644,7 @@ typedef struct
 {
    stbi_uc *zbuffer, *zbuffer_end;
    int num_bits;
-   stbi__uint32 code_buffer;
+   stbi__bitbuf code_buffer;
 
    char *zout;
    char *zout_start;
@@ -3866,6 +4652,14 @@ typedef struct
    int   z_expandable;
 
    stbi__zhuffman z_length, z_distance;
+   stbi__uint32 z_length_pairs[1 << STBI__ZPAIR_BITS];
+
+   // optional streaming consumer: output goes into a fixed buffer ending at
+   // zout_limit, zout_end is a window that moves forward each time sink()
+   // has been handed everything written so far
+   int (*sink)(void *user, char *zout);
+   void *sink_user;
+   char *zout_limit;
 } stbi__zbuf;
 
 stbi_inline static stbi_uc stbi__zget8(stbi__zbuf *z)
@@ -3874,20 +4668,32 @@ stbi_inline static stbi_uc stbi__zget8(stbi__zbuf *z)
    return *z->zbuffer++;
 }
 
+// bits above num_bits are not necessarily zero: the word-sized refill
+// leaves the low bits of the next input byte there, and only advances
+// zbuffer past the bytes that fit completely
 static void stbi__fill_bits(stbi__zbuf *z)
 {
+#ifdef STBI__LITTLE_ENDIAN
+   if (z->zbuffer_end - z->zbuffer >= (int) sizeof(stbi__bitbuf)) {
+      stbi__bitbuf word;
+      memcpy(&word, z->zbuffer, sizeof(word));
+      z->code_buffer |= word << z->num_bits;
+      z->zbuffer += (STBI__BITBUF_BITS - 1 - z->num_bits) >> 3;
+      z->num_bits |= STBI__BITBUF_BITS - 8;
+      return;
+   }
+#endif
    do {
-      STBI_ASSERT(z->code_buffer < (1U << z->num_bits));
-      z->code_buffer |= (unsigned int) stbi__zget8(z) << z->num_bits;
+      z->code_buffer |= (stbi__bitbuf) stbi__zget8(z) << z->num_bits;
       z->num_bits += 8;
-   } while (z->num_bits <= 24);
+   } while (z->num_bits <= STBI__BITBUF_BITS - 8);
 }
 
 stbi_inline static unsigned int stbi__zreceive(stbi__zbuf *z, int n)
 {
    unsigned int k;
    if (z->num_bits < n) stbi__fill_bits(z);
-   k = z->code_buffer & ((1 << n) - 1);
+   k = (unsigned int) z->code_buffer & ((1 << n) - 1);
    z->code_buffer >>= n;
    z->num_bits -= n;
    return k;
@@ -3898,7 +4704,7 @@ static int stbi__zhuffman_decode_slowpath(stbi__zbuf *a, stbi__zhuffman *z)
    int b,s,k;
    // not resolved by fast table, so compute it the slow way
    // use jpeg approach, which requires MSbits at top
-   k = stbi__bit_reverse(a->code_buffer, 16);
+   k = stbi__bit_reverse((int) (a->code_buffer & 0xffff), 16);
    for (s=STBI__ZFAST_BITS+1; ; ++s)
       if (k < z->maxcode[s])
          break;
@@ -3915,7 +4721,7 @@ stbi_inline static int stbi__zhuffman_decode(stbi__zbuf *a, stbi__zhuffman *z)
 {
    int b,s;
    if (a->num_bits < 16) stbi__fill_bits(a);
-   b = z->fast[a->code_buffer & STBI__ZFAST_MASK];
+   b = z->fast[(int) a->code_buffer & STBI__ZFAST_MASK];
    if (b) {
       s = b >> 9;
       a->code_buffer >>= s;
@@ -3930,6 +4736,12 @@ static int stbi__zexpand(stbi__zbuf *z, char *zout, int n)  // need to make room
    char *q;
    int cur, limit, old_limit;
    z->zout = zout;
+   if (z->sink) {
+      if (z->zout_limit - zout < n) return stbi__err("output buffer limit","Corrupt PNG");
+      if (!z->sink(z->sink_user, zout)) return 0;
+      z->zout_end = (z->zout_limit - zout - n > STBI__ZSINK_WINDOW) ? zout + n + STBI__ZSINK_WINDOW : z->zout_limit;
+      return 1;
+   }
    if (!z->z_expandable) return stbi__err("output buffer limit","Corrupt PNG");
    cur   = (int) (z->zout     - z->zout_start);
    limit = old_limit = (int) (z->zout_end - z->zout_start);
@@ -3962,7 +4774,23 @@ static int stbi__parse_huffman_block(stbi__zbuf *a)
 {
    char *zout = a->zout;
    for(;;) {
-      int z = stbi__zhuffman_decode(a, &a->z_length);
+      int z;
+      stbi__uint32 pair;
+      if (a->num_bits < 16) stbi__fill_bits(a);
+      pair = a->z_length_pairs[(int) a->code_buffer & STBI__ZPAIR_MASK];
+      if (pair) {
+         if (zout + 2 > a->zout_end) {
+            if (!stbi__zexpand(a, zout, 2)) return 0;
+            zout = a->zout;
+         }
+         zout[0] = (char) pair;
+         zout[1] = (char) (pair >> 8);
+         zout += 2;
+         a->code_buffer >>= (pair >> 16) & 31;
+         a->num_bits -= (pair >> 16) & 31;
+         continue;
+      }
+      z = stbi__zhuffman_decode(a, &a->z_length);
       if (z < 256) {
          if (z < 0) return stbi__err("bad huffman code","Corrupt PNG"); // error in huffman codes
          if (zout >= a->zout_end) {
@@ -3991,8 +4819,18 @@ static int stbi__parse_huffman_block(stbi__zbuf *a)
          }
          p = (stbi_uc *) (zout - dist);
          if (dist == 1) { // run of one byte; common in images.
-            stbi_uc v = *p;
-            if (len) { do *zout++ = v; while (--len); }
+            memset(zout, *p, len);
+            zout += len;
+         } else if (dist >= 8 && a->zout_end - zout >= len + 8) {
+            // 8 bytes at a time; each chunk only reads bytes that are already
+            // written, and the overshoot past len is overwritten later
+            char *end = zout + len;
+            do {
+               memcpy(zout, p, 8);
+               zout += 8;
+               p += 8;
+            } while (zout < end);
+            zout = end;
          } else {
             if (len) { do *zout++ = *p++; while (--len); }
          }
@@ -4057,21 +4895,29 @@ static int stbi__parse_uncompressed_block(stbi__zbuf *a)
       stbi__zreceive(a, a->num_bits & 7); // discard
    // drain the bit-packed data into header
    k = 0;
-   while (a->num_bits > 0) {
+   while (a->num_bits > 0 && k < 4) {
       header[k++] = (stbi_uc) (a->code_buffer & 255); // suppress MSVC run-time check
       a->code_buffer >>= 8;
       a->num_bits -= 8;
    }
-   STBI_ASSERT(a->num_bits == 0);
    // now fill header the normal way
    while (k < 4)
       header[k++] = stbi__zget8(a);
    len  = header[1] * 256 + header[0];
    nlen = header[3] * 256 + header[2];
    if (nlen != (len ^ 0xffff)) return stbi__err("zlib corrupt","Corrupt PNG");
-   if (a->zbuffer + len > a->zbuffer_end) return stbi__err("read past buffer","Corrupt PNG");
    if (a->zout + len > a->zout_end)
       if (!stbi__zexpand(a, a->zout, len)) return 0;
+   // a 64-bit bit buffer can still hold the first bytes of the stored data
+   while (a->num_bits > 0 && len > 0) {
+      *a->zout++ = (char) (a->code_buffer & 255);
+      a->code_buffer >>= 8;
+      a->num_bits -= 8;
+      --len;
+   }
+   // the read-ahead bits above num_bits no longer match zbuffer once it moves
+   a->code_buffer &= ((stbi__bitbuf) 1 << a->num_bits) - 1;
+   if (a->zbuffer + len > a->zbuffer_end) return stbi__err("read past buffer","Corrupt PNG");
    memcpy(a->zout, a->zbuffer, len);
    a->zbuffer += len;
    a->zout += len;
@@ -4142,6 +4988,7 @@ static int stbi__parse_zlib(stbi__zbuf *a, int parse_header)
          } else {
             if (!stbi__compute_huffman_codes(a)) return 0;
          }
+         stbi__zbuild_pairs(a->z_length_pairs, &a->z_length);
          if (!stbi__parse_huffman_block(a)) return 0;
       }
    } while (!final);
@@ -4154,6 +5001,24 @@ static int stbi__do_zlib(stbi__zbuf *a, char *obuf, int olen, int exp, int parse
    a->zout       = obuf;
    a->zout_end   = obuf + olen;
    a->z_expandable = exp;
+   a->sink = NULL;
+
+   return stbi__parse_zlib(a, parse_header);
+}
+
+// decode into exactly olen bytes, passing the output to sink() in windows of
+// STBI__ZSINK_WINDOW bytes as it is produced. sink() sees every byte up to
+// the pointer it is given, but is not called for the final window; the
+// caller does that with a->zout once this returns
+static int stbi__do_zlib_sink(stbi__zbuf *a, char *obuf, int olen, int parse_header, int (*sink)(void *user, char *zout), void *user)
+{
+   a->zout_start = obuf;
+   a->zout       = obuf;
+   a->zout_limit = obuf + olen;
+   a->zout_end   = olen > STBI__ZSINK_WINDOW ? obuf + STBI__ZSINK_WINDOW : a->zout_limit;
+   a->z_expandable = 0;
+   a->sink = sink;
+   a->sink_user = user;
 
    return stbi__parse_zlib(a, parse_header);
 }
@@ -4309,214 +5174,417 @@ static int stbi__paeth(int a, int b, int c)
 
 static stbi_uc stbi__depth_scale_table[9] = { 0, 0xff, 0x55, 0, 0x11, 0,0,0, 0x01 };
 
-// create the png data from post-deflated data
-static int stbi__create_png_image_raw(stbi__png *a, stbi_uc *raw, stbi__uint32 raw_len, int out_n, stbi__uint32 x, stbi__uint32 y, int depth, int color)
+#ifdef STBI_SSE2
+// sub, avg and paeth depend on the pixel to the left, so the 8-bit 3 and 4
+// channel kernels below go one pixel per step with all channels in the low
+// 32 bits of a register. 3-byte pixels are moved a byte at a time so nothing
+// is read or written past the end of a row
+stbi_inline static __m128i stbi__png_load_px(const stbi_uc *p, int n)
+{
+   stbi__uint32 v;
+   if (n == 4) memcpy(&v, p, 4);
+   else        v = p[0] | (p[1] << 8) | (p[2] << 16);
+   return _mm_cvtsi32_si128((int) v);
+}
+
+stbi_inline static void stbi__png_store_px(stbi_uc *p, __m128i v, int n)
+{
+   stbi__uint32 x = (stbi__uint32) _mm_cvtsi128_si32(v);
+   if (n == 4) memcpy(p, &x, 4);
+   else {
+      p[0] = STBI__BYTECAST(x);
+      p[1] = STBI__BYTECAST(x >> 8);
+      p[2] = STBI__BYTECAST(x >> 16);
+   }
+}
+
+stbi_inline static __m128i stbi__png_abs16(__m128i x)
+{
+   return _mm_max_epi16(x, _mm_sub_epi16(_mm_setzero_si128(), x));
+}
+
+// defilter 'pixels' pixels after the first one of a row. raw_n is 3 or 4,
+// out_n is raw_n or raw_n+1, in which case alpha is set to 255. returns 0 if
+// the scalar loop is the faster choice
+static int stbi__png_defilter_sse2(int filter, stbi_uc *cur, const stbi_uc *prior, const stbi_uc *raw, int pixels, int raw_n, int out_n)
+{
+   // alpha is only or'ed in when storing: the running pixel keeps whatever the
+   // filter produced for that channel, which only feeds back into alpha itself
+   __m128i zero = _mm_setzero_si128();
+   __m128i alpha = _mm_cvtsi32_si128(out_n != raw_n ? (int) 0xff000000 : 0);
+   __m128i mask = _mm_set1_epi16(255);
+   __m128i a, b, c;
+   int i;
+
+   switch (filter) {
+      case STBI__F_none:
+         if (raw_n == out_n) { memcpy(cur, raw, pixels*raw_n); break; }
+         for (i=0; i < pixels; ++i, raw+=raw_n, cur+=out_n)
+            stbi__png_store_px(cur, _mm_or_si128(stbi__png_load_px(raw, raw_n), alpha), out_n);
+         break;
+
+      case STBI__F_sub:
+      case STBI__F_paeth_first: // paeth(a,0,0) == a
+         a = stbi__png_load_px(cur - out_n, out_n);
+         for (i=0; i < pixels; ++i, raw+=raw_n, cur+=out_n) {
+            a = _mm_add_epi8(a, stbi__png_load_px(raw, raw_n));
+            stbi__png_store_px(cur, _mm_or_si128(a, alpha), out_n);
+         }
+         break;
+
+      case STBI__F_up:
+         if (raw_n == out_n) {
+            int k, nk = pixels*raw_n;
+            for (k=0; k+16 <= nk; k+=16)
+               _mm_storeu_si128((__m128i *) (cur+k), _mm_add_epi8(_mm_loadu_si128((const __m128i *) (raw+k)), _mm_loadu_si128((const __m128i *) (prior+k))));
+            for (; k < nk; ++k)
+               cur[k] = STBI__BYTECAST(raw[k] + prior[k]);
+            break;
+         }
+         for (i=0; i < pixels; ++i, raw+=raw_n, cur+=out_n, prior+=out_n) {
+            b = _mm_add_epi8(stbi__png_load_px(prior, out_n), stbi__png_load_px(raw, raw_n));
+            stbi__png_store_px(cur, _mm_or_si128(b, alpha), out_n);
+         }
+         break;
+
+      case STBI__F_avg:
+      case STBI__F_avg_first:
+         // the byte-wise loop interleaves the channels' dependency chains
+         // better than one pixel per step does
+         if (raw_n == out_n) return 0;
+         // 16-bit lanes, so a+b can't overflow
+         a = _mm_unpacklo_epi8(stbi__png_load_px(cur - out_n, out_n), zero);
+         for (i=0; i < pixels; ++i, raw+=raw_n, cur+=out_n, prior+=out_n) {
+            b = filter == STBI__F_avg ? _mm_unpacklo_epi8(stbi__png_load_px(prior, out_n), zero) : zero;
+            c = _mm_unpacklo_epi8(stbi__png_load_px(raw, raw_n), zero);
+            a = _mm_and_si128(_mm_add_epi16(_mm_srli_epi16(_mm_add_epi16(a, b), 1), c), mask);
+            stbi__png_store_px(cur, _mm_or_si128(_mm_packus_epi16(a, zero), alpha), out_n);
+         }
+         break;
+
+      case STBI__F_paeth:
+         a = _mm_unpacklo_epi8(stbi__png_load_px(cur - out_n, out_n), zero);
+         c = _mm_unpacklo_epi8(stbi__png_load_px(prior - out_n, out_n), zero);
+         for (i=0; i < pixels; ++i, raw+=raw_n, cur+=out_n, prior+=out_n) {
+            __m128i pa, pb, pc, smallest, nearest, t;
+            b = _mm_unpacklo_epi8(stbi__png_load_px(prior, out_n), zero);
+            // p = a+b-c, so p-a = b-c, p-b = a-c and p-c = (b-c)+(a-c)
+            pa = _mm_sub_epi16(b, c);
+            pb = _mm_sub_epi16(a, c);
+            pc = stbi__png_abs16(_mm_add_epi16(pa, pb));
+            pa = stbi__png_abs16(pa);
+            pb = stbi__png_abs16(pb);
+            // ties go to a, then b, then c
+            smallest = _mm_min_epi16(pc, _mm_min_epi16(pa, pb));
+            t = _mm_cmpeq_epi16(smallest, pb);
+            nearest = _mm_or_si128(_mm_and_si128(t, b), _mm_andnot_si128(t, c));
+            t = _mm_cmpeq_epi16(smallest, pa);
+            nearest = _mm_or_si128(_mm_and_si128(t, a), _mm_andnot_si128(t, nearest));
+            a = _mm_and_si128(_mm_add_epi16(nearest, _mm_unpacklo_epi8(stbi__png_load_px(raw, raw_n), zero)), mask);
+            stbi__png_store_px(cur, _mm_or_si128(_mm_packus_epi16(a, zero), alpha), out_n);
+            c = b;
+         }
+         break;
+   }
+   return 1;
+}
+#endif
+
+// undo the filter of scanline j of an x-pixel wide (sub)image; raw points at
+// the scanline's filter byte
+static int stbi__png_defilter_row(stbi__png *a, stbi_uc *raw, stbi__uint32 j, int out_n, stbi__uint32 x, int depth)
 {
    int bytes = (depth == 16? 2 : 1);
-   stbi__context *s = a->s;
-   stbi__uint32 i,j,stride = x*out_n*bytes;
-   stbi__uint32 img_len, img_width_bytes;
+   stbi__uint32 i, stride = x*out_n*bytes;
+   stbi__uint32 img_width_bytes = (((a->s->img_n * x * depth) + 7) >> 3);
    int k;
-   int img_n = s->img_n; // copy it into a local for later
+   int img_n = a->s->img_n; // copy it into a local for later
 
    int output_bytes = out_n*bytes;
    int filter_bytes = img_n*bytes;
    int width = x;
 
-   STBI_ASSERT(out_n == s->img_n || out_n == s->img_n+1);
-   a->out = (stbi_uc *) stbi__malloc_mad3(x, y, output_bytes, 0); // extra bytes to write off the end into
-   if (!a->out) return stbi__err("outofmem", "Out of memory");
+   stbi_uc *cur = a->out + stride*j;
+   stbi_uc *prior;
+   int filter = *raw++;
 
-   img_width_bytes = (((img_n * x * depth) + 7) >> 3);
-   img_len = (img_width_bytes + 1) * y;
-   if (s->img_x == x && s->img_y == y) {
-      if (raw_len != img_len) return stbi__err("not enough pixels","Corrupt PNG");
-   } else { // interlaced:
-      if (raw_len < img_len) return stbi__err("not enough pixels","Corrupt PNG");
+   if (filter > 4)
+      return stbi__err("invalid filter","Corrupt PNG");
+
+   if (depth < 8) {
+      STBI_ASSERT(img_width_bytes <= x);
+      cur += x*out_n - img_width_bytes; // store output to the rightmost img_len bytes, so we can decode in place
+      filter_bytes = 1;
+      width = img_width_bytes;
+   }
+   prior = cur - stride; // bugfix: need to compute this after 'cur +=' computation above
+
+   // if first row, use special filter that doesn't sample previous row
+   if (j == 0) filter = first_row_filter[filter];
+
+   // handle first byte explicitly
+   for (k=0; k < filter_bytes; ++k) {
+      switch (filter) {
+         case STBI__F_none       : cur[k] = raw[k]; break;
+         case STBI__F_sub        : cur[k] = raw[k]; break;
+         case STBI__F_up         : cur[k] = STBI__BYTECAST(raw[k] + prior[k]); break;
+         case STBI__F_avg        : cur[k] = STBI__BYTECAST(raw[k] + (prior[k]>>1)); break;
+         case STBI__F_paeth      : cur[k] = STBI__BYTECAST(raw[k] + stbi__paeth(0,prior[k],0)); break;
+         case STBI__F_avg_first  : cur[k] = raw[k]; break;
+         case STBI__F_paeth_first: cur[k] = raw[k]; break;
+      }
    }
 
-   for (j=0; j < y; ++j) {
-      stbi_uc *cur = a->out + stride*j;
-      stbi_uc *prior;
-      int filter = *raw++;
+   if (depth == 8) {
+      if (img_n != out_n)
+         cur[img_n] = 255; // first pixel
+      raw += img_n;
+      cur += out_n;
+      prior += out_n;
+   } else if (depth == 16) {
+      if (img_n != out_n) {
+         cur[filter_bytes]   = 255; // first pixel top byte
+         cur[filter_bytes+1] = 255; // first pixel bottom byte
+      }
+      raw += filter_bytes;
+      cur += output_bytes;
+      prior += output_bytes;
+   } else {
+      raw += 1;
+      cur += 1;
+      prior += 1;
+   }
 
-      if (filter > 4)
-         return stbi__err("invalid filter","Corrupt PNG");
+#ifdef STBI_SSE2
+   if (depth == 8 && img_n >= 3 && stbi__sse2_available())
+      if (stbi__png_defilter_sse2(filter, cur, prior, raw, x-1, img_n, out_n))
+         return 1;
+#endif
 
-      if (depth < 8) {
-         STBI_ASSERT(img_width_bytes <= x);
-         cur += x*out_n - img_width_bytes; // store output to the rightmost img_len bytes, so we can decode in place
-         filter_bytes = 1;
-         width = img_width_bytes;
+   // this is a little gross, so that we don't switch per-pixel or per-component
+   if (depth < 8 || img_n == out_n) {
+      int nk = (width - 1)*filter_bytes;
+      #define STBI__CASE(f) \
+          case f:     \
+             for (k=0; k < nk; ++k)
+      switch (filter) {
+         // "none" filter turns into a memcpy here; make that explicit.
+         case STBI__F_none:         memcpy(cur, raw, nk); break;
+         STBI__CASE(STBI__F_sub)          { cur[k] = STBI__BYTECAST(raw[k] + cur[k-filter_bytes]); } break;
+         STBI__CASE(STBI__F_up)           { cur[k] = STBI__BYTECAST(raw[k] + prior[k]); } break;
+         STBI__CASE(STBI__F_avg)          { cur[k] = STBI__BYTECAST(raw[k] + ((prior[k] + cur[k-filter_bytes])>>1)); } break;
+         STBI__CASE(STBI__F_paeth)        { cur[k] = STBI__BYTECAST(raw[k] + stbi__paeth(cur[k-filter_bytes],prior[k],prior[k-filter_bytes])); } break;
+         STBI__CASE(STBI__F_avg_first)    { cur[k] = STBI__BYTECAST(raw[k] + (cur[k-filter_bytes] >> 1)); } break;
+         STBI__CASE(STBI__F_paeth_first)  { cur[k] = STBI__BYTECAST(raw[k] + stbi__paeth(cur[k-filter_bytes],0,0)); } break;
       }
-      prior = cur - stride; // bugfix: need to compute this after 'cur +=' computation above
-
-      // if first row, use special filter that doesn't sample previous row
-      if (j == 0) filter = first_row_filter[filter];
-
-      // handle first byte explicitly
-      for (k=0; k < filter_bytes; ++k) {
-         switch (filter) {
-            case STBI__F_none       : cur[k] = raw[k]; break;
-            case STBI__F_sub        : cur[k] = raw[k]; break;
-            case STBI__F_up         : cur[k] = STBI__BYTECAST(raw[k] + prior[k]); break;
-            case STBI__F_avg        : cur[k] = STBI__BYTECAST(raw[k] + (prior[k]>>1)); break;
-            case STBI__F_paeth      : cur[k] = STBI__BYTECAST(raw[k] + stbi__paeth(0,prior[k],0)); break;
-            case STBI__F_avg_first  : cur[k] = raw[k]; break;
-            case STBI__F_paeth_first: cur[k] = raw[k]; break;
-         }
+      #undef STBI__CASE
+      raw += nk;
+   } else {
+      STBI_ASSERT(img_n+1 == out_n);
+      #define STBI__CASE(f) \
+          case f:     \
+             for (i=x-1; i >= 1; --i, cur[filter_bytes]=255,raw+=filter_bytes,cur+=output_bytes,prior+=output_bytes) \
+                for (k=0; k < filter_bytes; ++k)
+      switch (filter) {
+         STBI__CASE(STBI__F_none)         { cur[k] = raw[k]; } break;
+         STBI__CASE(STBI__F_sub)          { cur[k] = STBI__BYTECAST(raw[k] + cur[k- output_bytes]); } break;
+         STBI__CASE(STBI__F_up)           { cur[k] = STBI__BYTECAST(raw[k] + prior[k]); } break;
+         STBI__CASE(STBI__F_avg)          { cur[k] = STBI__BYTECAST(raw[k] + ((prior[k] + cur[k- output_bytes])>>1)); } break;
+         STBI__CASE(STBI__F_paeth)        { cur[k] = STBI__BYTECAST(raw[k] + stbi__paeth(cur[k- output_bytes],prior[k],prior[k- output_bytes])); } break;
+         STBI__CASE(STBI__F_avg_first)    { cur[k] = STBI__BYTECAST(raw[k] + (cur[k- output_bytes] >> 1)); } break;
+         STBI__CASE(STBI__F_paeth_first)  { cur[k] = STBI__BYTECAST(raw[k] + stbi__paeth(cur[k- output_bytes],0,0)); } break;
       }
+      #undef STBI__CASE
 
-      if (depth == 8) {
-         if (img_n != out_n)
-            cur[img_n] = 255; // first pixel
-         raw += img_n;
-         cur += out_n;
-         prior += out_n;
-      } else if (depth == 16) {
-         if (img_n != out_n) {
-            cur[filter_bytes]   = 255; // first pixel top byte
-            cur[filter_bytes+1] = 255; // first pixel bottom byte
+      // the loop above sets the high byte of the pixels' alpha, but for
+      // 16 bit png files we also need the low byte set. we'll do that here.
+      if (depth == 16) {
+         cur = a->out + stride*j; // start at the beginning of the row again
+         for (i=0; i < x; ++i,cur+=output_bytes) {
+            cur[filter_bytes+1] = 255;
          }
-         raw += filter_bytes;
-         cur += output_bytes;
-         prior += output_bytes;
-      } else {
-         raw += 1;
-         cur += 1;
-         prior += 1;
       }
+   }
+
+   return 1;
+}
+
+// expand 1/2/4-bit samples to bytes, or swap 16-bit samples to native byte
+// order, for scanline j. this runs one scanline behind defiltering, which
+// still needs the packed big-endian data of the previous row
+static void stbi__png_finish_row(stbi__png *a, stbi__uint32 j, int out_n, stbi__uint32 x, int depth, int color)
+{
+   stbi__uint32 i, stride = x*out_n*(depth == 16 ? 2 : 1);
+   int img_n = a->s->img_n;
 
-      // this is a little gross, so that we don't switch per-pixel or per-component
-      if (depth < 8 || img_n == out_n) {
-         int nk = (width - 1)*filter_bytes;
-         #define STBI__CASE(f) \
-             case f:     \
-                for (k=0; k < nk; ++k)
-         switch (filter) {
-            // "none" filter turns into a memcpy here; make that explicit.
-            case STBI__F_none:         memcpy(cur, raw, nk); break;
-            STBI__CASE(STBI__F_sub)          { cur[k] = STBI__BYTECAST(raw[k] + cur[k-filter_bytes]); } break;
-            STBI__CASE(STBI__F_up)           { cur[k] = STBI__BYTECAST(raw[k] + prior[k]); } break;
-            STBI__CASE(STBI__F_avg)          { cur[k] = STBI__BYTECAST(raw[k] + ((prior[k] + cur[k-filter_bytes])>>1)); } break;
-            STBI__CASE(STBI__F_paeth)        { cur[k] = STBI__BYTECAST(raw[k] + stbi__paeth(cur[k-filter_bytes],prior[k],prior[k-filter_bytes])); } break;
-            STBI__CASE(STBI__F_avg_first)    { cur[k] = STBI__BYTECAST(raw[k] + (cur[k-filter_bytes] >> 1)); } break;
-            STBI__CASE(STBI__F_paeth_first)  { cur[k] = STBI__BYTECAST(raw[k] + stbi__paeth(cur[k-filter_bytes],0,0)); } break;
+   if (depth < 8) {
+      stbi__uint32 img_width_bytes = (((img_n * x * depth) + 7) >> 3);
+      int k;
+      stbi_uc *cur = a->out + stride*j;
+      stbi_uc *in  = a->out + stride*j + x*out_n - img_width_bytes;
+      // unpack 1/2/4-bit into a 8-bit buffer. allows us to keep the common 8-bit path optimal at minimal cost for 1/2/4-bit
+      // png guarante byte alignment, if width is not multiple of 8/4/2 we'll decode dummy trailing data that will be skipped in the later loop
+      stbi_uc scale = (color == 0) ? stbi__depth_scale_table[depth] : 1; // scale grayscale values to 0..255 range
+
+      // note that the final byte might overshoot and write more data than desired.
+      // we can allocate enough data that this never writes out of memory, but it
+      // could also overwrite the next scanline. can it overwrite non-empty data
+      // on the next scanline? yes, consider 1-pixel-wide scanlines with 1-bit-per-pixel.
+      // so we need to explicitly clamp the final ones
+
+      if (depth == 4) {
+         for (k=x*img_n; k >= 2; k-=2, ++in) {
+            *cur++ = scale * ((*in >> 4)       );
+            *cur++ = scale * ((*in     ) & 0x0f);
          }
-         #undef STBI__CASE
-         raw += nk;
-      } else {
-         STBI_ASSERT(img_n+1 == out_n);
-         #define STBI__CASE(f) \
-             case f:     \
-                for (i=x-1; i >= 1; --i, cur[filter_bytes]=255,raw+=filter_bytes,cur+=output_bytes,prior+=output_bytes) \
-                   for (k=0; k < filter_bytes; ++k)
-         switch (filter) {
-            STBI__CASE(STBI__F_none)         { cur[k] = raw[k]; } break;
-            STBI__CASE(STBI__F_sub)          { cur[k] = STBI__BYTECAST(raw[k] + cur[k- output_bytes]); } break;
-            STBI__CASE(STBI__F_up)           { cur[k] = STBI__BYTECAST(raw[k] + prior[k]); } break;
-            STBI__CASE(STBI__F_avg)          { cur[k] = STBI__BYTECAST(raw[k] + ((prior[k] + cur[k- output_bytes])>>1)); } break;
-            STBI__CASE(STBI__F_paeth)        { cur[k] = STBI__BYTECAST(raw[k] + stbi__paeth(cur[k- output_bytes],prior[k],prior[k- output_bytes])); } break;
-            STBI__CASE(STBI__F_avg_first)    { cur[k] = STBI__BYTECAST(raw[k] + (cur[k- output_bytes] >> 1)); } break;
-            STBI__CASE(STBI__F_paeth_first)  { cur[k] = STBI__BYTECAST(raw[k] + stbi__paeth(cur[k- output_bytes],0,0)); } break;
+         if (k > 0) *cur++ = scale * ((*in >> 4)       );
+      } else if (depth == 2) {
+         for (k=x*img_n; k >= 4; k-=4, ++in) {
+            *cur++ = scale * ((*in >> 6)       );
+            *cur++ = scale * ((*in >> 4) & 0x03);
+            *cur++ = scale * ((*in >> 2) & 0x03);
+            *cur++ = scale * ((*in     ) & 0x03);
          }
-         #undef STBI__CASE
-
-         // the loop above sets the high byte of the pixels' alpha, but for
-         // 16 bit png files we also need the low byte set. we'll do that here.
-         if (depth == 16) {
-            cur = a->out + stride*j; // start at the beginning of the row again
-            for (i=0; i < x; ++i,cur+=output_bytes) {
-               cur[filter_bytes+1] = 255;
-            }
+         if (k > 0) *cur++ = scale * ((*in >> 6)       );
+         if (k > 1) *cur++ = scale * ((*in >> 4) & 0x03);
+         if (k > 2) *cur++ = scale * ((*in >> 2) & 0x03);
+      } else if (depth == 1) {
+         for (k=x*img_n; k >= 8; k-=8, ++in) {
+            *cur++ = scale * ((*in >> 7)       );
+            *cur++ = scale * ((*in >> 6) & 0x01);
+            *cur++ = scale * ((*in >> 5) & 0x01);
+            *cur++ = scale * ((*in >> 4) & 0x01);
+            *cur++ = scale * ((*in >> 3) & 0x01);
+            *cur++ = scale * ((*in >> 2) & 0x01);
+            *cur++ = scale * ((*in >> 1) & 0x01);
+            *cur++ = scale * ((*in     ) & 0x01);
          }
+         if (k > 0) *cur++ = scale * ((*in >> 7)       );
+         if (k > 1) *cur++ = scale * ((*in >> 6) & 0x01);
+         if (k > 2) *cur++ = scale * ((*in >> 5) & 0x01);
+         if (k > 3) *cur++ = scale * ((*in >> 4) & 0x01);
+         if (k > 4) *cur++ = scale * ((*in >> 3) & 0x01);
+         if (k > 5) *cur++ = scale * ((*in >> 2) & 0x01);
+         if (k > 6) *cur++ = scale * ((*in >> 1) & 0x01);
       }
-   }
-
-   // we make a separate pass to expand bits to pixels; for performance,
-   // this could run two scanlines behind the above code, so it won't
-   // intefere with filtering but will still be in the cache.
-   if (depth < 8) {
-      for (j=0; j < y; ++j) {
-         stbi_uc *cur = a->out + stride*j;
-         stbi_uc *in  = a->out + stride*j + x*out_n - img_width_bytes;
-         // unpack 1/2/4-bit into a 8-bit buffer. allows us to keep the common 8-bit path optimal at minimal cost for 1/2/4-bit
-         // png guarante byte alignment, if width is not multiple of 8/4/2 we'll decode dummy trailing data that will be skipped in the later loop
-         stbi_uc scale = (color == 0) ? stbi__depth_scale_table[depth] : 1; // scale grayscale values to 0..255 range
-
-         // note that the final byte might overshoot and write more data than desired.
-         // we can allocate enough data that this never writes out of memory, but it
-         // could also overwrite the next scanline. can it overwrite non-empty data
-         // on the next scanline? yes, consider 1-pixel-wide scanlines with 1-bit-per-pixel.
-         // so we need to explicitly clamp the final ones
-
-         if (depth == 4) {
-            for (k=x*img_n; k >= 2; k-=2, ++in) {
-               *cur++ = scale * ((*in >> 4)       );
-               *cur++ = scale * ((*in     ) & 0x0f);
+      if (img_n != out_n) {
+         int q;
+         // insert alpha = 255
+         cur = a->out + stride*j;
+         if (img_n == 1) {
+            for (q=x-1; q >= 0; --q) {
+               cur[q*2+1] = 255;
+               cur[q*2+0] = cur[q];
             }
-            if (k > 0) *cur++ = scale * ((*in >> 4)       );
-         } else if (depth == 2) {
-            for (k=x*img_n; k >= 4; k-=4, ++in) {
-               *cur++ = scale * ((*in >> 6)       );
-               *cur++ = scale * ((*in >> 4) & 0x03);
-               *cur++ = scale * ((*in >> 2) & 0x03);
-               *cur++ = scale * ((*in     ) & 0x03);
-            }
-            if (k > 0) *cur++ = scale * ((*in >> 6)       );
-            if (k > 1) *cur++ = scale * ((*in >> 4) & 0x03);
-            if (k > 2) *cur++ = scale * ((*in >> 2) & 0x03);
-         } else if (depth == 1) {
-            for (k=x*img_n; k >= 8; k-=8, ++in) {
-               *cur++ = scale * ((*in >> 7)       );
-               *cur++ = scale * ((*in >> 6) & 0x01);
-               *cur++ = scale * ((*in >> 5) & 0x01);
-               *cur++ = scale * ((*in >> 4) & 0x01);
-               *cur++ = scale * ((*in >> 3) & 0x01);
-               *cur++ = scale * ((*in >> 2) & 0x01);
-               *cur++ = scale * ((*in >> 1) & 0x01);
-               *cur++ = scale * ((*in     ) & 0x01);
-            }
-            if (k > 0) *cur++ = scale * ((*in >> 7)       );
-            if (k > 1) *cur++ = scale * ((*in >> 6) & 0x01);
-            if (k > 2) *cur++ = scale * ((*in >> 5) & 0x01);
-            if (k > 3) *cur++ = scale * ((*in >> 4) & 0x01);
-            if (k > 4) *cur++ = scale * ((*in >> 3) & 0x01);
-            if (k > 5) *cur++ = scale * ((*in >> 2) & 0x01);
-            if (k > 6) *cur++ = scale * ((*in >> 1) & 0x01);
-         }
-         if (img_n != out_n) {
-            int q;
-            // insert alpha = 255
-            cur = a->out + stride*j;
-            if (img_n == 1) {
-               for (q=x-1; q >= 0; --q) {
-                  cur[q*2+1] = 255;
-                  cur[q*2+0] = cur[q];
-               }
-            } else {
-               STBI_ASSERT(img_n == 3);
-               for (q=x-1; q >= 0; --q) {
-                  cur[q*4+3] = 255;
-                  cur[q*4+2] = cur[q*3+2];
-                  cur[q*4+1] = cur[q*3+1];
-                  cur[q*4+0] = cur[q*3+0];
-               }
+         } else {
+            STBI_ASSERT(img_n == 3);
+            for (q=x-1; q >= 0; --q) {
+               cur[q*4+3] = 255;
+               cur[q*4+2] = cur[q*3+2];
+               cur[q*4+1] = cur[q*3+1];
+               cur[q*4+0] = cur[q*3+0];
             }
          }
       }
    } else if (depth == 16) {
       // force the image data from big-endian to platform-native.
-      // this is done in a separate pass due to the decoding relying
-      // on the data being untouched, but could probably be done
-      // per-line during decode if care is taken.
-      stbi_uc *cur = a->out;
+      stbi_uc *cur = a->out + stride*j;
       stbi__uint16 *cur16 = (stbi__uint16*)cur;
 
-      for(i=0; i < x*y*out_n; ++i,cur16++,cur+=2) {
+      for(i=0; i < x*out_n; ++i,cur16++,cur+=2) {
          *cur16 = (cur[0] << 8) | cur[1];
       }
    }
+}
+
+// create the png data from post-deflated data
+static int stbi__create_png_image_raw(stbi__png *a, stbi_uc *raw, stbi__uint32 raw_len, int out_n, stbi__uint32 x, stbi__uint32 y, int depth, int color)
+{
+   int bytes = (depth == 16? 2 : 1);
+   stbi__context *s = a->s;
+   stbi__uint32 j;
+   stbi__uint32 img_len, img_width_bytes;
+   int img_n = s->img_n; // copy it into a local for later
+
+   int output_bytes = out_n*bytes;
+
+   STBI_ASSERT(out_n == s->img_n || out_n == s->img_n+1);
+   a->out = (stbi_uc *) stbi__malloc_mad3(x, y, output_bytes, 0); // extra bytes to write off the end into
+   if (!a->out) return stbi__err("outofmem", "Out of memory");
+
+   img_width_bytes = (((img_n * x * depth) + 7) >> 3);
+   img_len = (img_width_bytes + 1) * y;
+   if (s->img_x == x && s->img_y == y) {
+      if (raw_len != img_len) return stbi__err("not enough pixels","Corrupt PNG");
+   } else { // interlaced:
+      if (raw_len < img_len) return stbi__err("not enough pixels","Corrupt PNG");
+   }
+
+   for (j=0; j < y; ++j) {
+      if (!stbi__png_defilter_row(a, raw, j, out_n, x, depth)) return 0;
+      if (j) stbi__png_finish_row(a, j-1, out_n, x, depth, color);
+      raw += img_width_bytes + 1;
+   }
+   stbi__png_finish_row(a, y-1, out_n, x, depth, color);
+
+   return 1;
+}
+
+// state for defiltering scanlines while inflate is still producing them
+typedef struct
+{
+   stbi__png *a;
+   stbi_uc *raw;
+   stbi__uint32 row, row_bytes, x;
+   int out_n, depth, color;
+} stbi__png_rows;
+
+static int stbi__png_rows_sink(void *user, char *zout)
+{
+   stbi__png_rows *r = (stbi__png_rows *) user;
+   stbi__uint32 avail = (stbi__uint32) ((stbi_uc *) zout - r->raw) / r->row_bytes;
+   for (; r->row < avail; ++r->row) {
+      if (!stbi__png_defilter_row(r->a, r->raw + r->row*r->row_bytes, r->row, r->out_n, r->x, r->depth)) return 0;
+      if (r->row) stbi__png_finish_row(r->a, r->row-1, r->out_n, r->x, r->depth, r->color);
+   }
+   return 1;
+}
+
+// non-interlaced images: inflate into a buffer of exactly the image size and
+// defilter each window of scanlines as soon as inflate has written it, while
+// it is still in cache, instead of making a second pass over the whole image.
+// is_final says a->out needs no further conversion, so it may be the caller's
+// buffer
+static int stbi__create_png_image_streamed(stbi__png *a, stbi_uc *idata, stbi__uint32 idata_len, int parse_header, int out_n, int depth, int color, int is_final)
+{
+   int bytes = (depth == 16? 2 : 1);
+   stbi__context *s = a->s;
+   stbi__zbuf z;
+   stbi__png_rows r;
+
+   STBI_ASSERT(out_n == s->img_n || out_n == s->img_n+1);
+   r.a = a;
+   r.row = 0;
+   r.row_bytes = (((s->img_n * s->img_x * depth) + 7) >> 3) + 1;
+   r.x = s->img_x;
+   r.out_n = out_n;
+   r.depth = depth;
+   r.color = color;
+
+   a->expanded = (stbi_uc *) stbi__malloc_mad2(r.row_bytes, s->img_y, 0);
+   if (is_final)
+      a->out = (stbi_uc *) stbi__malloc_output_mad3(s, s->img_x, s->img_y, out_n, 0);
+   else
+      a->out = (stbi_uc *) stbi__malloc_mad3(s->img_x, s->img_y, out_n*bytes, 0);
+   if (!a->expanded || !a->out) return stbi__err("outofmem", "Out of memory");
+   r.raw = a->expanded;
+
+   z.zbuffer = idata;
+   z.zbuffer_end = idata + idata_len;
+   if (!stbi__do_zlib_sink(&z, (char *) a->expanded, r.row_bytes * s->img_y, parse_header, stbi__png_rows_sink, &r)) return 0;
+   if (z.zout != z.zout_limit) return stbi__err("not enough pixels","Corrupt PNG");
+   if (!stbi__png_rows_sink(&r, z.zout)) return 0;
+   stbi__png_finish_row(a, s->img_y-1, out_n, s->img_x, depth, color);
 
    return 1;
 }
@@ -4824,17 +5892,23 @@ static int stbi__parse_png_file(stbi__png *z, int scan, int req_comp)
             if (first) return stbi__err("first not IHDR", "Corrupt PNG");
             if (scan != STBI__SCAN_load) return 1;
             if (z->idata == NULL) return stbi__err("no IDAT","Corrupt PNG");
-            // initial guess for decoded data size to avoid unnecessary reallocs
-            bpl = (s->img_x * z->depth + 7) / 8; // bytes per line, per component
-            raw_len = bpl * s->img_y * s->img_n /* pixels */ + s->img_y /* filter mode per row */;
-            z->expanded = (stbi_uc *) stbi_zlib_decode_malloc_guesssize_headerflag((char *) z->idata, ioff, raw_len, (int *) &raw_len, !is_iphone);
-            if (z->expanded == NULL) return 0; // zlib should set error
-            STBI_FREE(z->idata); z->idata = NULL;
             if ((req_comp == s->img_n+1 && req_comp != 3 && !pal_img_n) || has_trans)
                s->img_out_n = s->img_n+1;
             else
                s->img_out_n = s->img_n;
-            if (!stbi__create_png_image(z, z->expanded, raw_len, s->img_out_n, z->depth, color, interlace)) return 0;
+            if (!interlace) {
+               int is_final = z->depth == 8 && !pal_img_n && s->img_out_n == (req_comp ? req_comp : s->img_n);
+               if (!stbi__create_png_image_streamed(z, z->idata, ioff, !is_iphone, s->img_out_n, z->depth, color, is_final)) return 0;
+               STBI_FREE(z->idata); z->idata = NULL;
+            } else {
+               // initial guess for decoded data size to avoid unnecessary reallocs
+               bpl = (s->img_x * z->depth + 7) / 8; // bytes per line, per component
+               raw_len = bpl * s->img_y * s->img_n /* pixels */ + s->img_y /* filter mode per row */;
+               z->expanded = (stbi_uc *) stbi_zlib_decode_malloc_guesssize_headerflag((char *) z->idata, ioff, raw_len, (int *) &raw_len, !is_iphone);
+               if (z->expanded == NULL) return 0; // zlib should set error
+               STBI_FREE(z->idata); z->idata = NULL;
+               if (!stbi__create_png_image(z, z->expanded, raw_len, s->img_out_n, z->depth, color, interlace)) return 0;
+            }
             if (has_trans) {
                if (z->depth == 16) {
                   if (!stbi__compute_transparency16(z, tc16, s->img_out_n)) return 0;
@@ -4901,7 +5975,7 @@ static void *stbi__do_png(stbi__png *p, int *x, int *y, int *n, int req_comp, st
       *y = p->s->img_y;
       if (n) *n = p->s->img_n;
    }
-   STBI_FREE(p->out);      p->out      = NULL;
+   stbi__free_output(p->s, p->out); p->out = NULL;
    STBI_FREE(p->expanded); p->expanded = NULL;
    STBI_FREE(p->idata);    p->idata    = NULL;
 
@@ -47,6 +47,15 @@ USAGE:
    where the callback is:
       void stbi_write_func(void *context, void *data, int size);
 
+   PNG rows are filtered and deflated in independent pieces, which can run
+   in parallel if you install a thread pool:
+
+     void stbi_write_set_parallel_for(stbi_write_parallel_for *func, void *user);
+
+   Images larger than a few hundred KB are compressed as several deflate
+   blocks that don't reference each other, so the output depends only on
+   the image, not on how many threads encoded it.
+
    You can define STBI_WRITE_NO_STDIO to disable the file variant of these
    functions, so the library will not use stdio.h at all. However, this will
    also disable HDR writing, because it requires stdio for formatted output.
@@ -140,6 +149,14 @@ STBIWDEF int stbi_write_bmp_to_func(stbi_write_func *func, void *context, int w,
 STBIWDEF int stbi_write_tga_to_func(stbi_write_func *func, void *context, int w, int h, int comp, const void  *data);
 STBIWDEF int stbi_write_hdr_to_func(stbi_write_func *func, void *context, int w, int h, int comp, const float *data);
 
+// PNG filtering and deflate are split into independent tasks; by default
+// they run one after another, install a parallel_for to spread them over
+// a thread pool. func must run task(arg,i) for every i in [0,count) and
+// return once they have all finished.
+typedef void stbi_write_parallel_for(void *user, int count, void (*task)(void *arg, int index), void *arg);
+
+STBIWDEF void stbi_write_set_parallel_for(stbi_write_parallel_for *func, void *user);
+
 #ifdef __cplusplus
 }
 #endif
@@ -197,6 +214,40 @@ STBIWDEF int stbi_write_hdr_to_func(stbi_write_func *func, void *context, int w,
 
 #define STBIW_UCHAR(x) (unsigned char) ((x) & 0xff)
 
+#if !defined(STBIW_NO_SIMD) && (defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2))
+#define STBIW_SSE2
+#include <emmintrin.h>
+#endif
+
+// match lengths are found 8 bytes at a time where the first differing
+// byte can be located with a count-trailing-zeros
+#if (defined(__GNUC__) || defined(__clang__)) && defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#define STBIW_CTZ64(x) __builtin_ctzll(x)
+#elif defined(_MSC_VER) && (defined(_M_X64) || defined(_M_ARM64))
+#include <intrin.h>
+static int stbiw__ctz64(unsigned __int64 x) { unsigned long i; _BitScanForward64(&i, x); return (int) i; }
+#define STBIW_CTZ64(x) stbiw__ctz64(x)
+#endif
+
+static stbi_write_parallel_for *stbiw__parallel_for = NULL;
+static void *stbiw__parallel_for_user = NULL;
+
+STBIWDEF void stbi_write_set_parallel_for(stbi_write_parallel_for *func, void *user)
+{
+   stbiw__parallel_for = func;
+   stbiw__parallel_for_user = user;
+}
+
+static void stbiw__run_tasks(int count, void (*task)(void *arg, int index), void *arg)
+{
+   int i;
+   if (stbiw__parallel_for && count > 1)
+      stbiw__parallel_for(stbiw__parallel_for_user, count, task, arg);
+   else
+      for (i=0; i < count; ++i)
+         task(arg, i);
+}
+
 typedef struct
 {
    stbi_write_func *func;
@@ -646,56 +697,19 @@ int stbi_write_hdr(char const *filename, int x, int y, int comp, const float *da
 // PNG writer
 //
 
-// stretchy buffer; stbiw__sbpush() == vector<>::push_back() -- stbiw__sbcount() == vector<>::size()
-#define stbiw__sbraw(a) ((int *) (a) - 2)
-#define stbiw__sbm(a)   stbiw__sbraw(a)[0]
-#define stbiw__sbn(a)   stbiw__sbraw(a)[1]
-
-#define stbiw__sbneedgrow(a,n)  ((a)==0 || stbiw__sbn(a)+n >= stbiw__sbm(a))
-#define stbiw__sbmaybegrow(a,n) (stbiw__sbneedgrow(a,(n)) ? stbiw__sbgrow(a,n) : 0)
-#define stbiw__sbgrow(a,n)  stbiw__sbgrowf((void **) &(a), (n), sizeof(*(a)))
-
-#define stbiw__sbpush(a, v)      (stbiw__sbmaybegrow(a,1), (a)[stbiw__sbn(a)++] = (v))
-#define stbiw__sbcount(a)        ((a) ? stbiw__sbn(a) : 0)
-#define stbiw__sbfree(a)         ((a) ? STBIW_FREE(stbiw__sbraw(a)),0 : 0)
-
-static void *stbiw__sbgrowf(void **arr, int increment, int itemsize)
-{
-   int m = *arr ? 2*stbiw__sbm(*arr)+increment : increment+1;
-   void *p = STBIW_REALLOC_SIZED(*arr ? stbiw__sbraw(*arr) : 0, *arr ? (stbiw__sbm(*arr)*itemsize + sizeof(int)*2) : 0, itemsize * m + sizeof(int)*2);
-   STBIW_ASSERT(p);
-   if (p) {
-      if (!*arr) ((int *) p)[1] = 0;
-      *arr = (void *) ((int *) p + 2);
-      stbiw__sbm(*arr) = m;
-   }
-   return *arr;
-}
-
-static unsigned char *stbiw__zlib_flushf(unsigned char *data, unsigned int *bitbuffer, int *bitcount)
-{
-   while (*bitcount >= 8) {
-      stbiw__sbpush(data, STBIW_UCHAR(*bitbuffer));
-      *bitbuffer >>= 8;
-      *bitcount -= 8;
-   }
-   return data;
-}
-
-static int stbiw__zlib_bitrev(int code, int codebits)
-{
-   int res=0;
-   while (codebits--) {
-      res = (res << 1) | (code & 1);
-      code >>= 1;
-   }
-   return res;
-}
-
 static unsigned int stbiw__zlib_countm(unsigned char *a, unsigned char *b, int limit)
 {
-   int i;
-   for (i=0; i < limit && i < 258; ++i)
+   int i=0;
+   if (limit > 258) limit = 258;
+#ifdef STBIW_CTZ64
+   for (; i+8 <= limit; i += 8) {
+      unsigned long long x,y;
+      memcpy(&x, a+i, 8);
+      memcpy(&y, b+i, 8);
+      if (x != y) return i + (STBIW_CTZ64(x ^ y) >> 3);
+   }
+#endif
+   for (; i < limit; ++i)
       if (a[i] != b[i]) break;
    return i;
 }
@@ -712,123 +726,252 @@ static unsigned int stbiw__zhash(unsigned char *data)
    return hash;
 }
 
-#define stbiw__zlib_flush() (out = stbiw__zlib_flushf(out, &bitbuf, &bitcount))
+static int stbiw__zlib_bitrev(int code, int codebits)
+{
+   code = ((code & 0xaaaa) >> 1) | ((code & 0x5555) << 1);
+   code = ((code & 0xcccc) >> 2) | ((code & 0x3333) << 2);
+   code = ((code & 0xf0f0) >> 4) | ((code & 0x0f0f) << 4);
+   code = ((code & 0xff00) >> 8) | ((code & 0x00ff) << 8);
+   return code >> (16 - codebits);
+}
+
+static unsigned int stbiw__adler32(unsigned char *data, int data_len)
+{
+   unsigned int s1=1, s2=0;
+   int i, j=0, blocklen = (int) (data_len % 5552);
+   while (j < data_len) {
+      for (i=0; i < blocklen; ++i) s1 += data[j+i], s2 += s1;
+      s1 %= 65521, s2 %= 65521;
+      j += blocklen;
+      blocklen = 5552;
+   }
+   return (s2 << 16) | s1;
+}
+
+// adler32 of two concatenated pieces, from their own checksums (as zlib's adler32_combine)
+static unsigned int stbiw__adler32_combine(unsigned int adler1, unsigned int adler2, int len2)
+{
+   unsigned int rem = (unsigned int) len2 % 65521;
+   unsigned int sum1 = adler1 & 0xffff;
+   unsigned int sum2 = (rem * sum1) % 65521;
+   sum1 += (adler2 & 0xffff) + 65521 - 1;
+   sum2 += (adler1 >> 16) + (adler2 >> 16) + 65521 - rem;
+   if (sum1 >= 65521) sum1 -= 65521;
+   if (sum1 >= 65521) sum1 -= 65521;
+   if (sum2 >= 65521*2) sum2 -= 65521*2;
+   if (sum2 >= 65521) sum2 -= 65521;
+   return (sum2 << 16) | sum1;
+}
+
+// codes go out through a 64-bit accumulator, 32 bits at a time; no single
+// add is wider than 16 bits so it never overflows
 #define stbiw__zlib_add(code,codebits) \
-      (bitbuf |= (code) << bitcount, bitcount += (codebits), stbiw__zlib_flush())
-#define stbiw__zlib_huffa(b,c)  stbiw__zlib_add(stbiw__zlib_bitrev(b,c),c)
-// default huffman tables
-#define stbiw__zlib_huff1(n)  stbiw__zlib_huffa(0x30 + (n), 8)
-#define stbiw__zlib_huff2(n)  stbiw__zlib_huffa(0x190 + (n)-144, 9)
-#define stbiw__zlib_huff3(n)  stbiw__zlib_huffa(0 + (n)-256,7)
-#define stbiw__zlib_huff4(n)  stbiw__zlib_huffa(0xc0 + (n)-280,8)
-#define stbiw__zlib_huff(n)  ((n) <= 143 ? stbiw__zlib_huff1(n) : (n) <= 255 ? stbiw__zlib_huff2(n) : (n) <= 279 ? stbiw__zlib_huff3(n) : stbiw__zlib_huff4(n))
-#define stbiw__zlib_huffb(n) ((n) <= 143 ? stbiw__zlib_huff1(n) : stbiw__zlib_huff2(n))
+      (bitbuf |= (unsigned long long) (code) << bitcount, bitcount += (codebits), \
+       bitcount >= 32 ? (out[0] = STBIW_UCHAR(bitbuf), out[1] = STBIW_UCHAR(bitbuf >> 8), \
+                         out[2] = STBIW_UCHAR(bitbuf >> 16), out[3] = STBIW_UCHAR(bitbuf >> 24), \
+                         out += 4, bitbuf >>= 32, bitcount -= 32) : 0)
+#define stbiw__zlib_huff(n)  stbiw__zlib_add(litcode[n], litbits[n])
 
 #define stbiw__ZHASH   16384
 
-unsigned char * stbi_zlib_compress(unsigned char *data, int data_len, int *out_len, int quality)
+// data above this size is deflated as independent pieces of this size
+#define stbiw__ZSEGMENT   (256*1024)
+
+typedef struct
+{
+   unsigned char *data;
+   int start, end;
+   int quality;
+   int last;
+   unsigned char *out;
+   int out_len;
+   unsigned int adler;
+} stbiw__zlib_segment;
+
+// deflates data[start,end) as a fixed-huffman block that only refers back
+// inside the piece; every piece but the last ends in an empty stored block,
+// which byte-aligns it so the pieces can simply be concatenated
+static void stbiw__zlib_compress_segment(void *arg, int index)
 {
    static unsigned short lengthc[] = { 3,4,5,6,7,8,9,10,11,13,15,17,19,23,27,31,35,43,51,59,67,83,99,115,131,163,195,227,258, 259 };
    static unsigned char  lengtheb[]= { 0,0,0,0,0,0,0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4,  4,  5,  5,  5,  5,  0 };
    static unsigned short distc[]   = { 1,2,3,4,5,7,9,13,17,25,33,49,65,97,129,193,257,385,513,769,1025,1537,2049,3073,4097,6145,8193,12289,16385,24577, 32768 };
    static unsigned char  disteb[]  = { 0,0,0,0,1,1,2,2,3,3,4,4,5,5,6,6,7,7,8,8,9,9,10,10,11,11,12,12,13,13 };
-   unsigned int bitbuf=0;
-   int i,j, bitcount=0;
-   unsigned char *out = NULL;
-   unsigned char ***hash_table = (unsigned char***) STBIW_MALLOC(stbiw__ZHASH * sizeof(char**));
-   if (quality < 5) quality = 5;
+   stbiw__zlib_segment *seg = (stbiw__zlib_segment *) arg + index;
+   unsigned char *data = seg->data;
+   int data_len = seg->end;
+   int quality = seg->quality;
+   unsigned short litcode[288], distcode[30];
+   unsigned char litbits[288], lengthsym[259], distsym[512];
+   unsigned long long bitbuf=0;
+   int i,j,bitcount=0;
+   unsigned char *out, *out_start;
+   int *chain, *chain_len;
+
+   seg->out = NULL;
+   seg->adler = stbiw__adler32(data + seg->start, seg->end - seg->start);
+
+   // literals and lengths need at most 9 bits each, a stored-block trailer and padding a few bytes more
+   out_start = out = (unsigned char *) STBIW_MALLOC((seg->end - seg->start) + (seg->end - seg->start) / 8 + 16);
+   chain = (int *) STBIW_MALLOC(stbiw__ZHASH * 2 * quality * sizeof(int));
+   chain_len = (int *) STBIW_MALLOC(stbiw__ZHASH * sizeof(int));
+   if (!out || !chain || !chain_len) {
+      STBIW_FREE(out); STBIW_FREE(chain); STBIW_FREE(chain_len);
+      return;
+   }
+   memset(chain_len, 0, stbiw__ZHASH * sizeof(int));
+
+   // the fixed huffman tables, bit-reversed for the LSB-first stream
+   for (i=0; i < 288; ++i) {
+      if (i <= 143)      litcode[i] = (unsigned short) stbiw__zlib_bitrev(0x30 + i, 8), litbits[i] = 8;
+      else if (i <= 255) litcode[i] = (unsigned short) stbiw__zlib_bitrev(0x190 + i-144, 9), litbits[i] = 9;
+      else if (i <= 279) litcode[i] = (unsigned short) stbiw__zlib_bitrev(i-256, 7), litbits[i] = 7;
+      else               litcode[i] = (unsigned short) stbiw__zlib_bitrev(0xc0 + i-280, 8), litbits[i] = 8;
+   }
+   for (i=0; i < 30; ++i)
+      distcode[i] = (unsigned short) stbiw__zlib_bitrev(i, 5);
+   for (i=3, j=0; i <= 258; ++i) {
+      while (i > lengthc[j+1]-1) ++j;
+      lengthsym[i] = (unsigned char) j;
+   }
+   // distances up to 256 directly, longer ones by (d-1)>>7
+   for (i=1, j=0; i <= 256; ++i) {
+      while (i > distc[j+1]-1) ++j;
+      distsym[i-1] = (unsigned char) j;
+   }
+   for (i=256, j=0; i < 512; ++i) {
+      int d = ((i-256) << 7) + 1;
+      while (d > distc[j+1]-1) ++j;
+      distsym[i] = (unsigned char) j;
+   }
 
-   stbiw__sbpush(out, 0x78);   // DEFLATE 32K window
-   stbiw__sbpush(out, 0x5e);   // FLEVEL = 1
-   stbiw__zlib_add(1,1);  // BFINAL = 1
+   stbiw__zlib_add(seg->last ? 1 : 0,1);  // BFINAL
    stbiw__zlib_add(1,2);  // BTYPE = 1 -- fixed huffman
 
-   for (i=0; i < stbiw__ZHASH; ++i)
-      hash_table[i] = NULL;
-
-   i=0;
+   i=seg->start;
    while (i < data_len-3) {
       // hash next 3 bytes of data to be compressed
       int h = stbiw__zhash(data+i)&(stbiw__ZHASH-1), best=3;
-      unsigned char *bestloc = 0;
-      unsigned char **hlist = hash_table[h];
-      int n = stbiw__sbcount(hlist);
+      int bestloc = -1;
+      int *hlist = chain + h * 2 * quality;
+      int n = chain_len[h];
       for (j=0; j < n; ++j) {
-         if (hlist[j]-data > i-32768) { // if entry lies within window
-            int d = stbiw__zlib_countm(hlist[j], data+i, data_len-i);
+         if (hlist[j] > i-32768) { // if entry lies within window
+            int d = stbiw__zlib_countm(data+hlist[j], data+i, data_len-i);
             if (d >= best) best=d,bestloc=hlist[j];
          }
       }
       // when hash table entry is too long, delete half the entries
-      if (hash_table[h] && stbiw__sbn(hash_table[h]) == 2*quality) {
-         STBIW_MEMMOVE(hash_table[h], hash_table[h]+quality, sizeof(hash_table[h][0])*quality);
-         stbiw__sbn(hash_table[h]) = quality;
+      if (n == 2*quality) {
+         STBIW_MEMMOVE(hlist, hlist+quality, sizeof(hlist[0])*quality);
+         chain_len[h] = n = quality;
       }
-      stbiw__sbpush(hash_table[h],data+i);
+      hlist[chain_len[h]++] = i;
 
-      if (bestloc) {
+      if (bestloc >= 0) {
          // "lazy matching" - check match at *next* byte, and if it's better, do cur byte as literal
          h = stbiw__zhash(data+i+1)&(stbiw__ZHASH-1);
-         hlist = hash_table[h];
-         n = stbiw__sbcount(hlist);
+         hlist = chain + h * 2 * quality;
+         n = chain_len[h];
          for (j=0; j < n; ++j) {
-            if (hlist[j]-data > i-32767) {
-               int e = stbiw__zlib_countm(hlist[j], data+i+1, data_len-i-1);
+            if (hlist[j] > i-32767) {
+               int e = stbiw__zlib_countm(data+hlist[j], data+i+1, data_len-i-1);
                if (e > best) { // if next match is better, bail on current match
-                  bestloc = NULL;
+                  bestloc = -1;
                   break;
                }
             }
          }
       }
 
-      if (bestloc) {
-         int d = (int) (data+i - bestloc); // distance back
+      if (bestloc >= 0) {
+         int d = i - bestloc; // distance back
          STBIW_ASSERT(d <= 32767 && best <= 258);
-         for (j=0; best > lengthc[j+1]-1; ++j);
+         j = lengthsym[best];
          stbiw__zlib_huff(j+257);
          if (lengtheb[j]) stbiw__zlib_add(best - lengthc[j], lengtheb[j]);
-         for (j=0; d > distc[j+1]-1; ++j);
-         stbiw__zlib_add(stbiw__zlib_bitrev(j,5),5);
+         j = d <= 256 ? distsym[d-1] : distsym[256 + ((d-1) >> 7)];
+         stbiw__zlib_add(distcode[j],5);
          if (disteb[j]) stbiw__zlib_add(d - distc[j], disteb[j]);
          i += best;
       } else {
-         stbiw__zlib_huffb(data[i]);
+         stbiw__zlib_huff(data[i]);
          ++i;
       }
    }
    // write out final bytes
    for (;i < data_len; ++i)
-      stbiw__zlib_huffb(data[i]);
+      stbiw__zlib_huff(data[i]);
    stbiw__zlib_huff(256); // end of block
+   if (!seg->last) {
+      // empty stored block: BFINAL = 0, BTYPE = 0, pad, LEN = 0, NLEN = ~0
+      stbiw__zlib_add(0,3);
+      if (bitcount & 7) stbiw__zlib_add(0, 8 - (bitcount & 7));
+      stbiw__zlib_add(0,16);
+      stbiw__zlib_add(0xffff,16);
+   }
    // pad with 0 bits to byte boundary
-   while (bitcount)
-      stbiw__zlib_add(0,1);
+   if (bitcount & 7) stbiw__zlib_add(0, 8 - (bitcount & 7));
+   while (bitcount) {
+      *out++ = STBIW_UCHAR(bitbuf);
+      bitbuf >>= 8;
+      bitcount -= 8;
+   }
 
-   for (i=0; i < stbiw__ZHASH; ++i)
-      (void) stbiw__sbfree(hash_table[i]);
-   STBIW_FREE(hash_table);
+   STBIW_FREE(chain);
+   STBIW_FREE(chain_len);
+   seg->out = out_start;
+   seg->out_len = (int) (out - out_start);
+}
 
-   {
-      // compute adler32 on input
-      unsigned int s1=1, s2=0;
-      int blocklen = (int) (data_len % 5552);
-      j=0;
-      while (j < data_len) {
-         for (i=0; i < blocklen; ++i) s1 += data[j+i], s2 += s1;
-         s1 %= 65521, s2 %= 65521;
-         j += blocklen;
-         blocklen = 5552;
+unsigned char * stbi_zlib_compress(unsigned char *data, int data_len, int *out_len, int quality)
+{
+   stbiw__zlib_segment *segs;
+   unsigned char *out = NULL, *o;
+   unsigned int adler = 1;
+   int i, count, total = 2+4;
+   if (quality < 5) quality = 5;
+
+   count = data_len >= 2*stbiw__ZSEGMENT ? (data_len + stbiw__ZSEGMENT-1) / stbiw__ZSEGMENT : 1;
+   segs = (stbiw__zlib_segment *) STBIW_MALLOC(count * sizeof(stbiw__zlib_segment));
+   if (!segs) return NULL;
+   for (i=0; i < count; ++i) {
+      segs[i].data = data;
+      segs[i].start = count == 1 ? 0 : i * stbiw__ZSEGMENT;
+      segs[i].end = i == count-1 ? data_len : (i+1) * stbiw__ZSEGMENT;
+      segs[i].quality = quality;
+      segs[i].last = i == count-1;
+   }
+
+   stbiw__run_tasks(count, stbiw__zlib_compress_segment, segs);
+
+   for (i=0; i < count; ++i) {
+      if (!segs[i].out) break;
+      total += segs[i].out_len;
+   }
+   if (i == count)
+      out = (unsigned char *) STBIW_MALLOC(total);
+
+   if (out) {
+      o = out;
+      *o++ = 0x78;   // DEFLATE 32K window
+      *o++ = 0x5e;   // FLEVEL = 1
+      for (i=0; i < count; ++i) {
+         memcpy(o, segs[i].out, segs[i].out_len);
+         o += segs[i].out_len;
+         adler = i == 0 ? segs[i].adler : stbiw__adler32_combine(adler, segs[i].adler, segs[i].end - segs[i].start);
       }
-      stbiw__sbpush(out, STBIW_UCHAR(s2 >> 8));
-      stbiw__sbpush(out, STBIW_UCHAR(s2));
-      stbiw__sbpush(out, STBIW_UCHAR(s1 >> 8));
-      stbiw__sbpush(out, STBIW_UCHAR(s1));
+      *o++ = STBIW_UCHAR(adler >> 24);
+      *o++ = STBIW_UCHAR(adler >> 16);
+      *o++ = STBIW_UCHAR(adler >> 8);
+      *o++ = STBIW_UCHAR(adler);
+      *out_len = total;
    }
-   *out_len = stbiw__sbn(out);
-   // make returned pointer freeable
-   STBIW_MEMMOVE(stbiw__sbraw(out), out, *out_len);
-   return (unsigned char *) stbiw__sbraw(out);
+
+   for (i=0; i < count; ++i)
+      STBIW_FREE(segs[i].out);
+   STBIW_FREE(segs);
+   return out;
 }
 
 static unsigned int stbiw__crc32(unsigned char *buffer, int len)
@@ -894,61 +1037,160 @@ static unsigned char stbiw__paeth(int a, int b, int c)
    return STBIW_UCHAR(c);
 }
 
-// @OPTIMIZE: provide an option that always forces left-predict or paeth predict
+#ifdef STBIW_SSE2
+static __m128i stbiw__paeth_sse2(__m128i a, __m128i b, __m128i c)
+{
+   // a, b, c are 16-bit lanes holding bytes; same tie-breaking as stbiw__paeth
+   __m128i zero = _mm_setzero_si128();
+   __m128i pa = _mm_sub_epi16(b, c);
+   __m128i pb = _mm_sub_epi16(a, c);
+   __m128i pc = _mm_add_epi16(pa, pb);
+   __m128i not_a, not_b, bc;
+   pa = _mm_max_epi16(pa, _mm_sub_epi16(zero, pa));
+   pb = _mm_max_epi16(pb, _mm_sub_epi16(zero, pb));
+   pc = _mm_max_epi16(pc, _mm_sub_epi16(zero, pc));
+   not_a = _mm_or_si128(_mm_cmpgt_epi16(pa, pb), _mm_cmpgt_epi16(pa, pc));
+   not_b = _mm_cmpgt_epi16(pb, pc);
+   bc = _mm_or_si128(_mm_and_si128(not_b, c), _mm_andnot_si128(not_b, b));
+   return _mm_or_si128(_mm_and_si128(not_a, bc), _mm_andnot_si128(not_a, a));
+}
+#endif
+
+// filters one row with the given type into line_buffer, returns the sum of
+// the absolute values of the filtered bytes (as signed) the row is scored by
+static int stbiw__png_filter_row(unsigned char *z, int stride_bytes, int width_bytes, int n, int type, unsigned char *line_buffer)
+{
+   unsigned char *u = z - stride_bytes;
+   int i, est = 0;
+   for (i=0; i < n; ++i) {
+      switch (type) {
+         case 0: line_buffer[i] = z[i]; break;
+         case 1: line_buffer[i] = z[i]; break;
+         case 2: line_buffer[i] = STBIW_UCHAR(z[i] - u[i]); break;
+         case 3: line_buffer[i] = STBIW_UCHAR(z[i] - (u[i]>>1)); break;
+         case 4: line_buffer[i] = STBIW_UCHAR(z[i] - stbiw__paeth(0,u[i],0)); break;
+         case 5: line_buffer[i] = z[i]; break;
+         case 6: line_buffer[i] = z[i]; break;
+      }
+   }
+#ifdef STBIW_SSE2
+   if (type == 0) {
+      memcpy(line_buffer + i, z + i, width_bytes - i);
+      i = width_bytes;
+   }
+   for (; i+16 <= width_bytes; i += 16) {
+      __m128i cur = _mm_loadu_si128((__m128i *) (z+i));
+      __m128i a = _mm_loadu_si128((__m128i *) (z+i-n)), b, pred;
+      switch (type) {
+         case 1: case 6: pred = a; break;
+         case 2: pred = _mm_loadu_si128((__m128i *) (u+i)); break;
+         case 3:
+            b = _mm_loadu_si128((__m128i *) (u+i));
+            // avg_epu8 rounds up, the filter rounds down
+            pred = _mm_sub_epi8(_mm_avg_epu8(a, b), _mm_and_si128(_mm_xor_si128(a, b), _mm_set1_epi8(1)));
+            break;
+         case 4: {
+            __m128i zero = _mm_setzero_si128();
+            __m128i c = _mm_loadu_si128((__m128i *) (u+i-n));
+            b = _mm_loadu_si128((__m128i *) (u+i));
+            pred = _mm_packus_epi16(
+               stbiw__paeth_sse2(_mm_unpacklo_epi8(a, zero), _mm_unpacklo_epi8(b, zero), _mm_unpacklo_epi8(c, zero)),
+               stbiw__paeth_sse2(_mm_unpackhi_epi8(a, zero), _mm_unpackhi_epi8(b, zero), _mm_unpackhi_epi8(c, zero)));
+            break;
+         }
+         default: pred = _mm_and_si128(_mm_srli_epi16(a, 1), _mm_set1_epi8(0x7f)); break; // 5
+      }
+      _mm_storeu_si128((__m128i *) (line_buffer+i), _mm_sub_epi8(cur, pred));
+   }
+#endif
+   for (; i < width_bytes; ++i) {
+      switch (type) {
+         case 0: line_buffer[i] = z[i]; break;
+         case 1: line_buffer[i] = STBIW_UCHAR(z[i] - z[i-n]); break;
+         case 2: line_buffer[i] = STBIW_UCHAR(z[i] - u[i]); break;
+         case 3: line_buffer[i] = STBIW_UCHAR(z[i] - ((z[i-n] + u[i])>>1)); break;
+         case 4: line_buffer[i] = STBIW_UCHAR(z[i] - stbiw__paeth(z[i-n], u[i], u[i-n])); break;
+         case 5: line_buffer[i] = STBIW_UCHAR(z[i] - (z[i-n]>>1)); break;
+         case 6: line_buffer[i] = STBIW_UCHAR(z[i] - stbiw__paeth(z[i-n], 0,0)); break;
+      }
+   }
+
+   i = 0;
+#ifdef STBIW_SSE2
+   {
+      __m128i zero = _mm_setzero_si128(), sum = zero;
+      for (; i+16 <= width_bytes; i += 16) {
+         __m128i v = _mm_loadu_si128((__m128i *) (line_buffer+i));
+         __m128i neg = _mm_cmpgt_epi8(zero, v);
+         // |v| of a signed byte fits an unsigned one, even for -128
+         sum = _mm_add_epi64(sum, _mm_sad_epu8(_mm_sub_epi8(_mm_xor_si128(v, neg), neg), zero));
+      }
+      est = _mm_cvtsi128_si32(sum) + _mm_cvtsi128_si32(_mm_srli_si128(sum, 8));
+   }
+#endif
+   for (; i < width_bytes; ++i)
+      est += abs((signed char) line_buffer[i]);
+   return est;
+}
+
+typedef struct
+{
+   unsigned char *pixels;
+   int stride_bytes, x, y, n;
+   unsigned char *filt;
+   int failed;
+} stbiw__png_filter_job;
+
+#define stbiw__PNG_FILTER_ROWS 32
+
+static void stbiw__png_filter_rows(void *arg, int index)
+{
+   static int mapping[] = { 0,1,2,3,4 };
+   static int firstmap[] = { 0,1,0,5,6 };
+   stbiw__png_filter_job *job = (stbiw__png_filter_job *) arg;
+   int width_bytes = job->x * job->n;
+   int j, k, j1 = (index+1) * stbiw__PNG_FILTER_ROWS;
+   unsigned char *line_buffer = (unsigned char *) STBIW_MALLOC(width_bytes * 5);
+   if (!line_buffer) { job->failed = 1; return; }
+   if (j1 > job->y) j1 = job->y;
+
+   for (j=index * stbiw__PNG_FILTER_ROWS; j < j1; ++j) {
+      int *mymap = (j != 0) ? mapping : firstmap;
+      int best = 0, bestval = 0x7fffffff;
+      unsigned char *z = job->pixels + job->stride_bytes*j;
+      // every filter lands in its own buffer, so the winner needn't be redone
+      for (k=0; k < 5; ++k) {
+         int est = stbiw__png_filter_row(z, job->stride_bytes, width_bytes, job->n, mymap[k], line_buffer + k*width_bytes);
+         if (est < bestval) { bestval = est; best = k; }
+      }
+      // when we get here, best contains the filter type
+      job->filt[j*(width_bytes+1)] = (unsigned char) best;
+      STBIW_MEMMOVE(job->filt+j*(width_bytes+1)+1, line_buffer + best*width_bytes, width_bytes);
+   }
+   STBIW_FREE(line_buffer);
+}
+
 unsigned char *stbi_write_png_to_mem(unsigned char *pixels, int stride_bytes, int x, int y, int n, int *out_len)
 {
    int ctype[5] = { -1, 0, 4, 2, 6 };
    unsigned char sig[8] = { 137,80,78,71,13,10,26,10 };
    unsigned char *out,*o, *filt, *zlib;
-   signed char *line_buffer;
-   int i,j,k,p,zlen;
+   stbiw__png_filter_job job;
+   int zlen;
 
    if (stride_bytes == 0)
       stride_bytes = x * n;
 
    filt = (unsigned char *) STBIW_MALLOC((x*n+1) * y); if (!filt) return 0;
-   line_buffer = (signed char *) STBIW_MALLOC(x * n); if (!line_buffer) { STBIW_FREE(filt); return 0; }
-   for (j=0; j < y; ++j) {
-      static int mapping[] = { 0,1,2,3,4 };
-      static int firstmap[] = { 0,1,0,5,6 };
-      int *mymap = (j != 0) ? mapping : firstmap;
-      int best = 0, bestval = 0x7fffffff;
-      for (p=0; p < 2; ++p) {
-         for (k= p?best:0; k < 5; ++k) { // @TODO: clarity: rewrite this to go 0..5, and 'continue' the unwanted ones during 2nd pass
-            int type = mymap[k],est=0;
-            unsigned char *z = pixels + stride_bytes*j;
-            for (i=0; i < n; ++i)
-               switch (type) {
-                  case 0: line_buffer[i] = z[i]; break;
-                  case 1: line_buffer[i] = z[i]; break;
-                  case 2: line_buffer[i] = z[i] - z[i-stride_bytes]; break;
-                  case 3: line_buffer[i] = z[i] - (z[i-stride_bytes]>>1); break;
-                  case 4: line_buffer[i] = (signed char) (z[i] - stbiw__paeth(0,z[i-stride_bytes],0)); break;
-                  case 5: line_buffer[i] = z[i]; break;
-                  case 6: line_buffer[i] = z[i]; break;
-               }
-            for (i=n; i < x*n; ++i) {
-               switch (type) {
-                  case 0: line_buffer[i] = z[i]; break;
-                  case 1: line_buffer[i] = z[i] - z[i-n]; break;
-                  case 2: line_buffer[i] = z[i] - z[i-stride_bytes]; break;
-                  case 3: line_buffer[i] = z[i] - ((z[i-n] + z[i-stride_bytes])>>1); break;
-                  case 4: line_buffer[i] = z[i] - stbiw__paeth(z[i-n], z[i-stride_bytes], z[i-stride_bytes-n]); break;
-                  case 5: line_buffer[i] = z[i] - (z[i-n]>>1); break;
-                  case 6: line_buffer[i] = z[i] - stbiw__paeth(z[i-n], 0,0); break;
-               }
-            }
-            if (p) break;
-            for (i=0; i < x*n; ++i)
-               est += abs((signed char) line_buffer[i]);
-            if (est < bestval) { bestval = est; best = k; }
-         }
-      }
-      // when we get here, best contains the filter type, and line_buffer contains the data
-      filt[j*(x*n+1)] = (unsigned char) best;
-      STBIW_MEMMOVE(filt+j*(x*n+1)+1, line_buffer, x*n);
-   }
-   STBIW_FREE(line_buffer);
+   job.pixels = pixels;
+   job.stride_bytes = stride_bytes;
+   job.x = x;
+   job.y = y;
+   job.n = n;
+   job.filt = filt;
+   job.failed = 0;
+   stbiw__run_tasks((y + stbiw__PNG_FILTER_ROWS-1) / stbiw__PNG_FILTER_ROWS, stbiw__png_filter_rows, &job);
+   if (job.failed) { STBIW_FREE(filt); return 0; }
    zlib = stbi_zlib_compress(filt, y*( x*n+1), &zlen, 8); // increase 8 to get smaller but use more memory
    STBIW_FREE(filt);
    if (!zlib) return 0;
@@ -57,6 +57,12 @@ public:
         return glm::lookAt( this->position, this->position + this->front, this->up );
     }
     
+    // Same, but seen from eye instead of the camera's own position, e.g. one interpolated between two simulation steps
+    glm::mat4 GetViewMatrix( const glm::vec3 &eye )
+    {
+        return glm::lookAt( eye, eye + this->front, this->up );
+    }
+    
     // Processes input received from any keyboard-like input system. Accepts input parameter in the form of camera defined ENUM (to abstract it from windowing systems)
     void ProcessKeyboard( Camera_Movement direction, GLfloat deltaTime )
     {
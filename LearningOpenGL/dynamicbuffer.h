@@ -0,0 +1,176 @@
+#pragma once
+
+// Std. Includes
+#include <iostream>
+#include <vector>
+#include <cstring>
+
+// GL Includes
+#define GLEW_STATIC
+#include <GL/glew.h>
+
+// Where Write put a block, for binding it to a uniform block binding point
+struct DynamicRange
+{
+    GLintptr offset;
+    GLsizeiptr size;
+};
+
+// Ring buffer for the uniform blocks that change every frame. It holds FRAME_COUNT regions of frameSize bytes, the
+// render thread writes one region while the GPU may still read the others, and a fence per region tells when it is
+// free again. Blocks are bump allocated and bound with glBindBufferRange, so no draw goes through glUniform*.
+// A frame writes all of its blocks first, then calls Upload once, then binds them. With
+// ARB_buffer_storage the buffer stays mapped, Write copies straight into it and Upload has nothing to do. Without it
+// (macOS stops at 4.1) Write gathers the frame in memory and Upload sends it with one glBufferSubData
+class DynamicBuffer
+{
+public:
+    static const GLuint FRAME_COUNT = 3;
+    
+    explicit DynamicBuffer( GLsizeiptr frameSize ) : frameSize( frameSize ), frame( 0 ), head( 0 ), uploaded( 0 ), mapped( NULL ), full( false )
+    {
+        GLint alignment = 0;
+        glGetIntegerv( GL_UNIFORM_BUFFER_OFFSET_ALIGNMENT, &alignment );
+        this->alignment = alignment > 0 ? alignment : 256;
+        
+        for ( GLuint i = 0; i < FRAME_COUNT; i++ )
+        {
+            this->fences[i] = NULL;
+        }
+        
+        glGenBuffers( 1, &this->buffer );
+        glBindBuffer( GL_UNIFORM_BUFFER, this->buffer );
+        
+        if ( GLEW_ARB_buffer_storage )
+        {
+            const GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+            
+            glBufferStorage( GL_UNIFORM_BUFFER, FRAME_COUNT * frameSize, NULL, flags );
+            this->mapped = ( GLubyte * )glMapBufferRange( GL_UNIFORM_BUFFER, 0, FRAME_COUNT * frameSize, flags );
+        }
+        else
+        {
+            glBufferData( GL_UNIFORM_BUFFER, FRAME_COUNT * frameSize, NULL, GL_STREAM_DRAW );
+            this->staging.resize( frameSize );
+        }
+        
+        glBindBuffer( GL_UNIFORM_BUFFER, 0 );
+    }
+    
+    ~DynamicBuffer( )
+    {
+        for ( GLuint i = 0; i < FRAME_COUNT; i++ )
+        {
+            glDeleteSync( this->fences[i] );
+        }
+        
+        // Deleting the buffer unmaps it
+        glDeleteBuffers( 1, &this->buffer );
+    }
+    
+    DynamicBuffer( const DynamicBuffer & ) = delete;
+    DynamicBuffer &operator=( const DynamicBuffer & ) = delete;
+    
+    // Starts writing the next region, first waiting for the GPU to finish the frame that used it FRAME_COUNT frames ago
+    void BeginFrame( )
+    {
+        GLsync &fence = this->fences[this->frame];
+        
+        if ( NULL != fence )
+        {
+            GLbitfield flags = 0;
+            
+            while ( GL_TIMEOUT_EXPIRED == glClientWaitSync( fence, flags, 1000000 ) )
+            {
+                // Only needs flushing once, to make sure the fence reaches the GPU at all
+                flags = GL_SYNC_FLUSH_COMMANDS_BIT;
+            }
+            
+            glDeleteSync( fence );
+            fence = NULL;
+        }
+        
+        this->head = 0;
+        this->uploaded = 0;
+    }
+    
+    // Fences the region after the frame's last draw
+    void EndFrame( )
+    {
+        this->fences[this->frame] = glFenceSync( GL_SYNC_GPU_COMMANDS_COMPLETE, 0 );
+        this->frame = ( this->frame + 1 ) % FRAME_COUNT;
+    }
+    
+    // Copies size bytes of data to the frame's region, at the next offset the GL accepts for a uniform block
+    DynamicRange Write( const void *data, GLsizeiptr size )
+    {
+        DynamicRange range = { 0, size };
+        GLsizeiptr start = ( this->head + this->alignment - 1 ) / this->alignment * this->alignment;
+        
+        if ( start + size > this->frameSize )
+        {
+            if ( !this->full )
+            {
+                std::cout << "WARNING::DYNAMIC_BUFFER::FRAME_FULL " << this->frameSize << " bytes are not enough for one frame" << std::endl;
+                this->full = true;
+            }
+            
+            // Starts over at the region's beginning. Draws reading the blocks written there show the wrong data, but
+            // nothing is written past the region or into one the GPU may still be reading
+            start = 0;
+            this->uploaded = 0;
+        }
+        
+        if ( NULL != this->mapped )
+        {
+            memcpy( this->mapped + this->frame * this->frameSize + start, data, size );
+        }
+        else
+        {
+            memcpy( &this->staging[start], data, size );
+        }
+        
+        this->head = start + size;
+        range.offset = this->frame * this->frameSize + start;
+        
+        return range;
+    }
+    
+    template<typename T>
+    DynamicRange Write( const T &data )
+    {
+        return this->Write( &data, sizeof( T ) );
+    }
+    
+    // Sends the blocks written since the last Upload to the GL, before the first draw that reads them. Blocks
+    // written after it only reach the GL with another Upload, which costs another glBufferSubData
+    void Upload( )
+    {
+        if ( NULL == this->mapped && this->uploaded < this->head )
+        {
+            glBindBuffer( GL_UNIFORM_BUFFER, this->buffer );
+            glBufferSubData( GL_UNIFORM_BUFFER, this->frame * this->frameSize + this->uploaded, this->head - this->uploaded, &this->staging[this->uploaded] );
+            glBindBuffer( GL_UNIFORM_BUFFER, 0 );
+        }
+        
+        this->uploaded = this->head;
+    }
+    
+    // Binds a block written and uploaded this frame to uniform block binding point binding
+    void Bind( GLuint binding, const DynamicRange &range )
+    {
+        glBindBufferRange( GL_UNIFORM_BUFFER, binding, this->buffer, range.offset, range.size );
+    }
+    
+private:
+    GLuint buffer;
+    GLsizeiptr frameSize;
+    GLsizeiptr alignment;
+    GLuint frame;                       // Region being written
+    GLsizeiptr head;                    // End of the last block in the region
+    GLsizeiptr uploaded;                // End of what Upload has sent so far
+    GLsync fences[FRAME_COUNT];
+    GLubyte *mapped;                    // The whole buffer, NULL without ARB_buffer_storage
+    std::vector<GLubyte> staging;       // The region being written, only without the mapping
+    bool full;
+};
@@ -0,0 +1,62 @@
+#pragma once
+
+// GL Includes
+#define GLEW_STATIC
+#include <GL/glew.h>
+
+// A GL query issued once per frame and read back a frame late, so asking for its result never stalls the pipeline
+class FrameQuery
+{
+public:
+    explicit FrameQuery( GLenum target ) : target( target ), frame( 0 ), result( 0 )
+    {
+        glGenQueries( QUERY_COUNT, this->queries );
+    }
+    
+    ~FrameQuery( )
+    {
+        glDeleteQueries( QUERY_COUNT, this->queries );
+    }
+    
+    FrameQuery( const FrameQuery & ) = delete;
+    FrameQuery &operator=( const FrameQuery & ) = delete;
+    
+    void Begin( )
+    {
+        glBeginQuery( this->target, this->queries[this->frame % QUERY_COUNT] );
+    }
+    
+    void End( )
+    {
+        glEndQuery( this->target );
+        this->frame++;
+        
+        // The next query to reuse is last frame's, pick up its result if the GPU is done with it
+        if ( this->frame >= QUERY_COUNT )
+        {
+            GLuint query = this->queries[this->frame % QUERY_COUNT];
+            GLint available = 0;
+            
+            glGetQueryObjectiv( query, GL_QUERY_RESULT_AVAILABLE, &available );
+            
+            if ( available )
+            {
+                glGetQueryObjectui64v( query, GL_QUERY_RESULT, &this->result );
+            }
+        }
+    }
+    
+    // Latest result that has come back
+    GLuint64 Result( ) const
+    {
+        return this->result;
+    }
+    
+private:
+    static const GLuint QUERY_COUNT = 2;
+    
+    GLenum target;
+    GLuint queries[QUERY_COUNT];
+    GLuint frame;
+    GLuint64 result;
+};
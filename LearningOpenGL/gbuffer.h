@@ -0,0 +1,116 @@
+#pragma once
+
+// Std. Includes
+#include <iostream>
+
+// GL Includes
+#define GLEW_STATIC
+#include <GL/glew.h>
+
+#include "shader.h"
+
+// Render targets of the deferred path, in the layout gbuffer.glsl reads and writes
+class GBuffer
+{
+public:
+    GBuffer( GLuint width, GLuint height ) : width( width ), height( height )
+    {
+        const GLenum formats[COLOR_COUNT] = { GL_RGBA8, GL_RGBA8, GL_RGBA16F };
+        const GLenum types[COLOR_COUNT] = { GL_UNSIGNED_BYTE, GL_UNSIGNED_BYTE, GL_FLOAT };
+        GLenum attachments[COLOR_COUNT];
+        
+        glGenFramebuffers( 1, &this->framebuffer );
+        glBindFramebuffer( GL_FRAMEBUFFER, this->framebuffer );
+        glGenTextures( TEXTURE_COUNT, this->textures );
+        
+        for ( GLuint i = 0; i < TEXTURE_COUNT; i++ )
+        {
+            glBindTexture( GL_TEXTURE_2D, this->textures[i] );
+            
+            if ( i < COLOR_COUNT )
+            {
+                glTexImage2D( GL_TEXTURE_2D, 0, formats[i], width, height, 0, GL_RGBA, types[i], NULL );
+                glFramebufferTexture2D( GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0 + i, GL_TEXTURE_2D, this->textures[i], 0 );
+                attachments[i] = GL_COLOR_ATTACHMENT0 + i;
+            }
+            else
+            {
+                // Same format as the default framebuffer's depth, so BlitDepth can copy it over
+                glTexImage2D( GL_TEXTURE_2D, 0, GL_DEPTH24_STENCIL8, width, height, 0, GL_DEPTH_STENCIL, GL_UNSIGNED_INT_24_8, NULL );
+                glFramebufferTexture2D( GL_FRAMEBUFFER, GL_DEPTH_STENCIL_ATTACHMENT, GL_TEXTURE_2D, this->textures[i], 0 );
+            }
+            
+            glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST );
+            glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST );
+        }
+        
+        glDrawBuffers( COLOR_COUNT, attachments );
+        
+        if ( GL_FRAMEBUFFER_COMPLETE != glCheckFramebufferStatus( GL_FRAMEBUFFER ) )
+        {
+            std::cout << "ERROR::GBUFFER::FRAMEBUFFER_INCOMPLETE" << std::endl;
+        }
+        
+        glBindTexture( GL_TEXTURE_2D, 0 );
+        glBindFramebuffer( GL_FRAMEBUFFER, 0 );
+    }
+    
+    ~GBuffer( )
+    {
+        glDeleteTextures( TEXTURE_COUNT, this->textures );
+        glDeleteFramebuffers( 1, &this->framebuffer );
+    }
+    
+    GBuffer( const GBuffer & ) = delete;
+    GBuffer &operator=( const GBuffer & ) = delete;
+    
+    // Makes the G-buffer the render target and clears it for the geometry pass
+    void Bind( )
+    {
+        glBindFramebuffer( GL_FRAMEBUFFER, this->framebuffer );
+        glClearColor( 0.0f, 0.0f, 0.0f, 0.0f );
+        glClear( GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT );
+    }
+    
+    // Binds the targets to texture units firstUnit to firstUnit + 3 as the shader's gAlbedo, gSpecular, gNormal and gDepth
+    void BindTextures( const Shader &shader, GLuint firstUnit ) const
+    {
+        const GLchar *samplers[TEXTURE_COUNT] = { "gAlbedo", "gSpecular", "gNormal", "gDepth" };
+        
+        for ( GLuint i = 0; i < TEXTURE_COUNT; i++ )
+        {
+            glActiveTexture( GL_TEXTURE0 + firstUnit + i );
+            glBindTexture( GL_TEXTURE_2D, this->textures[i] );
+            glUniform1i( glGetUniformLocation( shader.Program, samplers[i] ), firstUnit + i );
+        }
+        
+        glActiveTexture( GL_TEXTURE0 );
+    }
+    
+    void UnbindTextures( GLuint firstUnit ) const
+    {
+        for ( GLuint i = 0; i < TEXTURE_COUNT; i++ )
+        {
+            glActiveTexture( GL_TEXTURE0 + firstUnit + i );
+            glBindTexture( GL_TEXTURE_2D, 0 );
+        }
+        
+        glActiveTexture( GL_TEXTURE0 );
+    }
+    
+    // Copies the geometry pass depth into framebuffer target, so forward drawn objects are hidden behind it
+    void BlitDepth( GLuint target ) const
+    {
+        glBindFramebuffer( GL_READ_FRAMEBUFFER, this->framebuffer );
+        glBindFramebuffer( GL_DRAW_FRAMEBUFFER, target );
+        glBlitFramebuffer( 0, 0, this->width, this->height, 0, 0, this->width, this->height, GL_DEPTH_BUFFER_BIT, GL_NEAREST );
+        glBindFramebuffer( GL_FRAMEBUFFER, target );
+    }
+    
+private:
+    enum { COLOR_COUNT = 3, TEXTURE_COUNT = 4 };
+    
+    GLuint framebuffer;
+    GLuint textures[TEXTURE_COUNT];
+    GLuint width, height;
+};
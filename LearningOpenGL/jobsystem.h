@@ -0,0 +1,579 @@
+#pragma once
+
+// Std. Includes
+#include <iostream>
+#include <cstdio>
+#include <vector>
+#include <deque>
+#include <cmath>
+#include <memory>
+#include <functional>
+#include <algorithm>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <chrono>
+
+// GL Includes
+#define GLEW_STATIC
+#include <GL/glew.h>
+
+// Counts the jobs started with it that have not finished yet. Wait on it, or start jobs that need them done with RunAfter
+class JobCounter
+{
+public:
+    JobCounter( ) : pending( 0 )
+    {
+    }
+    
+    JobCounter( const JobCounter & ) = delete;
+    JobCounter &operator=( const JobCounter & ) = delete;
+    
+    bool Done( ) const
+    {
+        return 0 == this->pending.load( );
+    }
+    
+private:
+    friend class JobSystem;
+    
+    // A job started with RunAfter, and the slot of the thread that started it, where it is queued once this is done
+    struct Continuation
+    {
+        std::function<void( )> job;
+        JobCounter *counter;
+        GLuint slot;
+    };
+    
+    std::atomic<GLint> pending;
+    std::mutex lock;                    // Guards continuations, and is held while pending drops to zero
+    std::vector<Continuation> continuations;
+};
+
+// Work-stealing job scheduler. Every worker owns a deque: it pushes and pops its own jobs at the back, while idle
+// workers steal the oldest jobs from the front of the others. Threads calling in from outside (the main, render and
+// SOIL writer threads) each claim a caller slot with a deque of their own the first time they do. They only run jobs
+// from that deque, and only while they wait for some, so one caller waiting never runs another caller's jobs. Worker
+// threads steal from caller slots too. Nothing GL related may go into a job.
+class JobSystem
+{
+public:
+    typedef std::function<void( )> Job;
+    
+    // Caller slots, threads past this many share the last one
+    static const GLuint MAX_CALLERS = 8;
+    
+    struct WorkerStats
+    {
+        GLuint jobs;                    // Jobs run by the worker
+        GLuint steals;                  // Of those, taken from another worker's deque
+        GLdouble busySeconds;           // Time spent inside jobs
+        GLdouble utilization;           // busySeconds over the time since ResetStats
+    };
+    
+    // Starts threadCount worker threads, in slots [0, threadCount). The caller slots come after them
+    explicit JobSystem( GLuint threadCount ) : threadCount( threadCount ), slotCount( threadCount + MAX_CALLERS ), workers( new Worker[threadCount + MAX_CALLERS] ), queued( 0 ), sleeping( 0 ), quit( false ), tooManyCallers( false )
+    {
+        this->ResetStats( );
+        
+        for ( GLuint i = 0; i < this->slotCount; i++ )
+        {
+            this->workers[i].claimed = false;
+        }
+        
+        for ( GLuint i = 0; i < this->threadCount; i++ )
+        {
+            this->threads.push_back( std::thread( &JobSystem::WorkerLoop, this, i ) );
+        }
+    }
+    
+    ~JobSystem( )
+    {
+        // The destroying thread's slot would otherwise be released into freed memory when the thread exits
+        if ( this == CurrentSlot( ).system )
+        {
+            CurrentSlot( ) = ThreadSlot( );
+        }
+        
+        {
+            std::lock_guard<std::mutex> lock( this->sleepLock );
+            this->quit = true;
+        }
+        this->wake.notify_all( );
+        
+        for ( size_t i = 0; i < this->threads.size( ); i++ )
+        {
+            this->threads[i].join( );
+        }
+    }
+    
+    JobSystem( const JobSystem & ) = delete;
+    JobSystem &operator=( const JobSystem & ) = delete;
+    
+    // The shared scheduler, with one worker per core (the calling thread being one of them)
+    static JobSystem &Get( )
+    {
+        static JobSystem instance( std::max( 1u, std::thread::hardware_concurrency( ) ) - 1 );
+        
+        return instance;
+    }
+    
+    // Worker threads plus the calling thread, i.e. how many of one caller's jobs can run at once
+    GLuint WorkerCount( ) const
+    {
+        return this->threadCount + 1;
+    }
+    
+    // Has every worker thread call cleanup on its way out, for per-thread state the jobs leave behind
+    void AtWorkerExit( std::function<void( )> cleanup )
+    {
+        std::lock_guard<std::mutex> lock( this->sleepLock );
+        this->exitHandlers.push_back( std::move( cleanup ) );
+    }
+    
+    // Queues job on the calling thread's deque. counter, if given, stays above zero until the job has finished
+    void Run( Job job, JobCounter *counter = nullptr )
+    {
+        if ( nullptr != counter )
+        {
+            counter->pending++;
+        }
+        
+        this->Push( this->Self( ), Task( std::move( job ), counter ) );
+    }
+    
+    // Same as Run, but the job is only queued once every job started with dependency has finished. It goes to the
+    // calling thread's deque even when another thread finishes dependency, so a caller can always run it itself
+    void RunAfter( JobCounter &dependency, Job job, JobCounter *counter = nullptr )
+    {
+        GLuint self = this->Self( );
+        
+        if ( nullptr != counter )
+        {
+            counter->pending++;
+        }
+        
+        {
+            std::lock_guard<std::mutex> lock( dependency.lock );
+            
+            if ( dependency.pending.load( ) > 0 )
+            {
+                JobCounter::Continuation continuation = { std::move( job ), counter, self };
+                dependency.continuations.push_back( std::move( continuation ) );
+                return;
+            }
+        }
+        
+        this->Push( self, Task( std::move( job ), counter ) );
+    }
+    
+    // Runs queued jobs until every job started with counter has finished. Workers run their own first and then steal,
+    // callers only run the ones in their own deque
+    void Wait( JobCounter &counter )
+    {
+        GLuint self = this->Self( );
+        
+        while ( counter.pending.load( ) > 0 )
+        {
+            Task task;
+            
+            if ( this->Take( self, task ) )
+            {
+                this->Execute( self, task );
+            }
+            else
+            {
+                std::this_thread::yield( );
+            }
+        }
+        
+        // The job that finished last may still be on its way out of the counter's lock
+        std::lock_guard<std::mutex> lock( counter.lock );
+    }
+    
+    // Calls function( first, last ) over [begin, end) in chunks of at most grain and returns once all of them are done
+    template<typename Function>
+    void ParallelFor( GLuint begin, GLuint end, GLuint grain, const Function &function )
+    {
+        grain = std::max( grain, 1u );
+        
+        if ( end <= begin )
+        {
+            return;
+        }
+        
+        if ( end - begin <= grain )
+        {
+            function( begin, end );
+            return;
+        }
+        
+        // The chunks go on this worker's deque, it works through them from the back while the others steal from the front
+        JobCounter counter;
+        
+        for ( GLuint first = begin; first < end; first += std::min( grain, end - first ) )
+        {
+            GLuint last = first + std::min( grain, end - first );
+            
+            this->Run( [&function, first, last]( ) { function( first, last ); }, &counter );
+        }
+        
+        this->Wait( counter );
+    }
+    
+    // Per slot counters since the last ResetStats, the worker threads' first and then the callers'
+    std::vector<WorkerStats> Stats( ) const
+    {
+        GLdouble elapsed = std::chrono::duration<GLdouble>( Clock::now( ) - this->statsStart ).count( );
+        std::vector<WorkerStats> stats( this->slotCount );
+        
+        for ( GLuint i = 0; i < this->slotCount; i++ )
+        {
+            stats[i].jobs = this->workers[i].jobs.load( );
+            stats[i].steals = this->workers[i].steals.load( );
+            stats[i].busySeconds = this->workers[i].busyNanoseconds.load( ) * 1e-9;
+            stats[i].utilization = elapsed > 0.0 ? stats[i].busySeconds / elapsed : 0.0;
+        }
+        
+        return stats;
+    }
+    
+    void ResetStats( )
+    {
+        for ( GLuint i = 0; i < this->slotCount; i++ )
+        {
+            this->workers[i].jobs = 0;
+            this->workers[i].steals = 0;
+            this->workers[i].busyNanoseconds = 0;
+        }
+        
+        this->statsStart = Clock::now( );
+    }
+    
+    void PrintStats( ) const
+    {
+        std::vector<WorkerStats> stats = this->Stats( );
+        
+        for ( GLuint i = 0; i < stats.size( ); i++ )
+        {
+            // Caller slots that ran nothing are left out
+            if ( i >= this->threadCount && 0 == stats[i].jobs )
+            {
+                continue;
+            }
+            
+            printf( "JobSystem: %s %u: %u jobs, %u stolen, %.2f ms busy, %.1f%% utilization\n", i < this->threadCount ? "worker" : "caller", i < this->threadCount ? i : i - this->threadCount, stats[i].jobs, stats[i].steals, stats[i].busySeconds * 1000.0, stats[i].utilization * 100.0 );
+        }
+    }
+    
+    // Times the scheduler itself: the cost of an empty job, levels of dependent jobs, and a ParallelFor against the same loop run serially
+    void Benchmark( )
+    {
+        const GLuint EMPTY_JOBS = 100000;
+        const GLuint ITEMS = 1 << 22;
+        std::vector<GLfloat> items( ITEMS );
+        
+        printf( "JobSystem: benchmark on %u workers\n", this->WorkerCount( ) );
+        this->ResetStats( );
+        
+        Clock::time_point start = Clock::now( );
+        JobCounter empty;
+        
+        for ( GLuint i = 0; i < EMPTY_JOBS; i++ )
+        {
+            this->Run( []( ) { }, &empty );
+        }
+        
+        this->Wait( empty );
+        printf( "JobSystem:   %u empty jobs: %.3f us per job\n", EMPTY_JOBS, Seconds( start ) * 1e6 / EMPTY_JOBS );
+        
+        // Each level starts after the one before it, like loading a mesh before building its buffers
+        start = Clock::now( );
+        JobCounter levels[8];
+        std::atomic<GLuint> finished( 0 );
+        
+        for ( GLuint level = 0; level < 8; level++ )
+        {
+            for ( GLuint i = 0; i < 1000; i++ )
+            {
+                if ( 0 == level )
+                {
+                    this->Run( [&finished]( ) { finished++; }, &levels[level] );
+                }
+                else
+                {
+                    this->RunAfter( levels[level - 1], [&finished]( ) { finished++; }, &levels[level] );
+                }
+            }
+        }
+        
+        this->Wait( levels[7] );
+        printf( "JobSystem:   8 dependent levels of 1000 jobs: %.3f ms, %u run\n", Seconds( start ) * 1000.0, finished.load( ) );
+        
+        // Enough arithmetic per item that the loop is not bound by memory bandwidth
+        auto work = [&items]( GLuint first, GLuint last )
+        {
+            for ( GLuint i = first; i < last; i++ )
+            {
+                GLfloat x = ( GLfloat )i;
+                
+                for ( GLuint j = 0; j < 16; j++ )
+                {
+                    x = std::sqrt( x * 0.5f + 1.0f );
+                }
+                
+                items[i] = x;
+            }
+        };
+        
+        start = Clock::now( );
+        work( 0, ITEMS );
+        GLdouble serial = Seconds( start );
+        
+        start = Clock::now( );
+        this->ParallelFor( 0, ITEMS, 16384, work );
+        GLdouble parallel = Seconds( start );
+        
+        printf( "JobSystem:   %u item loop: %.2f ms serial, %.2f ms ParallelFor, %.2fx\n", ITEMS, serial * 1000.0, parallel * 1000.0, serial / parallel );
+        this->PrintStats( );
+        this->ResetStats( );
+    }
+    
+private:
+    typedef std::chrono::steady_clock Clock;
+    typedef std::pair<Job, JobCounter *> Task;
+    
+    struct Worker
+    {
+        std::mutex lock;
+        std::deque<Task> tasks;
+        std::atomic<GLuint> jobs, steals;
+        std::atomic<unsigned long long> busyNanoseconds;
+        std::atomic<bool> claimed;      // Caller slots only, held by a thread until it exits
+    };
+    
+    GLuint threadCount;
+    GLuint slotCount;                   // Worker threads' slots and the caller slots
+    std::unique_ptr<Worker[]> workers;
+    std::vector<std::thread> threads;
+    std::atomic<GLint> queued;          // Jobs in all deques together, what the sleeping workers wait for
+    std::atomic<GLint> sleeping;
+    std::mutex sleepLock;
+    std::condition_variable wake;
+    std::vector<std::function<void( )>> exitHandlers;   // Run by every worker thread as it exits, see AtWorkerExit
+    bool quit;
+    std::atomic<bool> tooManyCallers;
+    Clock::time_point statsStart;
+    
+    // The slot of the calling thread in system
+    struct ThreadSlot
+    {
+        JobSystem *system;
+        GLuint index;
+        GLuint depth;                   // Jobs running on the thread, nested ones run while waiting inside a job
+        bool claimed;                   // Holds a caller slot, given back when the thread exits
+        
+        ThreadSlot( ) : system( nullptr ), index( 0 ), depth( 0 ), claimed( false )
+        {
+        }
+        
+        ~ThreadSlot( )
+        {
+            this->Release( );
+        }
+        
+        void Release( )
+        {
+            if ( this->claimed )
+            {
+                this->system->workers[this->index].claimed = false;
+                this->claimed = false;
+            }
+        }
+    };
+    
+    static ThreadSlot &CurrentSlot( )
+    {
+        static thread_local ThreadSlot slot;
+        
+        return slot;
+    }
+    
+    // The calling thread's slot, claiming a caller slot the first time a thread that is not one of ours calls in
+    GLuint Self( )
+    {
+        ThreadSlot &slot = CurrentSlot( );
+        
+        if ( slot.system != this )
+        {
+            slot.Release( );
+            slot.system = this;
+            slot.index = this->Claim( slot.claimed );
+        }
+        
+        return slot.index;
+    }
+    
+    // A free caller slot, or the last one shared when every slot is held
+    GLuint Claim( bool &claimed )
+    {
+        for ( GLuint i = this->threadCount; i < this->slotCount; i++ )
+        {
+            bool expected = false;
+            
+            if ( this->workers[i].claimed.compare_exchange_strong( expected, true ) )
+            {
+                claimed = true;
+                
+                return i;
+            }
+        }
+        
+        if ( !this->tooManyCallers.exchange( true ) )
+        {
+            std::cout << "WARNING::JOB_SYSTEM::TOO_MANY_CALLERS more than " << MAX_CALLERS << " threads call in, the last ones share a slot" << std::endl;
+        }
+        
+        claimed = false;
+        
+        return this->slotCount - 1;
+    }
+    
+    static GLdouble Seconds( Clock::time_point start )
+    {
+        return std::chrono::duration<GLdouble>( Clock::now( ) - start ).count( );
+    }
+    
+    void Push( GLuint slot, Task task )
+    {
+        Worker &worker = this->workers[slot];
+        
+        {
+            std::lock_guard<std::mutex> lock( worker.lock );
+            worker.tasks.push_back( std::move( task ) );
+        }
+        
+        this->queued++;
+        
+        if ( this->sleeping.load( ) > 0 )
+        {
+            std::lock_guard<std::mutex> lock( this->sleepLock );
+            this->wake.notify_one( );
+        }
+    }
+    
+    // Newest job of slot self, or for worker threads failing that the oldest one of any other slot
+    bool Take( GLuint self, Task &task )
+    {
+        GLuint victims = self < this->threadCount ? this->slotCount : 1;
+        
+        for ( GLuint i = 0; i < victims; i++ )
+        {
+            Worker &victim = this->workers[( self + i ) % this->slotCount];
+            std::lock_guard<std::mutex> lock( victim.lock );
+            
+            if ( victim.tasks.empty( ) )
+            {
+                continue;
+            }
+            
+            if ( 0 == i )
+            {
+                task = std::move( victim.tasks.back( ) );
+                victim.tasks.pop_back( );
+            }
+            else
+            {
+                task = std::move( victim.tasks.front( ) );
+                victim.tasks.pop_front( );
+                this->workers[self].steals++;
+            }
+            
+            this->queued--;
+            
+            return true;
+        }
+        
+        return false;
+    }
+    
+    void Execute( GLuint self, Task &task )
+    {
+        ThreadSlot &slot = CurrentSlot( );
+        Clock::time_point start = Clock::now( );
+        
+        slot.depth++;
+        task.first( );
+        slot.depth--;
+        
+        // A job waiting on others runs them itself, only the outermost one counts towards the busy time
+        if ( 0 == slot.depth )
+        {
+            this->workers[self].busyNanoseconds += std::chrono::duration_cast<std::chrono::nanoseconds>( Clock::now( ) - start ).count( );
+        }
+        
+        this->workers[self].jobs++;
+        
+        if ( nullptr != task.second )
+        {
+            this->Finish( *task.second );
+        }
+    }
+    
+    // Queues the jobs waiting on counter once its last job is done
+    void Finish( JobCounter &counter )
+    {
+        std::vector<JobCounter::Continuation> ready;
+        
+        {
+            std::lock_guard<std::mutex> lock( counter.lock );
+            
+            if ( 0 == --counter.pending )
+            {
+                ready.swap( counter.continuations );
+            }
+        }
+        
+        for ( size_t i = 0; i < ready.size( ); i++ )
+        {
+            this->Push( ready[i].slot, Task( std::move( ready[i].job ), ready[i].counter ) );
+        }
+    }
+    
+    void WorkerLoop( GLuint index )
+    {
+        ThreadSlot &slot = CurrentSlot( );
+        slot.system = this;
+        slot.index = index;
+        
+        for ( ;; )
+        {
+            Task task;
+            
+            if ( this->Take( index, task ) )
+            {
+                this->Execute( index, task );
+                continue;
+            }
+            
+            std::unique_lock<std::mutex> lock( this->sleepLock );
+            this->sleeping++;
+            this->wake.wait( lock, [this]( ) { return this->quit || this->queued.load( ) > 0; } );
+            this->sleeping--;
+            
+            if ( this->quit )
+            {
+                std::vector<std::function<void( )>> handlers = this->exitHandlers;
+                lock.unlock( );
+                
+                for ( size_t i = 0; i < handlers.size( ); i++ )
+                {
+                    handlers[i]( );
+                }
+                
+                return;
+            }
+        }
+    }
+};
@@ -0,0 +1,403 @@
+#pragma once
+
+// Std. Includes
+#include <iostream>
+#include <vector>
+#include <cmath>
+#include <algorithm>
+
+// GL Includes
+#define GLEW_STATIC
+#include <GL/glew.h>
+
+#include <glm/glm.hpp>
+
+#include "shader.h"
+#include "jobsystem.h"
+
+#if !defined( LIGHT_CLUSTERS_NO_SIMD ) && ( defined( __SSE2__ ) || defined( _M_X64 ) || ( defined( _M_IX86_FP ) && _M_IX86_FP >= 2 ) )
+#define LIGHT_CLUSTERS_SSE2
+#include <emmintrin.h>
+#endif
+
+// A point light as lights.glsl's PointLight sees it
+struct ClusterLight
+{
+    glm::vec3 position;
+    
+    GLfloat constant;
+    GLfloat linear;
+    GLfloat quadratic;
+    
+    glm::vec3 ambient;
+    glm::vec3 diffuse;
+    glm::vec3 specular;
+};
+
+// Clustered forward shading. The view frustum is split into froxels (screen tiles times exponential depth slices),
+// the point lights are binned into them on the CPU every frame, and the lit shaders only loop over their froxel's lights,
+// read from buffer textures.
+class LightClusters
+{
+public:
+    static const GLuint TILES_X = 16;
+    static const GLuint TILES_Y = 9;
+    static const GLuint SLICES = 24;
+    static const GLuint CLUSTER_COUNT = TILES_X * TILES_Y * SLICES;
+    
+    LightClusters( ) : lists( CLUSTER_COUNT ), nearPlane( 0.0f ), farPlane( 0.0f ), sliceScale( 0.0f ), sliceBias( 0.0f ), tileSize( 1.0f )
+    {
+        GLint maxTexels;
+        glGetIntegerv( GL_MAX_TEXTURE_BUFFER_SIZE, &maxTexels );
+        this->maxTexels = maxTexels;
+        
+        const GLenum formats[BUFFER_COUNT] = { GL_RGBA32F, GL_RG32UI, GL_R32UI };
+        glGenBuffers( BUFFER_COUNT, this->buffers );
+        glGenTextures( BUFFER_COUNT, this->textures );
+        
+        for ( GLuint i = 0; i < BUFFER_COUNT; i++ )
+        {
+            glBindBuffer( GL_TEXTURE_BUFFER, this->buffers[i] );
+            glBufferData( GL_TEXTURE_BUFFER, 16, NULL, GL_DYNAMIC_DRAW );
+            glBindTexture( GL_TEXTURE_BUFFER, this->textures[i] );
+            glTexBuffer( GL_TEXTURE_BUFFER, formats[i], this->buffers[i] );
+        }
+        
+        glBindTexture( GL_TEXTURE_BUFFER, 0 );
+        glBindBuffer( GL_TEXTURE_BUFFER, 0 );
+    }
+    
+    ~LightClusters( )
+    {
+        glDeleteTextures( BUFFER_COUNT, this->textures );
+        glDeleteBuffers( BUFFER_COUNT, this->buffers );
+    }
+    
+    LightClusters( const LightClusters & ) = delete;
+    LightClusters &operator=( const LightClusters & ) = delete;
+    
+    // Turns a define set into the clustered variant of lights.glsl
+    static ShaderDefines &AddDefines( ShaderDefines &defines )
+    {
+        return defines.Set( "CLUSTERED_POINT_LIGHTS" ).Set( "CLUSTER_TILES_X", ( int )TILES_X ).Set( "CLUSTER_TILES_Y", ( int )TILES_Y ).Set( "CLUSTER_SLICES", ( int )SLICES );
+    }
+    
+    // Distance at which the light's brightest channel falls below 1/256
+    static GLfloat LightRadius( const ClusterLight &light )
+    {
+        GLfloat brightest = std::max( std::max( MaxComponent( light.ambient ), MaxComponent( light.diffuse ) ), MaxComponent( light.specular ) );
+        // Solve constant + linear * d + quadratic * d^2 = 256 * brightest
+        GLfloat c = light.constant - 256.0f * brightest;
+        
+        if ( c >= 0.0f )
+        {
+            return 0.0f;
+        }
+        
+        if ( light.quadratic > 0.0f )
+        {
+            return ( -light.linear + std::sqrt( light.linear * light.linear - 4.0f * light.quadratic * c ) ) / ( 2.0f * light.quadratic );
+        }
+        
+        if ( light.linear > 0.0f )
+        {
+            return -c / light.linear;
+        }
+        
+        return HUGE_VALF;
+    }
+    
+    // Replaces the point lights. Each one is cut off at its LightRadius.
+    void SetLights( const std::vector<ClusterLight> &lights )
+    {
+        GLuint count = ( GLuint )std::min<size_t>( lights.size( ), this->maxTexels / 4 );
+        
+        if ( count < lights.size( ) )
+        {
+            std::cout << "WARNING::LIGHT_CLUSTERS::TOO_MANY_LIGHTS " << lights.size( ) << ", keeping " << count << std::endl;
+        }
+        
+        // Four texels per light: position + constant, ambient + linear, diffuse + quadratic, specular + radius
+        std::vector<glm::vec4> texels( count * 4 );
+        this->spheres.resize( count );
+        
+        for ( GLuint i = 0; i < count; i++ )
+        {
+            const ClusterLight &light = lights[i];
+            GLfloat radius = LightRadius( light );
+            
+            texels[i * 4 + 0] = glm::vec4( light.position, light.constant );
+            texels[i * 4 + 1] = glm::vec4( light.ambient, light.linear );
+            texels[i * 4 + 2] = glm::vec4( light.diffuse, light.quadratic );
+            texels[i * 4 + 3] = glm::vec4( light.specular, radius );
+            this->spheres[i] = glm::vec4( light.position, radius );
+        }
+        
+        glBindBuffer( GL_TEXTURE_BUFFER, this->buffers[LIGHT_BUFFER] );
+        glBufferData( GL_TEXTURE_BUFFER, texels.size( ) * sizeof( glm::vec4 ), texels.empty( ) ? NULL : &texels[0], GL_DYNAMIC_DRAW );
+        glBindBuffer( GL_TEXTURE_BUFFER, 0 );
+    }
+    
+    GLuint LightCount( ) const
+    {
+        return ( GLuint )this->spheres.size( );
+    }
+    
+    // Bins the lights into the froxels of this frame's camera and uploads the per-cluster light lists
+    void Update( const glm::mat4 &view, const glm::mat4 &projection, GLuint screenWidth, GLuint screenHeight )
+    {
+        this->tileSize = glm::vec2( screenWidth / ( GLfloat )TILES_X, screenHeight / ( GLfloat )TILES_Y );
+        
+        if ( projection != this->projection || 0.0f == this->farPlane )
+        {
+            this->BuildClusterBounds( projection );
+        }
+        
+        // Light spheres in view space, with z turned into the distance in front of the camera
+        this->viewSpheres.resize( this->spheres.size( ) );
+        
+        for ( size_t i = 0; i < this->spheres.size( ); i++ )
+        {
+            glm::vec4 position = view * glm::vec4( glm::vec3( this->spheres[i] ), 1.0f );
+            this->viewSpheres[i] = glm::vec4( position.x, position.y, -position.z, this->spheres[i].w );
+        }
+        
+        // Every job owns an interleaved set of slices, so no cluster list is written by two jobs
+        GLuint jobCount = 1;
+        
+        if ( this->spheres.size( ) >= 2 * MIN_LIGHTS_PER_JOB )
+        {
+            jobCount = std::max( 1u, std::min( JobSystem::Get( ).WorkerCount( ), ( GLuint )( this->spheres.size( ) / MIN_LIGHTS_PER_JOB ) ) );
+            jobCount = jobCount < SLICES ? jobCount : SLICES;
+        }
+        
+        JobSystem::Get( ).ParallelFor( 0, jobCount, 1, [this, jobCount]( GLuint first, GLuint last )
+        {
+            for ( GLuint i = first; i < last; i++ )
+            {
+                this->BinSlices( i, jobCount );
+            }
+        } );
+        
+        // Pack the lists back to back, each cluster keeps its first index and light count
+        this->grid.resize( CLUSTER_COUNT * 2 );
+        this->indices.clear( );
+        
+        for ( GLuint i = 0; i < CLUSTER_COUNT; i++ )
+        {
+            GLuint count = ( GLuint )std::min<size_t>( this->lists[i].size( ), this->maxTexels - this->indices.size( ) );
+            
+            this->grid[i * 2] = ( GLuint )this->indices.size( );
+            this->grid[i * 2 + 1] = count;
+            this->indices.insert( this->indices.end( ), this->lists[i].begin( ), this->lists[i].begin( ) + count );
+        }
+        
+        glBindBuffer( GL_TEXTURE_BUFFER, this->buffers[GRID_BUFFER] );
+        glBufferData( GL_TEXTURE_BUFFER, this->grid.size( ) * sizeof( GLuint ), &this->grid[0], GL_STREAM_DRAW );
+        glBindBuffer( GL_TEXTURE_BUFFER, this->buffers[INDEX_BUFFER] );
+        glBufferData( GL_TEXTURE_BUFFER, this->indices.size( ) * sizeof( GLuint ), this->indices.empty( ) ? NULL : &this->indices[0], GL_STREAM_DRAW );
+        glBindBuffer( GL_TEXTURE_BUFFER, 0 );
+    }
+    
+    // Binds the light buffers to texture units firstUnit to firstUnit + 2 and points the shader's cluster uniforms at them
+    void Bind( const Shader &shader, GLuint firstUnit ) const
+    {
+        const GLchar *samplers[BUFFER_COUNT] = { "clusterLights", "clusterGrid", "clusterLightIndices" };
+        
+        for ( GLuint i = 0; i < BUFFER_COUNT; i++ )
+        {
+            glActiveTexture( GL_TEXTURE0 + firstUnit + i );
+            glBindTexture( GL_TEXTURE_BUFFER, this->textures[i] );
+            glUniform1i( glGetUniformLocation( shader.Program, samplers[i] ), firstUnit + i );
+        }
+        
+        glActiveTexture( GL_TEXTURE0 );
+        glUniform2f( glGetUniformLocation( shader.Program, "clusterTileSize" ), this->tileSize.x, this->tileSize.y );
+        glUniform4f( glGetUniformLocation( shader.Program, "clusterDepth" ), this->nearPlane, this->farPlane, this->sliceScale, this->sliceBias );
+    }
+    
+private:
+    enum { LIGHT_BUFFER, GRID_BUFFER, INDEX_BUFFER, BUFFER_COUNT };
+    
+    // Fewer lights than this per extra job are not worth queueing it
+    static const GLuint MIN_LIGHTS_PER_JOB = 256;
+    
+    GLuint buffers[BUFFER_COUNT];
+    GLuint textures[BUFFER_COUNT];
+    size_t maxTexels;
+    
+    std::vector<glm::vec4> spheres;        // World space position + radius
+    std::vector<glm::vec4> viewSpheres;    // View space x, y, depth + radius
+    std::vector<std::vector<GLuint> > lists;
+    std::vector<GLuint> grid;
+    std::vector<GLuint> indices;
+    
+    glm::mat4 projection;
+    GLfloat nearPlane, farPlane;
+    GLfloat sliceScale, sliceBias;         // slice = log( depth ) * sliceScale + sliceBias
+    glm::vec2 tileSize;
+    
+    // View space bounds of every froxel: depth per slice, x per slice and column, y per slice and row
+    GLfloat sliceDepth[SLICES + 1];
+    GLfloat tileMinX[SLICES][TILES_X], tileMaxX[SLICES][TILES_X];
+    GLfloat tileMinY[SLICES][TILES_Y], tileMaxY[SLICES][TILES_Y];
+    
+    static GLfloat MaxComponent( const glm::vec3 &color )
+    {
+        return std::max( std::max( color.x, color.y ), color.z );
+    }
+    
+    void BuildClusterBounds( const glm::mat4 &projection )
+    {
+        this->projection = projection;
+        // A perspective projection keeps -(f + n) / (f - n) and -2fn / (f - n) in its third column
+        this->nearPlane = projection[3][2] / ( projection[2][2] - 1.0f );
+        this->farPlane = projection[3][2] / ( projection[2][2] + 1.0f );
+        this->sliceScale = SLICES / std::log( this->farPlane / this->nearPlane );
+        this->sliceBias = -std::log( this->nearPlane ) * this->sliceScale;
+        
+        for ( GLuint k = 0; k <= SLICES; k++ )
+        {
+            this->sliceDepth[k] = this->nearPlane * std::pow( this->farPlane / this->nearPlane, k / ( GLfloat )SLICES );
+        }
+        
+        for ( GLuint k = 0; k < SLICES; k++ )
+        {
+            TileBounds( projection[0][0], this->sliceDepth[k], this->sliceDepth[k + 1], TILES_X, this->tileMinX[k], this->tileMaxX[k] );
+            TileBounds( projection[1][1], this->sliceDepth[k], this->sliceDepth[k + 1], TILES_Y, this->tileMinY[k], this->tileMaxY[k] );
+        }
+    }
+    
+    // View space extent of each tile along one axis, over the depth range [zNear, zFar]
+    static void TileBounds( GLfloat scale, GLfloat zNear, GLfloat zFar, GLuint tiles, GLfloat *minimum, GLfloat *maximum )
+    {
+        for ( GLuint i = 0; i < tiles; i++ )
+        {
+            GLfloat low = -1.0f + 2.0f * i / tiles;
+            GLfloat high = -1.0f + 2.0f * ( i + 1 ) / tiles;
+            
+            minimum[i] = std::min( low * zNear, low * zFar ) / scale;
+            maximum[i] = std::max( high * zNear, high * zFar ) / scale;
+        }
+    }
+    
+    // Tiles [first, last] along one axis that a sphere can touch between depths zMin and zMax, false when it is off screen
+    static bool TileRange( GLfloat center, GLfloat radius, GLfloat zMin, GLfloat zMax, GLfloat scale, GLint tiles, GLint &first, GLint &last )
+    {
+        GLfloat low = center - radius;
+        GLfloat high = center + radius;
+        GLfloat ndcLow = scale * std::min( low / zMin, low / zMax );
+        GLfloat ndcHigh = scale * std::max( high / zMin, high / zMax );
+        
+        if ( ndcHigh < -1.0f || ndcLow > 1.0f )
+        {
+            return false;
+        }
+        
+        first = ( GLint )( ( std::max( ndcLow, -1.0f ) + 1.0f ) * 0.5f * tiles );
+        last = std::min( ( GLint )( ( std::min( ndcHigh, 1.0f ) + 1.0f ) * 0.5f * tiles ), tiles - 1 );
+        
+        return true;
+    }
+    
+    GLuint SliceOf( GLfloat depth ) const
+    {
+        GLfloat slice = std::log( depth ) * this->sliceScale + this->sliceBias;
+        
+        return ( GLuint )std::min( std::max( slice, 0.0f ), ( GLfloat )( SLICES - 1 ) );
+    }
+    
+    // Bins every light into slices first, first + step, ...
+    void BinSlices( GLuint first, GLuint step )
+    {
+        for ( GLuint k = first; k < SLICES; k += step )
+        {
+            for ( GLuint i = 0; i < TILES_X * TILES_Y; i++ )
+            {
+                this->lists[k * TILES_X * TILES_Y + i].clear( );
+            }
+        }
+        
+        for ( GLuint n = 0; n < this->viewSpheres.size( ); n++ )
+        {
+            const glm::vec4 &sphere = this->viewSpheres[n];
+            
+            if ( sphere.z + sphere.w <= this->nearPlane || sphere.z - sphere.w >= this->farPlane )
+            {
+                continue;
+            }
+            
+            GLuint firstSlice = this->SliceOf( std::max( sphere.z - sphere.w, this->nearPlane ) );
+            GLuint lastSlice = this->SliceOf( std::min( sphere.z + sphere.w, this->farPlane ) );
+            
+            // Round up to the next slice this job owns
+            for ( GLuint k = firstSlice + ( first + step - firstSlice % step ) % step; k <= lastSlice; k += step )
+            {
+                this->BinSphere( n, k );
+            }
+        }
+    }
+    
+    // Adds light n to every cluster of slice k its sphere touches
+    void BinSphere( GLuint n, GLuint k )
+    {
+        const glm::vec4 &sphere = this->viewSpheres[n];
+        GLfloat zMin = std::max( this->sliceDepth[k], sphere.z - sphere.w );
+        GLfloat zMax = std::min( this->sliceDepth[k + 1], sphere.z + sphere.w );
+        GLint firstX, lastX, firstY, lastY;
+        
+        if ( zMin > zMax ||
+            !TileRange( sphere.x, sphere.w, zMin, zMax, this->projection[0][0], TILES_X, firstX, lastX ) ||
+            !TileRange( sphere.y, sphere.w, zMin, zMax, this->projection[1][1], TILES_Y, firstY, lastY ) )
+        {
+            return;
+        }
+        
+        // The sphere has to reach the froxel's box, not only the screen rectangle around it
+        GLfloat dz = std::max( std::max( this->sliceDepth[k] - sphere.z, sphere.z - this->sliceDepth[k + 1] ), 0.0f );
+        GLfloat radius2 = sphere.w * sphere.w - dz * dz;
+        
+        for ( GLint j = firstY; j <= lastY; j++ )
+        {
+            GLfloat dy = std::max( std::max( this->tileMinY[k][j] - sphere.y, sphere.y - this->tileMaxY[k][j] ), 0.0f );
+            GLfloat rest = radius2 - dy * dy;
+            std::vector<GLuint> *row = &this->lists[( k * TILES_Y + j ) * TILES_X];
+            
+            if ( rest < 0.0f )
+            {
+                continue;
+            }
+
+#ifdef LIGHT_CLUSTERS_SSE2
+            // Four columns at a time, TILES_X is a multiple of four
+            const __m128 x = _mm_set1_ps( sphere.x );
+            const __m128 limit = _mm_set1_ps( rest );
+            const __m128 zero = _mm_setzero_ps( );
+            
+            for ( GLint i = firstX & ~3; i <= lastX; i += 4 )
+            {
+                __m128 dx = _mm_max_ps( _mm_max_ps( _mm_sub_ps( _mm_loadu_ps( &this->tileMinX[k][i] ), x ), _mm_sub_ps( x, _mm_loadu_ps( &this->tileMaxX[k][i] ) ) ), zero );
+                int hits = _mm_movemask_ps( _mm_cmple_ps( _mm_mul_ps( dx, dx ), limit ) );
+                
+                for ( GLint b = 0; b < 4; b++ )
+                {
+                    if ( ( hits & ( 1 << b ) ) && i + b >= firstX && i + b <= lastX )
+                    {
+                        row[i + b].push_back( n );
+                    }
+                }
+            }
+#else
+            for ( GLint i = firstX; i <= lastX; i++ )
+            {
+                GLfloat dx = std::max( std::max( this->tileMinX[k][i] - sphere.x, sphere.x - this->tileMaxX[k][i] ), 0.0f );
+                
+                if ( dx * dx <= rest )
+                {
+                    row[i].push_back( n );
+                }
+            }
+#endif
+        }
+    }
+};
@@ -1,4 +1,11 @@
 #include <iostream>
+#include <cstdio>
+#include <cmath>
+#include <vector>
+#include <random>
+#include <thread>
+#include <mutex>
+#include <chrono>
 
 #define GLEW_STATIC
 #include <GL/glew.h>
@@ -8,20 +15,113 @@
 #include <glm/glm.hpp>
 #include <glm/gtc/matrix_transform.hpp>
 #include <glm/gtc/type_ptr.hpp>
+#include <glm/gtc/matrix_inverse.hpp>
 
 #include "shader.h"
 #include "camera.h"
 #include "model.h"
 #include "texture.h"
+#include "lightclusters.h"
+#include "objectlights.h"
+#include "gbuffer.h"
+#include "framequery.h"
+#include "jobsystem.h"
+#include "spscqueue.h"
+#include "dynamicbuffer.h"
+#include "profiler.h"
 
 const GLint WIDTH = 800, HEIGHT = 600;
 int SCREEN_WIDTH, SCREEN_HEIGHT;
 
+// The ten boxes, the model ([10]) and the four lamps ([11] on). The lit ones come first, only they get light lists
+const GLuint OBJECT_COUNT = 15, LIT_OBJECT_COUNT = 11;
+
+// Everything the render thread needs for one frame. The simulation thread fills it in, and it stays untouched from
+// the moment it is queued until the render thread hands it back
+struct FrameSnapshot
+{
+    GLdouble inputTime;                 // glfwGetTime( ) when the frame's input had been read, for the latency
+    glm::mat4 view;
+    glm::vec3 viewPos, viewFront;
+    bool flashlightOn, deferredShading, depthPrePass, perObjectLights, plainUniforms;
+    bool takeScreenshot;
+    
+    // pointLights only holds the lights in the frame they changed
+    bool pointLightsChanged;
+    std::vector<ClusterLight> pointLights;
+    
+    glm::mat4 boxModels[10], suitModel;
+    glm::mat3 boxNormalMatrices[10], suitNormalMatrix;
+    // Light lists of the ten boxes and the model ([10]) with per-object lights, kept across frames for their capacity
+    std::vector<GLint> objectLightIndices[LIT_OBJECT_COUNT];
+    
+    bool quit;                          // Set on the last snapshot, which stops the render thread
+    
+    FrameSnapshot( ) : quit( false )
+    {
+    }
+};
+
+// Binding points of the uniform blocks the shaders read from the DynamicBuffer, see BindUniformBlocks
+const GLuint FRAME_TRANSFORMS_BINDING = 0;
+const GLuint OBJECT_TRANSFORMS_BINDING = 1;
+const GLuint SCENE_LIGHTS_BINDING = 2;
+const GLuint OBJECT_LIGHTS_BINDING = 3;
+
+// std140 layouts of the blocks in transforms.glsl and lights.glsl, ObjectTransform is one entry of ObjectTransforms.
+// Each vec3 and mat3 column takes a whole vec4, unless a float follows that fits into its fourth component
+struct FrameTransforms
+{
+    glm::mat4 view, projection;
+};
+
+struct ObjectTransform
+{
+    glm::mat4 model;
+    glm::vec4 normalMatrix[3];
+    
+    ObjectTransform( const glm::mat4 &model, const glm::mat3 &normalMatrix ) : model( model )
+    {
+        for ( GLuint i = 0; i < 3; i++ )
+        {
+            this->normalMatrix[i] = glm::vec4( normalMatrix[i], 0.0f );
+        }
+    }
+};
+
+struct SceneLights
+{
+    glm::vec4 dirLightDirection, dirLightAmbient, dirLightDiffuse, dirLightSpecular;
+    glm::vec4 spotLightPosition;
+    glm::vec3 spotLightDirection;
+    GLfloat spotLightCutOff, spotLightOuterCutOff, spotLightConstant, spotLightLinear, spotLightQuadratic;
+    glm::vec4 spotLightAmbient, spotLightDiffuse, spotLightSpecular;
+    glm::vec4 viewPos;
+};
+
+// The programs the scene is drawn with, [1] of each pair has the flashlight. They come in two sets, one reads the
+// blocks above from the DynamicBuffer and the other, built with PLAIN_UNIFORMS, gets the same values through glUniform*
+struct SceneShaders
+{
+    ShaderFuture lighting[2], model[2];             // Forward, froxel light lists
+    ShaderFuture lightingObject[2], modelObject[2]; // Forward, per-object light lists
+    ShaderFuture lightingGBuffer, modelGBuffer, deferred[2];
+    ShaderFuture depth, lamp;
+};
+
 // Function prototypes
 void KeyCallback( GLFWwindow *window, int key, int scancode, int action, int mode );
 void ScrollCallback( GLFWwindow *window, double xOffset, double yOffset );
 void MouseCallback( GLFWwindow *window, double xPos, double yPos );
 void DoMovement( );
+std::vector<ClusterLight> BuildPointLights( GLuint extraLights );
+SceneLights BuildSceneLights( const FrameSnapshot &frame );
+SceneShaders SubmitSceneShaders( ShaderManager &shaderManager, bool plainUniforms );
+void FinishSceneShaders( SceneShaders &shaders, bool plainUniforms );
+void BindUniformBlocks( const Shader &shader );
+void SetFrameUniforms( const Shader &shader, const FrameTransforms &transforms, const SceneLights &lights );
+void SetObjectUniforms( const Shader &shader, const ObjectTransform &transform );
+FrameSnapshot *WaitForSnapshot( SpscQueue<FrameSnapshot *, 2> &queue );
 
 // Camera
 Camera  camera(glm::vec3( 0.0f, 0.0f, 3.0f ) );
@@ -29,6 +129,14 @@ GLfloat lastX = WIDTH / 2.0;
 GLfloat lastY = HEIGHT / 2.0;
 bool keys[1024];
 bool firstMouse = true;
+bool flashlightOn = true;
+bool deferredShading = false;
+bool depthPrePass = false;
+bool objectLightLists = false;
+bool plainUniforms = true;
+bool jobSystemReport = false;
+bool profilerReport = false;
+bool toggleTraceCapture = false;
 
 // Light attributes
 glm::vec3 dirLightDir(-0.2f, -1.0f, -0.3f);
@@ -39,11 +147,33 @@ glm::vec3 pointLightPos[] = {
     glm::vec3(  0.0f,  0.0f, -3.0f      )
 };
 
-GLfloat deltaTime = 0.0f;
-GLfloat lastFrame = 0.0f;
+// Extra point lights for stress testing the clustered lighting, L cycles through the counts
+const GLuint EXTRA_LIGHT_COUNTS[] = { 0, 1024, 4096, 10240 };
+GLuint extraLightStep = 0;
+bool pointLightsChanged = true;
+// Fewer light tests than this per extra object job are not worth queueing it
+const GLuint MIN_LIGHT_TESTS_PER_JOB = 4096;
+
+// The simulation advances in fixed steps, so it costs and moves the same whatever the frame rate. A frame runs at most
+// MAX_SIMULATION_STEPS of them and drops the rest of a longer stall instead of spiralling into ever longer frames
+const GLdouble SIMULATION_STEP = 1.0 / 120.0;
+const GLuint MAX_SIMULATION_STEPS = 8;
+GLdouble lastFrame = 0.0;
+GLdouble simulationLag = 0.0;       // Time not simulated yet, less than one step after every frame
+
+// Frame capture (F12 saves one frame, F11 toggles recording every frame)
+bool takeScreenshot = false;
+bool recordFrames = false;
+unsigned int capturedFrames = 0;
+unsigned int capturedTraces = 0;
 
 int main( )
 {
+    // Loading is traced from the start, into profile_loading.json
+    Profiler::Get( ).SetThreadName( "Main" );
+    Profiler::Get( ).StartCapture( );
+    Profiler::Get( ).Begin( "Loading" );
+    
     // Init GLFW
     if (!glfwInit())
     {
@@ -93,10 +223,20 @@ int main( )
     // glBlendFunc (GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
     glEnable( GL_DEPTH_TEST );
     
-    // Shader myShader ("resources/shaders/core.vert", "resources/shaders/core.frag");
-    Shader lightingShader( "resources/shaders/lighting.vert", "resources/shaders/lighting.frag" );
-    Shader lampShader( "resources/shaders/lamp.vert", "resources/shaders/lamp.frag" );
-    Shader skyboxShader( "resources/shaders/skybox.vert", "resources/shaders/skybox.frag" );
+    // Let large JPEGs with restart markers and PNG rows decode on the job system's workers
+    TextureLoading::UseJobSystem( );
+    
+    // Submit every shader up front, the driver compiles them while the textures and model load
+    Profiler::Get( ).Begin( "Submit shaders" );
+    ShaderManager shaderManager;
+    // ShaderFuture myShaderFuture = shaderManager.Load( "resources/shaders/core.vert", "resources/shaders/core.frag" );
+    // Every program that reads the DynamicBuffer's blocks also comes as a PLAIN_UNIFORMS variant, U switches between
+    // them. Only the set in use is built here, the render thread builds the other the first time it is asked for
+    SceneShaders sceneShaders[2];
+    bool sceneShadersBuilt[2] = { false, false };
+    sceneShaders[plainUniforms] = SubmitSceneShaders( shaderManager, plainUniforms );
+    ShaderFuture skyboxShaderFuture = shaderManager.Load( "resources/shaders/skybox.vert", "resources/shaders/skybox.frag" );
+    Profiler::Get( ).End( );
     
     GLfloat vertices[] = {
         // Positions            // Normals              // Texture Coords
@@ -240,8 +380,14 @@ int main( )
     glBindVertexArray (0);
     
     // Load Texture
-    GLuint cubeDiffuseMap = TextureLoading::LoadTexture( "resources/images/container2.png" );
-    GLuint cubeSpecularMap = TextureLoading::LoadTexture( "resources/images/container2_specular.png" );
+    vector<string> cubeMaps;
+    cubeMaps.push_back( "resources/images/container2.png" );
+    cubeMaps.push_back( "resources/images/container2_specular.png" );
+    Profiler::Get( ).Begin( "Load textures" );
+    vector<GLuint> cubeTextures = TextureLoading::LoadTextures( cubeMaps );
+    Profiler::Get( ).End( );
+    GLuint cubeDiffuseMap = cubeTextures[0];
+    GLuint cubeSpecularMap = cubeTextures[1];
     
     vector<const GLchar*> faces;
     faces.push_back( "resources/images/skybox/right.tga" );
@@ -250,7 +396,9 @@ int main( )
     faces.push_back( "resources/images/skybox/bottom.tga" );
     faces.push_back( "resources/images/skybox/back.tga" );
     faces.push_back( "resources/images/skybox/front.tga" );
+    Profiler::Get( ).Begin( "Load skybox" );
     GLuint cubemapTexture = TextureLoading::LoadCubemap( faces );
+    Profiler::Get( ).End( );
     
     glm::mat4 projection;
     // 3D camera
@@ -259,195 +407,539 @@ int main( )
     // projection = glm::ortho(0.0f, ( GLfloat )SCREEN_WIDTH, 0.0f, ( GLfloat )SCREEN_HEIGHT, 0.1f, 1000.0f);
     
     // Load models
-    Shader modelShader( "resources/shaders/model.vert", "resources/shaders/model.frag" );
+    Profiler::Get( ).Begin( "Load model" );
     Model loadedModel( "resources/models/nanosuit.obj" );
+    Profiler::Get( ).End( );
+    
+    ObjectLights objectLights;
+    // The deferred lighting pass draws without vertex attributes, but the core profile still wants a VAO bound
+    GLuint screenVAO;
+    glGenVertexArrays( 1, &screenVAO );
+    
+    // Everything else is loaded, now wait for the shaders
+    Profiler::Get( ).Begin( "Wait for shaders" );
+    shaderManager.FinishAll( );
+    FinishSceneShaders( sceneShaders[plainUniforms], plainUniforms );
+    sceneShadersBuilt[plainUniforms] = true;
+    Shader &skyboxShader = skyboxShaderFuture.Get( );
+    Profiler::Get( ).End( );
     // glPolygonMode(GL_FRONT_AND_BACK, GL_LINE);
     
+    Profiler::Get( ).End( );
+    Profiler::Get( ).WriteTrace( "profile_loading.json" );
+    
+    // From here on the render thread owns the context. It draws frame N from an immutable snapshot while this thread
+    // reads the input and simulates frame N + 1 into the other one. The snapshots go back and forth through lock-free
+    // queues, so a slow frame on either side never holds the other up by more than the one frame of slack
+    FrameSnapshot snapshots[2];
+    SpscQueue<FrameSnapshot *, 2> queuedFrames, freeFrames;
+    freeFrames.Push( &snapshots[0] );
+    freeFrames.Push( &snapshots[1] );
+    // GLFW only lets the main thread set the title, so the render thread leaves it here
+    std::mutex titleLock;
+    char windowTitle[256];
+    bool titleChanged = false;
+    glfwMakeContextCurrent( nullptr );
+    
+    std::thread renderThread( [&]( )
+    {
+        glfwMakeContextCurrent( window );
+        Profiler::Get( ).SetThreadName( "Render" );
+        
+        // The GL objects only the render thread uses live in this scope, so they are deleted before it gives the context back
+        {
+            LightClusters lightClusters;
+            GBuffer gBuffer( SCREEN_WIDTH, SCREEN_HEIGHT );
+            // Samples the lit passes write, i.e. how much overdraw the depth pre-pass removes
+            FrameQuery shadedFragments( GL_SAMPLES_PASSED );
+            // Transforms and light parameters, rewritten every frame. A frame takes about 8 KB at a 256 byte block alignment
+            DynamicBuffer dynamicData( 64 * 1024 );
+            
+            // Every object's transforms in OBJECT_COUNT order, refilled every frame
+            std::vector<ObjectTransform> objectTransforms;
+            
+            GLdouble frameTimeStart = glfwGetTime( ), latencySum = 0.0;
+            GLuint framesTimed = 0;
+            
+            for ( ;; )
+            {
+                FrameSnapshot *frame = WaitForSnapshot( queuedFrames );
+                
+                if ( frame->quit )
+                {
+                    break;
+                }
+                
+                Profiler::Get( ).Begin( "Frame" );
+                Profiler::Get( ).Begin( "Light clusters" );
+                
+                if ( frame->pointLightsChanged )
+                {
+                    lightClusters.SetLights( frame->pointLights );
+                }
+                
+                // Bin the point lights into this frame's froxels
+                if ( !frame->perObjectLights )
+                {
+                    lightClusters.Update( frame->view, projection, SCREEN_WIDTH, SCREEN_HEIGHT );
+                }
+                
+                Profiler::Get( ).End( );
+                
+                // The first frame to ask for the other uniform path waits for its programs to build
+                SceneShaders &shaders = sceneShaders[frame->plainUniforms];
+                
+                if ( !sceneShadersBuilt[frame->plainUniforms] )
+                {
+                    Profiler::Get( ).Begin( "Build shaders" );
+                    shaders = SubmitSceneShaders( shaderManager, frame->plainUniforms );
+                    FinishSceneShaders( shaders, frame->plainUniforms );
+                    sceneShadersBuilt[frame->plainUniforms] = true;
+                    Profiler::Get( ).End( );
+                }
+                
+                // Every block the passes below read is written and bound before the first draw, so the frame reaches
+                // the GL with one Upload and one binding per block. The objects' transforms and light lists are arrays,
+                // a draw only sets objectIndex to pick its entry. Uniform buffer bindings are context state, so they
+                // stay bound across every shader switch. Plain uniforms are set on each program instead
+                FrameTransforms frameTransforms = { frame->view, projection };
+                SceneLights sceneLights = BuildSceneLights( *frame );
+                
+                objectTransforms.clear( );
+                for ( GLuint i = 0; i < 10; i++ )
+                {
+                    objectTransforms.push_back( ObjectTransform( frame->boxModels[i], frame->boxNormalMatrices[i] ) );
+                }
+                objectTransforms.push_back( ObjectTransform( frame->suitModel, frame->suitNormalMatrix ) );
+                for ( GLuint i = 0; i < 4; i++ )
+                {
+                    glm::mat4 lampModel = glm::scale( glm::translate( glm::mat4( ), pointLightPos[i] ), glm::vec3( 0.2f ) );
+                    objectTransforms.push_back( ObjectTransform( lampModel, glm::mat3( ) ) );
+                }
+                
+                if ( !frame->plainUniforms )
+                {
+                    dynamicData.BeginFrame( );
+                    DynamicRange frameRange = dynamicData.Write( frameTransforms );
+                    DynamicRange lightsRange = dynamicData.Write( sceneLights );
+                    DynamicRange objectsRange = dynamicData.Write( &objectTransforms[0], OBJECT_COUNT * sizeof( ObjectTransform ) );
+                    DynamicRange objectLightsRange = { 0, 0 };
+                    
+                    if ( frame->perObjectLights )
+                    {
+                        objectLightsRange = objectLights.Write( dynamicData, frame->objectLightIndices, LIT_OBJECT_COUNT );
+                    }
+                    
+                    dynamicData.Upload( );
+                    dynamicData.Bind( FRAME_TRANSFORMS_BINDING, frameRange );
+                    dynamicData.Bind( SCENE_LIGHTS_BINDING, lightsRange );
+                    dynamicData.Bind( OBJECT_TRANSFORMS_BINDING, objectsRange );
+                    
+                    if ( frame->perObjectLights )
+                    {
+                        dynamicData.Bind( OBJECT_LIGHTS_BINDING, objectLightsRange );
+                    }
+                }
+                
+                // Hand the shader just made current the frame's values, and object's transforms and lights before its draw
+                auto setFrame = [&]( const Shader &shader )
+                {
+                    if ( frame->plainUniforms )
+                    {
+                        SetFrameUniforms( shader, frameTransforms, sceneLights );
+                    }
+                };
+                auto setObject = [&]( const Shader &shader, GLuint object )
+                {
+                    if ( frame->plainUniforms )
+                    {
+                        SetObjectUniforms( shader, objectTransforms[object] );
+                    }
+                    else
+                    {
+                        glUniform1i( glGetUniformLocation( shader.Program, "objectIndex" ), object );
+                    }
+                };
+                auto setObjectLights = [&]( const Shader &shader, GLuint object )
+                {
+                    if ( !frame->perObjectLights )
+                    {
+                        return;
+                    }
+                    
+                    // The blocks' lists are picked by the objectIndex setObject set
+                    if ( frame->plainUniforms )
+                    {
+                        objectLights.SetUniforms( shader, frame->objectLightIndices[object] );
+                    }
+                };
+                
+                // Render
+                // Clear the colorbuffer
+                glClearColor( 0.1f, 0.1f, 0.1f, 1.0f );
+                glClear( GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT );
+                
+                // Each draw uses the leanest variant, without the spot light while the flashlight is off.
+                // The deferred path draws the lit objects into the G-buffer instead and lights them in one screen pass.
+                Shader &lightingShader = frame->deferredShading ? shaders.lightingGBuffer.Get( ) : frame->perObjectLights ? shaders.lightingObject[frame->flashlightOn].Get( ) : shaders.lighting[frame->flashlightOn].Get( );
+                Shader &modelShader = frame->deferredShading ? shaders.modelGBuffer.Get( ) : frame->perObjectLights ? shaders.modelObject[frame->flashlightOn].Get( ) : shaders.model[frame->flashlightOn].Get( );
+                
+                // Create transformations
+                glm::mat4 model, view;
+                // model = glm::rotate( model, ( GLfloat)glfwGetTime( ) * 1.0f, glm::vec3( 0.5f, 1.0f, 0.0f ) );
+                view = frame->view;
+                
+                if ( frame->deferredShading )
+                {
+                    gBuffer.Bind( );
+                }
+                
+                if ( frame->depthPrePass )
+                {
+                    // Lay down the nearest depth with a position-only pass, so the lit pass below shades each pixel once
+                    Profiler::Get( ).BeginGpu( "Depth pre-pass" );
+                    glColorMask( GL_FALSE, GL_FALSE, GL_FALSE, GL_FALSE );
+                    Shader &depthShader = shaders.depth.Get( );
+                    depthShader.Use( );
+                    setFrame( depthShader );
+                    
+                    glBindVertexArray( lightVAO );
+                    for ( GLuint i = 0; i < 10; i++ )
+                    {
+                        setObject( depthShader, i );
+                        glDrawArrays( GL_TRIANGLES, 0, 36 );
+                    }
+                    glBindVertexArray( 0 );
+                    
+                    setObject( depthShader, 10 );
+                    loadedModel.DrawDepth( );
+                    
+                    // Only the fragments that won the pre-pass get shaded, and the depth buffer is already final
+                    glColorMask( GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE );
+                    glDepthFunc( GL_EQUAL );
+                    glDepthMask( GL_FALSE );
+                    Profiler::Get( ).End( );
+                }
+                
+                shadedFragments.Begin( );
+                
+                // rander boxes
+                Profiler::Get( ).BeginGpu( "Cubes" );
+                lightingShader.Use();
+                setFrame( lightingShader );
+                glUniform1f(glGetUniformLocation( lightingShader.Program, "material.shininess" ), 32.0f );
+                
+                if ( !frame->deferredShading )
+                {
+                    lightClusters.Bind( lightingShader, 8 );
+                }
+                
+                // Set texture units
+                glUniform1i( glGetUniformLocation( lightingShader.Program, "material.diffuse" ),  0 );
+                glUniform1i( glGetUniformLocation( lightingShader.Program, "material.specular" ), 1 );
+                glActiveTexture( GL_TEXTURE0 );
+                glBindTexture( GL_TEXTURE_2D, cubeDiffuseMap );
+                glActiveTexture( GL_TEXTURE1 );
+                glBindTexture( GL_TEXTURE_2D, cubeSpecularMap );
+                
+                glBindVertexArray (VAO);
+                // glDrawElements(GL_TRIANGLES, 6, GL_UNSIGNED_INT, 0);
+                // glDrawArrays(GL_TRIANGLES, 0, 36);
+                for ( GLuint i = 0; i < 10; i++ )
+                {
+                    setObject( lightingShader, i );
+                    setObjectLights( lightingShader, i );
+                    glDrawArrays( GL_TRIANGLES, 0, 36 );
+                }
+                glBindVertexArray (0);
+                
+                glActiveTexture( GL_TEXTURE0 );
+                glBindTexture( GL_TEXTURE_2D, 0 );
+                glActiveTexture( GL_TEXTURE1 );
+                glBindTexture( GL_TEXTURE_2D, 0 );
+                Profiler::Get( ).End( );
+                
+                // Draw the loaded model
+                Profiler::Get( ).BeginGpu( "Model" );
+                modelShader.Use();
+                setFrame( modelShader );
+                
+                if ( !frame->deferredShading )
+                {
+                    lightClusters.Bind( modelShader, 8 );
+                }
+                
+                setObject( modelShader, 10 );
+                setObjectLights( modelShader, 10 );
+                loadedModel.Draw(modelShader);
+                Profiler::Get( ).End( );
+                
+                shadedFragments.End( );
+                
+                if ( frame->depthPrePass )
+                {
+                    glDepthFunc( GL_LESS );
+                    glDepthMask( GL_TRUE );
+                }
+                
+                if ( frame->deferredShading )
+                {
+                    // Light each covered pixel once, then bring the depth over so the lamps and the skybox are hidden behind it
+                    Profiler::Get( ).BeginGpu( "Deferred lighting" );
+                    glBindFramebuffer( GL_FRAMEBUFFER, 0 );
+                    glDisable( GL_DEPTH_TEST );
+                    
+                    Shader &deferredShader = shaders.deferred[frame->flashlightOn].Get( );
+                    deferredShader.Use( );
+                    setFrame( deferredShader );
+                    lightClusters.Bind( deferredShader, 8 );
+                    glm::mat4 inverseViewProjection = glm::inverse( projection * view );
+                    glUniformMatrix4fv( glGetUniformLocation( deferredShader.Program, "inverseViewProjection" ), 1, GL_FALSE, glm::value_ptr( inverseViewProjection ) );
+                    gBuffer.BindTextures( deferredShader, 0 );
+                    
+                    glBindVertexArray( screenVAO );
+                    glDrawArrays( GL_TRIANGLES, 0, 3 );
+                    glBindVertexArray( 0 );
+                    
+                    gBuffer.UnbindTextures( 0 );
+                    glEnable( GL_DEPTH_TEST );
+                    gBuffer.BlitDepth( 0 );
+                    Profiler::Get( ).End( );
+                }
+                
+                // render lamp
+                Profiler::Get( ).BeginGpu( "Lamps" );
+                Shader &lampShader = shaders.lamp.Get( );
+                lampShader.Use( );
+                setFrame( lampShader );
+                
+                glBindVertexArray( lightVAO );
+                for (int i = 0; i < 4; i++) {
+                    setObject( lampShader, 11 + i );
+                    glDrawArrays( GL_TRIANGLES, 0, 36 );
+                }
+                glBindVertexArray( 0 );
+                Profiler::Get( ).End( );
+                
+                // Draw skybox as last
+                Profiler::Get( ).BeginGpu( "Skybox" );
+                glDepthFunc( GL_LEQUAL );  // Change depth function so depth test passes when values are equal to depth buffer's content
+                skyboxShader.Use( );
+                view = glm::mat4( glm::mat3( frame->view ) );	// Remove any translation component of the view matrix
+                glUniformMatrix4fv( glGetUniformLocation( skyboxShader.Program, "view" ), 1, GL_FALSE, glm::value_ptr( view ) );
+                glUniformMatrix4fv( glGetUniformLocation( skyboxShader.Program, "projection" ), 1, GL_FALSE, glm::value_ptr( projection ) );
+                
+                glBindVertexArray( skyboxVAO );
+                glBindTexture( GL_TEXTURE_CUBE_MAP, cubemapTexture );
+                glDrawArrays( GL_TRIANGLES, 0, 36 );
+                glBindVertexArray( 0 );
+                glDepthFunc( GL_LESS ); // Set depth function back to default
+                Profiler::Get( ).End( );
+                
+                // Queue the back buffer for readback, the PNG is written on SOIL's writer thread
+                if( frame->takeScreenshot )
+                {
+                    char screenshotName[64];
+                    snprintf( screenshotName, sizeof( screenshotName ), "screenshot_%05u.png", capturedFrames++ );
+                    SOIL_queue_screenshot( screenshotName, SOIL_SAVE_TYPE_PNG, 0, 0, SCREEN_WIDTH, SCREEN_HEIGHT );
+                }
+                SOIL_process_screenshots( );
+                
+                // The GPU is done with this frame's blocks once it passes the fence
+                if ( !frame->plainUniforms )
+                {
+                    dynamicData.EndFrame( );
+                }
+                
+                // Swap the screen buffers
+                Profiler::Get( ).Begin( "Swap" );
+                glfwSwapBuffers( window );
+                Profiler::Get( ).End( );
+                // Closes "Frame", then picks up the GPU times of the frame before
+                Profiler::Get( ).End( );
+                Profiler::Get( ).EndFrame( );
+                
+                // Throughput is how often frames reach the screen, latency how long after its input was read each one did.
+                // Both are averaged over the last second and shown in the title bar
+                GLdouble frameEnd = glfwGetTime( );
+                latencySum += frameEnd - frame->inputTime;
+                framesTimed++;
+                
+                if ( frameEnd - frameTimeStart >= 1.0 )
+                {
+                    std::lock_guard<std::mutex> lock( titleLock );
+                    snprintf( windowTitle, sizeof( windowTitle ), "LearnOpenGL - %s%s%s%s - %u point lights - %llu shaded fragments - %.2f ms - %.2f ms latency", frame->deferredShading ? "deferred" : "forward", frame->depthPrePass ? " + depth pre-pass" : "", frame->perObjectLights ? " + per-object lights" : "", frame->plainUniforms ? " + plain uniforms" : "", lightClusters.LightCount( ), ( unsigned long long )shadedFragments.Result( ), 1000.0 * ( frameEnd - frameTimeStart ) / framesTimed, 1000.0 * latencySum / framesTimed );
+                    titleChanged = true;
+                    frameTimeStart = frameEnd;
+                    framesTimed = 0;
+                    latencySum = 0.0;
+                }
+                
+                freeFrames.Push( frame );
+            }
+            
+            // Wait for queued screenshots to reach the disk
+            SOIL_finish_screenshots( );
+            
+            glDeleteVertexArrays (1, &VAO);
+            glDeleteVertexArrays( 1, &lightVAO );
+            glDeleteVertexArrays( 1, &screenVAO );
+            glDeleteVertexArrays( 1, &skyboxVAO );
+            glDeleteBuffers (1, &VBO);
+            glDeleteBuffers( 1, &skyboxVBO );
+            glDeleteTextures( ( GLsizei )cubeTextures.size( ), &cubeTextures[0] );
+            glDeleteTextures( 1, &cubemapTexture );
+            loadedModel.Release( );
+            shaderManager.Release( );
+            Profiler::Get( ).ReleaseQueries( );
+        }
+        
+        glfwMakeContextCurrent( nullptr );
+    } );
+    
+    // Where the camera was one simulation step before the current one, the frames are drawn in between
+    glm::vec3 previousCameraPosition = camera.GetPosition( );
+    lastFrame = glfwGetTime( );
+    
     // Game loop
     while ( !glfwWindowShouldClose( window ) )
     {
         // Set frame time
-        GLfloat currentFrame = glfwGetTime( );
-        deltaTime = currentFrame - lastFrame;
+        GLdouble currentFrame = glfwGetTime( );
+        simulationLag += currentFrame - lastFrame;
         lastFrame = currentFrame;
         // Check and call events
         glfwPollEvents( );
-        DoMovement( );
-        
-        // Render
-        // Clear the colorbuffer
-        glClearColor( 0.1f, 0.1f, 0.1f, 1.0f );
-        glClear( GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT );
-        
-        // rander boxes
-        lightingShader.Use();
-        GLint viewPosLoc = glGetUniformLocation( lightingShader.Program, "viewPos" );
-        glUniform3f( viewPosLoc, camera.GetPosition( ).x, camera.GetPosition( ).y, camera.GetPosition( ).z );
-        glUniform1f(glGetUniformLocation( lightingShader.Program, "material.shininess" ), 32.0f );
         
-        glUniform3f( glGetUniformLocation( lightingShader.Program, "dirLight.direction" ), dirLightDir.x, dirLightDir.y, dirLightDir.z);
-        glUniform3f( glGetUniformLocation( lightingShader.Program, "dirlight.ambient" ), 0.2f, 0.2f, 0.2f);
-        glUniform3f( glGetUniformLocation( lightingShader.Program, "dirlight.diffuse" ), 0.8f, 0.8f, 0.8f);
-        
-        glUniform3f( glGetUniformLocation( lightingShader.Program, "pointLights[0].position" ), pointLightPos[0].x, pointLightPos[0].y, pointLightPos[0].z );
-        glUniform3f( glGetUniformLocation( lightingShader.Program, "pointLights[0].ambient" ), 0.05f, 0.05f, 0.05f );
-        glUniform3f( glGetUniformLocation( lightingShader.Program, "pointLights[0].diffuse" ), 0.8f, 0.8f, 0.8f );
-        glUniform3f( glGetUniformLocation( lightingShader.Program, "pointLights[0].specular" ), 1.0f, 1.0f, 1.0f );
-        glUniform1f( glGetUniformLocation( lightingShader.Program, "pointLights[0].constant" ), 1.0f );
-        glUniform1f( glGetUniformLocation( lightingShader.Program, "pointLights[0].linear" ), 0.09f );
-        glUniform1f( glGetUniformLocation( lightingShader.Program, "pointLights[0].quadratic" ), 0.032f );
-        
-        glUniform3f( glGetUniformLocation( lightingShader.Program, "pointLights[1].position" ), pointLightPos[1].x, pointLightPos[1].y, pointLightPos[1].z );
-        glUniform3f( glGetUniformLocation( lightingShader.Program, "pointLights[1].ambient" ), 0.05f, 0.05f, 0.05f );
-        glUniform3f( glGetUniformLocation( lightingShader.Program, "pointLights[1].diffuse" ), 0.8f, 0.8f, 0.8f );
-        glUniform3f( glGetUniformLocation( lightingShader.Program, "pointLights[1].specular" ), 1.0f, 1.0f, 1.0f );
-        glUniform1f( glGetUniformLocation( lightingShader.Program, "pointLights[1].constant" ), 1.0f );
-        glUniform1f( glGetUniformLocation( lightingShader.Program, "pointLights[1].linear" ), 0.09f );
-        glUniform1f( glGetUniformLocation( lightingShader.Program, "pointLights[1].quadratic" ), 0.032f );
-        
-        glUniform3f( glGetUniformLocation( lightingShader.Program, "pointLights[2].position" ), pointLightPos[2].x, pointLightPos[2].y, pointLightPos[2].z );
-        glUniform3f( glGetUniformLocation( lightingShader.Program, "pointLights[2].ambient" ), 0.05f, 0.05f, 0.05f );
-        glUniform3f( glGetUniformLocation( lightingShader.Program, "pointLights[2].diffuse" ), 0.8f, 0.8f, 0.8f );
-        glUniform3f( glGetUniformLocation( lightingShader.Program, "pointLights[2].specular" ), 1.0f, 1.0f, 1.0f );
-        glUniform1f( glGetUniformLocation( lightingShader.Program, "pointLights[2].constant" ), 1.0f );
-        glUniform1f( glGetUniformLocation( lightingShader.Program, "pointLights[2].linear" ), 0.09f );
-        glUniform1f( glGetUniformLocation( lightingShader.Program, "pointLights[2].quadratic" ), 0.032f );
-
-        glUniform3f( glGetUniformLocation( lightingShader.Program, "pointLights[3].position" ), pointLightPos[3].x, pointLightPos[3].y, pointLightPos[3].z );
-        glUniform3f( glGetUniformLocation( lightingShader.Program, "pointLights[3].ambient" ), 0.05f, 0.05f, 0.05f );
-        glUniform3f( glGetUniformLocation( lightingShader.Program, "pointLights[3].diffuse" ), 0.8f, 0.8f, 0.8f );
-        glUniform3f( glGetUniformLocation( lightingShader.Program, "pointLights[3].specular" ), 1.0f, 1.0f, 1.0f );
-        glUniform1f( glGetUniformLocation( lightingShader.Program, "pointLights[3].constant" ), 1.0f );
-        glUniform1f( glGetUniformLocation( lightingShader.Program, "pointLights[3].linear" ), 0.09f );
-        glUniform1f( glGetUniformLocation( lightingShader.Program, "pointLights[3].quadratic" ), 0.032f );
+        // Run the steps that fit into the time since the last frame. Mouse look is applied as its events arrive instead
+        Profiler::Get( ).Begin( "Simulate" );
+        GLuint simulationSteps = 0;
+        for ( ; simulationLag >= SIMULATION_STEP && simulationSteps < MAX_SIMULATION_STEPS; simulationSteps++ )
+        {
+            previousCameraPosition = camera.GetPosition( );
+            DoMovement( );
+            simulationLag -= SIMULATION_STEP;
+        }
         
-        glUniform3f( glGetUniformLocation( lightingShader.Program, "spotLight.position" ), camera.GetPosition( ).x, camera.GetPosition( ).y, camera.GetPosition( ).z );
-        glUniform3f( glGetUniformLocation( lightingShader.Program, "spotLight.direction" ), camera.GetFront( ).x, camera.GetFront( ).y, camera.GetFront( ).z );
-        glUniform3f( glGetUniformLocation( lightingShader.Program, "spotLight.ambient" ), 0.0f, 0.0f, 0.0f );
-        glUniform3f( glGetUniformLocation( lightingShader.Program, "spotLight.diffuse" ), 1.0f, 1.0f, 1.0f );
-        glUniform3f( glGetUniformLocation( lightingShader.Program, "spotLight.specular" ), 1.0f, 1.0f, 1.0f );
-        glUniform1f( glGetUniformLocation( lightingShader.Program, "spotLight.constant" ), 1.0f );
-        glUniform1f( glGetUniformLocation( lightingShader.Program, "spotLight.linear" ), 0.09f );
-        glUniform1f( glGetUniformLocation( lightingShader.Program, "spotLight.quadratic" ), 0.032f );
-        glUniform1f( glGetUniformLocation( lightingShader.Program, "spotLight.cutOff" ), glm::cos( glm::radians( 12.5f ) ) );
-        glUniform1f( glGetUniformLocation( lightingShader.Program, "spotLight.outerCutOff" ), glm::cos( glm::radians( 15.0f ) ) );
+        if ( simulationLag >= SIMULATION_STEP )
+        {
+            simulationLag = std::fmod( simulationLag, SIMULATION_STEP );
+        }
         
-        // Create transformations
-        glm::mat4 model, view;
-        // model = glm::rotate( model, ( GLfloat)glfwGetTime( ) * 1.0f, glm::vec3( 0.5f, 1.0f, 0.0f ) );
-        view = camera.GetViewMatrix ();
+        Profiler::Get( ).End( );
         
-        // Get their uniform location
-        GLint modelLoc = glGetUniformLocation( lightingShader.Program, "model" );
-        GLint viewLoc = glGetUniformLocation( lightingShader.Program, "view" );
-        GLint projLoc = glGetUniformLocation( lightingShader.Program, "projection" );
-        // Pass them to the shaders
-        glUniformMatrix4fv( modelLoc, 1, GL_FALSE, glm::value_ptr( model ) );
-        glUniformMatrix4fv( viewLoc, 1, GL_FALSE, glm::value_ptr( view ) );
-        glUniformMatrix4fv( projLoc, 1, GL_FALSE, glm::value_ptr( projection ) );
+        // J prints how busy the job system's workers were since the last time, then benchmarks the scheduler
+        if ( jobSystemReport )
+        {
+            JobSystem::Get( ).PrintStats( );
+            JobSystem::Get( ).Benchmark( );
+            jobSystemReport = false;
+        }
         
-        // Set texture units
-        glUniform1i( glGetUniformLocation( lightingShader.Program, "material.diffuse" ),  0 );
-        glUniform1i( glGetUniformLocation( lightingShader.Program, "material.specular" ), 1 );
-        glActiveTexture( GL_TEXTURE0 );
-        glBindTexture( GL_TEXTURE_2D, cubeDiffuseMap );
-        glActiveTexture( GL_TEXTURE1 );
-        glBindTexture( GL_TEXTURE_2D, cubeSpecularMap );
+        // K prints the profiler's rolling times, T starts a trace and writes it to profile_<n>.json on the next press
+        if ( profilerReport )
+        {
+            Profiler::Get( ).PrintSummary( );
+            profilerReport = false;
+        }
         
-        glBindVertexArray (VAO);
-        // glDrawElements(GL_TRIANGLES, 6, GL_UNSIGNED_INT, 0);
-        // glDrawArrays(GL_TRIANGLES, 0, 36);
-        for ( GLuint i = 0; i < 10; i++ )
+        if ( toggleTraceCapture )
         {
-            model = glm::mat4( );
-            model = glm::translate( model, cubePositions[i] );
-            model = glm::rotate( model, 20.0f * i, glm::vec3( 1.0f, 0.3f, 0.5f ) );
-            glUniformMatrix4fv( modelLoc, 1, GL_FALSE, glm::value_ptr( model ) );
+            if ( Profiler::Get( ).Capturing( ) )
+            {
+                char traceName[64];
+                snprintf( traceName, sizeof( traceName ), "profile_%05u.json", capturedTraces++ );
+                Profiler::Get( ).WriteTrace( traceName );
+                Profiler::Get( ).PrintSummary( );
+            }
+            else
+            {
+                Profiler::Get( ).StartCapture( );
+            }
             
-            glDrawArrays( GL_TRIANGLES, 0, 36 );
+            toggleTraceCapture = false;
         }
-        glBindVertexArray (0);
-        
-        glActiveTexture( GL_TEXTURE0 );
-        glBindTexture( GL_TEXTURE_2D, 0 );
-        glActiveTexture( GL_TEXTURE1 );
-        glBindTexture( GL_TEXTURE_2D, 0 );
-
-        // render lamp
-        lampShader.Use( );
-        modelLoc = glGetUniformLocation( lampShader.Program, "model" );
-        viewLoc = glGetUniformLocation( lampShader.Program, "view" );
-        projLoc = glGetUniformLocation( lampShader.Program, "projection" );
         
-        glUniformMatrix4fv( viewLoc, 1, GL_FALSE, glm::value_ptr( view ) );
-        glUniformMatrix4fv( projLoc, 1, GL_FALSE, glm::value_ptr( projection ) );
-        
-        glBindVertexArray( lightVAO );
-        for (int i = 0; i < 4; i++) {
-            model = glm::mat4();
-            model = glm::translate( model, pointLightPos[i] );
-            model = glm::scale( model, glm::vec3( 0.2f ) );
-            glUniformMatrix4fv( modelLoc, 1, GL_FALSE, glm::value_ptr( model ) );
-            glDrawArrays( GL_TRIANGLES, 0, 36 );
+        {
+            std::lock_guard<std::mutex> lock( titleLock );
+            
+            if ( titleChanged )
+            {
+                glfwSetWindowTitle( window, windowTitle );
+                titleChanged = false;
+            }
         }
-        glBindVertexArray( 0 );
-        
-        // Draw the loaded model
-        modelShader.Use();
-        viewPosLoc = glGetUniformLocation( modelShader.Program, "viewPos" );
-        glUniform3f( viewPosLoc, camera.GetPosition( ).x, camera.GetPosition( ).y, camera.GetPosition( ).z );
-        
-        glUniform3f( glGetUniformLocation( modelShader.Program, "dirLight.direction" ), dirLightDir.x, dirLightDir.y, dirLightDir.z);
-        glUniform3f( glGetUniformLocation( modelShader.Program, "dirlight.ambient" ), 0.2f, 0.2f, 0.2f);
-        glUniform3f( glGetUniformLocation( modelShader.Program, "dirlight.diffuse" ), 0.8f, 0.8f, 0.8f);
         
-        glUniform3f( glGetUniformLocation( modelShader.Program, "pointLight.position" ), pointLightPos[0].x, pointLightPos[0].y, pointLightPos[0].z );
-        glUniform3f( glGetUniformLocation( modelShader.Program, "pointLight.ambient" ), 0.05f, 0.05f, 0.05f );
-        glUniform3f( glGetUniformLocation( modelShader.Program, "pointLight.diffuse" ), 0.8f, 0.8f, 0.8f );
-        glUniform3f( glGetUniformLocation( modelShader.Program, "pointLight.specular" ), 1.0f, 1.0f, 1.0f );
-        glUniform1f( glGetUniformLocation( modelShader.Program, "pointLight.constant" ), 1.0f );
-        glUniform1f( glGetUniformLocation( modelShader.Program, "pointLight.linear" ), 0.09f );
-        glUniform1f( glGetUniformLocation( modelShader.Program, "pointLight.quadratic" ), 0.032f );
+        // Wait until the render thread is done with the older snapshot, so this thread stays at most one frame ahead
+        FrameSnapshot *frame = WaitForSnapshot( freeFrames );
+        frame->inputTime = glfwGetTime( );
+        // The camera is drawn as far between its last two steps as the leftover time is into the next one
+        frame->viewPos = glm::mix( previousCameraPosition, camera.GetPosition( ), ( GLfloat )( simulationLag / SIMULATION_STEP ) );
+        frame->view = camera.GetViewMatrix( frame->viewPos );
+        frame->viewFront = camera.GetFront( );
+        frame->flashlightOn = flashlightOn;
+        frame->deferredShading = deferredShading;
+        frame->depthPrePass = depthPrePass;
+        // With per-object light lists the forward path finds the lights per draw instead
+        frame->perObjectLights = objectLightLists && !deferredShading;
+        frame->plainUniforms = plainUniforms;
+        frame->takeScreenshot = takeScreenshot || recordFrames;
+        takeScreenshot = false;
         
-        glUniform3f( glGetUniformLocation( modelShader.Program, "spotLight.position" ), camera.GetPosition( ).x, camera.GetPosition( ).y, camera.GetPosition( ).z );
-        glUniform3f( glGetUniformLocation( modelShader.Program, "spotLight.direction" ), camera.GetFront( ).x, camera.GetFront( ).y, camera.GetFront( ).z );
-        glUniform3f( glGetUniformLocation( modelShader.Program, "spotLight.ambient" ), 0.0f, 0.0f, 0.0f );
-        glUniform3f( glGetUniformLocation( modelShader.Program, "spotLight.diffuse" ), 1.0f, 1.0f, 1.0f );
-        glUniform3f( glGetUniformLocation( modelShader.Program, "spotLight.specular" ), 1.0f, 1.0f, 1.0f );
-        glUniform1f( glGetUniformLocation( modelShader.Program, "spotLight.constant" ), 1.0f );
-        glUniform1f( glGetUniformLocation( modelShader.Program, "spotLight.linear" ), 0.09f );
-        glUniform1f( glGetUniformLocation( modelShader.Program, "spotLight.quadratic" ), 0.032f );
-        glUniform1f( glGetUniformLocation( modelShader.Program, "spotLight.cutOff" ), glm::cos( glm::radians( 12.5f ) ) );
-        glUniform1f( glGetUniformLocation( modelShader.Program, "spotLight.outerCutOff" ), glm::cos( glm::radians( 15.0f ) ) );
-        
-        model = glm::mat4();
-        model = glm::translate( model, glm::vec3( 2.0f, -1.75f, 1.0f ) );
-        model = glm::scale( model, glm::vec3( 0.2f, 0.2f, 0.2f ) );
-        glUniformMatrix4fv( glGetUniformLocation( modelShader.Program, "model" ), 1, GL_FALSE, glm::value_ptr( model ) );
-        glUniformMatrix4fv( glGetUniformLocation( modelShader.Program, "view" ), 1, GL_FALSE, glm::value_ptr( view ) );
-        glUniformMatrix4fv( glGetUniformLocation( modelShader.Program, "projection" ), 1, GL_FALSE, glm::value_ptr( projection ) );
-        loadedModel.Draw(modelShader);
-        
-        // Draw skybox as last
-        glDepthFunc( GL_LEQUAL );  // Change depth function so depth test passes when values are equal to depth buffer's content
-        skyboxShader.Use( );
-        view = glm::mat4( glm::mat3( camera.GetViewMatrix( ) ) );	// Remove any translation component of the view matrix
-        glUniformMatrix4fv( glGetUniformLocation( skyboxShader.Program, "view" ), 1, GL_FALSE, glm::value_ptr( view ) );
-        glUniformMatrix4fv( glGetUniformLocation( skyboxShader.Program, "projection" ), 1, GL_FALSE, glm::value_ptr( projection ) );
+        frame->pointLightsChanged = pointLightsChanged;
+        if ( pointLightsChanged )
+        {
+            frame->pointLights = BuildPointLights( EXTRA_LIGHT_COUNTS[extraLightStep] );
+            objectLights.SetLights( frame->pointLights );
+            pointLightsChanged = false;
+        }
         
-        glBindVertexArray( skyboxVAO );
-        glBindTexture( GL_TEXTURE_CUBE_MAP, cubemapTexture );
-        glDrawArrays( GL_TRIANGLES, 0, 36 );
-        glBindVertexArray( 0 );
-        glDepthFunc( GL_LESS ); // Set depth function back to default
+        // Both the depth pre-pass and the lit pass draw the boxes and the model with these. The transforms alone are too
+        // little work for a job, only the per-object light searches get spread over the workers once there are enough lights
+        Profiler::Get( ).Begin( "Object transforms" );
+        GLuint objectsPerJob = LIT_OBJECT_COUNT;
+        if ( frame->perObjectLights && objectLights.LightCount( ) > 0 )
+        {
+            objectsPerJob = std::max( 1u, MIN_LIGHT_TESTS_PER_JOB / objectLights.LightCount( ) );
+        }
+        JobSystem::Get( ).ParallelFor( 0, LIT_OBJECT_COUNT, objectsPerJob, [&, frame]( GLuint first, GLuint last )
+        {
+            for ( GLuint i = first; i < last; i++ )
+            {
+                glm::vec3 boundsMin( -0.5f ), boundsMax( 0.5f );
+                
+                if ( i < 10 )
+                {
+                    frame->boxModels[i] = glm::translate( glm::mat4( ), cubePositions[i] );
+                    frame->boxModels[i] = glm::rotate( frame->boxModels[i], 20.0f * i, glm::vec3( 1.0f, 0.3f, 0.5f ) );
+                    // Normals go through the inverse transpose, once per box instead of once per vertex
+                    frame->boxNormalMatrices[i] = glm::inverseTranspose( glm::mat3( frame->boxModels[i] ) );
+                }
+                else
+                {
+                    frame->suitModel = glm::translate( glm::mat4( ), glm::vec3( 2.0f, -1.75f, 1.0f ) );
+                    frame->suitModel = glm::scale( frame->suitModel, glm::vec3( 0.2f, 0.2f, 0.2f ) );
+                    frame->suitNormalMatrix = glm::inverseTranspose( glm::mat3( frame->suitModel ) );
+                    loadedModel.GetBounds( boundsMin, boundsMax );
+                }
+                
+                if ( frame->perObjectLights )
+                {
+                    ObjectLights::TransformBounds( i < 10 ? frame->boxModels[i] : frame->suitModel, boundsMin, boundsMax );
+                    objectLights.Find( boundsMin, boundsMax, frame->objectLightIndices[i] );
+                }
+            }
+        } );
+        Profiler::Get( ).End( );
         
-        // Swap the screen buffers
-        glfwSwapBuffers( window );
+        queuedFrames.Push( frame );
     }
     
-    glDeleteVertexArrays (1, &VAO);
-    glDeleteVertexArrays( 1, &lightVAO );
-    glDeleteBuffers (1, &VBO);
+    // An empty snapshot with quit set stops the render thread, which gives the context back
+    FrameSnapshot *frame = WaitForSnapshot( freeFrames );
+    frame->quit = true;
+    queuedFrames.Push( frame );
+    renderThread.join( );
     
     // Terminate GLFW, clearing any resources allocated by GLFW.
     glfwTerminate( );
@@ -455,31 +947,229 @@ int main( )
     return EXIT_SUCCESS;
 }
 
-// Moves/alters the camera positions based on user input
+// Moves/alters the camera positions based on user input, by one simulation step
 void DoMovement( )
 {
     // Camera controls
     if( keys[GLFW_KEY_W] || keys[GLFW_KEY_UP] )
     {
-        camera.ProcessKeyboard( FORWARD, deltaTime );
+        camera.ProcessKeyboard( FORWARD, SIMULATION_STEP );
     }
     
     if( keys[GLFW_KEY_S] || keys[GLFW_KEY_DOWN] )
     {
-        camera.ProcessKeyboard( BACKWARD, deltaTime );
+        camera.ProcessKeyboard( BACKWARD, SIMULATION_STEP );
     }
     
     if( keys[GLFW_KEY_A] || keys[GLFW_KEY_LEFT] )
     {
-        camera.ProcessKeyboard( LEFT, deltaTime );
+        camera.ProcessKeyboard( LEFT, SIMULATION_STEP );
     }
     
     if( keys[GLFW_KEY_D] || keys[GLFW_KEY_RIGHT] )
     {
-        camera.ProcessKeyboard( RIGHT, deltaTime );
+        camera.ProcessKeyboard( RIGHT, SIMULATION_STEP );
     }
 }
 
+// The four lamps plus extraLights small colored lights scattered around the boxes, always the same ones for a given count
+std::vector<ClusterLight> BuildPointLights( GLuint extraLights )
+{
+    std::vector<ClusterLight> lights;
+    
+    for ( int i = 0; i < 4; i++ )
+    {
+        ClusterLight light;
+        light.position = pointLightPos[i];
+        light.constant = 1.0f;
+        light.linear = 0.09f;
+        light.quadratic = 0.032f;
+        light.ambient = glm::vec3( 0.05f );
+        light.diffuse = glm::vec3( 0.8f );
+        light.specular = glm::vec3( 1.0f );
+        lights.push_back( light );
+    }
+    
+    std::mt19937 random( 1 );
+    std::uniform_real_distribution<GLfloat> x( -20.0f, 20.0f ), y( -6.0f, 8.0f ), z( -30.0f, 10.0f ), channel( 0.1f, 0.5f );
+    
+    for ( GLuint i = 0; i < extraLights; i++ )
+    {
+        ClusterLight light;
+        light.position = glm::vec3( x( random ), y( random ), z( random ) );
+        // Falls off fast so each one reaches less than two units
+        light.constant = 1.0f;
+        light.linear = 0.0f;
+        light.quadratic = 40.0f;
+        light.ambient = glm::vec3( 0.0f );
+        light.diffuse = glm::vec3( channel( random ), channel( random ), channel( random ) );
+        light.specular = light.diffuse;
+        lights.push_back( light );
+    }
+    
+    return lights;
+}
+
+// The SceneLights block shared by the forward lit shaders and the deferred lighting pass
+SceneLights BuildSceneLights( const FrameSnapshot &frame )
+{
+    SceneLights lights;
+    
+    // Only the direction used to reach the shaders (the colors were set on a misspelt "dirlight"), so the sun stays
+    // black and the scene looks as it was tuned
+    lights.dirLightDirection = glm::vec4( dirLightDir, 0.0f );
+    lights.dirLightAmbient = glm::vec4( 0.0f );
+    lights.dirLightDiffuse = glm::vec4( 0.0f );
+    lights.dirLightSpecular = glm::vec4( 0.0f );
+    
+    lights.spotLightPosition = glm::vec4( frame.viewPos, 0.0f );
+    lights.spotLightDirection = frame.viewFront;
+    lights.spotLightAmbient = glm::vec4( 0.0f, 0.0f, 0.0f, 0.0f );
+    lights.spotLightDiffuse = glm::vec4( 1.0f, 1.0f, 1.0f, 0.0f );
+    lights.spotLightSpecular = glm::vec4( 1.0f, 1.0f, 1.0f, 0.0f );
+    lights.spotLightConstant = 1.0f;
+    lights.spotLightLinear = 0.09f;
+    lights.spotLightQuadratic = 0.032f;
+    lights.spotLightCutOff = glm::cos( glm::radians( 12.5f ) );
+    lights.spotLightOuterCutOff = glm::cos( glm::radians( 15.0f ) );
+    
+    lights.viewPos = glm::vec4( frame.viewPos, 0.0f );
+    
+    return lights;
+}
+
+// Submits one set of the scene's programs, the driver keeps compiling them until their futures are fetched
+SceneShaders SubmitSceneShaders( ShaderManager &shaderManager, bool plainUniforms )
+{
+    SceneShaders shaders;
+    ShaderDefines baseDefines;
+    
+    if ( plainUniforms )
+    {
+        baseDefines.Set( "PLAIN_UNIFORMS" );
+    }
+    else
+    {
+        baseDefines.Set( "OBJECT_COUNT", ( int )OBJECT_COUNT ).Set( "LIT_OBJECT_COUNT", ( int )LIT_OBJECT_COUNT );
+    }
+    
+    auto load = [&]( const GLchar *vertexPath, const GLchar *fragmentPath, const ShaderDefines &defines )
+    {
+        return shaderManager.Load( vertexPath, fragmentPath, defines );
+    };
+    
+    // The lit shaders come in variants with and without the flashlight, [1] has it
+    // Both read their point lights from the froxel light lists
+    ShaderDefines boxDefines( baseDefines ), modelDefines( baseDefines );
+    LightClusters::AddDefines( boxDefines ).Set( "HAS_SPECULAR_MAP" );
+    LightClusters::AddDefines( modelDefines );
+    shaders.lighting[0] = load( "resources/shaders/lighting.vert", "resources/shaders/lighting.frag", boxDefines );
+    shaders.lighting[1] = load( "resources/shaders/lighting.vert", "resources/shaders/lighting.frag", ShaderDefines( boxDefines ).Set( "HAS_SPOT_LIGHT" ) );
+    shaders.model[0] = load( "resources/shaders/model.vert", "resources/shaders/model.frag", modelDefines );
+    shaders.model[1] = load( "resources/shaders/model.vert", "resources/shaders/model.frag", ShaderDefines( modelDefines ).Set( "HAS_SPOT_LIGHT" ) );
+    // Forward variants that loop over per-object light lists instead of the froxel ones
+    ShaderDefines boxObjectDefines( baseDefines ), modelObjectDefines( baseDefines );
+    ObjectLights::AddDefines( boxObjectDefines ).Set( "HAS_SPECULAR_MAP" );
+    ObjectLights::AddDefines( modelObjectDefines );
+    shaders.lightingObject[0] = load( "resources/shaders/lighting.vert", "resources/shaders/lighting.frag", boxObjectDefines );
+    shaders.lightingObject[1] = load( "resources/shaders/lighting.vert", "resources/shaders/lighting.frag", ShaderDefines( boxObjectDefines ).Set( "HAS_SPOT_LIGHT" ) );
+    shaders.modelObject[0] = load( "resources/shaders/model.vert", "resources/shaders/model.frag", modelObjectDefines );
+    shaders.modelObject[1] = load( "resources/shaders/model.vert", "resources/shaders/model.frag", ShaderDefines( modelObjectDefines ).Set( "HAS_SPOT_LIGHT" ) );
+    // The deferred path's G-buffer variants and lighting pass
+    shaders.lightingGBuffer = load( "resources/shaders/lighting.vert", "resources/shaders/lighting.frag", ShaderDefines( boxDefines ).Set( "GBUFFER" ) );
+    shaders.modelGBuffer = load( "resources/shaders/model.vert", "resources/shaders/model.frag", ShaderDefines( modelDefines ).Set( "GBUFFER" ) );
+    ShaderDefines deferredDefines( baseDefines );
+    LightClusters::AddDefines( deferredDefines ).Set( "HAS_SPECULAR_MAP" );
+    shaders.deferred[0] = load( "resources/shaders/deferred.vert", "resources/shaders/deferred.frag", deferredDefines );
+    shaders.deferred[1] = load( "resources/shaders/deferred.vert", "resources/shaders/deferred.frag", ShaderDefines( deferredDefines ).Set( "HAS_SPOT_LIGHT" ) );
+    shaders.depth = load( "resources/shaders/depth.vert", "resources/shaders/depth.frag", baseDefines );
+    shaders.lamp = load( "resources/shaders/lamp.vert", "resources/shaders/lamp.frag", baseDefines );
+    
+    return shaders;
+}
+
+// Waits for a set SubmitSceneShaders started. The block set's programs then get their binding points
+void FinishSceneShaders( SceneShaders &shaders, bool plainUniforms )
+{
+    ShaderFuture *programs[] = { &shaders.lighting[0], &shaders.lighting[1], &shaders.model[0], &shaders.model[1], &shaders.lightingObject[0], &shaders.lightingObject[1], &shaders.modelObject[0], &shaders.modelObject[1], &shaders.lightingGBuffer, &shaders.modelGBuffer, &shaders.deferred[0], &shaders.deferred[1], &shaders.depth, &shaders.lamp };
+    
+    for ( ShaderFuture *program : programs )
+    {
+        Shader &shader = program->Get( );
+        
+        if ( !plainUniforms )
+        {
+            BindUniformBlocks( shader );
+        }
+    }
+}
+
+// Points the shader's blocks at the binding points the render loop fills them through
+void BindUniformBlocks( const Shader &shader )
+{
+    shader.BindUniformBlock( "FrameTransforms", FRAME_TRANSFORMS_BINDING );
+    shader.BindUniformBlock( "ObjectTransforms", OBJECT_TRANSFORMS_BINDING );
+    shader.BindUniformBlock( "SceneLights", SCENE_LIGHTS_BINDING );
+    shader.BindUniformBlock( "ObjectLightLists", OBJECT_LIGHTS_BINDING );
+}
+
+// Sets the FrameTransforms and SceneLights values on a PLAIN_UNIFORMS shader in use. Uniforms it does not declare
+// are skipped by the GL
+void SetFrameUniforms( const Shader &shader, const FrameTransforms &transforms, const SceneLights &lights )
+{
+    glUniformMatrix4fv( glGetUniformLocation( shader.Program, "view" ), 1, GL_FALSE, glm::value_ptr( transforms.view ) );
+    glUniformMatrix4fv( glGetUniformLocation( shader.Program, "projection" ), 1, GL_FALSE, glm::value_ptr( transforms.projection ) );
+    
+    glUniform3fv( glGetUniformLocation( shader.Program, "dirLight.direction" ), 1, glm::value_ptr( lights.dirLightDirection ) );
+    glUniform3fv( glGetUniformLocation( shader.Program, "dirLight.ambient" ), 1, glm::value_ptr( lights.dirLightAmbient ) );
+    glUniform3fv( glGetUniformLocation( shader.Program, "dirLight.diffuse" ), 1, glm::value_ptr( lights.dirLightDiffuse ) );
+    glUniform3fv( glGetUniformLocation( shader.Program, "dirLight.specular" ), 1, glm::value_ptr( lights.dirLightSpecular ) );
+    
+    glUniform3fv( glGetUniformLocation( shader.Program, "spotLight.position" ), 1, glm::value_ptr( lights.spotLightPosition ) );
+    glUniform3fv( glGetUniformLocation( shader.Program, "spotLight.direction" ), 1, glm::value_ptr( lights.spotLightDirection ) );
+    glUniform1f( glGetUniformLocation( shader.Program, "spotLight.cutOff" ), lights.spotLightCutOff );
+    glUniform1f( glGetUniformLocation( shader.Program, "spotLight.outerCutOff" ), lights.spotLightOuterCutOff );
+    glUniform1f( glGetUniformLocation( shader.Program, "spotLight.constant" ), lights.spotLightConstant );
+    glUniform1f( glGetUniformLocation( shader.Program, "spotLight.linear" ), lights.spotLightLinear );
+    glUniform1f( glGetUniformLocation( shader.Program, "spotLight.quadratic" ), lights.spotLightQuadratic );
+    glUniform3fv( glGetUniformLocation( shader.Program, "spotLight.ambient" ), 1, glm::value_ptr( lights.spotLightAmbient ) );
+    glUniform3fv( glGetUniformLocation( shader.Program, "spotLight.diffuse" ), 1, glm::value_ptr( lights.spotLightDiffuse ) );
+    glUniform3fv( glGetUniformLocation( shader.Program, "spotLight.specular" ), 1, glm::value_ptr( lights.spotLightSpecular ) );
+    
+    glUniform3fv( glGetUniformLocation( shader.Program, "viewPos" ), 1, glm::value_ptr( lights.viewPos ) );
+}
+
+// Sets an ObjectTransform's values on a PLAIN_UNIFORMS shader in use
+void SetObjectUniforms( const Shader &shader, const ObjectTransform &transform )
+{
+    glm::mat3 normalMatrix( glm::vec3( transform.normalMatrix[0] ), glm::vec3( transform.normalMatrix[1] ), glm::vec3( transform.normalMatrix[2] ) );
+    
+    glUniformMatrix4fv( glGetUniformLocation( shader.Program, "model" ), 1, GL_FALSE, glm::value_ptr( transform.model ) );
+    glUniformMatrix3fv( glGetUniformLocation( shader.Program, "normalMatrix" ), 1, GL_FALSE, glm::value_ptr( normalMatrix ) );
+}
+
+// Takes the next snapshot off queue, waiting for the other thread to put one there. Spins briefly first since the
+// wait is usually short, then sleeps so a thread waiting out a vsync does not keep a core busy
+FrameSnapshot *WaitForSnapshot( SpscQueue<FrameSnapshot *, 2> &queue )
+{
+    ProfileScope scope( "Wait for snapshot" );
+    FrameSnapshot *frame;
+    
+    for ( GLuint tries = 0; !queue.Pop( frame ); tries++ )
+    {
+        if ( tries < 64 )
+        {
+            std::this_thread::yield( );
+        }
+        else
+        {
+            std::this_thread::sleep_for( std::chrono::microseconds( 100 ) );
+        }
+    }
+    
+    return frame;
+}
+
 // Is called whenever a key is pressed/released via GLFW
 void KeyCallback( GLFWwindow *window, int key, int scancode, int action, int mode )
 {
@@ -488,6 +1178,62 @@ void KeyCallback( GLFWwindow *window, int key, int scancode, int action, int mod
         glfwSetWindowShouldClose(window, GL_TRUE);
     }
     
+    if( key == GLFW_KEY_F && action == GLFW_PRESS )
+    {
+        flashlightOn = !flashlightOn;
+    }
+    
+    if( key == GLFW_KEY_F12 && action == GLFW_PRESS )
+    {
+        takeScreenshot = true;
+    }
+    
+    if( key == GLFW_KEY_F11 && action == GLFW_PRESS )
+    {
+        recordFrames = !recordFrames;
+    }
+    
+    if( key == GLFW_KEY_G && action == GLFW_PRESS )
+    {
+        deferredShading = !deferredShading;
+    }
+    
+    if( key == GLFW_KEY_P && action == GLFW_PRESS )
+    {
+        depthPrePass = !depthPrePass;
+    }
+    
+    if( key == GLFW_KEY_O && action == GLFW_PRESS )
+    {
+        objectLightLists = !objectLightLists;
+    }
+    
+    if( key == GLFW_KEY_U && action == GLFW_PRESS )
+    {
+        plainUniforms = !plainUniforms;
+    }
+    
+    if( key == GLFW_KEY_J && action == GLFW_PRESS )
+    {
+        jobSystemReport = true;
+    }
+    
+    if( key == GLFW_KEY_K && action == GLFW_PRESS )
+    {
+        profilerReport = true;
+    }
+    
+    if( key == GLFW_KEY_T && action == GLFW_PRESS )
+    {
+        toggleTraceCapture = true;
+    }
+    
+    if( key == GLFW_KEY_L && action == GLFW_PRESS )
+    {
+        extraLightStep = ( extraLightStep + 1 ) % ( sizeof( EXTRA_LIGHT_COUNTS ) / sizeof( EXTRA_LIGHT_COUNTS[0] ) );
+        pointLightsChanged = true;
+    }
+    
     if ( key >= 0 && key < 1024 )
     {
         if( action == GLFW_PRESS )
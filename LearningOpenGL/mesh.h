@@ -40,7 +40,7 @@ public:
         this->setupMesh();
     }
     
-    void Draw( Shader shader )
+    void Draw( Shader &shader )
     {
         GLuint diffuseNum = 1;
         GLuint specularNum = 1;
@@ -82,8 +82,26 @@ public:
         }
     }
     
+    // Draws positions only, for depth-only passes
+    void DrawDepth( )
+    {
+        glBindVertexArray( this->depthVAO );
+        glDrawElements( GL_TRIANGLES, this->indices.size( ), GL_UNSIGNED_INT, 0 );
+        glBindVertexArray( 0 );
+    }
+    
+    // Deletes the vertex arrays and buffers, on the thread that holds the context
+    void Release( )
+    {
+        GLuint vertexArrays[] = { this->VAO, this->depthVAO };
+        GLuint buffers[] = { this->VBO, this->EBO, this->positionVBO };
+        glDeleteVertexArrays( 2, vertexArrays );
+        glDeleteBuffers( 3, buffers );
+    }
+    
 private:
     GLuint VAO, VBO, EBO;
+    GLuint depthVAO, positionVBO;
     
     void setupMesh()
     {
@@ -113,6 +131,23 @@ private:
         glEnableVertexAttribArray(2);
         glVertexAttribPointer( 2, 2, GL_FLOAT, GL_FALSE, sizeof( Vertex ), ( GLvoid * )offsetof(Vertex, TexCoords) );
         
+        // Depth-only passes read the positions alone, packed so they fetch a third of the vertex data
+        std::vector<glm::vec3> positions( this->vertices.size( ) );
+        for ( GLuint i = 0; i < this->vertices.size( ); i++ )
+        {
+            positions[i] = this->vertices[i].Position;
+        }
+        
+        glGenVertexArrays( 1, &this->depthVAO );
+        glGenBuffers( 1, &this->positionVBO );
+        
+        glBindVertexArray( this->depthVAO );
+        glBindBuffer( GL_ARRAY_BUFFER, this->positionVBO );
+        glBufferData( GL_ARRAY_BUFFER, positions.size( ) * sizeof( glm::vec3 ), &positions[0], GL_STATIC_DRAW );
+        glBindBuffer( GL_ELEMENT_ARRAY_BUFFER, this->EBO );
+        glEnableVertexAttribArray( 0 );
+        glVertexAttribPointer( 0, 3, GL_FLOAT, GL_FALSE, sizeof( glm::vec3 ), ( GLvoid * )0 );
+        
         glBindVertexArray(0);
     }
 };
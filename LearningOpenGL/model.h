@@ -6,6 +6,7 @@
 #include <iostream>
 #include <map>
 #include <vector>
+#include <cmath>
 
 #include <GL/glew.h>
 #include <glm/glm.hpp>
@@ -16,21 +17,22 @@
 
 #include "SOIL2/SOIL2.h"
 #include "Mesh.h"
+#include "texture.h"
+#include "jobsystem.h"
+#include "profiler.h"
 
 using namespace std;
 
-GLint TextureFromFile(const char *path, string directory);
-
 class Model
 {
 public:
-    Model( GLchar *path )
+    Model( GLchar *path ) : boundsMin( HUGE_VALF ), boundsMax( -HUGE_VALF )
     {
         this->loadModel( path );
     }
     
     // Draws the model, and thus all its meshes
-    void Draw( Shader shader )
+    void Draw( Shader &shader )
     {
         for ( GLuint i = 0; i < this->meshes.size( ); i++ )
         {
@@ -38,16 +40,66 @@ public:
         }
     }
     
+    // Draws the positions of all its meshes, for depth-only passes
+    void DrawDepth( )
+    {
+        for ( GLuint i = 0; i < this->meshes.size( ); i++ )
+        {
+            this->meshes[i].DrawDepth( );
+        }
+    }
+    
+    // Deletes the meshes' buffers and the textures, on the thread that holds the context
+    void Release( )
+    {
+        for ( GLuint i = 0; i < this->meshes.size( ); i++ )
+        {
+            this->meshes[i].Release( );
+        }
+        
+        for ( GLuint i = 0; i < this->textures_loaded.size( ); i++ )
+        {
+            glDeleteTextures( 1, &this->textures_loaded[i].id );
+        }
+        
+        this->meshes.clear( );
+        this->textures_loaded.clear( );
+    }
+    
+    // Model space box around every vertex
+    void GetBounds( glm::vec3 &boundsMin, glm::vec3 &boundsMax ) const
+    {
+        boundsMin = this->boundsMin;
+        boundsMax = this->boundsMax;
+    }
+    
 private:
     vector<Mesh> meshes;
     string directory;
     vector<Texture> textures_loaded;
+    vector<string> pendingTexturePaths;
+    vector<GLuint> pendingTextureIDs;
+    glm::vec3 boundsMin, boundsMax;
+    
+    // What processMesh makes of one aiMesh
+    struct MeshData
+    {
+        vector<Vertex> vertices;
+        vector<GLuint> indices;
+        glm::vec3 boundsMin, boundsMax;
+        
+        MeshData( ) : boundsMin( HUGE_VALF ), boundsMax( -HUGE_VALF )
+        {
+        }
+    };
     
     void loadModel( string path )
     {
         // Read file via ASSIMP
         Assimp::Importer importer;
+        Profiler::Get( ).Begin( "Import scene" );
         const aiScene *scene = importer.ReadFile( path, aiProcess_Triangulate | aiProcess_FlipUVs );
+        Profiler::Get( ).End( );
         if( !scene || scene->mFlags == AI_SCENE_FLAGS_INCOMPLETE || !scene->mRootNode ) // if is Not Zero
         {
             cout << "ERROR::ASSIMP:: " << importer.GetErrorString() << endl;
@@ -56,33 +108,73 @@ private:
         // Retrieve the directory path of the filepath
         this->directory = path.substr( 0, path.find_last_of( '/' ) );
         // Process ASSIMP's root node recursively
-        this->processNode( scene->mRootNode, scene );
+        vector<aiMesh *> sceneMeshes;
+        this->processNode( scene->mRootNode, scene, sceneMeshes );
+        
+        // The vertex and index conversion of every mesh is independent, so each one is a job. Only the materials
+        // (which reserve texture IDs) and the buffers are made here on the GL thread, in the original mesh order.
+        vector<MeshData> meshData( sceneMeshes.size( ) );
+        JobSystem::Get( ).ParallelFor( 0, ( GLuint )sceneMeshes.size( ), 1, [&sceneMeshes, &meshData]( GLuint first, GLuint last )
+        {
+            for ( GLuint i = first; i < last; i++ )
+            {
+                ProfileScope scope( "Convert mesh" );
+                processMesh( sceneMeshes[i], meshData[i] );
+            }
+        } );
+        
+        Profiler::Get( ).Begin( "Create meshes" );
+        for ( GLuint i = 0; i < sceneMeshes.size( ); i++ )
+        {
+            this->boundsMin = glm::min( this->boundsMin, meshData[i].boundsMin );
+            this->boundsMax = glm::max( this->boundsMax, meshData[i].boundsMax );
+            this->meshes.push_back( Mesh( meshData[i].vertices, meshData[i].indices, this->processMaterial( sceneMeshes[i], scene ) ) );
+        }
+        
+        Profiler::Get( ).End( );
+        
+        // Meshes only hold texture IDs, so every texture the model references can be decoded in one batch
+        vector<GLuint> queuedTextureIDs = this->pendingTextureIDs;
+        TextureLoading::LoadTextures( this->pendingTexturePaths, this->pendingTextureIDs );
+        
+        for ( GLuint i = 0; i < queuedTextureIDs.size( ); i++ )
+        {
+            if ( queuedTextureIDs[i] != this->pendingTextureIDs[i] )
+            {
+                this->replaceTextureID( queuedTextureIDs[i], this->pendingTextureIDs[i] );
+            }
+        }
+        
+        this->pendingTexturePaths.clear( );
+        this->pendingTextureIDs.clear( );
     }
     
-    void processNode( aiNode* node, const aiScene* scene )
+    // Collects the meshes of node and its children, in the order they are drawn
+    void processNode( aiNode* node, const aiScene* scene, vector<aiMesh *> &sceneMeshes )
     {
         // Process each mesh located at the current node
         for ( GLuint i = 0; i < node->mNumMeshes; i++ )
         {
             // The node object only contains indices to index the actual objects in the scene.
             // The scene contains all the data, node is just to keep stuff organized (like relations between nodes).
-            aiMesh* mesh = scene->mMeshes[node->mMeshes[i]];
-            
-            this->meshes.push_back( this->processMesh( mesh, scene ) );
+            sceneMeshes.push_back( scene->mMeshes[node->mMeshes[i]] );
         }
         
         // After we've processed all of the meshes (if any) we then recursively process each of the children nodes
         for ( GLuint i = 0; i < node->mNumChildren; i++ )
         {
-            this->processNode( node->mChildren[i], scene );
+            this->processNode( node->mChildren[i], scene, sceneMeshes );
         }
     }
     
-    Mesh processMesh( aiMesh *mesh, const aiScene *scene )
+    // Converts the vertices and indices of one mesh. Runs as a job, so it touches nothing but its own MeshData
+    static void processMesh( const aiMesh *mesh, MeshData &data )
     {
-        vector<Vertex> vertices;
-        vector<GLuint> indices;
-        vector<Texture> textures;
+        vector<Vertex> &vertices = data.vertices;
+        vector<GLuint> &indices = data.indices;
+        
+        vertices.reserve( mesh->mNumVertices );
+        indices.reserve( mesh->mNumFaces * 3 );
         
         for ( GLuint i = 0; i < mesh->mNumVertices; i++ )
         {
@@ -94,6 +186,8 @@ private:
             vector.y = mesh->mVertices[i].y;
             vector.z = mesh->mVertices[i].z;
             vertex.Position = vector;
+            data.boundsMin = glm::min( data.boundsMin, vector );
+            data.boundsMax = glm::max( data.boundsMax, vector );
             
             // Normals
             vector.x = mesh->mNormals[i].x;
@@ -128,6 +222,12 @@ private:
                 indices.push_back( face.mIndices[j] );
             }
         }
+    }
+    
+    // Textures of the mesh's material, queued for the batch load in loadModel
+    vector<Texture> processMaterial( const aiMesh *mesh, const aiScene *scene )
+    {
+        vector<Texture> textures;
         
         // Process materials
         if( mesh->mMaterialIndex >= 0 )
@@ -149,8 +249,7 @@ private:
             textures.insert( textures.end( ), specularMaps.begin( ), specularMaps.end( ) );
         }
         
-        // Return a mesh object created from the extracted mesh data
-        return Mesh( vertices, indices, textures );
+        return textures;
     }
     
     vector<Texture> loadMaterialTextures( aiMaterial *mat, aiTextureType type, string typeName )
@@ -178,7 +277,7 @@ private:
             if( !skip )
             {
                 Texture texture;
-                texture.id = TextureFromFile( str.C_Str( ), this->directory );
+                texture.id = this->queueTexture( str.C_Str( ) );
                 texture.type = typeName;
                 texture.path = str;
                 textures.push_back( texture );
@@ -188,33 +287,39 @@ private:
         
         return textures;
     }
-};
-
-GLint TextureFromFile( const char *path, string directory )
-{
-    //Generate texture ID and load texture data
-    string filename = string( path );
-    filename = directory + '/' + filename;
-    GLuint textureID;
-    glGenTextures( 1, &textureID );
-    
-    int width, height;
-    
-    unsigned char *image = SOIL_load_image( filename.c_str( ), &width, &height, 0, SOIL_LOAD_RGB );
-    
-    // Assign texture to ID
-    glBindTexture( GL_TEXTURE_2D, textureID );
-    glTexImage2D( GL_TEXTURE_2D, 0, GL_RGB, width, height, 0, GL_RGB, GL_UNSIGNED_BYTE, image );
-    glGenerateMipmap( GL_TEXTURE_2D );
     
-    // Parameters
-    glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT );
-    glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT );
-    glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR );
-    glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-    glBindTexture( GL_TEXTURE_2D, 0 );
-    SOIL_free_image_data( image );
+    // Reserves a texture ID now, the image itself is loaded with the rest of the model's textures in loadModel
+    GLuint queueTexture( const char *path )
+    {
+        GLuint textureID;
+        glGenTextures( 1, &textureID );
+        
+        this->pendingTexturePaths.push_back( this->directory + '/' + string( path ) );
+        this->pendingTextureIDs.push_back( textureID );
+        
+        return textureID;
+    }
     
-    printf("Load texture %d: %s\n", textureID, path);
-    return textureID;
-}
+    // Points every mesh that used the texture oldID at newID, after LoadTextures had to make it again
+    void replaceTextureID( GLuint oldID, GLuint newID )
+    {
+        for ( GLuint i = 0; i < this->meshes.size( ); i++ )
+        {
+            for ( GLuint j = 0; j < this->meshes[i].textures.size( ); j++ )
+            {
+                if ( oldID == this->meshes[i].textures[j].id )
+                {
+                    this->meshes[i].textures[j].id = newID;
+                }
+            }
+        }
+        
+        for ( GLuint i = 0; i < this->textures_loaded.size( ); i++ )
+        {
+            if ( oldID == this->textures_loaded[i].id )
+            {
+                this->textures_loaded[i].id = newID;
+            }
+        }
+    }
+};
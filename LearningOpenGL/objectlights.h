@@ -0,0 +1,192 @@
+#pragma once
+
+// Std. Includes
+#include <iostream>
+#include <vector>
+#include <cmath>
+#include <algorithm>
+
+// GL Includes
+#define GLEW_STATIC
+#include <GL/glew.h>
+
+#include <glm/glm.hpp>
+
+#include "shader.h"
+#include "lightclusters.h"
+#include "dynamicbuffer.h"
+
+// Per-object light lists. Every draw gets the indices of the point lights whose range reaches its world space bounds,
+// written to a DynamicBuffer along with the other objects' as lights.glsl's ObjectLightLists block (or set as plain
+// uniforms), and the lit shaders only loop over those. The light data itself is read from LightClusters' light
+// buffer, so both are given the same lights.
+class ObjectLights
+{
+public:
+    // Size of the shaders' index array, lights past it are dropped
+    static const GLuint MAX_LIGHTS = 128;
+    
+    ObjectLights( ) : block( ), tooManyLights( false )
+    {
+    }
+    
+    // Turns a define set into the per-object variant of lights.glsl
+    static ShaderDefines &AddDefines( ShaderDefines &defines )
+    {
+        return defines.Set( "OBJECT_POINT_LIGHTS" ).Set( "MAX_OBJECT_LIGHTS", ( int )MAX_LIGHTS );
+    }
+    
+    // Replaces the point lights, in the order LightClusters::SetLights got them
+    void SetLights( const std::vector<ClusterLight> &lights )
+    {
+        // One array per coordinate, padded to a multiple of four with lights that reach nothing
+        GLuint padded = ( ( GLuint )lights.size( ) + 3 ) & ~3u;
+        
+        this->x.assign( padded, 0.0f );
+        this->y.assign( padded, 0.0f );
+        this->z.assign( padded, 0.0f );
+        this->radius2.assign( padded, -1.0f );
+        
+        for ( GLuint i = 0; i < lights.size( ); i++ )
+        {
+            GLfloat radius = LightClusters::LightRadius( lights[i] );
+            
+            this->x[i] = lights[i].position.x;
+            this->y[i] = lights[i].position.y;
+            this->z[i] = lights[i].position.z;
+            this->radius2[i] = radius * radius;
+        }
+    }
+    
+    // World space bounds of the model space box [boundsMin, boundsMax] under model, replaced in place
+    static void TransformBounds( const glm::mat4 &model, glm::vec3 &boundsMin, glm::vec3 &boundsMax )
+    {
+        glm::vec3 newMin( model[3] ), newMax( model[3] );
+        
+        // Each axis of the new box takes the smaller and larger end of every column's contribution
+        for ( GLuint i = 0; i < 3; i++ )
+        {
+            for ( GLuint j = 0; j < 3; j++ )
+            {
+                GLfloat a = model[j][i] * boundsMin[j];
+                GLfloat b = model[j][i] * boundsMax[j];
+                
+                newMin[i] += std::min( a, b );
+                newMax[i] += std::max( a, b );
+            }
+        }
+        
+        boundsMin = newMin;
+        boundsMax = newMax;
+    }
+    
+    // Writes the lists Find gave objectCount objects to buffer as one ObjectLightLists array, object i's at index i,
+    // for binding once uploaded
+    DynamicRange Write( DynamicBuffer &buffer, const std::vector<GLint> *lightIndices, GLuint objectCount )
+    {
+        this->blocks.resize( objectCount );
+        
+        for ( GLuint i = 0; i < objectCount; i++ )
+        {
+            this->Pack( lightIndices[i], this->blocks[i] );
+        }
+        
+        return buffer.Write( &this->blocks[0], objectCount * sizeof( Block ) );
+    }
+    
+    // Sets lights found earlier by Find on shader, a PLAIN_UNIFORMS variant in use
+    void SetUniforms( const Shader &shader, const std::vector<GLint> &lightIndices )
+    {
+        this->Pack( lightIndices, this->block );
+        
+        glUniform1i( glGetUniformLocation( shader.Program, "objectLightCount" ), this->block.count );
+        
+        if ( this->block.count > 0 )
+        {
+            glUniform4iv( glGetUniformLocation( shader.Program, "objectLightIndices" ), ( this->block.count + 3 ) / 4, this->block.indices );
+        }
+    }
+    
+    // How many lights Find( ) tests an object against
+    GLuint LightCount( ) const
+    {
+        return ( GLuint )this->radius2.size( );
+    }
+    
+    // Indices of the lights reaching the world space box [boundsMin, boundsMax], i.e. those whose radius reaches the box
+    // point nearest to them. Only reads the lights, so jobs can run it for several objects at once
+    void Find( const glm::vec3 &boundsMin, const glm::vec3 &boundsMax, std::vector<GLint> &lightIndices ) const
+    {
+        lightIndices.clear( );
+
+#ifdef LIGHT_CLUSTERS_SSE2
+        // Four lights at a time
+        const __m128 minX = _mm_set1_ps( boundsMin.x ), maxX = _mm_set1_ps( boundsMax.x );
+        const __m128 minY = _mm_set1_ps( boundsMin.y ), maxY = _mm_set1_ps( boundsMax.y );
+        const __m128 minZ = _mm_set1_ps( boundsMin.z ), maxZ = _mm_set1_ps( boundsMax.z );
+        const __m128 zero = _mm_setzero_ps( );
+        
+        for ( GLuint i = 0; i < this->radius2.size( ); i += 4 )
+        {
+            __m128 lx = _mm_loadu_ps( &this->x[i] );
+            __m128 ly = _mm_loadu_ps( &this->y[i] );
+            __m128 lz = _mm_loadu_ps( &this->z[i] );
+            __m128 dx = _mm_max_ps( _mm_max_ps( _mm_sub_ps( minX, lx ), _mm_sub_ps( lx, maxX ) ), zero );
+            __m128 dy = _mm_max_ps( _mm_max_ps( _mm_sub_ps( minY, ly ), _mm_sub_ps( ly, maxY ) ), zero );
+            __m128 dz = _mm_max_ps( _mm_max_ps( _mm_sub_ps( minZ, lz ), _mm_sub_ps( lz, maxZ ) ), zero );
+            __m128 distance2 = _mm_add_ps( _mm_add_ps( _mm_mul_ps( dx, dx ), _mm_mul_ps( dy, dy ) ), _mm_mul_ps( dz, dz ) );
+            int hits = _mm_movemask_ps( _mm_cmple_ps( distance2, _mm_loadu_ps( &this->radius2[i] ) ) );
+            
+            for ( GLint b = 0; hits; b++, hits >>= 1 )
+            {
+                if ( hits & 1 )
+                {
+                    lightIndices.push_back( i + b );
+                }
+            }
+        }
+#else
+        for ( GLuint i = 0; i < this->radius2.size( ); i++ )
+        {
+            GLfloat dx = std::max( std::max( boundsMin.x - this->x[i], this->x[i] - boundsMax.x ), 0.0f );
+            GLfloat dy = std::max( std::max( boundsMin.y - this->y[i], this->y[i] - boundsMax.y ), 0.0f );
+            GLfloat dz = std::max( std::max( boundsMin.z - this->z[i], this->z[i] - boundsMax.z ), 0.0f );
+            
+            if ( dx * dx + dy * dy + dz * dz <= this->radius2[i] )
+            {
+                lightIndices.push_back( i );
+            }
+        }
+#endif
+    }
+    
+private:
+    // std140 layout of ObjectLightList, which is also its stride in the ObjectLightLists array
+    struct Block
+    {
+        GLint count;
+        GLint padding[3];
+        GLint indices[MAX_LIGHTS];
+    };
+    
+    // Fills target with lightIndices, as many as the shaders take
+    void Pack( const std::vector<GLint> &lightIndices, Block &target )
+    {
+        GLuint count = ( GLuint )std::min<size_t>( lightIndices.size( ), MAX_LIGHTS );
+        
+        if ( count < lightIndices.size( ) && !this->tooManyLights )
+        {
+            std::cout << "WARNING::OBJECT_LIGHTS::TOO_MANY_LIGHTS " << lightIndices.size( ) << " reach one object, keeping " << count << std::endl;
+            this->tooManyLights = true;
+        }
+        
+        target.count = count;
+        std::copy( lightIndices.begin( ), lightIndices.begin( ) + count, target.indices );
+    }
+    
+    std::vector<GLfloat> x, y, z;
+    std::vector<GLfloat> radius2;       // Squared radius, negative for the padding
+    Block block;                        // Staging for SetUniforms, the indices past count are left from earlier draws
+    std::vector<Block> blocks;          // Staging for Write, the same way
+    bool tooManyLights;
+};
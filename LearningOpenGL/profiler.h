@@ -0,0 +1,432 @@
+#pragma once
+
+// Std. Includes
+#include <iostream>
+#include <cstdio>
+#include <cstring>
+#include <cmath>
+#include <vector>
+#include <map>
+#include <string>
+#include <algorithm>
+#include <mutex>
+#include <chrono>
+
+// GL Includes
+#define GLEW_STATIC
+#include <GL/glew.h>
+
+// Frame profiler. Begin and End (or a ProfileScope) time a stretch of work on the calling thread, BeginGpu also wraps
+// it in a GL_TIME_ELAPSED query. The queries of a frame are read back when EndFrame comes round to reuse them one
+// frame later, so asking for a result never stalls the pipeline. Every time lands in a rolling window per marker for
+// PrintSummary, and while capturing also in a trace that WriteTrace saves as Chrome trace events (chrome://tracing or
+// ui.perfetto.dev). Marker names are kept by pointer, so they have to be string literals
+class Profiler
+{
+public:
+    static const GLuint HISTORY = 240;              // Samples per marker that PrintSummary looks at
+    static const size_t MAX_EVENTS = 1 << 20;       // Trace events kept while capturing, anything past is dropped
+    
+    static Profiler &Get( )
+    {
+        static Profiler instance;
+        
+        return instance;
+    }
+    
+    Profiler( const Profiler & ) = delete;
+    Profiler &operator=( const Profiler & ) = delete;
+    
+    // Names the calling thread in the trace, threads that never call it show up as "Thread <n>"
+    void SetThreadName( const char *name )
+    {
+        GLuint thread = this->CurrentThread( ).id;
+        std::lock_guard<std::mutex> lock( this->lock );
+        
+        this->threadNames[thread] = name;
+    }
+    
+    // Starts timing name on the calling thread, until the matching End. Markers nest
+    void Begin( const char *name )
+    {
+        OpenMarker marker = { name, this->Now( ), false };
+        
+        this->CurrentThread( ).open.push_back( marker );
+    }
+    
+    // Same as Begin, and also times the GL commands issued until End on the GPU. Only on the GL thread, and GL allows
+    // one GL_TIME_ELAPSED query at a time, so GPU markers cannot nest in each other
+    void BeginGpu( const char *name )
+    {
+        OpenMarker marker = { name, this->Now( ), false };
+        
+        if ( this->gpuActive )
+        {
+            if ( !this->nestedGpu )
+            {
+                std::cout << "WARNING::PROFILER::NESTED_GPU_MARKER " << name << " is only timed on the CPU" << std::endl;
+                this->nestedGpu = true;
+            }
+        }
+        else
+        {
+            GpuFrame &frame = this->gpuFrames[this->gpuFrame % FRAME_COUNT];
+            size_t index = frame.markers.size( );
+            
+            if ( index == frame.queries.size( ) )
+            {
+                GLuint query;
+                glGenQueries( 1, &query );
+                frame.queries.push_back( query );
+            }
+            
+            GpuMarker gpuMarker = { name, marker.start, frame.queries[index] };
+            frame.markers.push_back( gpuMarker );
+            glBeginQuery( GL_TIME_ELAPSED, gpuMarker.query );
+            this->gpuActive = true;
+            marker.gpu = true;
+        }
+        
+        this->CurrentThread( ).open.push_back( marker );
+    }
+    
+    // Ends the calling thread's innermost marker
+    void End( )
+    {
+        ThreadState &thread = this->CurrentThread( );
+        
+        if ( thread.open.empty( ) )
+        {
+            return;
+        }
+        
+        OpenMarker marker = thread.open.back( );
+        thread.open.pop_back( );
+        
+        if ( marker.gpu )
+        {
+            glEndQuery( GL_TIME_ELAPSED );
+            this->gpuActive = false;
+        }
+        
+        this->Record( marker.name, thread.id, marker.start, this->Now( ) - marker.start, this->cpuSamples );
+    }
+    
+    // Call on the GL thread once its frame is submitted. Picks up the GPU times of the frame before, whose queries the
+    // next one reuses. A result the GPU still owes by then is dropped rather than waited for, and counted as late
+    void EndFrame( )
+    {
+        this->gpuFrame++;
+        GpuFrame &frame = this->gpuFrames[this->gpuFrame % FRAME_COUNT];
+        GLuint late = 0;
+        
+        for ( GLuint i = 0; i < frame.markers.size( ); i++ )
+        {
+            GLint available = 0;
+            glGetQueryObjectiv( frame.markers[i].query, GL_QUERY_RESULT_AVAILABLE, &available );
+            
+            if ( !available )
+            {
+                late++;
+                continue;
+            }
+            
+            GLuint64 nanoseconds = 0;
+            glGetQueryObjectui64v( frame.markers[i].query, GL_QUERY_RESULT, &nanoseconds );
+            
+            // GL_TIME_ELAPSED has no start time. The GPU lane starts each marker when it was submitted, or when the
+            // one before it ended if that was later, which is as early as the GPU can have run it
+            GLdouble duration = nanoseconds / 1000.0;
+            GLdouble start = std::max( frame.markers[i].cpuStart, this->gpuLaneEnd );
+            this->gpuLaneEnd = start + duration;
+            this->Record( frame.markers[i].name, GPU_THREAD, start, duration, this->gpuSamples );
+        }
+        
+        frame.markers.clear( );
+        
+        // PrintSummary reads the count from another thread
+        if ( late > 0 )
+        {
+            std::lock_guard<std::mutex> lock( this->lock );
+            
+            this->lateGpuResults += late;
+        }
+    }
+    
+    // Deletes the queries, on the GL thread before it lets go of the context
+    void ReleaseQueries( )
+    {
+        for ( GLuint i = 0; i < FRAME_COUNT; i++ )
+        {
+            if ( !this->gpuFrames[i].queries.empty( ) )
+            {
+                glDeleteQueries( ( GLsizei )this->gpuFrames[i].queries.size( ), &this->gpuFrames[i].queries[0] );
+            }
+            
+            this->gpuFrames[i].queries.clear( );
+            this->gpuFrames[i].markers.clear( );
+        }
+    }
+    
+    // Starts a new trace, dropping any events not written yet
+    void StartCapture( )
+    {
+        std::lock_guard<std::mutex> lock( this->lock );
+        
+        this->events.clear( );
+        this->droppedEvents = 0;
+        this->capturing = true;
+    }
+    
+    bool Capturing( )
+    {
+        std::lock_guard<std::mutex> lock( this->lock );
+        
+        return this->capturing;
+    }
+    
+    // Stops capturing and writes the trace to path as Chrome trace event JSON, timestamps in microseconds since startup
+    bool WriteTrace( const char *path )
+    {
+        std::vector<Event> events;
+        std::map<GLuint, std::string> threadNames;
+        size_t droppedEvents;
+        
+        // Takes the events out, so the other threads can go on recording while the file is written
+        {
+            std::lock_guard<std::mutex> lock( this->lock );
+            
+            events.swap( this->events );
+            threadNames = this->threadNames;
+            droppedEvents = this->droppedEvents;
+            this->capturing = false;
+        }
+        
+        FILE *file = fopen( path, "w" );
+        
+        if ( nullptr == file )
+        {
+            std::cout << "ERROR::PROFILER::TRACE_NOT_WRITTEN " << path << std::endl;
+            
+            return false;
+        }
+        
+        fprintf( file, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n" );
+        fprintf( file, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%u,\"args\":{\"name\":\"GPU\"}}", GPU_THREAD );
+        
+        for ( std::map<GLuint, std::string>::const_iterator it = threadNames.begin( ); it != threadNames.end( ); ++it )
+        {
+            fprintf( file, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%u,\"args\":{\"name\":\"%s\"}}", it->first, it->second.c_str( ) );
+        }
+        
+        for ( size_t i = 0; i < events.size( ); i++ )
+        {
+            fprintf( file, ",\n{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%u,\"ts\":%.3f,\"dur\":%.3f}", events[i].name, GPU_THREAD == events[i].thread ? "gpu" : "cpu", events[i].thread, events[i].start, events[i].duration );
+        }
+        
+        fprintf( file, "\n]}\n" );
+        fclose( file );
+        
+        if ( droppedEvents > 0 )
+        {
+            printf( "Profiler: wrote %zu events to %s, dropped %zu past the limit\n", events.size( ), path, droppedEvents );
+        }
+        else
+        {
+            printf( "Profiler: wrote %zu events to %s\n", events.size( ), path );
+        }
+        
+        return true;
+    }
+    
+    // Prints average, median, 95th and 99th percentile and worst of the last HISTORY samples of every marker
+    void PrintSummary( )
+    {
+        std::lock_guard<std::mutex> lock( this->lock );
+        
+        printf( "Profiler: last %u samples per marker, in ms (%u late GPU results dropped)\n", HISTORY, this->lateGpuResults );
+        PrintSamples( "cpu", this->cpuSamples );
+        PrintSamples( "gpu", this->gpuSamples );
+    }
+    
+private:
+    typedef std::chrono::steady_clock Clock;
+    
+    static const GLuint FRAME_COUNT = 2;            // Frames of queries in flight
+    static const GLuint GPU_THREAD = 0;             // Trace lane of the GPU markers, the threads count from 1
+    
+    // A marker name as a map key, compared by its characters
+    struct NameLess
+    {
+        bool operator( )( const char *a, const char *b ) const
+        {
+            return strcmp( a, b ) < 0;
+        }
+    };
+    
+    // Rolling window of one marker's times in ms, oldest overwritten first
+    struct Samples
+    {
+        std::vector<GLfloat> times;
+        GLuint next;
+        
+        Samples( ) : next( 0 )
+        {
+        }
+        
+        void Add( GLfloat time )
+        {
+            if ( this->times.size( ) < HISTORY )
+            {
+                this->times.push_back( time );
+            }
+            else
+            {
+                this->times[this->next] = time;
+                this->next = ( this->next + 1 ) % HISTORY;
+            }
+        }
+    };
+    
+    typedef std::map<const char *, Samples, NameLess> SampleMap;
+    
+    struct Event
+    {
+        const char *name;
+        GLuint thread;
+        GLdouble start, duration;       // Microseconds
+    };
+    
+    struct OpenMarker
+    {
+        const char *name;
+        GLdouble start;
+        bool gpu;
+    };
+    
+    struct GpuMarker
+    {
+        const char *name;
+        GLdouble cpuStart;
+        GLuint query;
+    };
+    
+    // One frame's GPU markers, with the queries they used. The queries stay allocated for the next frame in the slot
+    struct GpuFrame
+    {
+        std::vector<GLuint> queries;
+        std::vector<GpuMarker> markers;
+    };
+    
+    struct ThreadState
+    {
+        GLuint id;
+        std::vector<OpenMarker> open;
+    };
+    
+    Clock::time_point startTime;
+    std::mutex lock;                    // Guards everything below up to gpuFrames
+    SampleMap cpuSamples, gpuSamples;
+    std::vector<Event> events;
+    std::map<GLuint, std::string> threadNames;
+    GLuint nextThread;
+    size_t droppedEvents;
+    bool capturing;
+    GLuint lateGpuResults;
+    // Only touched by the GL thread
+    GpuFrame gpuFrames[FRAME_COUNT];
+    GLuint gpuFrame;
+    GLdouble gpuLaneEnd;
+    bool gpuActive;
+    bool nestedGpu;
+    
+    Profiler( ) : startTime( Clock::now( ) ), nextThread( GPU_THREAD + 1 ), droppedEvents( 0 ), capturing( false ), lateGpuResults( 0 ), gpuFrame( 0 ), gpuLaneEnd( 0.0 ), gpuActive( false ), nestedGpu( false )
+    {
+    }
+    
+    GLdouble Now( ) const
+    {
+        return std::chrono::duration<GLdouble, std::micro>( Clock::now( ) - this->startTime ).count( );
+    }
+    
+    // The calling thread's open markers, and its lane in the trace
+    ThreadState &CurrentThread( )
+    {
+        static thread_local ThreadState state = { 0, std::vector<OpenMarker>( ) };
+        
+        if ( 0 == state.id )
+        {
+            std::lock_guard<std::mutex> lock( this->lock );
+            
+            state.id = this->nextThread++;
+            this->threadNames[state.id] = "Thread " + std::to_string( state.id );
+        }
+        
+        return state;
+    }
+    
+    void Record( const char *name, GLuint thread, GLdouble start, GLdouble duration, SampleMap &samples )
+    {
+        std::lock_guard<std::mutex> lock( this->lock );
+        
+        samples[name].Add( ( GLfloat )( duration / 1000.0 ) );
+        
+        if ( !this->capturing )
+        {
+            return;
+        }
+        
+        if ( this->events.size( ) < MAX_EVENTS )
+        {
+            Event event = { name, thread, start, duration };
+            this->events.push_back( event );
+        }
+        else
+        {
+            this->droppedEvents++;
+        }
+    }
+    
+    static void PrintSamples( const char *kind, const SampleMap &samples )
+    {
+        for ( SampleMap::const_iterator it = samples.begin( ); it != samples.end( ); ++it )
+        {
+            std::vector<GLfloat> times( it->second.times );
+            std::sort( times.begin( ), times.end( ) );
+            GLdouble sum = 0.0;
+            
+            for ( GLuint i = 0; i < times.size( ); i++ )
+            {
+                sum += times[i];
+            }
+            
+            printf( "Profiler:   %s %-24s avg %8.3f  p50 %8.3f  p95 %8.3f  p99 %8.3f  max %8.3f  (%zu samples)\n", kind, it->first, sum / times.size( ), Percentile( times, 0.5 ), Percentile( times, 0.95 ), Percentile( times, 0.99 ), times.back( ), times.size( ) );
+        }
+    }
+    
+    // Nearest rank percentile of sorted times
+    static GLfloat Percentile( const std::vector<GLfloat> &times, GLdouble fraction )
+    {
+        size_t rank = ( size_t )std::ceil( fraction * times.size( ) );
+        
+        return times[std::max<size_t>( rank, 1 ) - 1];
+    }
+};
+
+// Times the enclosing block on the CPU, see Profiler::Begin
+class ProfileScope
+{
+public:
+    explicit ProfileScope( const char *name )
+    {
+        Profiler::Get( ).Begin( name );
+    }
+    
+    ~ProfileScope( )
+    {
+        Profiler::Get( ).End( );
+    }
+    
+    ProfileScope( const ProfileScope & ) = delete;
+    ProfileScope &operator=( const ProfileScope & ) = delete;
+};
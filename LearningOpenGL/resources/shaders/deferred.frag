@@ -0,0 +1,30 @@
+#version 330 core
+
+#include "lights.glsl"
+#include "gbuffer.glsl"
+
+out vec4 color;
+
+uniform mat4 inverseViewProjection;
+
+void main()
+{
+    ivec2 pixel = ivec2( gl_FragCoord.xy );
+    float depth = texelFetch( gDepth, pixel, 0 ).r;
+    
+    // Nothing was drawn here, leave it to the skybox
+    if ( depth == 1.0 )
+    {
+        discard;
+    }
+    
+    vec3 norm;
+    Surface surface = ReadGBuffer( pixel, norm );
+    
+    vec3 ndc = vec3( gl_FragCoord.xy / vec2( textureSize( gDepth, 0 ) ), depth ) * 2.0 - 1.0;
+    vec4 position = inverseViewProjection * vec4( ndc, 1.0 );
+    vec3 fragPos = position.xyz / position.w;
+    vec3 viewDir = normalize( viewPos - fragPos );
+    
+    color = vec4( CalcLighting( surface, norm, fragPos, viewDir, depth ), 1.0f );
+}
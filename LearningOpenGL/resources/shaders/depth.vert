@@ -0,0 +1,12 @@
+#version 330 core
+layout (location = 0) in vec3 position;
+
+#include "transforms.glsl"
+
+// The lit pass tests its depth against this one with GL_EQUAL, so both have to come out bit for bit the same
+invariant gl_Position;
+
+void main()
+{
+    gl_Position = projection * view * model * vec4(position, 1.0f);
+}
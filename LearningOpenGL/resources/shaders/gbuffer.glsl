@@ -0,0 +1,37 @@
+// G-buffer layout of the deferred path. The GBUFFER variants of the lit shaders write it,
+// everything else including this file reads it back. Needs Surface from lights.glsl.
+//   gAlbedo    RGBA8    surface diffuse color
+//   gSpecular  RGBA8    surface specular color, shininess / 255 in alpha
+//   gNormal    RGBA16F  world space normal
+//   gDepth     depth    window depth, world position is rebuilt from it
+
+#ifdef GBUFFER
+layout (location = 0) out vec4 gAlbedoOut;
+layout (location = 1) out vec4 gSpecularOut;
+layout (location = 2) out vec4 gNormalOut;
+
+void WriteGBuffer( Surface surface, vec3 normal )
+{
+    gAlbedoOut = vec4( surface.diffuse, 1.0 );
+    gSpecularOut = vec4( surface.specular, surface.shininess / 255.0 );
+    gNormalOut = vec4( normal, 0.0 );
+}
+#else
+uniform sampler2D gAlbedo;
+uniform sampler2D gSpecular;
+uniform sampler2D gNormal;
+uniform sampler2D gDepth;
+
+Surface ReadGBuffer( ivec2 pixel, out vec3 normal )
+{
+    vec4 specular = texelFetch( gSpecular, pixel, 0 );
+
+    Surface surface;
+    surface.diffuse = texelFetch( gAlbedo, pixel, 0 ).rgb;
+    surface.specular = specular.rgb;
+    surface.shininess = specular.a * 255.0;
+    normal = texelFetch( gNormal, pixel, 0 ).xyz;
+
+    return surface;
+}
+#endif
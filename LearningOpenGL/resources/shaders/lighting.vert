@@ -7,14 +7,15 @@ out vec3 Normal;
 out vec3 FragPos;
 out vec2 TexCoords;
 
-uniform mat4 model;
-uniform mat4 view;
-uniform mat4 projection;
+#include "transforms.glsl"
+
+// Matches depth.vert's position exactly, for the GL_EQUAL test after a depth pre-pass
+invariant gl_Position;
 
 void main()
 {
     gl_Position = projection * view *  model * vec4(position, 1.0f);
     FragPos = vec3(model * vec4(position, 1.0f));
-    Normal = mat3(transpose(inverse(model))) * normal;
+    Normal = normalMatrix * normal;
     TexCoords = texCoords;
 }
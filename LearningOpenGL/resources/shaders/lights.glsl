@@ -0,0 +1,240 @@
+// Light types and lighting terms shared by the lit shaders.
+// Injected defines pick the variant:
+//   NUMBER_OF_POINT_LIGHTS  size of the pointLights array, 0 for none
+//   HAS_SPOT_LIGHT          adds the spotLight term
+//   HAS_SPECULAR_MAP        adds the specular term, from surface.specular and surface.shininess
+//   CLUSTERED_POINT_LIGHTS  loops over the point lights of the fragment's froxel instead, from LightClusters' buffer textures.
+//                           CLUSTER_TILES_X, CLUSTER_TILES_Y and CLUSTER_SLICES give the cluster grid
+//   OBJECT_POINT_LIGHTS     loops over the point lights ObjectLights found for the draw instead, at most MAX_OBJECT_LIGHTS.
+//                           Their data still comes from LightClusters' clusterLights buffer
+//   LIT_OBJECT_COUNT        with OBJECT_POINT_LIGHTS and without PLAIN_UNIFORMS, how many objects the ObjectLightLists block holds
+//   PLAIN_UNIFORMS          declares the members of the SceneLights block and the draw's light list as plain uniforms
+
+#ifndef NUMBER_OF_POINT_LIGHTS
+#define NUMBER_OF_POINT_LIGHTS 0
+#endif
+
+struct DirLight
+{
+    vec3 direction;
+
+    vec3 ambient;
+    vec3 diffuse;
+    vec3 specular;
+};
+
+struct PointLight
+{
+    vec3 position;
+
+    float constant;
+    float linear;
+    float quadratic;
+
+    vec3 ambient;
+    vec3 diffuse;
+    vec3 specular;
+};
+
+struct SpotLight
+{
+    vec3 position;
+    vec3 direction;
+    float cutOff;
+    float outerCutOff;
+
+    float constant;
+    float linear;
+    float quadratic;
+
+    vec3 ambient;
+    vec3 diffuse;
+    vec3 specular;
+};
+
+// Material colors at the fragment, sampled once and shared by every light
+struct Surface
+{
+    vec3 diffuse;
+    vec3 specular;
+    float shininess;
+};
+
+// The camera and the lights that are the same for every draw, written to DynamicBuffer once per frame. std140, and
+// laid out the same with or without HAS_SPOT_LIGHT, so SceneLights (main.cpp) fits every variant
+#ifdef PLAIN_UNIFORMS
+uniform DirLight dirLight;
+uniform SpotLight spotLight;
+uniform vec3 viewPos;
+#else
+layout( std140 ) uniform SceneLights
+{
+    DirLight dirLight;
+    SpotLight spotLight;
+    vec3 viewPos;
+};
+#endif
+#if NUMBER_OF_POINT_LIGHTS > 0
+uniform PointLight pointLights[NUMBER_OF_POINT_LIGHTS];
+#endif
+#if defined( CLUSTERED_POINT_LIGHTS ) || defined( OBJECT_POINT_LIGHTS )
+uniform samplerBuffer clusterLights;        // Four texels per light, see LightClusters::SetLights
+#endif
+#ifdef CLUSTERED_POINT_LIGHTS
+uniform usamplerBuffer clusterGrid;         // First index and light count of every cluster
+uniform usamplerBuffer clusterLightIndices; // Light lists of all clusters, back to back
+uniform vec2 clusterTileSize;               // Screen tile size in pixels
+uniform vec4 clusterDepth;                  // Near plane, far plane, slice scale and bias on log( depth )
+#endif
+#ifdef OBJECT_POINT_LIGHTS
+// Lights reaching the draw's bounds. Four to an ivec4, std140 would pad single ints to 16 bytes each
+#ifdef PLAIN_UNIFORMS
+uniform int objectLightCount;
+uniform ivec4 objectLightIndices[MAX_OBJECT_LIGHTS / 4];
+#else
+// Every lit object's list, written to DynamicBuffer once per frame. objectIndex picks the draw's, as for its transforms
+struct ObjectLightList
+{
+    int count;
+    ivec4 indices[MAX_OBJECT_LIGHTS / 4];
+};
+
+layout( std140 ) uniform ObjectLightLists
+{
+    ObjectLightList objectLightLists[LIT_OBJECT_COUNT];
+};
+
+uniform int objectIndex;
+
+#define objectLightCount objectLightLists[objectIndex].count
+#define objectLightIndices objectLightLists[objectIndex].indices
+#endif
+#endif
+
+// Ambient + diffuse (+ specular) for a light coming from lightDir
+vec3 CalcLightTerms( vec3 lightAmbient, vec3 lightDiffuse, vec3 lightSpecular, vec3 lightDir, Surface surface, vec3 normal, vec3 viewDir )
+{
+    // Ambient
+    vec3 result = lightAmbient * surface.diffuse;
+    // Diffuse
+    float diff = max(dot(normal, lightDir), 0.0);
+    result += lightDiffuse * diff * surface.diffuse;
+#ifdef HAS_SPECULAR_MAP
+    // Specular
+    vec3 reflectDir = reflect(-lightDir, normal);
+    float spec = pow(max(dot(viewDir, reflectDir), 0.0), surface.shininess);
+    result += lightSpecular * spec * surface.specular;
+#endif
+
+    return result;
+}
+
+vec3 CalcDirLight( DirLight light, Surface surface, vec3 normal, vec3 viewDir )
+{
+    vec3 lightDir = normalize(-light.direction); // Directional Lighting
+
+    return CalcLightTerms( light.ambient, light.diffuse, light.specular, lightDir, surface, normal, viewDir );
+}
+
+float CalcAttenuation( vec3 lightPosition, float constant, float linear, float quadratic, vec3 fragPos )
+{
+    float distance = length(lightPosition - fragPos);
+
+    return 1.0f / (constant + linear * distance + quadratic * (distance * distance));
+}
+
+#if NUMBER_OF_POINT_LIGHTS > 0 || defined( CLUSTERED_POINT_LIGHTS ) || defined( OBJECT_POINT_LIGHTS )
+vec3 CalcPointLight( PointLight light, Surface surface, vec3 normal, vec3 fragPos, vec3 viewDir )
+{
+    vec3 lightDir = normalize(light.position - fragPos);
+    float attenuation = CalcAttenuation( light.position, light.constant, light.linear, light.quadratic, fragPos );
+
+    return CalcLightTerms( light.ambient, light.diffuse, light.specular, lightDir, surface, normal, viewDir ) * attenuation;
+}
+#endif
+
+#if defined( CLUSTERED_POINT_LIGHTS ) || defined( OBJECT_POINT_LIGHTS )
+PointLight FetchClusterLight( int index )
+{
+    vec4 positionConstant = texelFetch( clusterLights, index * 4 );
+    vec4 ambientLinear = texelFetch( clusterLights, index * 4 + 1 );
+    vec4 diffuseQuadratic = texelFetch( clusterLights, index * 4 + 2 );
+
+    PointLight light;
+    light.position = positionConstant.xyz;
+    light.constant = positionConstant.w;
+    light.linear = ambientLinear.w;
+    light.quadratic = diffuseQuadratic.w;
+    light.ambient = ambientLinear.rgb;
+    light.diffuse = diffuseQuadratic.rgb;
+    light.specular = texelFetch( clusterLights, index * 4 + 3 ).rgb;
+
+    return light;
+}
+#endif
+
+#ifdef CLUSTERED_POINT_LIGHTS
+// Grid index of the froxel holding the fragment at gl_FragCoord.xy and window depth fragDepth
+int ClusterIndex( float fragDepth )
+{
+    float nearPlane = clusterDepth.x;
+    float farPlane = clusterDepth.y;
+    float depth = 2.0 * nearPlane * farPlane / ( farPlane + nearPlane - ( fragDepth * 2.0 - 1.0 ) * ( farPlane - nearPlane ) );
+
+    ivec3 cluster = ivec3( ivec2( gl_FragCoord.xy / clusterTileSize ), int( floor( log( depth ) * clusterDepth.z + clusterDepth.w ) ) );
+    cluster = clamp( cluster, ivec3( 0 ), ivec3( CLUSTER_TILES_X - 1, CLUSTER_TILES_Y - 1, CLUSTER_SLICES - 1 ) );
+
+    return ( cluster.z * CLUSTER_TILES_Y + cluster.y ) * CLUSTER_TILES_X + cluster.x;
+}
+#endif
+
+#ifdef HAS_SPOT_LIGHT
+vec3 CalcSpotLight( SpotLight light, Surface surface, vec3 normal, vec3 fragPos, vec3 viewDir )
+{
+    vec3 lightDir = normalize(light.position - fragPos);
+    float attenuation = CalcAttenuation( light.position, light.constant, light.linear, light.quadratic, fragPos );
+
+    // Spotlight intensity
+    float theta = dot( lightDir, normalize( -light.direction ) );
+    float epsilon = light.cutOff - light.outerCutOff;
+    float intensity = clamp( ( theta - light.outerCutOff ) / epsilon, 0.0, 1.0 );
+
+    return CalcLightTerms( light.ambient, light.diffuse, light.specular, lightDir, surface, normal, viewDir ) * ( attenuation * intensity );
+}
+#endif
+
+// Sum of every light this variant was built with, fragDepth is the window depth at gl_FragCoord.xy
+vec3 CalcLighting( Surface surface, vec3 normal, vec3 fragPos, vec3 viewDir, float fragDepth )
+{
+    vec3 result = CalcDirLight( dirLight, surface, normal, viewDir );
+#if NUMBER_OF_POINT_LIGHTS > 0
+    for ( int i = 0; i < NUMBER_OF_POINT_LIGHTS; i++ )
+    {
+        result += CalcPointLight( pointLights[i], surface, normal, fragPos, viewDir );
+    }
+#endif
+#ifdef CLUSTERED_POINT_LIGHTS
+    uvec2 cluster = texelFetch( clusterGrid, ClusterIndex( fragDepth ) ).xy;
+    for ( uint i = 0u; i < cluster.y; i++ )
+    {
+        int index = int( texelFetch( clusterLightIndices, int( cluster.x + i ) ).r );
+        result += CalcPointLight( FetchClusterLight( index ), surface, normal, fragPos, viewDir );
+    }
+#endif
+#ifdef OBJECT_POINT_LIGHTS
+    for ( int i = 0; i < objectLightCount; i++ )
+    {
+        result += CalcPointLight( FetchClusterLight( objectLightIndices[i >> 2][i & 3] ), surface, normal, fragPos, viewDir );
+    }
+#endif
+#ifdef HAS_SPOT_LIGHT
+    result += CalcSpotLight( spotLight, surface, normal, fragPos, viewDir );
+#endif
+
+    return result;
+}
+
+vec3 CalcLighting( Surface surface, vec3 normal, vec3 fragPos, vec3 viewDir )
+{
+    return CalcLighting( surface, normal, fragPos, viewDir, gl_FragCoord.z );
+}
@@ -1,118 +1,47 @@
 #version 330 core
 
-struct DirLight
-{
-    vec3 direction;
-    
-    vec3 ambient;
-    vec3 diffuse;
-    vec3 specular;
-};
-
-struct PointLight
-{
-    vec3 position;
-    
-    float constant;
-    float linear;
-    float quadratic;
-    
-    vec3 ambient;
-    vec3 diffuse;
-    vec3 specular;
-};
-
-struct SpotLight
-{
-    vec3 position;
-    vec3 direction;
-    float cutOff;
-    float outerCutOff;
-    
-    float constant;
-    float linear;
-    float quadratic;
-    
-    vec3 ambient;
-    vec3 diffuse;
-    vec3 specular;
-};
+#include "lights.glsl"
+#ifdef GBUFFER
+#include "gbuffer.glsl"
+#endif
 
 in vec3 FragPos;
 in vec3 Normal;
 in vec2 TexCoords;
 
+#ifndef GBUFFER
 out vec4 color;
+#endif
 
-uniform vec3 viewPos;
-uniform sampler2D texture_diffuse;
-uniform DirLight dirLight;
-uniform PointLight pointLight;
-uniform SpotLight spotLight;
+uniform sampler2D texture_diffuse1;
+#ifdef HAS_SPECULAR_MAP
+struct Material
+{
+    float shininess;
+};
 
-vec3 CalcDirLight( DirLight light, vec3 normal, vec3 viewDir );
-vec3 CalcPointLight( PointLight light, vec3 normal, vec3 fragPos, vec3 viewDir );
-vec3 CalcSpotLight( SpotLight light, vec3 normal, vec3 fragPos, vec3 viewDir );
+uniform sampler2D texture_specular1;
+uniform Material material;
+#endif
 
 void main()
 {
     vec3 norm = normalize( Normal );
     vec3 viewDir = normalize( viewPos - FragPos );
     
-    vec3 result = CalcDirLight( dirLight, norm, viewDir );
-    result += CalcPointLight( pointLight, norm, FragPos, viewDir );
-    result += CalcSpotLight( spotLight, norm, FragPos, viewDir );
-    
-    color = vec4(result, 1.0f);
-}
-
-vec3 CalcDirLight(DirLight light, vec3 normal, vec3 viewDir ) {
-    vec3 lightDir = normalize(-light.direction); // Directional Lighting
-    // Ambient
-    vec3 ambient = light.ambient * vec3(texture(texture_diffuse, TexCoords));
-    // Diffuse
-    float diff = max(dot(normal, lightDir), 0.0);
-    vec3 diffuse = light.diffuse * diff * vec3(texture(texture_diffuse, TexCoords));
-    
-    return (ambient + diffuse);
-}
-
-vec3 CalcPointLight( PointLight light, vec3 normal, vec3 fragPos, vec3 viewDir ) {
-    vec3 lightDir = normalize(light.position - FragPos); // Point Light and Spot Light
-    // Ambient
-    vec3 ambient = light.ambient * vec3(texture(texture_diffuse, TexCoords));
-    // Diffuse
-    float diff = max(dot(normal, lightDir), 0.0);
-    vec3 diffuse = light.diffuse * diff * vec3(texture(texture_diffuse, TexCoords));
-    
-    // Attenuation
-    float distance    = length(light.position - FragPos);
-    float attenuation = 1.0f / (light.constant + light.linear * distance + light.quadratic * (distance * distance));
-    ambient  *= attenuation;
-    diffuse  *= attenuation;
-    
-    return (ambient + diffuse);
-}
-
-vec3 CalcSpotLight( SpotLight light, vec3 normal, vec3 fragPos, vec3 viewDir ) {
-    vec3 lightDir = normalize(light.position - FragPos); // Point Light and Spot Light
-    // Ambient
-    vec3 ambient = light.ambient * vec3(texture(texture_diffuse, TexCoords));
-    // Diffuse
-    float diff = max(dot(normal, lightDir), 0.0);
-    vec3 diffuse = light.diffuse * diff * vec3(texture(texture_diffuse, TexCoords));
-    
-    // Attenuation
-    float distance    = length(light.position - FragPos);
-    float attenuation = 1.0f / (light.constant + light.linear * distance + light.quadratic * (distance * distance));
-    
-    // Spotlight intensity
-    float theta = dot( lightDir, normalize( -light.direction ) );
-    float epsilon = light.cutOff - light.outerCutOff;
-    float intensity = clamp( ( theta - light.outerCutOff ) / epsilon, 0.0, 1.0 );
-    
-    ambient *= attenuation * intensity;
-    diffuse *= attenuation * intensity;
-    
-    return (ambient + diffuse);
+    Surface surface;
+    surface.diffuse = vec3(texture(texture_diffuse1, TexCoords));
+#ifdef HAS_SPECULAR_MAP
+    surface.specular = vec3(texture(texture_specular1, TexCoords));
+    surface.shininess = material.shininess;
+#else
+    surface.specular = vec3(0.0);
+    surface.shininess = 1.0;
+#endif
+    
+#ifdef GBUFFER
+    WriteGBuffer( surface, norm );
+#else
+    color = vec4(CalcLighting( surface, norm, FragPos, viewDir ), 1.0f);
+#endif
 }
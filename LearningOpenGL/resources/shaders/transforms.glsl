@@ -0,0 +1,34 @@
+// Camera and object transforms as std140 uniform blocks, written to DynamicBuffer and bound once per frame.
+// ObjectTransforms holds all OBJECT_COUNT objects, each draw picks its own with objectIndex.
+// The C++ side mirrors their layout in FrameTransforms and ObjectTransform (main.cpp).
+// PLAIN_UNIFORMS declares view, projection, model and normalMatrix as plain uniforms instead, set through glUniform*
+
+#ifdef PLAIN_UNIFORMS
+uniform mat4 view;
+uniform mat4 projection;
+uniform mat4 model;
+uniform mat3 normalMatrix;
+#else
+layout( std140 ) uniform FrameTransforms
+{
+    mat4 view;
+    mat4 projection;
+};
+
+struct ObjectTransform
+{
+    mat4 model;
+    mat3 normalMatrix; // transpose( inverse( mat3( model ) ) ), computed once per object on the CPU
+};
+
+layout( std140 ) uniform ObjectTransforms
+{
+    ObjectTransform objectTransforms[OBJECT_COUNT];
+};
+
+uniform int objectIndex;
+
+// So the vertex shaders read the same names either way
+#define model objectTransforms[objectIndex].model
+#define normalMatrix objectTransforms[objectIndex].normalMatrix
+#endif
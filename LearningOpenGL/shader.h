@@ -5,77 +5,180 @@
 #include <fstream>
 #include <sstream>
 #include <iostream>
+#include <cstdio>
+#include <vector>
+#include <cstring>
+#include <cstdint>
+#include <memory>
+#include <map>
+#include <algorithm>
+#include <thread>
+#include <cstdlib>
+#include <sys/stat.h>
+#ifdef _WIN32
+#include <direct.h>
+#endif
 
 #include <GL/glew.h>
 
+#ifndef GL_COMPLETION_STATUS_KHR
+#define GL_COMPLETION_STATUS_KHR 0x91B1
+#endif
+
+// Compile-time switches for one shader variant, injected as #defines right after #version
+class ShaderDefines
+{
+public:
+    ShaderDefines &Set( const std::string &name, const std::string &value = "1" )
+    {
+        values[name] = value;
+        
+        return *this;
+    }
+    
+    ShaderDefines &Set( const std::string &name, int value )
+    {
+        return Set( name, std::to_string( value ) );
+    }
+    
+    // The #define lines, in name order so equal sets always give equal sources
+    std::string Source( ) const
+    {
+        std::string source;
+        
+        for ( std::map<std::string, std::string>::const_iterator it = values.begin( ); it != values.end( ); ++it )
+        {
+            source += "#define " + it->first + " " + it->second + "\n";
+        }
+        
+        return source;
+    }
+    
+    bool Empty( ) const
+    {
+        return values.empty( );
+    }
+    
+private:
+    std::map<std::string, std::string> values;
+};
+
 class Shader
 {
 public:
     GLuint Program;
-    // Constructor generates the shader on the fly
-    Shader( const GLchar *vertexPath, const GLchar *fragmentPath )
-    {
-        // 1. Retrieve the vertex/fragment source code from filePath
-        std::string vertexCode;
-        std::string fragmentCode;
-        std::ifstream vShaderFile;
-        std::ifstream fShaderFile;
-        // ensures ifstream objects can throw exceptions:
-        vShaderFile.exceptions ( std::ifstream::badbit );
-        fShaderFile.exceptions ( std::ifstream::badbit );
-        try
-        {
-            // Open files
-            vShaderFile.open( vertexPath );
-            fShaderFile.open( fragmentPath );
-            std::stringstream vShaderStream, fShaderStream;
-            // Read file's buffer contents into streams
-            vShaderStream << vShaderFile.rdbuf( );
-            fShaderStream << fShaderFile.rdbuf( );
-            // close file handlers
-            vShaderFile.close( );
-            fShaderFile.close( );
-            // Convert stream into string
-            vertexCode = vShaderStream.str( );
-            fragmentCode = fShaderStream.str( );
-        }
-        catch ( std::ifstream::failure e )
-        {
-            std::cout << "ERROR::SHADER::FILE_NOT_SUCCESFULLY_READ" << std::endl;
+    // An empty shader, Submit( ) starts building it
+    Shader( ) : Program( 0 ), vertex( 0 ), fragment( 0 ), binaryKey( 0 ), binaryCacheable( false ), fromBinary( false ), pending( false )
+    {
+    }
+    // Constructor generates the shader on the fly, or reloads the program binary an earlier run cached
+    Shader( const GLchar *vertexPath, const GLchar *fragmentPath, const ShaderDefines &defines = ShaderDefines( ) ) : Shader( )
+    {
+        Submit( vertexPath, fragmentPath, defines );
+        Finish( );
+    }
+    // Hands the shaders to the driver to compile and link without waiting on it, call Finish( ) before use
+    void Submit( const GLchar *vertexPath, const GLchar *fragmentPath, const ShaderDefines &defines = ShaderDefines( ) )
+    {
+        // 1. Retrieve the vertex/fragment source code from filePath, with #includes expanded and the defines added
+        std::vector<std::string> vertexFiles, fragmentFiles;
+        std::string vertexCode = Preprocess( vertexPath, defines, vertexFiles );
+        std::string fragmentCode = Preprocess( fragmentPath, defines, fragmentFiles );
+        vertexSourceNames = SourceNames( vertexFiles );
+        fragmentSourceNames = SourceNames( fragmentFiles );
+        // 2. Swap in the sources tools/optimize_shaders.sh built for this variant, keeping the written ones in case the driver rejects them
+        std::string writtenVertexCode = vertexCode, writtenFragmentCode = fragmentCode;
+        bool optimizedVertex = UseOptimizedSource( vertexPath, defines, vertexCode );
+        bool optimizedFragment = UseOptimizedSource( fragmentPath, defines, fragmentCode );
+        if ( optimizedVertex || optimizedFragment )
+        {
+            fallbackVertexCode = writtenVertexCode;
+            fallbackFragmentCode = writtenFragmentCode;
         }
-        const GLchar *vShaderCode = vertexCode.c_str( );
-        const GLchar *fShaderCode = fragmentCode.c_str( );
-        // 2. Compile shaders
-        GLuint vertex, fragment;
+        // 3. Reuse the linked program from the binary cache, Finish( ) compiles the sources if the driver rejects it
+        binaryPath = BinaryCachePath( vertexPath, fragmentPath, defines );
+        binaryKey = BinaryCacheKey( vertexCode, fragmentCode );
+        binaryCacheable = ProgramBinarySupported( ) && !binaryPath.empty( );
+        if ( binaryCacheable && LoadProgramBinary( binaryPath, binaryKey ) )
+        {
+            binaryVertexCode = vertexCode;
+            binaryFragmentCode = fragmentCode;
+            return;
+        }
+        // 4. Compile shaders and link, the status checks wait until Finish( )
+        Compile( vertexCode, fragmentCode );
+    }
+    // True once the driver has finished compiling and linking. Drivers without
+    // KHR_parallel_shader_compile can't tell, so for them Finish( ) may still block.
+    bool IsReady( ) const
+    {
+        if ( !pending || !ParallelCompileSupported( ) )
+        {
+            return true;
+        }
+        
+        GLint completed = GL_TRUE;
+        glGetProgramiv( this->Program, GL_COMPLETION_STATUS_KHR, &completed );
+        
+        return GL_TRUE == completed;
+    }
+    // Waits for the link to finish, prints any errors and caches the program binary
+    void Finish( )
+    {
+        if ( !pending )
+        {
+            return;
+        }
+        pending = false;
         GLint success;
         GLchar infoLog[512];
-        // Vertex Shader
-        vertex = glCreateShader( GL_VERTEX_SHADER );
-        glShaderSource( vertex, 1, &vShaderCode, NULL );
-        glCompileShader( vertex );
+        // Drivers may reject a binary they produced themselves, e.g. after an update, so fall back to compiling
+        if ( fromBinary )
+        {
+            fromBinary = false;
+            glGetProgramiv( this->Program, GL_LINK_STATUS, &success );
+            if ( success )
+            {
+                binaryVertexCode.clear( );
+                binaryFragmentCode.clear( );
+                fallbackVertexCode.clear( );
+                fallbackFragmentCode.clear( );
+                return;
+            }
+            glDeleteProgram( this->Program );
+            Compile( binaryVertexCode, binaryFragmentCode );
+            binaryVertexCode.clear( );
+            binaryFragmentCode.clear( );
+            Finish( );
+            return;
+        }
+        // Optimized sources the driver can't build are retried as written, only those errors get printed
+        glGetProgramiv( this->Program, GL_LINK_STATUS, &success );
+        if ( !success && !fallbackVertexCode.empty( ) )
+        {
+            std::cout << "WARNING::SHADER::OPTIMIZED_SOURCE_REJECTED\n" << vertexSourceNames << fragmentSourceNames;
+            glDeleteShader( vertex );
+            glDeleteShader( fragment );
+            glDeleteProgram( this->Program );
+            Compile( fallbackVertexCode, fallbackFragmentCode );
+            fallbackVertexCode.clear( );
+            fallbackFragmentCode.clear( );
+            Finish( );
+            return;
+        }
         // Print compile errors if any
         glGetShaderiv( vertex, GL_COMPILE_STATUS, &success );
         if ( !success )
         {
             glGetShaderInfoLog( vertex, 512, NULL, infoLog );
-            std::cout << "ERROR::SHADER::VERTEX::COMPILATION_FAILED\n" << infoLog << std::endl;
+            std::cout << "ERROR::SHADER::VERTEX::COMPILATION_FAILED\n" << vertexSourceNames << infoLog << std::endl;
         }
-        // Fragment Shader
-        fragment = glCreateShader( GL_FRAGMENT_SHADER );
-        glShaderSource( fragment, 1, &fShaderCode, NULL );
-        glCompileShader( fragment );
-        // Print compile errors if any
         glGetShaderiv( fragment, GL_COMPILE_STATUS, &success );
         if ( !success )
         {
             glGetShaderInfoLog( fragment, 512, NULL, infoLog );
-            std::cout << "ERROR::SHADER::FRAGMENT::COMPILATION_FAILED\n" << infoLog << std::endl;
+            std::cout << "ERROR::SHADER::FRAGMENT::COMPILATION_FAILED\n" << fragmentSourceNames << infoLog << std::endl;
         }
-        // Shader Program
-        this->Program = glCreateProgram( );
-        glAttachShader( this->Program, vertex );
-        glAttachShader( this->Program, fragment );
-        glLinkProgram( this->Program );
         // Print linking errors if any
         glGetProgramiv( this->Program, GL_LINK_STATUS, &success );
         if (!success)
@@ -83,16 +186,575 @@ public:
             glGetProgramInfoLog( this->Program, 512, NULL, infoLog );
             std::cout << "ERROR::SHADER::PROGRAM::LINKING_FAILED\n" << infoLog << std::endl;
         }
+        else if ( binaryCacheable )
+        {
+            SaveProgramBinary( binaryPath, binaryKey );
+        }
         // Delete the shaders as they're linked into our program now and no longer necessery
         glDeleteShader( vertex );
         glDeleteShader( fragment );
-        
+        vertex = fragment = 0;
+        fallbackVertexCode.clear( );
+        fallbackFragmentCode.clear( );
     }
     // Uses the current shader
     void Use( )
     {
         glUseProgram( this->Program );
     }
+    // Points the program's uniform block name at binding point binding, a block the program does not use is skipped
+    void BindUniformBlock( const GLchar *name, GLuint binding ) const
+    {
+        GLuint index = glGetUniformBlockIndex( this->Program, name );
+        if ( GL_INVALID_INDEX != index )
+        {
+            glUniformBlockBinding( this->Program, index, binding );
+        }
+    }
+    // Deletes the program, on the thread that holds the context
+    void Release( )
+    {
+        glDeleteShader( vertex );
+        glDeleteShader( fragment );
+        glDeleteProgram( this->Program );
+        vertex = fragment = this->Program = 0;
+        pending = fromBinary = false;
+    }
+    
+private:
+    GLuint vertex, fragment;
+    std::string vertexSourceNames, fragmentSourceNames;
+    std::string fallbackVertexCode, fallbackFragmentCode;
+    std::string binaryVertexCode, binaryFragmentCode;  // What to compile if the cached binary turns out rejected
+    std::string binaryPath;
+    uint64_t binaryKey;
+    bool binaryCacheable;
+    bool fromBinary;                    // Program came from the binary cache, its link status is still unchecked
+    bool pending;
+    
+    // Starts compiling and linking the given sources
+    void Compile( const std::string &vertexCode, const std::string &fragmentCode )
+    {
+        const GLchar *vShaderCode = vertexCode.c_str( );
+        const GLchar *fShaderCode = fragmentCode.c_str( );
+        vertex = glCreateShader( GL_VERTEX_SHADER );
+        glShaderSource( vertex, 1, &vShaderCode, NULL );
+        glCompileShader( vertex );
+        fragment = glCreateShader( GL_FRAGMENT_SHADER );
+        glShaderSource( fragment, 1, &fShaderCode, NULL );
+        glCompileShader( fragment );
+        // Shader Program
+        this->Program = glCreateProgram( );
+        glAttachShader( this->Program, vertex );
+        glAttachShader( this->Program, fragment );
+        if ( binaryCacheable )
+        {
+            glProgramParameteri( this->Program, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE );
+        }
+        glLinkProgram( this->Program );
+        pending = true;
+    }
+    
+    static bool ParallelCompileSupported( )
+    {
+#if defined( GLEW_KHR_parallel_shader_compile ) && defined( GLEW_ARB_parallel_shader_compile )
+        return GLEW_KHR_parallel_shader_compile || GLEW_ARB_parallel_shader_compile;
+#else
+        // Older GLEW headers don't know the extension, look it up ourselves once
+        static const bool supported = HasExtension( "GL_KHR_parallel_shader_compile" ) || HasExtension( "GL_ARB_parallel_shader_compile" );
+        
+        return supported;
+#endif
+    }
+    
+    static bool HasExtension( const char *name )
+    {
+        GLint count = 0;
+        glGetIntegerv( GL_NUM_EXTENSIONS, &count );
+        
+        for ( GLint i = 0; i < count; i++ )
+        {
+            const char *extension = ( const char * )glGetStringi( GL_EXTENSIONS, i );
+            
+            if ( extension && 0 == strcmp( extension, name ) )
+            {
+                return true;
+            }
+        }
+        
+        return false;
+    }
+    
+    // Layout of the start of a cached program binary file, the driver's binary follows it
+    struct ProgramBinaryHeader
+    {
+        char magic[4];
+        GLenum format;
+        uint64_t key;
+        uint32_t length;
+    };
+    
+    static bool ProgramBinarySupported( )
+    {
+        if ( !GLEW_VERSION_4_1 && !GLEW_ARB_get_program_binary )
+        {
+            return false;
+        }
+        
+        GLint formats = 0;
+        glGetIntegerv( GL_NUM_PROGRAM_BINARY_FORMATS, &formats );
+        
+        return formats > 0;
+    }
+    
+    // Reads path, replacing each #include "file" (relative to the including file, every file at most
+    // once) with its contents. #line directives keep compiler messages pointing at the right file and line,
+    // the source string numbers index files.
+    static std::string Preprocess( const std::string &path, const ShaderDefines &defines, std::vector<std::string> &files )
+    {
+        std::string source;
+        AppendSource( path, &defines, files, source );
+        
+        return source;
+    }
+    
+    static void AppendSource( const std::string &path, const ShaderDefines *defines, std::vector<std::string> &files, std::string &source )
+    {
+        std::ifstream file( path.c_str( ) );
+        
+        if ( !file )
+        {
+            std::cout << "ERROR::SHADER::FILE_NOT_SUCCESFULLY_READ " << path << std::endl;
+            
+            return;
+        }
+        
+        size_t index = files.size( );
+        files.push_back( path );
+        std::string directory = path.substr( 0, path.find_last_of( "/\\" ) + 1 );
+        std::string line;
+        
+        for ( int number = 1; std::getline( file, line ); number++ )
+        {
+            std::string::size_type start = line.find_first_not_of( " \t" );
+            
+            if ( std::string::npos != start && 0 == line.compare( start, 8, "#include" ) )
+            {
+                std::string::size_type open = line.find( '"', start );
+                std::string::size_type close = std::string::npos == open ? open : line.find( '"', open + 1 );
+                
+                if ( std::string::npos == close )
+                {
+                    std::cout << "ERROR::SHADER::BAD_INCLUDE " << path << ":" << number << std::endl;
+                    continue;
+                }
+                
+                std::string included = directory + line.substr( open + 1, close - open - 1 );
+                
+                if ( std::find( files.begin( ), files.end( ), included ) == files.end( ) )
+                {
+                    source += "#line 1 " + std::to_string( files.size( ) ) + "\n";
+                    AppendSource( included, NULL, files, source );
+                    source += "#line " + std::to_string( number + 1 ) + " " + std::to_string( index ) + "\n";
+                }
+                continue;
+            }
+            
+            source += line + "\n";
+            
+            // The defines have to come after #version, which must be the first line
+            if ( defines && 1 == number && !defines->Empty( ) )
+            {
+                source += defines->Source( );
+                source += "#line 2 0\n";
+            }
+        }
+    }
+    
+    // "0: lighting.frag, 1: lights.glsl" for resolving the source numbers in compiler messages
+    static std::string SourceNames( const std::vector<std::string> &files )
+    {
+        std::string names;
+        
+        for ( size_t i = 0; i < files.size( ); i++ )
+        {
+            names += std::to_string( i ) + ": " + files[i] + ( i + 1 < files.size( ) ? ", " : "\n" );
+        }
+        
+        return names;
+    }
+    
+    // "resources/shaders/lighting.vert" + ".../lighting.frag" -> "<cache>/lighting.programbin", variants add a hash
+    // of their defines: "<cache>/lighting.0123456789abcdef.programbin". Empty without a cache directory
+    static std::string BinaryCachePath( const std::string &vertexPath, const std::string &fragmentPath, const ShaderDefines &defines )
+    {
+        const std::string &directory = BinaryCacheDirectory( );
+        
+        if ( directory.empty( ) )
+        {
+            return "";
+        }
+        
+        std::string vertexName = StripExtension( vertexPath.substr( vertexPath.find_last_of( "/\\" ) + 1 ) );
+        std::string fragmentName = StripExtension( fragmentPath.substr( fragmentPath.find_last_of( "/\\" ) + 1 ) );
+        std::string name = vertexName == fragmentName ? vertexName : vertexName + "_" + fragmentName;
+        
+        return directory + name + VariantSuffix( defines ) + ".programbin";
+    }
+    
+    // SHADER_CACHE_DIR if the build defines it, otherwise the user's cache directory (~/Library/Caches, %LOCALAPPDATA%
+    // or $XDG_CACHE_HOME), never the shader sources' own, which may be read-only or shared. Binaries go into a
+    // subdirectory per GL vendor, renderer and version, so GPUs and drivers sharing it keep their own
+    static const std::string &BinaryCacheDirectory( )
+    {
+        static const std::string directory = MakeBinaryCacheDirectory( );
+        
+        return directory;
+    }
+    
+    static std::string MakeBinaryCacheDirectory( )
+    {
+        std::string base;
+#if defined( SHADER_CACHE_DIR )
+        base = SHADER_CACHE_DIR;
+#elif defined( _WIN32 )
+        const char *localAppData = getenv( "LOCALAPPDATA" );
+        if ( localAppData && *localAppData )
+        {
+            base = std::string( localAppData ) + "/LearningOpenGL";
+        }
+#elif defined( __APPLE__ )
+        const char *home = getenv( "HOME" );
+        if ( home && *home )
+        {
+            base = std::string( home ) + "/Library/Caches/LearningOpenGL";
+        }
+#else
+        const char *cacheHome = getenv( "XDG_CACHE_HOME" );
+        const char *home = getenv( "HOME" );
+        if ( cacheHome && *cacheHome )
+        {
+            base = std::string( cacheHome ) + "/LearningOpenGL";
+        }
+        else if ( home && *home )
+        {
+            base = std::string( home ) + "/.cache/LearningOpenGL";
+        }
+#endif
+        if ( base.empty( ) )
+        {
+            return "";
+        }
+        
+        char driver[17];
+        snprintf( driver, sizeof( driver ), "%016llx", ( unsigned long long )HashDriver( 14695981039346656037ULL ) );
+        std::string directory = base + "/shaders/" + driver;
+        
+        if ( !MakeDirectories( directory ) )
+        {
+            std::cout << "WARNING::SHADER::NO_BINARY_CACHE " << directory << std::endl;
+            return "";
+        }
+        
+        return directory + "/";
+    }
+    
+    // Creates path and any parents it lacks, true if it is a directory afterwards
+    static bool MakeDirectories( const std::string &path )
+    {
+        for ( std::string::size_type slash = path.find_first_of( "/\\", 1 ); ; slash = path.find_first_of( "/\\", slash + 1 ) )
+        {
+            std::string prefix = path.substr( 0, slash );
+#ifdef _WIN32
+            _mkdir( prefix.c_str( ) );
+#else
+            mkdir( prefix.c_str( ), 0755 );
+#endif
+            if ( std::string::npos == slash )
+            {
+                break;
+            }
+        }
+        
+        struct stat info;
+        
+        return 0 == stat( path.c_str( ), &info ) && 0 != ( info.st_mode & S_IFDIR );
+    }
+    
+    // ".0123456789abcdef", a hash of the defines, or nothing without any
+    static std::string VariantSuffix( const ShaderDefines &defines )
+    {
+        if ( defines.Empty( ) )
+        {
+            return "";
+        }
+        
+        std::string variant = defines.Source( );
+        char hash[18];
+        snprintf( hash, sizeof( hash ), ".%016llx", ( unsigned long long )HashBytes( 14695981039346656037ULL, variant.c_str( ), variant.size( ) ) );
+        
+        return hash;
+    }
+    
+    // "resources/shaders/lighting.frag" -> "resources/shaders/optimized/lighting.0123456789abcdef.frag"
+    static std::string OptimizedSourcePath( const std::string &path, const ShaderDefines &defines )
+    {
+        std::string::size_type slash = path.find_last_of( "/\\" ) + 1;
+        std::string stem = StripExtension( path.substr( slash ) );
+        
+        return path.substr( 0, slash ) + "optimized/" + stem + VariantSuffix( defines ) + path.substr( slash + stem.size( ) );
+    }
+    
+    // Replaces code with the optimized version tools/optimize_shaders.sh made from exactly this source, if there is one.
+    // Builds with SHADER_EXPORT_SOURCES defined otherwise export the source next to where that version goes, as
+    // <path>.in, for the tool's next run. Other builds never write there.
+    static bool UseOptimizedSource( const std::string &path, const ShaderDefines &defines, std::string &code )
+    {
+        std::string optimizedPath = OptimizedSourcePath( path, defines );
+        char key[32];
+        snprintf( key, sizeof( key ), "// source %016llx", ( unsigned long long )HashBytes( 14695981039346656037ULL, code.c_str( ), code.size( ) ) );
+        std::string line;
+        
+        // Both files start with the key of the source they belong to
+        std::ifstream optimized( optimizedPath.c_str( ) );
+        
+        if ( optimized && std::getline( optimized, line ) )
+        {
+            if ( line == key )
+            {
+                std::stringstream stream;
+                stream << optimized.rdbuf( );
+                code = stream.str( );
+                
+                return true;
+            }
+            
+            std::cout << "WARNING::SHADER::OPTIMIZED_SOURCE_OUT_OF_DATE " << optimizedPath << std::endl;
+        }
+        
+#ifdef SHADER_EXPORT_SOURCES
+        std::string exportPath = optimizedPath + ".in";
+        std::ifstream exported( exportPath.c_str( ) );
+        
+        if ( !exported || !std::getline( exported, line ) || line != key )
+        {
+            exported.close( );
+            std::ofstream file( exportPath.c_str( ), std::ios::trunc );
+            file << key << "\n" << code;
+        }
+#endif
+        
+        return false;
+    }
+    
+    static std::string StripExtension( const std::string &path )
+    {
+        std::string::size_type dot = path.find_last_of( '.' );
+        std::string::size_type slash = path.find_last_of( "/\\" );
+        
+        if ( dot == std::string::npos || ( slash != std::string::npos && dot < slash ) )
+        {
+            return path;
+        }
+        
+        return path.substr( 0, dot );
+    }
+    
+    // A binary is only valid for the exact sources and driver that produced it
+    static uint64_t BinaryCacheKey( const std::string &vertexCode, const std::string &fragmentCode )
+    {
+        uint64_t key = 14695981039346656037ULL;
+        
+        key = HashBytes( key, vertexCode.c_str( ), vertexCode.size( ) + 1 );
+        key = HashBytes( key, fragmentCode.c_str( ), fragmentCode.size( ) + 1 );
+        
+        return HashDriver( key );
+    }
+    
+    // Adds the GL vendor, renderer and version strings to hash
+    static uint64_t HashDriver( uint64_t hash )
+    {
+        const GLenum driverStrings[] = { GL_VENDOR, GL_RENDERER, GL_VERSION, GL_SHADING_LANGUAGE_VERSION };
+        
+        for ( GLenum name : driverStrings )
+        {
+            const char *value = ( const char * )glGetString( name );
+            
+            if ( value )
+            {
+                hash = HashBytes( hash, value, strlen( value ) + 1 );
+            }
+        }
+        
+        return hash;
+    }
+    
+    // 64-bit FNV-1a
+    static uint64_t HashBytes( uint64_t hash, const char *data, size_t length )
+    {
+        for ( size_t i = 0; i < length; i++ )
+        {
+            hash ^= ( unsigned char )data[i];
+            hash *= 1099511628211ULL;
+        }
+        
+        return hash;
+    }
+    
+    bool LoadProgramBinary( const std::string &path, uint64_t key )
+    {
+        std::ifstream file( path.c_str( ), std::ios::binary );
+        ProgramBinaryHeader header;
+        
+        if ( !file.read( ( char * )&header, sizeof( header ) ) || 0 != memcmp( header.magic, "GLPB", 4 ) || header.key != key || 0 == header.length )
+        {
+            return false;
+        }
+        
+        std::vector<char> binary( header.length );
+        
+        if ( !file.read( &binary[0], header.length ) )
+        {
+            return false;
+        }
+        
+        // Whether the driver accepts it is only asked in Finish( ), the query would wait for it here
+        this->Program = glCreateProgram( );
+        glProgramBinary( this->Program, header.format, &binary[0], header.length );
+        fromBinary = true;
+        pending = true;
+        
+        return true;
+    }
+    
+    void SaveProgramBinary( const std::string &path, uint64_t key )
+    {
+        GLint length = 0;
+        glGetProgramiv( this->Program, GL_PROGRAM_BINARY_LENGTH, &length );
+        
+        if ( length <= 0 )
+        {
+            return;
+        }
+        
+        ProgramBinaryHeader header;
+        std::vector<char> binary( length );
+        memset( &header, 0, sizeof( header ) );
+        memcpy( header.magic, "GLPB", 4 );
+        header.key = key;
+        glGetProgramBinary( this->Program, length, NULL, &header.format, &binary[0] );
+        header.length = ( uint32_t )length;
+        
+        std::ofstream file( path.c_str( ), std::ios::binary | std::ios::trunc );
+        file.write( ( const char * )&header, sizeof( header ) );
+        file.write( &binary[0], length );
+    }
+};
+
+// A program the driver may still be compiling, Get( ) waits for it on the GL thread
+class ShaderFuture
+{
+public:
+    ShaderFuture( )
+    {
+    }
+    
+    explicit ShaderFuture( const std::shared_ptr<Shader> &shader ) : shader( shader )
+    {
+    }
+    
+    Shader &Get( )
+    {
+        shader->Finish( );
+        
+        return *shader;
+    }
+    
+private:
+    std::shared_ptr<Shader> shader;
+};
+
+// Submits every program before checking on any of them, so the driver compiles
+// them all (on its own threads where it can) while the caller loads other assets
+class ShaderManager
+{
+public:
+    ShaderManager( )
+    {
+#ifdef GLEW_KHR_parallel_shader_compile
+        if ( GLEW_KHR_parallel_shader_compile )
+        {
+            glMaxShaderCompilerThreadsKHR( 0xFFFFFFFF );
+        }
+#endif
+    }
+    
+    // Deletes every program submitted so far, on the thread that holds the context
+    void Release( )
+    {
+        for ( std::map<std::string, std::shared_ptr<Shader>>::iterator it = variants.begin( ); it != variants.end( ); ++it )
+        {
+            it->second->Release( );
+        }
+    }
+    
+    // Asking for the same sources and defines again returns the variant already submitted
+    ShaderFuture Load( const GLchar *vertexPath, const GLchar *fragmentPath, const ShaderDefines &defines = ShaderDefines( ) )
+    {
+        std::string key = std::string( vertexPath ) + "\n" + fragmentPath + "\n" + defines.Source( );
+        std::map<std::string, std::shared_ptr<Shader>>::iterator variant = variants.find( key );
+        
+        if ( variant != variants.end( ) )
+        {
+            return ShaderFuture( variant->second );
+        }
+        
+        std::shared_ptr<Shader> shader = std::make_shared<Shader>( );
+        shader->Submit( vertexPath, fragmentPath, defines );
+        variants[key] = shader;
+        
+        return ShaderFuture( shader );
+    }
+    
+    // Waits for every program submitted so far. Each one is finished as soon as the driver is done with it, so its
+    // checks and binary caching overlap with the ones still compiling
+    void FinishAll( )
+    {
+        std::vector<Shader *> waiting;
+        
+        for ( std::map<std::string, std::shared_ptr<Shader>>::iterator it = variants.begin( ); it != variants.end( ); ++it )
+        {
+            waiting.push_back( it->second.get( ) );
+        }
+        
+        while ( !waiting.empty( ) )
+        {
+            size_t before = waiting.size( );
+            
+            for ( size_t i = 0; i < waiting.size( ); )
+            {
+                if ( waiting[i]->IsReady( ) )
+                {
+                    waiting[i]->Finish( );
+                    waiting[i] = waiting.back( );
+                    waiting.pop_back( );
+                }
+                else
+                {
+                    i++;
+                }
+            }
+            
+            if ( waiting.size( ) == before )
+            {
+                std::this_thread::yield( );
+            }
+        }
+    }
+    
+private:
+    // Every program submitted, keyed by its sources and defines
+    std::map<std::string, std::shared_ptr<Shader>> variants;
 };
 
 #endif /* shader_h */
@@ -0,0 +1,61 @@
+#pragma once
+
+// Std. Includes
+#include <cstddef>
+#include <atomic>
+
+// Lock-free queue between exactly one producer thread and one consumer thread. Holds up to Capacity items, which
+// must be a power of two. The producer only writes tail and the consumer only writes head, so neither ever waits
+// on a lock; a full or empty queue just makes Push or Pop return false.
+template<typename T, size_t Capacity>
+class SpscQueue
+{
+public:
+    SpscQueue( ) : head( 0 ), tail( 0 )
+    {
+        static_assert( Capacity > 0 && 0 == ( Capacity & ( Capacity - 1 ) ), "SpscQueue capacity must be a power of two" );
+    }
+    
+    SpscQueue( const SpscQueue & ) = delete;
+    SpscQueue &operator=( const SpscQueue & ) = delete;
+    
+    // Producer side
+    bool Push( const T &item )
+    {
+        size_t tail = this->tail.load( std::memory_order_relaxed );
+        
+        if ( tail - this->head.load( std::memory_order_acquire ) == Capacity )
+        {
+            return false;
+        }
+        
+        this->items[tail & ( Capacity - 1 )] = item;
+        // Publishes the item along with the new tail
+        this->tail.store( tail + 1, std::memory_order_release );
+        
+        return true;
+    }
+    
+    // Consumer side
+    bool Pop( T &item )
+    {
+        size_t head = this->head.load( std::memory_order_relaxed );
+        
+        if ( head == this->tail.load( std::memory_order_acquire ) )
+        {
+            return false;
+        }
+        
+        item = this->items[head & ( Capacity - 1 )];
+        // Hands the slot back to the producer
+        this->head.store( head + 1, std::memory_order_release );
+        
+        return true;
+    }
+    
+private:
+    // On separate cache lines, so the two threads do not keep stealing one line from each other
+    alignas( 64 ) std::atomic<size_t> head;
+    alignas( 64 ) std::atomic<size_t> tail;
+    T items[Capacity];
+};
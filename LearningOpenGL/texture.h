@@ -1,13 +1,26 @@
 #pragma once
 
+#include <string>
 #include <vector>
 
 #define GLEW_STATIC
 #include <GL/glew.h>
 
+#include "SOIL2/SOIL2.h"
+#include "jobsystem.h"
+#include "profiler.h"
+
 class TextureLoading
 {
 public:
+    // Splits SOIL's work inside one image (JPEG restart intervals, PNG rows) and SOIL_load_images' batches into jobs.
+    // The workers then decode with arenas of their own, released as they exit
+    static void UseJobSystem( )
+    {
+        SOIL_set_parallel_for( SoilParallelFor, &JobSystem::Get( ) );
+        JobSystem::Get( ).AtWorkerExit( SOIL_free_thread_arena );
+    }
+    
     static GLuint LoadTexture( GLchar *path )
     {
         //Generate texture ID and load texture data
@@ -35,30 +48,322 @@ public:
         return textureID;
     }
     
-    static GLuint LoadCubemap( vector<const GLchar * > faces)
+    // Loads a batch of 2D textures: every header is probed first so each texture's immutable storage and a pixel
+    // buffer for all the images are allocated before the decodes start, then the images are decoded together straight
+    // into the mapped pixel buffer and uploaded from there
+    static std::vector<GLuint> LoadTextures( const std::vector<std::string> &paths )
+    {
+        std::vector<GLuint> textureIDs( paths.size( ) );
+        
+        if ( !paths.empty( ) )
+        {
+            glGenTextures( ( GLsizei )textureIDs.size( ), &textureIDs[0] );
+            LoadTextures( paths, textureIDs );
+        }
+        
+        return textureIDs;
+    }
+    
+    // Same as above, into texture IDs the caller already generated. A texture whose image decodes to another size
+    // than its header promised has to be made again, its entry in textureIDs is replaced with the new ID
+    static void LoadTextures( const std::vector<std::string> &paths, std::vector<GLuint> &textureIDs )
+    {
+        int count = ( int )paths.size( );
+        
+        if ( 0 == count )
+        {
+            return;
+        }
+        
+        std::vector<const char *> names( count );
+        std::vector<int> probedWidths( count ), probedHeights( count );
+        
+        for ( int i = 0; i < count; i++ )
+        {
+            names[i] = paths[i].c_str( );
+        }
+        
+        SOIL_probe_images( count, &names[0], &probedWidths[0], &probedHeights[0], NULL, NULL );
+        
+        for ( int i = 0; i < count; i++ )
+        {
+            glBindTexture( GL_TEXTURE_2D, textureIDs[i] );
+            
+            if ( GLEW_ARB_texture_storage && probedWidths[i] > 0 )
+            {
+                glTexStorage2D( GL_TEXTURE_2D, MipLevelCount( probedWidths[i], probedHeights[i] ), GL_RGB8, probedWidths[i], probedHeights[i] );
+            }
+            
+            SetTextureParameters( );
+        }
+        
+        DecodedImages decoded;
+        DecodeImages( names, probedWidths, probedHeights, decoded );
+        
+        ProfileScope scope( "Upload textures" );
+        for ( int i = 0; i < count; i++ )
+        {
+            glBindTexture( GL_TEXTURE_2D, textureIDs[i] );
+            
+            if ( 0 == decoded.widths[i] )
+            {
+                printf("LoadTextures: failed to load %s\n", names[i]);
+                continue;
+            }
+            
+            GLboolean hasStorage = GLEW_ARB_texture_storage && probedWidths[i] > 0;
+            
+            // Immutable storage can't be resized, so a texture allocated at the wrong size starts over under a new ID
+            if ( hasStorage && ( probedWidths[i] != decoded.widths[i] || probedHeights[i] != decoded.heights[i] ) )
+            {
+                glDeleteTextures( 1, &textureIDs[i] );
+                glGenTextures( 1, &textureIDs[i] );
+                glBindTexture( GL_TEXTURE_2D, textureIDs[i] );
+                SetTextureParameters( );
+                hasStorage = GL_FALSE;
+            }
+            
+            const GLvoid *pixels = BindPixels( decoded, i );
+            
+            if ( hasStorage )
+            {
+                glTexSubImage2D( GL_TEXTURE_2D, 0, 0, 0, decoded.widths[i], decoded.heights[i], GL_RGB, GL_UNSIGNED_BYTE, pixels );
+            }
+            else
+            {
+                glTexImage2D( GL_TEXTURE_2D, 0, GL_RGB, decoded.widths[i], decoded.heights[i], 0, GL_RGB, GL_UNSIGNED_BYTE, pixels );
+            }
+            glGenerateMipmap( GL_TEXTURE_2D );
+            
+            printf("Load texture %d: %s\n", textureIDs[i], names[i]);
+        }
+        
+        ReleaseImages( decoded );
+        glBindTexture( GL_TEXTURE_2D, 0 );
+    }
+    
+    // Decodes the six faces together into one pixel buffer, then uploads them on the calling (GL) thread
+    static GLuint LoadCubemap( std::vector<const GLchar * > faces, GLboolean generateMipmaps = GL_FALSE )
     {
         GLuint textureID;
         glGenTextures( 1, &textureID );
         
-        int imageWidth, imageHeight;
-        unsigned char *image;
+        int count = ( int )faces.size( );
+        std::vector<int> probedWidths( count ), probedHeights( count );
+        DecodedImages decoded;
+        
+        printf("LoadCubemap: %d, size = %d\n", textureID, count);
+        
+        if ( count > 0 )
+        {
+            SOIL_probe_images( count, &faces[0], &probedWidths[0], &probedHeights[0], NULL, NULL );
+            DecodeImages( faces, probedWidths, probedHeights, decoded );
+        }
+        
+        glBindTexture( GL_TEXTURE_CUBE_MAP, textureID );
+        
+        // Immutable storage needs every face at the same size; otherwise fall back to glTexImage2D per face
+        GLboolean useStorage = GLEW_ARB_texture_storage && count > 0 && decoded.widths[0] > 0;
+        for ( int i = 1; useStorage && i < count; i++ )
+        {
+            useStorage = decoded.widths[i] == decoded.widths[0] && decoded.heights[i] == decoded.heights[0];
+        }
+        
+        if ( useStorage )
+        {
+            GLsizei levels = generateMipmaps ? MipLevelCount( decoded.widths[0], decoded.heights[0] ) : 1;
+            glTexStorage2D( GL_TEXTURE_CUBE_MAP, levels, GL_RGB8, decoded.widths[0], decoded.heights[0] );
+        }
+        
+        for ( int i = 0; i < count; i++ )
+        {
+            if ( 0 == decoded.widths[i] )
+            {
+                printf("LoadCubemap: failed to load %s\n", faces[i]);
+                continue;
+            }
+            
+            const GLvoid *pixels = BindPixels( decoded, i );
+            
+            if ( useStorage )
+            {
+                glTexSubImage2D( GL_TEXTURE_CUBE_MAP_POSITIVE_X + i, 0, 0, 0, decoded.widths[i], decoded.heights[i], GL_RGB, GL_UNSIGNED_BYTE, pixels );
+            }
+            else
+            {
+                glTexImage2D( GL_TEXTURE_CUBE_MAP_POSITIVE_X + i, 0, GL_RGB, decoded.widths[i], decoded.heights[i], 0, GL_RGB, GL_UNSIGNED_BYTE, pixels );
+            }
+        }
+        
+        ReleaseImages( decoded );
+        
+        if ( generateMipmaps )
+        {
+            glGenerateMipmap( GL_TEXTURE_CUBE_MAP );
+        }
+        
+        SetCubemapParameters( generateMipmaps );
+        glBindTexture( GL_TEXTURE_CUBE_MAP, 0);
+        
+        return textureID;
+    }
+    
+    // Loads a single pre-packed cross or strip image, faceOrder is any combination of NSWEUD (see SOIL_DDS_CUBEMAP_FACE_ORDER)
+    static GLuint LoadCubemap( const GLchar *path, const char faceOrder[6], GLboolean generateMipmaps = GL_FALSE )
+    {
+        GLuint textureID = SOIL_load_OGL_single_cubemap( path, faceOrder, SOIL_LOAD_RGB, SOIL_CREATE_NEW_ID, generateMipmaps ? SOIL_FLAG_GL_MIPMAPS : 0 );
+        
+        if ( 0 == textureID )
+        {
+            printf("LoadCubemap: failed to load %s: %s\n", path, SOIL_last_result( ));
+            return 0;
+        }
         
-        printf("LoadCubemap: %d, size = %d\n", textureID, faces.size());
+        printf("LoadCubemap: %d, %s\n", textureID, path);
         glBindTexture( GL_TEXTURE_CUBE_MAP, textureID );
+        SetCubemapParameters( generateMipmaps );
+        glBindTexture( GL_TEXTURE_CUBE_MAP, 0);
+        
+        return textureID;
+    }
+    
+private:
+    static void SoilParallelFor( void *user, int count, void (*task)( void *arg, int index ), void *arg )
+    {
+        static_cast<JobSystem *>( user )->ParallelFor( 0, ( GLuint )count, 1, [task, arg]( GLuint first, GLuint last )
+        {
+            for ( GLuint i = first; i < last; i++ )
+            {
+                task( arg, ( int )i );
+            }
+        } );
+    }
+    
+    // Where the pixels of each image of a batch are: at offsets[i] in pixelBuffer, or for an image that could not be
+    // decoded there, in images[i]. A width of 0 means the image did not load at all
+    struct DecodedImages
+    {
+        GLuint pixelBuffer;
+        std::vector<GLintptr> offsets;
+        std::vector<unsigned char *> images;
+        std::vector<int> widths, heights;
+    };
+    
+    // Decodes RGB images into one mapped pixel unpack buffer, sized from the probed headers, so neither the images
+    // nor (thanks to SOIL's per-thread arenas) the decoders' scratch get a malloc of their own. An image whose header
+    // could not be read, or which turned out larger than it said, is loaded on its own afterwards
+    static void DecodeImages( const std::vector<const char *> &names, const std::vector<int> &probedWidths, const std::vector<int> &probedHeights, DecodedImages &decoded )
+    {
+        ProfileScope scope( "Decode textures" );
+        int count = ( int )names.size( );
+        std::vector<int> sizes( count );
+        std::vector<unsigned char *> buffers( count );
+        GLsizeiptr total = 0;
+        
+        decoded.offsets.assign( count, 0 );
+        decoded.images.assign( count, nullptr );
+        decoded.widths.assign( count, 0 );
+        decoded.heights.assign( count, 0 );
+        
+        for ( int i = 0; i < count; i++ )
+        {
+            sizes[i] = probedWidths[i] * probedHeights[i] * 3;
+            decoded.offsets[i] = total;
+            // Each image starts on a 16 byte boundary
+            total += ( sizes[i] + 15 ) & ~15;
+        }
+        
+        glGenBuffers( 1, &decoded.pixelBuffer );
+        glBindBuffer( GL_PIXEL_UNPACK_BUFFER, decoded.pixelBuffer );
+        
+        if ( total > 0 )
+        {
+            glBufferData( GL_PIXEL_UNPACK_BUFFER, total, NULL, GL_STREAM_DRAW );
+            unsigned char *pixels = ( unsigned char * )glMapBufferRange( GL_PIXEL_UNPACK_BUFFER, 0, total, GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT );
+            
+            if ( nullptr != pixels )
+            {
+                for ( int i = 0; i < count; i++ )
+                {
+                    buffers[i] = pixels + decoded.offsets[i];
+                }
+                
+                SOIL_load_images_into( count, &names[0], &buffers[0], &sizes[0], &decoded.widths[0], &decoded.heights[0], NULL, SOIL_LOAD_RGB );
+                
+                // The mapping's contents are lost if the GL had to give up its memory meanwhile
+                if ( !glUnmapBuffer( GL_PIXEL_UNPACK_BUFFER ) )
+                {
+                    decoded.widths.assign( count, 0 );
+                }
+            }
+        }
+        
+        glBindBuffer( GL_PIXEL_UNPACK_BUFFER, 0 );
+        
+        for ( int i = 0; i < count; i++ )
+        {
+            if ( 0 == decoded.widths[i] )
+            {
+                decoded.images[i] = SOIL_load_image( names[i], &decoded.widths[i], &decoded.heights[i], 0, SOIL_LOAD_RGB );
+                
+                if ( nullptr == decoded.images[i] )
+                {
+                    decoded.widths[i] = decoded.heights[i] = 0;
+                }
+            }
+        }
+    }
+    
+    // Binds whatever holds image i's pixels for the next upload, and returns where they are in it
+    static const GLvoid *BindPixels( const DecodedImages &decoded, int i )
+    {
+        if ( nullptr != decoded.images[i] )
+        {
+            glBindBuffer( GL_PIXEL_UNPACK_BUFFER, 0 );
+            
+            return decoded.images[i];
+        }
+        
+        glBindBuffer( GL_PIXEL_UNPACK_BUFFER, decoded.pixelBuffer );
+        
+        return ( const GLvoid * )decoded.offsets[i];
+    }
+    
+    static void ReleaseImages( DecodedImages &decoded )
+    {
+        glBindBuffer( GL_PIXEL_UNPACK_BUFFER, 0 );
+        glDeleteBuffers( 1, &decoded.pixelBuffer );
         
-        for ( GLuint i = 0; i < faces.size( ); i++ )
+        for ( GLuint i = 0; i < decoded.images.size( ); i++ )
+        {
+            SOIL_free_image_data( decoded.images[i] );
+        }
+    }
+    
+    static GLsizei MipLevelCount( int width, int height )
+    {
+        GLsizei levels = 1;
+        while ( ( width | height ) >> levels )
         {
-            image = SOIL_load_image( faces[i], &imageWidth, &imageHeight, 0, SOIL_LOAD_RGB );
-            glTexImage2D( GL_TEXTURE_CUBE_MAP_POSITIVE_X + i, 0, GL_RGB, imageWidth, imageHeight, 0, GL_RGB, GL_UNSIGNED_BYTE, image );
-            SOIL_free_image_data( image );
+            levels++;
         }
+        return levels;
+    }
+    
+    static void SetTextureParameters( )
+    {
+        glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT );
+        glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT );
+        glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR );
+        glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR );
+    }
+    
+    static void SetCubemapParameters( GLboolean mipmapped )
+    {
         glTexParameteri( GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MAG_FILTER, GL_LINEAR );
-        glTexParameteri( GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MIN_FILTER, GL_LINEAR );
+        glTexParameteri( GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MIN_FILTER, mipmapped ? GL_LINEAR_MIPMAP_LINEAR : GL_LINEAR );
         glTexParameteri( GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE );
         glTexParameteri( GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE );
         glTexParameteri( GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE );
-        glBindTexture( GL_TEXTURE_CUBE_MAP, 0);
-        
-        return textureID;
     }
 };
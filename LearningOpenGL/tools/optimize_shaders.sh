@@ -0,0 +1,54 @@
+#!/bin/sh
+# Optimizes the shader variants the app exported to resources/shaders/optimized/*.in, ahead of time, so drivers
+# with weak GLSL compilers get code that is already cleaned up:
+#   GLSL 330 -> SPIR-V (glslangValidator) -> spirv-opt -O -> GLSL 330 (spirv-cross)
+# Each result keeps the key of the source it came from, the app only uses it while that source is unchanged.
+# SPIR-V instruction counts before and after optimizing go to resources/shaders/optimized/report.txt.
+#
+# Build the app with SHADER_EXPORT_SOURCES defined and run it once to export the variants it loads, then run this
+# script from anywhere. Builds without that define only read the results.
+set -e
+
+cd "$( dirname "$0" )/../resources/shaders/optimized"
+
+for tool in glslangValidator spirv-opt spirv-dis spirv-cross; do
+    if ! command -v $tool > /dev/null; then
+        echo "optimize_shaders: $tool not found, it comes with the Vulkan SDK" >&2
+        exit 1
+    fi
+done
+
+work=$( mktemp -d )
+trap 'rm -rf "$work"' EXIT
+
+# Instructions inside the functions of a SPIR-V module
+count_instructions( )
+{
+    spirv-dis "$1" | sed -n '/OpFunction /,/OpFunctionEnd/p' | grep -c 'Op'
+}
+
+: > report.txt
+
+for input in *.vert.in *.frag.in; do
+    [ -e "$input" ] || continue
+    output=${input%.in}
+    stage=${output##*.}
+
+    head -n 1 "$input" > "$work/key"
+    tail -n +2 "$input" > "$work/source.$stage"
+
+    # OpenGL SPIR-V wants locations on everything, the GLSL coming back out is matched up by name again
+    if ! glslangValidator -G --auto-map-locations --auto-map-bindings -o "$work/source.spv" "$work/source.$stage" > "$work/log"; then
+        echo "optimize_shaders: $input does not compile:" >&2
+        cat "$work/log" >&2
+        continue
+    fi
+
+    spirv-opt -O "$work/source.spv" -o "$work/optimized.spv"
+    spirv-cross --version 330 --no-es --no-420pack-extension --output "$work/optimized.$stage" "$work/optimized.spv"
+
+    # GLSL 330 has no uniform locations, the app looks its uniforms up by name
+    sed -E 's/layout\(location = [0-9]+\) uniform /uniform /' "$work/optimized.$stage" | cat "$work/key" - > "$output"
+
+    echo "$output: $( count_instructions "$work/source.spv" ) -> $( count_instructions "$work/optimized.spv" ) instructions" | tee -a report.txt
+done